@@ -0,0 +1,558 @@
+#include <endian.h>
+#include <errno.h>
+#include <limits.h>
+#include <openssl/evp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fake_libzfs.h"
+#include "zfscrypt_context.h"
+#include "zfscrypt_dataset.h"
+#include "zfscrypt_err.h"
+#include "zfscrypt_keywrap.h"
+#include "zfscrypt_pbkdf2.h"
+#include "zfscrypt_policy.h"
+#include "zfscrypt_session.h"
+#include "zfscrypt_utils.h"
+
+/*
+ * Microbenchmark of the dataset layer, linked against the libzfs stand-in in fake_libzfs.c
+ *
+ * usage: build/bench [datasets=N] [depth=N] [users=N] [children=N] [ioctl_us=N] [iterations=N] [roots=N] [rounds=N] [module options...]
+ *
+ * Prints mean, minimum and maximum wall time of each operation and the ioctls it issued. Options
+ * not listed above are passed on like PAM module arguments, e.g. workers=4. The derive ops time the
+ * keys of roots encryption roots, one after another like libzfs and in a single batch. Before
+ * anything is timed, the scalar and the AVX2 lanes of PBKDF2 are checked against known answers, the
+ * perfect hashes of the policy against lookups of present, absent and duplicate sections, and sealed
+ * keys against a round trip and malformed or forged values.
+ */
+
+#define BENCH_VALID_CALLS 1000
+
+typedef enum bench_op {
+    BENCH_ITER_WALK,
+    BENCH_ITER_PROGRAM,
+    BENCH_ITER_INDEX,
+    BENCH_VALID,
+    BENCH_UNLOCK,
+    BENCH_LOCK,
+    BENCH_UPDATE,
+    BENCH_SESSION,
+    BENCH_DERIVE_LIBZFS,
+    BENCH_DERIVE_BATCH,
+    BENCH_OPS
+} bench_op_t;
+
+typedef struct bench_stat {
+    const char* name;
+    uint64_t count;
+    double total;
+    double min;
+    double max;
+    uint64_t ioctls;
+} bench_stat_t;
+
+typedef struct bench_timer {
+    struct timespec begin;
+    uint64_t ioctls;
+} bench_timer_t;
+
+typedef struct bench_vector {
+    const char* passphrase;
+    uint64_t salt;
+    uint64_t iterations;
+    // PBKDF2-HMAC-SHA1 of Python's hashlib with the little endian salt, as libzfs derives it on x86
+    const char* key;
+} bench_vector_t;
+
+// the first BENCH_LANE_VECTORS share their iterations, so they fill the AVX2 lanes at once
+#define BENCH_LANE_VECTORS 8
+
+static const bench_vector_t bench_vectors[] = {
+    {"", 0x0, 1000, "aec3edf65e811e1a6c07ded13e82f68b22ec9545c807ff4525a5b72db251bd9d"},
+    {"p", 0x1, 1000, "678a074313eb9d15000c72a8aa5a67187224ac2396388297543ca64c40c62d2b"},
+    {"password", 0x0123456789abcdef, 1000, "36ebf42905c9d9ded845ed4ea5a92763bda29e35da824306b9e33b2f42c4723e"},
+    {"correct horse battery st", 0xdeadbeefcafebabe, 1000, "8b9cfd2945d4b1a47953c50ae10ac9462fa955e78310ae2dbca061e06b098de8"},
+    // one byte short of, exactly and one byte beyond the block of SHA-1
+    {"aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa", 0x2a, 1000, "ccbf935520dd091089772f82dedc8bc0730463c15f3aed856591522b143057e4"},
+    {"bbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbb", 0x2b, 1000, "686960912d5e0722178eee6fda8e303e191886cfc2c358e9e46a7f890bb72d5f"},
+    {"ccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccc", 0x2c, 1000, "36d3422767f5884b2e0f61a2266babcef2e34d7d17dc6753c8f4d13d5773b82a"},
+    {"long passphrase long passphrase long passphrase long passphrase long passphrase long passphrase long passphrase ", 0xffffffffffffffff, 1000, "9df61e93610d44713cff1332284763c03b73ef8f410fe1f22b63fcf3ccdbeedf"},
+    {"password", 0x0123456789abcdef, 1, "8e65dc2c38ea697b12ae5163692212746c6ae04beb6e5835a7a83cc194aef375"},
+    {"password", 0x0123456789abcdef, 2, "ee3a907f8de10c7f101e76d5e8b3ece60b3bd727d1579dbb1848a9c21caeec3d"},
+};
+
+#define BENCH_VECTORS (sizeof(bench_vectors) / sizeof(bench_vectors[0]))
+#define BENCH_BLOCKS 2
+
+static bench_stat_t bench_stats[BENCH_OPS] = {
+    [BENCH_ITER_WALK] = {.name = "iter-walk"},
+    [BENCH_ITER_PROGRAM] = {.name = "iter-program"},
+    [BENCH_ITER_INDEX] = {.name = "iter-index"},
+    [BENCH_VALID] = {.name = "valid"},
+    [BENCH_UNLOCK] = {.name = "unlock"},
+    [BENCH_LOCK] = {.name = "lock"},
+    [BENCH_UPDATE] = {.name = "update"},
+    [BENCH_SESSION] = {.name = "session"},
+    [BENCH_DERIVE_LIBZFS] = {.name = "derive-libzfs"},
+    [BENCH_DERIVE_BATCH] = {.name = "derive-batch"},
+};
+
+static void bench_start(bench_timer_t* timer) {
+    timer->ioctls = fake_libzfs_ioctls();
+    clock_gettime(CLOCK_MONOTONIC, &timer->begin);
+}
+
+// records calls operations that took the time since bench_start together
+static void bench_stop(bench_timer_t const* timer, const bench_op_t op, const uint64_t calls) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    const double us = ((end.tv_sec - timer->begin.tv_sec) * 1e9 + (end.tv_nsec - timer->begin.tv_nsec)) / 1e3 / calls;
+    bench_stat_t* stat = &bench_stats[op];
+    stat->min = stat->count == 0 || us < stat->min ? us : stat->min;
+    stat->max = stat->count == 0 || us > stat->max ? us : stat->max;
+    stat->total += us * calls;
+    stat->count += calls;
+    stat->ioctls += fake_libzfs_ioctls() - timer->ioctls;
+}
+
+static zfscrypt_err_t bench_discard(unused zfscrypt_plan_t* plan) {
+    return zfscrypt_err_os(0, "Discarded plan");
+}
+
+static zfscrypt_err_t bench_iter(zfscrypt_context_t* context, const bench_op_t op) {
+    bench_timer_t timer;
+    bench_start(&timer);
+    const zfscrypt_err_t err = zfscrypt_dataset_iter(context, NULL, NULL, bench_discard, NULL);
+    bench_stop(&timer, op, 1);
+    return err;
+}
+
+static zfscrypt_err_t bench_valid(zfscrypt_context_t* context, const size_t user) {
+    zfscrypt_dataset_t dataset = {.context = context, .handle = zfs_open(context->libzfs, fake_libzfs_home(user), ZFS_TYPE_FILESYSTEM), .key = NULL, .new_key = NULL};
+    if (dataset.handle == NULL)
+        return zfscrypt_err_os(ENOENT, "Could not open home");
+    bench_timer_t timer;
+    bool valid = true;
+    bench_start(&timer);
+    for (size_t i = 0; i < BENCH_VALID_CALLS; ++i) {
+        // measures reading the properties, not the snapshot
+        dataset.snapshot.validated = false;
+        valid = zfscrypt_dataset_valid(&dataset) && valid;
+    }
+    bench_stop(&timer, BENCH_VALID, BENCH_VALID_CALLS);
+    zfs_close(dataset.handle);
+    return zfscrypt_err_os(valid ? 0 : EINVAL, "Validated home");
+}
+
+// unlocks, rewraps twice and locks the datasets of one user
+static zfscrypt_err_t bench_user(zfscrypt_context_t* context, const size_t user) {
+    char passphrase[64], new_passphrase[64];
+    fake_libzfs_passphrase(user, passphrase, sizeof(passphrase));
+    (void) snprintf(new_passphrase, sizeof(new_passphrase), "new-%s", passphrase);
+    context->user = fake_libzfs_user(user);
+    bench_timer_t timer;
+    bench_start(&timer);
+    zfscrypt_err_t err = zfscrypt_dataset_unlock_all(context, passphrase);
+    bench_stop(&timer, BENCH_UNLOCK, 1);
+    if (!err.value) {
+        bench_start(&timer);
+        err = zfscrypt_dataset_update_all(context, passphrase, new_passphrase);
+        bench_stop(&timer, BENCH_UPDATE, 1);
+    }
+    if (!err.value) {
+        bench_start(&timer);
+        err = zfscrypt_dataset_update_all(context, new_passphrase, passphrase);
+        bench_stop(&timer, BENCH_UPDATE, 1);
+    }
+    if (!err.value) {
+        bench_start(&timer);
+        err = zfscrypt_dataset_lock_all(context);
+        bench_stop(&timer, BENCH_LOCK, 1);
+    }
+    return err;
+}
+
+static zfscrypt_err_t bench_session(zfscrypt_context_t* context) {
+    int count = 0;
+    bench_timer_t timer;
+    bench_start(&timer);
+    zfscrypt_err_t err = zfscrypt_session_counter_update(&count, context->runtime_dir, context->uid, 1);
+    if (!err.value)
+        err = zfscrypt_session_counter_update(&count, context->runtime_dir, context->uid, -1);
+    bench_stop(&timer, BENCH_SESSION, 2);
+    return err;
+}
+
+static zfscrypt_err_t bench_derive(const size_t roots, const uint64_t iterations) {
+    zfscrypt_pbkdf2_job_t jobs[roots];
+    uint8_t keys[roots][ZFSCRYPT_CRYPTO_KEY_LEN];
+    for (size_t i = 0; i < roots; ++i)
+        jobs[i] = (zfscrypt_pbkdf2_job_t) {.passphrase = "bench-passphrase", .salt = i * 0x9e3779b97f4a7c15, .iterations = iterations, .key = keys[i]};
+    bench_timer_t timer;
+    bench_start(&timer);
+    // what libzfs does for each encryption root
+    for (size_t i = 0; i < roots; ++i) {
+        const uint64_t salt = htole64(jobs[i].salt);
+        (void) PKCS5_PBKDF2_HMAC_SHA1(jobs[i].passphrase, strlen(jobs[i].passphrase), (const unsigned char*) &salt, sizeof(salt), iterations, ZFSCRYPT_CRYPTO_KEY_LEN, keys[i]);
+    }
+    bench_stop(&timer, BENCH_DERIVE_LIBZFS, 1);
+    bench_start(&timer);
+    const int err = zfscrypt_pbkdf2_derive(jobs, roots);
+    bench_stop(&timer, BENCH_DERIVE_BATCH, 1);
+    return zfscrypt_err_os(err, "Derived keys");
+}
+
+// runs the lanes of all vectors with run, returns the number of keys that do not match
+static size_t bench_check_lanes(const char* name, void (*run)(zfscrypt_pbkdf2_lane_t* lanes, const size_t len)) {
+    uint8_t keys[BENCH_VECTORS][ZFSCRYPT_CRYPTO_KEY_LEN];
+    zfscrypt_pbkdf2_lane_t lanes[BENCH_VECTORS * BENCH_BLOCKS];
+    for (size_t i = 0; i < BENCH_VECTORS; ++i) {
+        const zfscrypt_pbkdf2_job_t job = {.passphrase = bench_vectors[i].passphrase, .salt = bench_vectors[i].salt, .iterations = bench_vectors[i].iterations, .key = keys[i]};
+        for (uint32_t block = 1; block <= BENCH_BLOCKS; ++block)
+            zfscrypt_pbkdf2_lane_init(&lanes[(block - 1) * BENCH_VECTORS + i], &job, block);
+    }
+    run(lanes, BENCH_VECTORS * BENCH_BLOCKS);
+    size_t failed = 0;
+    for (size_t i = 0; i < BENCH_VECTORS * BENCH_BLOCKS; ++i)
+        zfscrypt_pbkdf2_lane_finish(&lanes[i]);
+    for (size_t i = 0; i < BENCH_VECTORS; ++i) {
+        char hex[2 * ZFSCRYPT_CRYPTO_KEY_LEN + 1];
+        zfscrypt_keywrap_hex_encode(keys[i], ZFSCRYPT_CRYPTO_KEY_LEN, hex);
+        if (strnq(hex, bench_vectors[i].key)) {
+            fprintf(stderr, "pbkdf2 %s lanes: vector %zu: expected %s, got %s\n", name, i, bench_vectors[i].key, hex);
+            ++failed;
+        }
+    }
+    return failed;
+}
+
+static void bench_run_scalar(zfscrypt_pbkdf2_lane_t* lanes, const size_t len) {
+    for (size_t i = 0; i < len; ++i)
+        zfscrypt_pbkdf2_run_scalar(&lanes[i]);
+}
+
+static void bench_run_avx2(zfscrypt_pbkdf2_lane_t* lanes, const size_t len) {
+    // each block of the vectors sharing their iterations side by side, the rest one by one
+    for (size_t block = 0; block < len; block += BENCH_VECTORS) {
+        zfscrypt_pbkdf2_lane_t* group[BENCH_LANE_VECTORS];
+        for (size_t i = 0; i < BENCH_LANE_VECTORS; ++i)
+            group[i] = &lanes[block + i];
+        zfscrypt_pbkdf2_run_avx2(group, BENCH_LANE_VECTORS);
+        for (size_t i = BENCH_LANE_VECTORS; i < BENCH_VECTORS; ++i)
+            zfscrypt_pbkdf2_run_scalar(&lanes[block + i]);
+    }
+}
+
+static zfscrypt_err_t bench_check_pbkdf2(void) {
+    size_t failed = bench_check_lanes("scalar", bench_run_scalar);
+    if (zfscrypt_pbkdf2_has_avx2())
+        failed += bench_check_lanes("avx2", bench_run_avx2);
+    else
+        fprintf(stderr, "pbkdf2 avx2 lanes: not supported by this CPU, skipped\n");
+    return zfscrypt_err_os(failed ? EPROTO : 0, "Checked PBKDF2 against known answers");
+}
+
+// prints what when ok is false, returns the number of failed checks
+static size_t bench_expect(const bool ok, const char* what) {
+    if (!ok)
+        fprintf(stderr, "%s\n", what);
+    return ok ? 0 : 1;
+}
+
+// enough keys that some buckets of the perfect hash collide and need a seed other than the first
+#define BENCH_POLICY_USERS 4096
+
+static size_t bench_check_hash(void) {
+    static char names[BENCH_POLICY_USERS][16];
+    static const void* keys[BENCH_POLICY_USERS];
+    static size_t lens[BENCH_POLICY_USERS];
+    static int32_t displacements[BENCH_POLICY_USERS];
+    static uint32_t slots[BENCH_POLICY_USERS];
+    static bool seen[BENCH_POLICY_USERS];
+    for (size_t i = 0; i < BENCH_POLICY_USERS; ++i) {
+        lens[i] = snprintf(names[i], sizeof(names[i]), "bench%zu", i);
+        keys[i] = names[i];
+    }
+    size_t failed = bench_expect(zfscrypt_policy_hash_build(displacements, slots, 0, keys, lens) == 0, "policy hash: no keys not built");
+    if (zfscrypt_policy_hash_build(displacements, slots, BENCH_POLICY_USERS, keys, lens) != 0)
+        return failed + bench_expect(false, "policy hash: not built");
+    bool reseeded = false;
+    for (size_t i = 0; i < BENCH_POLICY_USERS; ++i) {
+        reseeded |= displacements[i] > 1;
+        failed += bench_expect(slots[i] < BENCH_POLICY_USERS && !seen[slots[i]], "policy hash: slots are no permutation of the keys");
+        if (slots[i] < BENCH_POLICY_USERS)
+            seen[slots[i]] = true;
+        failed += bench_expect(slots[zfscrypt_policy_hash_slot(displacements, BENCH_POLICY_USERS, keys[i], lens[i])] == i, "policy hash: key not found in its slot");
+    }
+    failed += bench_expect(reseeded, "policy hash: no bucket needed another seed");
+    keys[BENCH_POLICY_USERS - 1] = keys[0];
+    lens[BENCH_POLICY_USERS - 1] = lens[0];
+    failed += bench_expect(zfscrypt_policy_hash_build(displacements, slots, BENCH_POLICY_USERS, keys, lens) == -EEXIST, "policy hash: duplicate key not rejected");
+    return failed;
+}
+
+// writes text and users sections bench0 to benchN into a source in dir and compiles it there
+static int bench_compile_policy(const char* dir, const char* text, const size_t users) {
+    const int err = make_private_dir(dir);
+    if (err)
+        return err;
+    defer(free_ptr) char* source = strfmt("%s/zfscrypt.conf", dir);
+    if (source == NULL)
+        return -ENOMEM;
+    defer(close_file) FILE* file = fopen(source, "we");
+    if (file == NULL)
+        return -errno;
+    fputs(text, file);
+    for (size_t i = 0; i < users; ++i)
+        fprintf(file, "[user bench%zu]\nworkers = %zu\n", i, i % 16 + 1);
+    if (fflush(file) == EOF)
+        return -errno;
+    size_t line;
+    return zfscrypt_policy_compile(source, dir, &line);
+}
+
+// reads and checks the policy compiled into dir, the caller frees it
+static zfscrypt_policy_header_t* bench_read_policy(const char* dir) {
+    defer(free_ptr) char* path = strfmt("%s/%s", dir, ZFSCRYPT_POLICY_FILE);
+    defer(close_file) FILE* file = path == NULL ? NULL : fopen(path, "re");
+    if (file == NULL || fseek(file, 0, SEEK_END) < 0)
+        return NULL;
+    const long size = ftell(file);
+    if (size < (long) sizeof(zfscrypt_policy_header_t) || fseek(file, 0, SEEK_SET) < 0)
+        return NULL;
+    zfscrypt_policy_header_t* policy = malloc(size);
+    if (policy == NULL || fread(policy, 1, size, file) != (size_t) size || zfscrypt_policy_check(policy, size)) {
+        free(policy);
+        return NULL;
+    }
+    return policy;
+}
+
+// reads the compiled file instead of mapping it, which would require it to belong to root
+static zfscrypt_err_t bench_check_policy(const char* base_dir) {
+    size_t failed = bench_check_hash();
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s/policy-users", base_dir);
+    // group root exists everywhere, gid -2 is no group of the policy
+    int err = bench_compile_policy(dir, "[default]\nworkers = 2\n[group root]\nlinger = 60\n", BENCH_POLICY_USERS);
+    defer(free_ptr) zfscrypt_policy_header_t* policy = err ? NULL : bench_read_policy(dir);
+    failed += bench_expect(policy != NULL, "policy users: not compiled");
+    if (policy != NULL) {
+        failed += bench_expect(policy->users == BENCH_POLICY_USERS && policy->groups == 1, "policy users: wrong number of sections");
+        for (size_t i = 0; i < BENCH_POLICY_USERS; ++i) {
+            char user[16];
+            snprintf(user, sizeof(user), "bench%zu", i);
+            zfscrypt_policy_record_t const* record = zfscrypt_policy_find_user(policy, user);
+            failed += bench_expect(record != NULL && record->workers == i % 16 + 1, "policy users: user not found or with the settings of another");
+        }
+        failed += bench_expect(zfscrypt_policy_find_user(policy, "bench-absent") == NULL, "policy users: absent user found");
+        failed += bench_expect(zfscrypt_policy_find_user(policy, "") == NULL, "policy users: empty user found");
+        const uint32_t group = zfscrypt_policy_find_group(policy, 0);
+        failed += bench_expect(group != 0 && zfscrypt_policy_records(policy)[group].linger == 60, "policy users: group root not found");
+        failed += bench_expect(zfscrypt_policy_find_group(policy, (gid_t) -2) == 0, "policy users: absent group found");
+    }
+    snprintf(dir, sizeof(dir), "%s/policy-duplicate-user", base_dir);
+    failed += bench_expect(bench_compile_policy(dir, "[user ben]\nlinger = 1\n[user ben]\nlinger = 2\n", 0) == -EEXIST, "policy duplicate user: not rejected");
+    snprintf(dir, sizeof(dir), "%s/policy-duplicate-group", base_dir);
+    failed += bench_expect(bench_compile_policy(dir, "[group root]\n[group root]\n", 0) == -EEXIST, "policy duplicate group: not rejected");
+    snprintf(dir, sizeof(dir), "%s/policy-empty", base_dir);
+    err = bench_compile_policy(dir, "", 0);
+    defer(free_ptr) zfscrypt_policy_header_t* empty = err ? NULL : bench_read_policy(dir);
+    failed += bench_expect(empty != NULL, "policy empty: not compiled");
+    if (empty != NULL) {
+        failed += bench_expect(empty->users == 0 && empty->groups == 0, "policy empty: has sections");
+        failed += bench_expect(zfscrypt_policy_find_user(empty, "root") == NULL, "policy empty: user found");
+        failed += bench_expect(zfscrypt_policy_find_group(empty, 0) == 0, "policy empty: group found");
+    }
+    return zfscrypt_err_os(failed ? EPROTO : 0, "Checked the policy hash and lookups");
+}
+
+// expects value to be rejected by zfscrypt_keywrap_parse
+static size_t bench_check_malformed(const char* value, const char* what) {
+    zfscrypt_keywrap_t keywrap;
+    return bench_expect(zfscrypt_keywrap_parse(&keywrap, value) == -EINVAL, what);
+}
+
+// seals a key with kdf at cost, formats, parses and opens it again
+static size_t bench_check_roundtrip(const zfscrypt_crypto_kdf_t kdf, const uint64_t cost, const uint64_t guid) {
+    uint8_t key[ZFSCRYPT_CRYPTO_KEY_LEN];
+    uint8_t opened[ZFSCRYPT_CRYPTO_KEY_LEN];
+    zfscrypt_keywrap_t sealed;
+    zfscrypt_keywrap_t parsed;
+    char value[ZFSCRYPT_KEYWRAP_MAX_LEN];
+    char again[ZFSCRYPT_KEYWRAP_MAX_LEN];
+    if (zfscrypt_crypto_random_bytes(key, sizeof(key)) || zfscrypt_keywrap_seal(&sealed, kdf, cost, guid, "password", key))
+        return bench_expect(false, "keywrap: not sealed");
+    zfscrypt_keywrap_format(&sealed, value);
+    if (zfscrypt_keywrap_parse(&parsed, value))
+        return bench_expect(false, "keywrap: formatted key not parsed");
+    zfscrypt_keywrap_format(&parsed, again);
+    size_t failed = bench_expect(streq(value, again), "keywrap: parsed key formatted differently");
+    failed += bench_expect(zfscrypt_keywrap_open(&parsed, guid, "password", opened) == 0 && memcmp(key, opened, sizeof(key)) == 0, "keywrap: parsed key does not open to the sealed one");
+    failed += bench_expect(zfscrypt_keywrap_open(&parsed, guid ^ 1, "password", opened) == -EACCES, "keywrap: key opened with the guid of another dataset");
+    failed += bench_expect(zfscrypt_keywrap_open(&parsed, guid, "passwore", opened) == -EACCES, "keywrap: key opened with a wrong password");
+    return failed;
+}
+
+static zfscrypt_err_t bench_check_keywrap(void) {
+    const uint64_t guid = 0x0123456789abcdef;
+    size_t failed = bench_check_roundtrip(ZFSCRYPT_CRYPTO_KDF_PBKDF2, 1000, guid);
+    failed += bench_check_roundtrip(ZFSCRYPT_CRYPTO_KDF_SCRYPT, 10, guid);
+    zfscrypt_keywrap_t keywrap;
+    char value[ZFSCRYPT_KEYWRAP_MAX_LEN];
+    if (zfscrypt_keywrap_seal(&keywrap, ZFSCRYPT_CRYPTO_KDF_PBKDF2, 1000, guid, "password", (const uint8_t[ZFSCRYPT_CRYPTO_KEY_LEN]) {0}))
+        return zfscrypt_err_os(EPROTO, "Could not seal a key to check malformed ones");
+    zfscrypt_keywrap_format(&keywrap, value);
+    const size_t len = strlen(value);
+    const char* sealed = strrchr(value, '$');
+    char broken[ZFSCRYPT_KEYWRAP_MAX_LEN + 8];
+    failed += bench_check_malformed("", "keywrap: empty value parsed");
+    snprintf(broken, sizeof(broken), "%.*s", (int) (len - 1), value);
+    failed += bench_check_malformed(broken, "keywrap: truncated sealed key parsed");
+    snprintf(broken, sizeof(broken), "%.*s", (int) (sealed - value), value);
+    failed += bench_check_malformed(broken, "keywrap: value without sealed key parsed");
+    snprintf(broken, sizeof(broken), "%s$00", value);
+    failed += bench_check_malformed(broken, "keywrap: seventh field parsed");
+    snprintf(broken, sizeof(broken), "2%s", &value[1]);
+    failed += bench_check_malformed(broken, "keywrap: unknown version parsed");
+    snprintf(broken, sizeof(broken), "1$argon2%s", strchr(&value[2], '$'));
+    failed += bench_check_malformed(broken, "keywrap: unknown kdf parsed");
+    snprintf(broken, sizeof(broken), "1$pbkdf2$$%s", strchr(&value[strlen("1$pbkdf2$")], '$') + 1);
+    failed += bench_check_malformed(broken, "keywrap: empty cost parsed");
+    snprintf(broken, sizeof(broken), "1$pbkdf2$1000x%s", strchr(&value[strlen("1$pbkdf2$")], '$'));
+    failed += bench_check_malformed(broken, "keywrap: cost with trailing garbage parsed");
+    snprintf(broken, sizeof(broken), "%.*sG", (int) (len - 1), value);
+    failed += bench_check_malformed(broken, "keywrap: sealed key with a non hex digit parsed");
+    // a forged cost passes parsing, but the kdf refuses it before any work
+    for (size_t kdf = 0; kdf < sizeof(ZFSCRYPT_CRYPTO_MAX_COST) / sizeof(ZFSCRYPT_CRYPTO_MAX_COST[0]); ++kdf) {
+        zfscrypt_keywrap_t forged = keywrap;
+        forged.kdf = (zfscrypt_crypto_kdf_t) kdf;
+        forged.cost = ZFSCRYPT_CRYPTO_MAX_COST[kdf] + 1;
+        zfscrypt_keywrap_format(&forged, value);
+        uint8_t key[ZFSCRYPT_CRYPTO_KEY_LEN];
+        failed += bench_expect(zfscrypt_keywrap_parse(&forged, value) == 0 && zfscrypt_keywrap_open(&forged, guid, "password", key) == -EINVAL, "keywrap: key opened with a cost above the maximum");
+    }
+    return zfscrypt_err_os(failed ? EPROTO : 0, "Checked sealed keys");
+}
+
+static zfscrypt_err_t bench_round(zfscrypt_context_t* context, const char* state_dir, const size_t round, const size_t users) {
+    // discovery=walk and program without index, an unwritable state dir keeps the walk from creating one
+    context->user = fake_libzfs_user(round % users);
+    context->state_dir = "/nonexistent/zfscrypt-bench";
+    context->discovery = ZFSCRYPT_DISCOVERY_WALK;
+    zfscrypt_err_t err = bench_iter(context, BENCH_ITER_WALK);
+    context->discovery = ZFSCRYPT_DISCOVERY_PROGRAM;
+    if (!err.value)
+        err = bench_iter(context, BENCH_ITER_PROGRAM);
+    context->state_dir = state_dir;
+    if (!err.value)
+        err = bench_iter(context, BENCH_ITER_INDEX);
+    if (!err.value)
+        err = bench_valid(context, round % users);
+    if (!err.value)
+        err = bench_user(context, round % users);
+    if (!err.value)
+        err = bench_session(context);
+    return err;
+}
+
+static void bench_print(void) {
+    printf("%-14s %8s %12s %12s %12s %10s\n", "op", "calls", "mean_us", "min_us", "max_us", "ioctls/op");
+    for (size_t i = 0; i < BENCH_OPS; ++i) {
+        bench_stat_t const* stat = &bench_stats[i];
+        if (stat->count == 0)
+            continue;
+        printf("%-14s %8lu %12.1f %12.1f %12.1f %10.1f\n", stat->name, (unsigned long) stat->count, stat->total / stat->count, stat->min, stat->max, (double) stat->ioctls / stat->count);
+    }
+}
+
+// returns true if item is one of the benchmark options
+static bool bench_parse_arg(const char* item, fake_libzfs_config_t* config, size_t* roots, size_t* rounds) {
+    const char* value = strchr(item, '=');
+    if (value == NULL)
+        return false;
+    const size_t len = value - item;
+    const unsigned long long number = strtoull(++value, NULL, 10);
+    if (len == strlen("datasets") && strncmp(item, "datasets", len) == 0)
+        config->datasets = number;
+    else if (len == strlen("depth") && strncmp(item, "depth", len) == 0)
+        config->depth = number;
+    else if (len == strlen("users") && strncmp(item, "users", len) == 0)
+        config->users = number;
+    else if (len == strlen("children") && strncmp(item, "children", len) == 0)
+        config->children = number;
+    else if (len == strlen("ioctl_us") && strncmp(item, "ioctl_us", len) == 0)
+        config->ioctl_us = number;
+    else if (len == strlen("iterations") && strncmp(item, "iterations", len) == 0)
+        config->iterations = number;
+    else if (len == strlen("roots") && strncmp(item, "roots", len) == 0)
+        *roots = number;
+    else if (len == strlen("rounds") && strncmp(item, "rounds", len) == 0)
+        *rounds = number;
+    else
+        return false;
+    return true;
+}
+
+int main(int argc, const char** argv) {
+    fake_libzfs_config_t config = {.datasets = 1000, .depth = 4, .users = 10, .children = 3, .ioctl_us = 20, .iterations = 350000};
+    size_t roots = 4;
+    size_t rounds = 10;
+    char base_dir[] = "/tmp/zfscrypt-bench-XXXXXX";
+    if (mkdtemp(base_dir) == NULL) {
+        perror("Could not create temporary dir");
+        return 1;
+    }
+    defer(free_ptr) char* runtime_dir = strfmt("runtime_dir=%s/run", base_dir);
+    defer(free_ptr) char* state_dir = strfmt("state_dir=%s/state", base_dir);
+    // options of the module, caches of the machine running the benchmark are not the subject
+    const char* args[argc + 3];
+    int len = 0;
+    args[len++] = "drop_caches=none";
+    args[len++] = runtime_dir;
+    args[len++] = state_dir;
+    for (int i = 1; i < argc; ++i)
+        if (!bench_parse_arg(argv[i], &config, &roots, &rounds))
+            args[len++] = argv[i];
+    if (config.users == 0 || roots == 0 || rounds == 0 || runtime_dir == NULL || state_dir == NULL) {
+        fprintf(stderr, "usage: %s [datasets=N] [depth=N] [users=N>0] [children=N] [ioctl_us=N] [iterations=N] [roots=N>0] [rounds=N>0] [module options...]\n", argv[0]);
+        return 1;
+    }
+    const int setup_err = fake_libzfs_setup(&config);
+    if (setup_err) {
+        fprintf(stderr, "Could not set up fake libzfs: %s\n", strerror(-setup_err));
+        return 1;
+    }
+    zfscrypt_context_t context;
+    zfscrypt_err_t err = zfscrypt_context_begin_tool(&context, NULL, len, args);
+    context.uid = getuid();
+    context.gid = getgid();
+    if (!err.value)
+        err = zfscrypt_context_log_err(&context, bench_check_pbkdf2());
+    if (!err.value)
+        err = zfscrypt_context_log_err(&context, bench_check_policy(base_dir));
+    if (!err.value)
+        err = zfscrypt_context_log_err(&context, bench_check_keywrap());
+    if (!err.value)
+        err = zfscrypt_context_log_err(&context, zfscrypt_err_os(make_private_dir(context.runtime_dir), "Created runtime dir"));
+    if (!err.value)
+        err = zfscrypt_context_log_err(&context, zfscrypt_dataset_index_rebuild(&context));
+    // the state dir of the options may be overridden by the command line
+    const char* index_dir = context.state_dir;
+    for (size_t i = 0; !err.value && i < rounds; ++i)
+        err = zfscrypt_context_log_err(&context, bench_round(&context, index_dir, i, config.users));
+    for (size_t i = 0; !err.value && i < rounds; ++i)
+        err = zfscrypt_context_log_err(&context, bench_derive(roots, config.iterations));
+    if (!err.value)
+        bench_print();
+    fake_libzfs_teardown();
+    defer(free_ptr) char* command = strfmt("rm -rf '%s'", base_dir);
+    if (command != NULL && system(command) != 0)
+        fprintf(stderr, "Could not remove %s\n", base_dir);
+    return zfscrypt_context_end(&context, err) ? 1 : 0;
+}
@@ -0,0 +1,32 @@
+#!/bin/sh
+#
+# Compares dataset discovery engines on the pools of this machine.
+#
+# usage: bench/discovery.sh <user> [rounds]
+#
+# For each engine prints the number of ioctls issued and the mean wall time of
+# one discovery, which is what every login, logout and password change pays.
+# The index is bypassed with a state dir that can not be created. Needs root, strace and bc.
+
+set -eu
+
+USER_NAME="${1:?usage: $0 <user> [rounds]}"
+ROUNDS="${2:-10}"
+ZFSCRYPT="${ZFSCRYPT:-./build/zfscrypt}"
+STATE_DIR="/nonexistent/zfscrypt-bench"
+
+printf '%-10s %10s %12s %10s\n' engine datasets ioctls ms
+for engine in walk program; do
+    found="$("${ZFSCRYPT}" discover "${USER_NAME}" "discovery=${engine}" "state_dir=${STATE_DIR}" 2>/dev/null | wc -l)"
+    ioctls="$(strace -f -c -e trace=ioctl "${ZFSCRYPT}" discover "${USER_NAME}" "discovery=${engine}" "state_dir=${STATE_DIR}" 2>&1 >/dev/null \
+        | awk '$NF == "ioctl" { print $4 }')"
+    total=0
+    i=0
+    while [ "${i}" -lt "${ROUNDS}" ]; do
+        ms="$("${ZFSCRYPT}" discover "${USER_NAME}" "discovery=${engine}" "state_dir=${STATE_DIR}" 2>&1 >/dev/null \
+            | awk '/^discovery took/ { print $3 }')"
+        total="$(echo "${total} + ${ms}" | bc)"
+        i=$((i + 1))
+    done
+    printf '%-10s %10s %12s %10.3f\n' "${engine}" "${found}" "${ioctls:-0}" "$(echo "${total} / ${ROUNDS}" | bc -l)"
+done
@@ -0,0 +1,534 @@
+#include "fake_libzfs.h"
+
+#include <errno.h>
+#include <libzfs.h>
+#include <libzfs_core.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include "zfscrypt_crypto.h"
+#include "zfscrypt_dataset.h"
+#include "zfscrypt_utils.h"
+
+// Note: only the subset of libzfs and libzfs_core used by zfscrypt is implemented, with the
+// semantics zfscrypt relies on. Properties are served from memory like the property cache of a
+// real handle, so only opening, iterating and changing keys or mounts cost an ioctl.
+
+#define FAKE_NONE UINT32_MAX
+
+typedef struct fake_dataset {
+    char name[ZFS_MAX_DATASET_NAME_LEN];
+    // zfscrypt user property, inherited like any user property, empty if untagged
+    char user[32];
+    uint32_t parent;
+    uint32_t child;
+    uint32_t sibling;
+    // encryption root, FAKE_NONE if unencrypted
+    uint32_t root;
+    // wrapping key and salt, only used on encryption roots
+    uint64_t salt;
+    uint8_t key[ZFSCRYPT_CRYPTO_KEY_LEN];
+    _Atomic int loaded;
+    _Atomic int mounted;
+    // mounted datasets sharing this encryption root
+    _Atomic int mounts;
+} fake_dataset_t;
+
+typedef struct fake_state {
+    fake_libzfs_config_t config;
+    _Atomic uint64_t ioctls;
+    size_t size;
+    size_t len;
+    size_t capacity;
+    // open addressing table of dataset indices by name
+    size_t buckets;
+    char prefix[16];
+} fake_state_t;
+
+struct libzfs_handle {
+    // same position as in the real handle, see libzfs_dummy_t
+    int libzfs_error;
+};
+
+struct zfs_handle {
+    libzfs_handle_t* libzfs;
+    uint32_t index;
+    nvlist_t* user_props;
+};
+
+// shared with forked children, so sessions in other processes see the same keys and mounts
+static fake_state_t* fake = NULL;
+static fake_dataset_t* fake_datasets = NULL;
+static uint32_t* fake_table = NULL;
+
+// private functions
+
+static void fake_ioctl(void) {
+    atomic_fetch_add(&fake->ioctls, 1);
+    if (fake->config.ioctl_us == 0)
+        return;
+    // spinning is more precise than sleeping for a few microseconds
+    struct timespec begin, now;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    do
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    while ((now.tv_sec - begin.tv_sec) * 1000000 + (now.tv_nsec - begin.tv_nsec) / 1000 < fake->config.ioctl_us);
+}
+
+static size_t fake_hash(const char* name) {
+    // FNV-1a
+    size_t hash = 14695981039346656037ULL;
+    for (; *name != '\0'; ++name)
+        hash = (hash ^ (unsigned char) *name) * 1099511628211ULL;
+    return hash;
+}
+
+static uint32_t fake_lookup(const char* name) {
+    for (size_t i = fake_hash(name) % fake->buckets;; i = (i + 1) % fake->buckets) {
+        const uint32_t index = fake_table[i];
+        if (index == FAKE_NONE || strcmp(fake_datasets[index].name, name) == 0)
+            return index;
+    }
+}
+
+static int fake_add(const uint32_t parent, const char* suffix, const char* user, const uint32_t root) {
+    if (fake->len >= fake->capacity)
+        return -ENOSPC;
+    const uint32_t index = fake->len++;
+    fake_dataset_t* dataset = &fake_datasets[index];
+    const int len = parent == FAKE_NONE
+        ? snprintf(dataset->name, sizeof(dataset->name), "%s", suffix)
+        : snprintf(dataset->name, sizeof(dataset->name), "%s/%s", fake_datasets[parent].name, suffix);
+    if (len < 0 || (size_t) len >= sizeof(dataset->name))
+        return -ENAMETOOLONG;
+    (void) snprintf(dataset->user, sizeof(dataset->user), "%s", user);
+    dataset->parent = parent;
+    dataset->child = FAKE_NONE;
+    dataset->sibling = parent == FAKE_NONE ? FAKE_NONE : fake_datasets[parent].child;
+    dataset->root = root == FAKE_NONE && user[0] != '\0' ? index : root;
+    if (parent != FAKE_NONE)
+        fake_datasets[parent].child = index;
+    size_t i = fake_hash(dataset->name) % fake->buckets;
+    while (fake_table[i] != FAKE_NONE)
+        i = (i + 1) % fake->buckets;
+    fake_table[i] = index;
+    return index;
+}
+
+// adds count datasets below top, nested up to depth levels
+static int fake_add_tree(const uint32_t top, const size_t count, const char* prefix) {
+    const size_t depth = fake->config.depth == 0 ? 1 : fake->config.depth;
+    uint32_t chain[depth + 1];
+    chain[0] = top;
+    for (size_t i = 0; i < count; ++i) {
+        const size_t level = 1 + i % depth;
+        char suffix[32];
+        (void) snprintf(suffix, sizeof(suffix), "%s%zu", prefix, i);
+        const fake_dataset_t* parent = &fake_datasets[chain[level - 1]];
+        const int index = fake_add(chain[level - 1], suffix, parent->user, parent->root);
+        if (index < 0)
+            return index;
+        chain[level] = index;
+    }
+    return 0;
+}
+
+static int fake_add_home(const uint32_t parent, const size_t i) {
+    char user[32];
+    char passphrase[64];
+    (void) snprintf(user, sizeof(user), "%s%zu", fake->prefix, i);
+    fake_libzfs_passphrase(i, passphrase, sizeof(passphrase));
+    const int index = fake_add(parent, user, user, FAKE_NONE);
+    if (index < 0)
+        return index;
+    fake_datasets[index].salt = i + 1;
+    const int err = zfscrypt_crypto_derive_key(passphrase, fake_datasets[index].salt, fake->config.iterations, fake_datasets[index].key);
+    if (err)
+        return err;
+    return fake_add_tree(index, fake->config.children, "c");
+}
+
+static bool fake_encrypted(const zfs_handle_t* handle) {
+    return fake_datasets[handle->index].root != FAKE_NONE;
+}
+
+static fake_dataset_t* fake_root(const zfs_handle_t* handle) {
+    return &fake_datasets[fake_datasets[handle->index].root];
+}
+
+static zfs_handle_t* fake_handle(libzfs_handle_t* libzfs, const uint32_t index) {
+    zfs_handle_t* handle = calloc(1, sizeof(zfs_handle_t));
+    if (handle == NULL)
+        return NULL;
+    *handle = (zfs_handle_t) {.libzfs = libzfs, .index = index, .user_props = NULL};
+    return handle;
+}
+
+static int fake_fail(libzfs_handle_t* libzfs, const int error) {
+    libzfs->libzfs_error = error;
+    return -1;
+}
+
+// mountpoints are the names below /, so sorting by name puts parents before their children
+static int fake_mountpoint_compare(const void* a, const void* b) {
+    return strcmp(zfs_get_name(*(zfs_handle_t* const*) a), zfs_get_name(*(zfs_handle_t* const*) b));
+}
+
+// public functions
+
+int fake_libzfs_setup(fake_libzfs_config_t const* config) {
+    const size_t minimum = 3 + config->users * (1 + config->children);
+    const size_t capacity = config->datasets < minimum ? minimum : config->datasets;
+    const size_t buckets = capacity * 2 + 1;
+    const size_t size = sizeof(fake_state_t) + capacity * sizeof(fake_dataset_t) + buckets * sizeof(uint32_t);
+    void* data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (data == MAP_FAILED)
+        return -errno;
+    fake = data;
+    fake->config = *config;
+    fake->size = size;
+    fake->capacity = capacity;
+    fake->buckets = buckets;
+    (void) snprintf(fake->prefix, sizeof(fake->prefix), "%s", config->prefix == NULL ? "user" : config->prefix);
+    fake_datasets = (fake_dataset_t*) &fake[1];
+    fake_table = (uint32_t*) &fake_datasets[capacity];
+    memset(fake_table, 0xff, buckets * sizeof(uint32_t));
+    const int pool = fake_add(FAKE_NONE, "bench", "", FAKE_NONE);
+    const int home = pool < 0 ? pool : fake_add(pool, "home", "", FAKE_NONE);
+    const int data_root = home < 0 ? home : fake_add(pool, "data", "", FAKE_NONE);
+    int err = data_root < 0 ? data_root : 0;
+    for (size_t i = 0; !err && i < config->users; ++i)
+        err = fake_add_home(home, i);
+    if (!err)
+        err = fake_add_tree(data_root, capacity - fake->len, "d");
+    if (err)
+        fake_libzfs_teardown();
+    return err;
+}
+
+void fake_libzfs_teardown(void) {
+    if (fake != NULL)
+        munmap(fake, fake->size);
+    fake = NULL;
+    fake_datasets = NULL;
+    fake_table = NULL;
+}
+
+uint64_t fake_libzfs_ioctls(void) {
+    return atomic_load(&fake->ioctls);
+}
+
+const char* fake_libzfs_user(const size_t i) {
+    return fake_datasets[3 + i * (1 + fake->config.children)].user;
+}
+
+const char* fake_libzfs_home(const size_t i) {
+    return fake_datasets[3 + i * (1 + fake->config.children)].name;
+}
+
+bool fake_libzfs_home_unlocked(const size_t i) {
+    const fake_dataset_t* home = &fake_datasets[3 + i * (1 + fake->config.children)];
+    return atomic_load(&home->loaded) && atomic_load(&home->mounted);
+}
+
+size_t fake_libzfs_unlocked(void) {
+    size_t count = 0;
+    for (size_t i = 0; i < fake->len; ++i)
+        count += atomic_load(&fake_datasets[i].loaded) || atomic_load(&fake_datasets[i].mounted);
+    return count;
+}
+
+void fake_libzfs_passphrase(const size_t i, char* buffer, const size_t size) {
+    (void) snprintf(buffer, size, "password-%s%zu", fake->prefix, i);
+}
+
+// libzfs
+
+libzfs_handle_t* libzfs_init(void) {
+    return calloc(1, sizeof(libzfs_handle_t));
+}
+
+void libzfs_fini(libzfs_handle_t* libzfs) {
+    free(libzfs);
+}
+
+int libzfs_errno(libzfs_handle_t* libzfs) {
+    return libzfs->libzfs_error;
+}
+
+const char* libzfs_error_description(libzfs_handle_t* libzfs) {
+    static _Thread_local char description[32];
+    (void) snprintf(description, sizeof(description), "fake libzfs error %d", libzfs->libzfs_error);
+    return description;
+}
+
+zfs_handle_t* zfs_open(libzfs_handle_t* libzfs, const char* name, int types) {
+    fake_ioctl();
+    const uint32_t index = fake_lookup(name);
+    if (index == FAKE_NONE || !(types & ZFS_TYPE_FILESYSTEM)) {
+        (void) fake_fail(libzfs, EZFS_NOENT);
+        return NULL;
+    }
+    return fake_handle(libzfs, index);
+}
+
+void zfs_close(zfs_handle_t* handle) {
+    nvlist_free(handle->user_props);
+    free(handle);
+}
+
+const char* zfs_get_name(const zfs_handle_t* handle) {
+    return fake_datasets[handle->index].name;
+}
+
+int zfs_iter_root(libzfs_handle_t* libzfs, zfs_iter_f func, void* data) {
+    fake_ioctl();
+    zfs_handle_t* handle = fake_handle(libzfs, 0);
+    return handle == NULL ? fake_fail(libzfs, EZFS_NOMEM) : func(handle, data);
+}
+
+int zfs_iter_filesystems(zfs_handle_t* handle, zfs_iter_f func, void* data) {
+    for (uint32_t i = fake_datasets[handle->index].child; i != FAKE_NONE; i = fake_datasets[i].sibling) {
+        // one ZFS_IOC_DATASET_LIST_NEXT per child, which also fetches its properties
+        fake_ioctl();
+        zfs_handle_t* child = fake_handle(handle->libzfs, i);
+        if (child == NULL)
+            return fake_fail(handle->libzfs, EZFS_NOMEM);
+        const int err = func(child, data);
+        if (err)
+            return err;
+    }
+    return 0;
+}
+
+nvlist_t* zfs_get_user_props(zfs_handle_t* handle) {
+    const fake_dataset_t* dataset = &fake_datasets[handle->index];
+    if (handle->user_props != NULL)
+        return handle->user_props;
+    nvlist_t* value = NULL;
+    if (nvlist_alloc(&handle->user_props, NV_UNIQUE_NAME, 0) || dataset->user[0] == '\0')
+        return handle->user_props;
+    if (nvlist_alloc(&value, NV_UNIQUE_NAME, 0) == 0 && nvlist_add_string(value, ZPROP_VALUE, dataset->user) == 0)
+        (void) nvlist_add_nvlist(handle->user_props, ZFSCRYPT_USER_PROPERTY, value);
+    nvlist_free(value);
+    return handle->user_props;
+}
+
+uint64_t zfs_prop_get_int(zfs_handle_t* handle, zfs_prop_t prop) {
+    const bool encrypted = fake_encrypted(handle);
+    switch (prop) {
+    case ZFS_PROP_CANMOUNT:
+        return ZFS_CANMOUNT_ON;
+    case ZFS_PROP_ENCRYPTION:
+        return encrypted ? ZIO_CRYPT_AES_256_GCM : ZIO_CRYPT_OFF;
+    case ZFS_PROP_KEYFORMAT:
+        return encrypted ? ZFS_KEYFORMAT_PASSPHRASE : ZFS_KEYFORMAT_NONE;
+    case ZFS_PROP_KEYSTATUS:
+        if (!encrypted)
+            return ZFS_KEYSTATUS_NONE;
+        return atomic_load(&fake_root(handle)->loaded) ? ZFS_KEYSTATUS_AVAILABLE : ZFS_KEYSTATUS_UNAVAILABLE;
+    case ZFS_PROP_PBKDF2_SALT:
+        return encrypted ? fake_root(handle)->salt : 0;
+    case ZFS_PROP_PBKDF2_ITERS:
+        return encrypted ? fake->config.iterations : 0;
+    case ZFS_PROP_MOUNTED:
+        return atomic_load(&fake_datasets[handle->index].mounted);
+    default:
+        return 0;
+    }
+}
+
+int zfs_prop_get(zfs_handle_t* handle, zfs_prop_t prop, char* buffer, size_t size, unused zprop_source_t* source, unused char* statbuf, unused size_t statlen, unused boolean_t literal) {
+    const bool encrypted = fake_encrypted(handle);
+    const bool is_root = encrypted && fake_root(handle) == &fake_datasets[handle->index];
+    int len = -1;
+    switch (prop) {
+    case ZFS_PROP_MOUNTPOINT:
+        len = snprintf(buffer, size, "/%s", zfs_get_name(handle));
+        break;
+    case ZFS_PROP_KEYLOCATION:
+        // like ZFS, only encryption roots have a key location
+        len = snprintf(buffer, size, "%s", is_root ? "prompt" : "none");
+        break;
+    case ZFS_PROP_ENCRYPTION_ROOT:
+        if (encrypted)
+            len = snprintf(buffer, size, "%s", fake_root(handle)->name);
+        break;
+    default:
+        break;
+    }
+    return len < 0 || (size_t) len >= size ? fake_fail(handle->libzfs, EZFS_PROPTYPE) : 0;
+}
+
+const char* zfs_prop_to_name(zfs_prop_t prop) {
+    switch (prop) {
+    case ZFS_PROP_KEYFORMAT:
+        return "keyformat";
+    case ZFS_PROP_PBKDF2_SALT:
+        return "pbkdf2salt";
+    case ZFS_PROP_PBKDF2_ITERS:
+        return "pbkdf2iters";
+    default:
+        return "unknown";
+    }
+}
+
+boolean_t zfs_is_mounted(zfs_handle_t* handle, char** where) {
+    if (!atomic_load(&fake_datasets[handle->index].mounted))
+        return B_FALSE;
+    if (where != NULL)
+        *where = strfmt("/%s", zfs_get_name(handle));
+    return B_TRUE;
+}
+
+int zfs_mount(zfs_handle_t* handle, unused const char* options, unused int flags) {
+    fake_ioctl();
+    if (fake_encrypted(handle) && !atomic_load(&fake_root(handle)->loaded))
+        return fake_fail(handle->libzfs, EZFS_CRYPTOFAILED);
+    if (!atomic_exchange(&fake_datasets[handle->index].mounted, 1) && fake_encrypted(handle))
+        atomic_fetch_add(&fake_root(handle)->mounts, 1);
+    return 0;
+}
+
+int zfs_unmount(zfs_handle_t* handle, unused const char* mountpoint, unused int flags) {
+    fake_ioctl();
+    if (atomic_exchange(&fake_datasets[handle->index].mounted, 0) && fake_encrypted(handle))
+        atomic_fetch_sub(&fake_root(handle)->mounts, 1);
+    return 0;
+}
+
+void zfs_foreach_mountpoint(unused libzfs_handle_t* libzfs, zfs_handle_t** handles, size_t len, zfs_iter_f callback, void* data, unused boolean_t parallel) {
+    // mounting only flips flags, running the subtrees one after another costs the same
+    qsort(handles, len, sizeof(zfs_handle_t*), fake_mountpoint_compare);
+    for (size_t i = 0; i < len; ++i)
+        (void) callback(handles[i], data);
+}
+
+int zfs_crypto_unload_key(zfs_handle_t* handle) {
+    fake_ioctl();
+    fake_dataset_t* root = &fake_datasets[handle->index];
+    if (root->root != handle->index || !atomic_load(&root->loaded))
+        return EACCES;
+    if (atomic_load(&root->mounts) > 0)
+        return EBUSY;
+    atomic_store(&root->loaded, 0);
+    return 0;
+}
+
+// libzfs_core
+
+int lzc_load_key(const char* name, boolean_t noop, uint8_t* key, uint_t len) {
+    fake_ioctl();
+    const uint32_t index = fake_lookup(name);
+    if (index == FAKE_NONE)
+        return ENOENT;
+    fake_dataset_t* root = &fake_datasets[index];
+    if (root->root != index)
+        return EINVAL;
+    if (len != ZFSCRYPT_CRYPTO_KEY_LEN || memcmp(root->key, key, len) != 0)
+        return EACCES;
+    if (noop)
+        return 0;
+    int expected = 0;
+    return atomic_compare_exchange_strong(&root->loaded, &expected, 1) ? 0 : EEXIST;
+}
+
+int lzc_unload_key(const char* name) {
+    fake_ioctl();
+    const uint32_t index = fake_lookup(name);
+    if (index == FAKE_NONE)
+        return ENOENT;
+    fake_dataset_t* root = &fake_datasets[index];
+    if (root->root != index || !atomic_load(&root->loaded))
+        return EACCES;
+    if (atomic_load(&root->mounts) > 0)
+        return EBUSY;
+    atomic_store(&root->loaded, 0);
+    return 0;
+}
+
+int lzc_change_key(const char* name, unused uint64_t cmd, nvlist_t* props, uint8_t* key, uint_t len) {
+    fake_ioctl();
+    const uint32_t index = fake_lookup(name);
+    if (index == FAKE_NONE)
+        return ENOENT;
+    fake_dataset_t* root = &fake_datasets[index];
+    uint64_t salt = 0;
+    if (root->root != index || len != ZFSCRYPT_CRYPTO_KEY_LEN || nvlist_lookup_uint64(props, "pbkdf2salt", &salt))
+        return EINVAL;
+    if (!atomic_load(&root->loaded))
+        return EACCES;
+    memcpy(root->key, key, len);
+    root->salt = salt;
+    return 0;
+}
+
+static int fake_program_visit(const uint32_t index, const char* user, nvlist_t* found) {
+    int err = 0;
+    for (uint32_t i = fake_datasets[index].child; !err && i != FAKE_NONE; i = fake_datasets[i].sibling) {
+        const fake_dataset_t* dataset = &fake_datasets[i];
+        if (dataset->root != FAKE_NONE && strcmp(dataset->user, user) == 0)
+            err = nvlist_add_string(found, dataset->name, atomic_load(&fake_datasets[dataset->root].loaded) ? "available" : "unavailable");
+        if (!err)
+            err = fake_program_visit(i, user, found);
+    }
+    return err;
+}
+
+// evaluates the discovery program natively, visiting datasets in the kernel costs nothing here
+int lzc_channel_program_nosync(unused const char* pool, unused const char* program, unused uint64_t instructions, unused uint64_t memory, nvlist_t* args, nvlist_t** out) {
+    fake_ioctl();
+    char** argv = NULL;
+    uint_t argc = 0;
+    nvlist_t* found = NULL;
+    int err = nvlist_lookup_string_array(args, "argv", &argv, &argc);
+    if (!err && argc != 3)
+        err = EINVAL;
+    const uint32_t root = err ? FAKE_NONE : fake_lookup(argv[0]);
+    if (!err && root == FAKE_NONE)
+        err = ENOENT;
+    if (!err)
+        err = nvlist_alloc(&found, NV_UNIQUE_NAME, 0);
+    if (!err)
+        err = fake_program_visit(root, argv[2], found);
+    if (!err)
+        err = nvlist_alloc(out, NV_UNIQUE_NAME, 0);
+    if (!err)
+        err = nvlist_add_nvlist(*out, "return", found);
+    nvlist_free(found);
+    return err;
+}
+
+// provisioning and migration are not simulated, the fake tree is built once by fake_libzfs_setup
+
+int lzc_create(unused const char* name, unused lzc_dataset_type_t type, unused nvlist_t* props, unused uint8_t* key, unused uint_t len) {
+    return ENOTSUP;
+}
+
+int lzc_clone(unused const char* name, unused const char* origin, unused nvlist_t* props) {
+    return ENOTSUP;
+}
+
+int lzc_destroy(unused const char* name) {
+    return ENOTSUP;
+}
+
+int zfs_set_fsacl(zfs_handle_t* handle, unused boolean_t undo, unused nvlist_t* acl) {
+    return fake_fail(handle->libzfs, EZFS_NOTSUP);
+}
+
+boolean_t zfs_dataset_exists(unused libzfs_handle_t* libzfs, const char* name, unused zfs_type_t types) {
+    return fake_lookup(name) != FAKE_NONE;
+}
+
+int zfs_prop_set(zfs_handle_t* handle, unused const char* name, unused const char* value) {
+    return fake_fail(handle->libzfs, EZFS_NOTSUP);
+}
+
+int zfs_prop_inherit(zfs_handle_t* handle, unused const char* name, unused boolean_t received) {
+    return fake_fail(handle->libzfs, EZFS_NOTSUP);
+}
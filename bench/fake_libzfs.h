@@ -0,0 +1,52 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Stand-in for libzfs and libzfs_core, so the dataset layer can be measured without pools or root.
+ *
+ * The fake serves a generated tree from memory shared with forked children. Every call that is an
+ * ioctl in the real libraries spins for ioctl_us, key derivations pay for the configured PBKDF2
+ * iterations, mounting only flips a flag. Layout of the tree:
+ *
+ *   bench                      pool root
+ *   bench/home                 unencrypted parent of all homes
+ *   bench/home/<prefix>N       encryption root of user <prefix>N, passphrase "password-<prefix>N"
+ *   bench/home/<prefix>N/cK... children of the home, inherit its key, nested up to depth
+ *   bench/data/...             untagged datasets up to the requested total, nested up to depth
+ */
+
+typedef struct fake_libzfs_config {
+    // total number of datasets, at least enough for the homes and their children
+    size_t datasets;
+    // maximum nesting below bench/home/userN and bench/data
+    size_t depth;
+    size_t users;
+    // datasets below each home
+    size_t children;
+    unsigned ioctl_us;
+    uint64_t iterations;
+    // names of the users, "user" if NULL
+    const char* prefix;
+} fake_libzfs_config_t;
+
+// public functions
+
+// builds the tree, returns 0 or -errno
+int fake_libzfs_setup(fake_libzfs_config_t const* config);
+void fake_libzfs_teardown(void);
+
+// number of ioctls issued since setup
+uint64_t fake_libzfs_ioctls(void);
+
+// name of user number i and their passphrase, valid until teardown
+const char* fake_libzfs_user(const size_t i);
+const char* fake_libzfs_home(const size_t i);
+void fake_libzfs_passphrase(const size_t i, char* buffer, const size_t size);
+
+// whether the key of home i is loaded and the home mounted
+bool fake_libzfs_home_unlocked(const size_t i);
+
+// number of datasets that are mounted or have their key loaded
+size_t fake_libzfs_unlocked(void);
@@ -0,0 +1,441 @@
+// RTLD_NEXT
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <errno.h>
+#include <grp.h>
+#include <limits.h>
+#include <pwd.h>
+#include <security/pam_appl.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fake_libzfs.h"
+#include "zfscrypt_session.h"
+#include "zfscrypt_utils.h"
+
+/*
+ * Login storm through libpam against the libzfs stand-in in fake_libzfs.c
+ *
+ * usage: build/storm [workers=N] [users=N] [sessions=N] [think_ms=N] [pause_ms=N] [datasets=N] [depth=N] [children=N] [ioctl_us=N] [iterations=N] [module options...]
+ *
+ * Forks workers that each run sessions logins as random users: authenticate, open_session, hold
+ * the session for up to think_ms, close_session, then pause for up to pause_ms. Prints latency
+ * percentiles per PAM stage and checks that every open session found the home of its user
+ * mounted, and that no session, key or mount is left over afterwards. The users exist only for
+ * this process, it answers the passwd lookups for them itself. pam_stress stands in for pam_unix:
+ * it asks for the password without checking it, the module still fails on a wrong passphrase.
+ * Needs root for the module to drop and regain privileges. The module is pam_zfscrypt_fake.so
+ * next to this binary, which links against it to share the fake with the module libpam loads.
+ */
+
+#define STORM_SERVICE "zfscrypt-storm"
+#define STORM_PREFIX "zfscrypt-storm"
+#define STORM_MODULE "pam_zfscrypt_fake.so"
+// uid of user number i is STORM_UID + i, above the ranges distributions hand out
+#define STORM_UID 2000000000U
+
+typedef enum storm_stage {
+    STORM_AUTHENTICATE,
+    STORM_OPEN_SESSION,
+    STORM_CLOSE_SESSION,
+    STORM_STAGES
+} storm_stage_t;
+
+static const char* const storm_stage_names[STORM_STAGES] = {"authenticate", "open_session", "close_session"};
+
+typedef struct storm_config {
+    fake_libzfs_config_t fake;
+    size_t workers;
+    size_t sessions;
+    unsigned think_ms;
+    unsigned pause_ms;
+} storm_config_t;
+
+// shared with the workers, samples of failed calls are negative
+typedef struct storm_results {
+    _Atomic uint64_t errors[STORM_STAGES];
+    // open sessions that did not find the home of their user unlocked
+    _Atomic uint64_t inconsistent;
+    double samples[];
+} storm_results_t;
+
+typedef struct storm_data {
+    char token[64];
+} storm_data_t;
+
+static int storm_conv(const int num_messages, const struct pam_message** messages, struct pam_response** result, void* raw_data) {
+    if (num_messages <= 0)
+        return PAM_CONV_ERR;
+    struct pam_response* responses = calloc(num_messages, sizeof(struct pam_response));
+    if (responses == NULL)
+        return PAM_BUF_ERR;
+    storm_data_t const* data = raw_data;
+    for (int i = 0; i < num_messages; i++) {
+        // the module only ever asks for the password
+        if (messages[i]->msg_style == PAM_PROMPT_ECHO_OFF && (responses[i].resp = strdup(data->token)) == NULL) {
+            for (int j = 0; j < i; j++)
+                free(responses[j].resp);
+            free(responses);
+            return PAM_BUF_ERR;
+        }
+    }
+    *result = responses;
+    return PAM_SUCCESS;
+}
+
+static double storm_now_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1e3 + now.tv_nsec / 1e6;
+}
+
+static void storm_sleep_ms(const unsigned ms) {
+    const struct timespec duration = {.tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000L};
+    while (nanosleep(&duration, NULL) < 0 && errno == EINTR)
+        continue;
+}
+
+static unsigned storm_random_ms(unsigned* seed, const unsigned max) {
+    return max == 0 ? 0 : (unsigned) rand_r(seed) % (max + 1);
+}
+
+static int storm_call(storm_results_t* results, const storm_stage_t stage, const size_t sample, int (*call)(pam_handle_t*, int), pam_handle_t* handle) {
+    const double begin = storm_now_ms();
+    const int status = call(handle, 0);
+    const double duration = storm_now_ms() - begin;
+    results->samples[sample * STORM_STAGES + stage] = status == PAM_SUCCESS ? duration : -1;
+    if (status != PAM_SUCCESS)
+        atomic_fetch_add(&results->errors[stage], 1);
+    return status;
+}
+
+static void storm_session(storm_config_t const* config, storm_results_t* results, const char* confdir, const size_t sample, unsigned* seed) {
+    const size_t user = (size_t) rand_r(seed) % config->fake.users;
+    storm_data_t data;
+    fake_libzfs_passphrase(user, data.token, sizeof(data.token));
+    const struct pam_conv conv = {.conv = storm_conv, .appdata_ptr = &data};
+    pam_handle_t* handle = NULL;
+    if (pam_start_confdir(STORM_SERVICE, fake_libzfs_user(user), &conv, confdir, &handle) != PAM_SUCCESS) {
+        atomic_fetch_add(&results->errors[STORM_AUTHENTICATE], 1);
+        return;
+    }
+    int status = storm_call(results, STORM_AUTHENTICATE, sample, pam_authenticate, handle);
+    if (status == PAM_SUCCESS)
+        status = storm_call(results, STORM_OPEN_SESSION, sample, pam_open_session, handle);
+    if (status == PAM_SUCCESS) {
+        if (!fake_libzfs_home_unlocked(user))
+            atomic_fetch_add(&results->inconsistent, 1);
+        storm_sleep_ms(storm_random_ms(seed, config->think_ms));
+        status = storm_call(results, STORM_CLOSE_SESSION, sample, pam_close_session, handle);
+    }
+    pam_end(handle, status);
+}
+
+static void storm_worker(storm_config_t const* config, storm_results_t* results, const char* confdir, const size_t worker) {
+    unsigned seed = (unsigned) (time(NULL) ^ (worker * 2654435761U));
+    for (size_t i = 0; i < config->sessions; ++i) {
+        storm_session(config, results, confdir, worker * config->sessions + i, &seed);
+        storm_sleep_ms(storm_random_ms(&seed, config->pause_ms));
+    }
+}
+
+static int storm_compare(const void* a, const void* b) {
+    const double x = *(const double*) a;
+    const double y = *(const double*) b;
+    return (x > y) - (x < y);
+}
+
+// nearest rank percentile of sorted samples
+static double storm_percentile(double const* sorted, const size_t len, const double percentile) {
+    size_t rank = (size_t) (percentile / 100 * len + 0.999999);
+    rank = rank == 0 ? 1 : rank > len ? len : rank;
+    return sorted[rank - 1];
+}
+
+static void storm_print(storm_config_t const* config, storm_results_t* results, const double duration) {
+    const size_t total = config->workers * config->sessions;
+    double* sorted = malloc(total * sizeof(double));
+    if (sorted == NULL)
+        return;
+    printf("%zu workers, %zu users, %zu sessions in %.1f s\n", config->workers, (size_t) config->fake.users, total, duration / 1e3);
+    printf("%-14s %8s %8s %10s %10s %10s %10s\n", "stage", "calls", "errors", "p50_ms", "p99_ms", "p99.9_ms", "max_ms");
+    for (size_t stage = 0; stage < STORM_STAGES; ++stage) {
+        size_t len = 0;
+        for (size_t i = 0; i < total; ++i)
+            if (results->samples[i * STORM_STAGES + stage] >= 0)
+                sorted[len++] = results->samples[i * STORM_STAGES + stage];
+        qsort(sorted, len, sizeof(double), storm_compare);
+        const uint64_t errors = atomic_load(&results->errors[stage]);
+        if (len == 0) {
+            printf("%-14s %8zu %8lu %10s %10s %10s %10s\n", storm_stage_names[stage], len, (unsigned long) errors, "-", "-", "-", "-");
+            continue;
+        }
+        printf("%-14s %8zu %8lu %10.2f %10.2f %10.2f %10.2f\n", storm_stage_names[stage], len, (unsigned long) errors, storm_percentile(sorted, len, 50), storm_percentile(sorted, len, 99), storm_percentile(sorted, len, 99.9), sorted[len - 1]);
+    }
+    free(sorted);
+}
+
+// returns the number of problems found once all workers are done
+static size_t storm_check(storm_config_t const* config, storm_results_t* results, const char* runtime_dir) {
+    size_t problems = atomic_load(&results->inconsistent);
+    if (problems > 0)
+        printf("%zu session(s) opened without their home unlocked\n", problems);
+    for (size_t i = 0; i < config->fake.users; ++i) {
+        struct passwd const* const pwd = getpwnam(fake_libzfs_user(i));
+        int count = -1;
+        if (pwd == NULL || zfscrypt_session_counter_get(&count, runtime_dir, pwd->pw_uid).value || count != 0) {
+            printf("session counter of %s is %d after all sessions closed\n", fake_libzfs_user(i), count);
+            ++problems;
+        }
+    }
+    const size_t unlocked = fake_libzfs_unlocked();
+    if (unlocked > 0)
+        printf("%zu dataset(s) still mounted or with key loaded after all sessions closed\n", unlocked);
+    return problems + unlocked;
+}
+
+static int storm_system(const char* format, const char* arg) {
+    defer(free_ptr) char* command = strfmt(format, arg);
+    return command == NULL ? -1 : system(command);
+}
+
+// passwd entries of the users of the fake, the module and libpam resolve these lookups against
+// this binary before libc, all other names and ids go on to libc
+
+static size_t storm_users = 0;
+
+// returns the number of the user or storm_users if it is none of the fake
+static size_t storm_user_by_name(const char* name) {
+    size_t i = 0;
+    while (name != NULL && i < storm_users && strcmp(name, fake_libzfs_user(i)) != 0)
+        ++i;
+    return name == NULL ? storm_users : i;
+}
+
+static size_t storm_user_by_uid(const uid_t uid) {
+    return uid >= STORM_UID && uid - STORM_UID < storm_users ? uid - STORM_UID : storm_users;
+}
+
+static int storm_passwd(const size_t user, struct passwd* entry, char* buffer, const size_t len, struct passwd** result) {
+    const int written = snprintf(buffer, len, "%s%c/nonexistent%c/usr/sbin/nologin", fake_libzfs_user(user), '\0', '\0');
+    if (written < 0 || (size_t) written >= len) {
+        *result = NULL;
+        return ERANGE;
+    }
+    entry->pw_name = buffer;
+    entry->pw_passwd = (char*) "x";
+    entry->pw_uid = STORM_UID + user;
+    entry->pw_gid = STORM_UID + user;
+    entry->pw_gecos = (char*) "";
+    entry->pw_dir = buffer + strlen(buffer) + 1;
+    entry->pw_shell = entry->pw_dir + strlen(entry->pw_dir) + 1;
+    *result = entry;
+    return 0;
+}
+
+int getpwnam_r(const char* name, struct passwd* entry, char* buffer, size_t len, struct passwd** result) {
+    const size_t user = storm_user_by_name(name);
+    if (user < storm_users)
+        return storm_passwd(user, entry, buffer, len, result);
+    int (*next)(const char*, struct passwd*, char*, size_t, struct passwd**) = NULL;
+    // POSIX way around ISO C not converting void* to function pointers
+    *(void**) &next = dlsym(RTLD_NEXT, "getpwnam_r");
+    return next(name, entry, buffer, len, result);
+}
+
+int getpwuid_r(uid_t uid, struct passwd* entry, char* buffer, size_t len, struct passwd** result) {
+    const size_t user = storm_user_by_uid(uid);
+    if (user < storm_users)
+        return storm_passwd(user, entry, buffer, len, result);
+    int (*next)(uid_t, struct passwd*, char*, size_t, struct passwd**) = NULL;
+    *(void**) &next = dlsym(RTLD_NEXT, "getpwuid_r");
+    return next(uid, entry, buffer, len, result);
+}
+
+struct passwd* getpwnam(const char* name) {
+    const size_t user = storm_user_by_name(name);
+    if (user >= storm_users) {
+        struct passwd* (*next)(const char*) = NULL;
+        *(void**) &next = dlsym(RTLD_NEXT, "getpwnam");
+        return next(name);
+    }
+    static struct passwd entry;
+    static char buffer[256];
+    struct passwd* result = NULL;
+    return storm_passwd(user, &entry, buffer, sizeof(buffer), &result) == 0 ? result : NULL;
+}
+
+struct passwd* getpwuid(uid_t uid) {
+    const size_t user = storm_user_by_uid(uid);
+    if (user >= storm_users) {
+        struct passwd* (*next)(uid_t) = NULL;
+        *(void**) &next = dlsym(RTLD_NEXT, "getpwuid");
+        return next(uid);
+    }
+    static struct passwd entry;
+    static char buffer[256];
+    struct passwd* result = NULL;
+    return storm_passwd(user, &entry, buffer, sizeof(buffer), &result) == 0 ? result : NULL;
+}
+
+// the users of the fake are members of their primary group only
+int getgrouplist(const char* name, gid_t group, gid_t* groups, int* count) {
+    if (storm_user_by_name(name) >= storm_users) {
+        int (*next)(const char*, gid_t, gid_t*, int*) = NULL;
+        *(void**) &next = dlsym(RTLD_NEXT, "getgrouplist");
+        return next(name, group, groups, count);
+    }
+    const int available = *count;
+    *count = 1;
+    if (available < 1)
+        return -1;
+    groups[0] = group;
+    return 1;
+}
+
+// writes the service with the module next to this binary, returns the config dir or NULL
+static char* storm_write_service(const char* base_dir, const char* args) {
+    char exe[PATH_MAX];
+    const ssize_t len = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+    if (len < 0)
+        return NULL;
+    exe[len] = '\0';
+    char* slash = strrchr(exe, '/');
+    if (slash != NULL)
+        *slash = '\0';
+    char* confdir = strfmt("%s/pam.d", base_dir);
+    defer(free_ptr) char* path = confdir == NULL ? NULL : strfmt("%s/%s", confdir, STORM_SERVICE);
+    if (path == NULL || make_private_dir(confdir)) {
+        free(confdir);
+        return NULL;
+    }
+    FILE* file = fopen(path, "we");
+    if (file != NULL) {
+        fprintf(file, "%s\n", "auth required pam_stress.so");
+        fprintf(file, "auth required %s/%s %s\n", exe, STORM_MODULE, args);
+        fprintf(file, "session required %s/%s %s\n", exe, STORM_MODULE, args);
+    }
+    if (file == NULL || fclose(file) != 0) {
+        free(confdir);
+        return NULL;
+    }
+    return confdir;
+}
+
+// returns true if item is one of the storm options
+static bool storm_parse_arg(const char* item, storm_config_t* config) {
+    const char* value = strchr(item, '=');
+    if (value == NULL)
+        return false;
+    const size_t len = value - item;
+    const unsigned long long number = strtoull(++value, NULL, 10);
+    if (len == strlen("workers") && strncmp(item, "workers", len) == 0)
+        config->workers = number;
+    else if (len == strlen("users") && strncmp(item, "users", len) == 0)
+        config->fake.users = number;
+    else if (len == strlen("sessions") && strncmp(item, "sessions", len) == 0)
+        config->sessions = number;
+    else if (len == strlen("think_ms") && strncmp(item, "think_ms", len) == 0)
+        config->think_ms = number;
+    else if (len == strlen("pause_ms") && strncmp(item, "pause_ms", len) == 0)
+        config->pause_ms = number;
+    else if (len == strlen("datasets") && strncmp(item, "datasets", len) == 0)
+        config->fake.datasets = number;
+    else if (len == strlen("depth") && strncmp(item, "depth", len) == 0)
+        config->fake.depth = number;
+    else if (len == strlen("children") && strncmp(item, "children", len) == 0)
+        config->fake.children = number;
+    else if (len == strlen("ioctl_us") && strncmp(item, "ioctl_us", len) == 0)
+        config->fake.ioctl_us = number;
+    else if (len == strlen("iterations") && strncmp(item, "iterations", len) == 0)
+        config->fake.iterations = number;
+    else
+        return false;
+    return true;
+}
+
+static int storm_run(storm_config_t const* config, const char* confdir, const char* runtime_dir) {
+    const size_t total = config->workers * config->sessions;
+    const size_t size = sizeof(storm_results_t) + total * STORM_STAGES * sizeof(double);
+    storm_results_t* results = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (results == MAP_FAILED) {
+        perror("Could not map results");
+        return 1;
+    }
+    for (size_t i = 0; i < total * STORM_STAGES; ++i)
+        results->samples[i] = -1;
+    const double begin = storm_now_ms();
+    size_t started = 0;
+    for (; started < config->workers; ++started) {
+        const pid_t pid = fork();
+        if (pid < 0)
+            break;
+        if (pid == 0) {
+            storm_worker(config, results, confdir, started);
+            _exit(0);
+        }
+    }
+    int failed = started < config->workers;
+    while (started > 0) {
+        int status = 0;
+        if (wait(&status) < 0 && errno == EINTR)
+            continue;
+        failed |= !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+        --started;
+    }
+    storm_print(config, results, storm_now_ms() - begin);
+    if (failed)
+        fprintf(stderr, "%s\n", "Some workers failed");
+    const size_t problems = storm_check(config, results, runtime_dir);
+    munmap(results, size);
+    return failed || problems > 0;
+}
+
+int main(int argc, const char** argv) {
+    storm_config_t config = {
+        .fake = {.datasets = 1000, .depth = 4, .users = 20, .children = 3, .ioctl_us = 20, .iterations = 350000, .prefix = STORM_PREFIX},
+        .workers = 50,
+        .sessions = 20,
+        .think_ms = 100,
+        .pause_ms = 50,
+    };
+    char base_dir[] = "/tmp/zfscrypt-storm-XXXXXX";
+    if (mkdtemp(base_dir) == NULL) {
+        perror("Could not create temporary dir");
+        return 1;
+    }
+    defer(free_ptr) char* runtime_dir = strfmt("%s/run", base_dir);
+    // module options, caches of the machine running the storm are not the subject
+    defer(free_ptr) char* args = runtime_dir == NULL ? NULL : strfmt("runtime_dir=%s state_dir=%s/state drop_caches=none", runtime_dir, base_dir);
+    for (int i = 1; args != NULL && i < argc; ++i) {
+        if (storm_parse_arg(argv[i], &config))
+            continue;
+        char* more = strfmt("%s %s", args, argv[i]);
+        free(args);
+        args = more;
+    }
+    if (config.workers == 0 || config.fake.users == 0 || config.sessions == 0 || runtime_dir == NULL || args == NULL) {
+        fprintf(stderr, "usage: %s [workers=N>0] [users=N>0] [sessions=N>0] [think_ms=N] [pause_ms=N] [datasets=N] [depth=N] [children=N] [ioctl_us=N] [iterations=N] [module options...]\n", argv[0]);
+        return 1;
+    }
+    const int setup_err = fake_libzfs_setup(&config.fake);
+    if (setup_err)
+        fprintf(stderr, "Could not set up fake libzfs: %s\n", strerror(-setup_err));
+    storm_users = setup_err ? 0 : config.fake.users;
+    defer(free_ptr) char* confdir = setup_err ? NULL : storm_write_service(base_dir, args);
+    int status = 1;
+    if (confdir != NULL)
+        status = storm_run(&config, confdir, runtime_dir);
+    else if (!setup_err)
+        fprintf(stderr, "Could not set up storm in %s\n", base_dir);
+    fake_libzfs_teardown();
+    if (storm_system("rm -rf '%s'", base_dir) != 0)
+        fprintf(stderr, "Could not remove %s\n", base_dir);
+    return status;
+}
@@ -0,0 +1,55 @@
+#pragma once
+#include <stdint.h>
+
+#include "zfscrypt_context.h"
+#include "zfscrypt_err.h"
+
+// With the daemon module argument, the PAM module hands lock, unlock, key check and rewrap requests to
+// zfscryptd, which keeps a warm libzfs handle. Both ends only talk to root. If the daemon is
+// not running, or a request can not be sent within ZFSCRYPT_CLIENT_TIMEOUT_MS, it is served in
+// process. Once sent, the daemon may be working on the request, so a missing answer is an error.
+
+#define ZFSCRYPT_CLIENT_MAX_MESSAGE 16384
+
+typedef enum zfscrypt_client_op {
+    ZFSCRYPT_CLIENT_LOCK = 1,
+    ZFSCRYPT_CLIENT_UNLOCK,
+    ZFSCRYPT_CLIENT_UPDATE,
+    ZFSCRYPT_CLIENT_VERIFY
+} zfscrypt_client_op_t;
+
+// followed by user, token and new token, each NUL terminated, absent tokens have length 0
+typedef struct zfscrypt_client_request {
+    uint32_t version;
+    uint32_t op;
+    uint32_t lengths[3];
+} zfscrypt_client_request_t;
+
+typedef struct zfscrypt_client_response {
+    uint32_t type;
+    int32_t value;
+} zfscrypt_client_response_t;
+
+// public functions
+
+// connects to zfscryptd, returns a socket or -errno
+int zfscrypt_client_connect(const char* runtime_dir);
+
+// like zfscrypt_dataset_*_all, but served by zfscryptd if context is connected to it
+zfscrypt_err_t zfscrypt_client_lock_all(zfscrypt_context_t* context);
+zfscrypt_err_t zfscrypt_client_unlock_all(zfscrypt_context_t* context, const char* key);
+zfscrypt_err_t zfscrypt_client_verify_all(zfscrypt_context_t* context, const char* key);
+zfscrypt_err_t zfscrypt_client_update_all(zfscrypt_context_t* context, const char* old_key, const char* new_key);
+
+// private functions
+
+// false if the request has to be served in process, result is set otherwise
+bool zfscrypt_client_call(zfscrypt_err_t* result, zfscrypt_context_t* context, const zfscrypt_client_op_t op, const char* token, const char* new_token);
+// sent tells whether the daemon got the request, the error is final then
+zfscrypt_err_t zfscrypt_client_request(bool* sent, zfscrypt_context_t* context, const zfscrypt_client_op_t op, const char* token, const char* new_token);
+
+// private constants
+
+extern const char ZFSCRYPT_CLIENT_SOCKET[];
+extern const uint32_t ZFSCRYPT_CLIENT_VERSION;
+extern const unsigned ZFSCRYPT_CLIENT_TIMEOUT_MS;
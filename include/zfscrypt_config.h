@@ -1,3 +1,4 @@
 #pragma once
 
 extern const char ZFSCRYPT_DEFAULT_RUNTIME_DIR[];
+extern const char ZFSCRYPT_DEFAULT_STATE_DIR[];
@@ -4,14 +4,99 @@
 #include <security/pam_modutil.h>
 #include <stdbool.h>
 
+#include "zfscrypt_crypto.h"
 #include "zfscrypt_err.h"
+#include "zfscrypt_stats.h"
+
+typedef enum zfscrypt_discovery {
+    // iterate over all filesystems with libzfs, one ioctl per dataset
+    ZFSCRYPT_DISCOVERY_WALK,
+    // filter filesystems in the kernel with a channel program, one ioctl per pool
+    ZFSCRYPT_DISCOVERY_PROGRAM
+} zfscrypt_discovery_t;
+
+typedef enum zfscrypt_drop_caches {
+    // leave caches alone
+    ZFSCRYPT_DROP_CACHES_NONE,
+    // write back each dataset before it is unmounted, unmounting evicts its inodes and dentries
+    ZFSCRYPT_DROP_CACHES_SCOPED,
+    // additionally sync and drop reclaimable inodes and dentries of all filesystems after the last session
+    ZFSCRYPT_DROP_CACHES_GLOBAL
+} zfscrypt_drop_caches_t;
+
+typedef enum zfscrypt_mount_mode {
+    // the zfscrypt mount property of each dataset decides
+    ZFSCRYPT_MOUNT_MODE_PROPERTY,
+    // mount every dataset at login
+    ZFSCRYPT_MOUNT_MODE_EAGER,
+    // leave every dataset to the automounter
+    ZFSCRYPT_MOUNT_MODE_LAZY
+} zfscrypt_mount_mode_t;
+
+// see zfscrypt_prepare.h
+typedef struct zfscrypt_prepare zfscrypt_prepare_t;
+
+// see zfscrypt_session.h
+typedef struct zfscrypt_session_slot zfscrypt_session_slot_t;
+
+// Survives between the stages of a pam handle, so login, sshd and gdm resolve the user, initialize
+// libzfs and discover datasets once per handle instead of once per stage.
+typedef struct zfscrypt_context_cache {
+    char* user;
+    uid_t uid;
+    gid_t gid;
+    // NULL until a stage serves requests in process
+    libzfs_handle_t* libzfs;
+    // names of the datasets unlocked through this handle, NULL if nothing was unlocked
+    char** datasets;
+    // started by pam_sm_acct_mgmt with the prepare argument, NULL otherwise
+    zfscrypt_prepare_t* prepare;
+} zfscrypt_context_cache_t;
 
 typedef struct zfscrypt_context {
     pam_handle_t* pam;
     libzfs_handle_t* libzfs;
     bool debug;
     const char* runtime_dir;
+    const char* state_dir;
+    zfscrypt_discovery_t discovery;
+    // number of threads deriving and loading keys while datasets are mounted, 0 unlocks serially
+    unsigned workers;
+    zfscrypt_drop_caches_t drop_caches;
+    // hand requests to zfscryptd if it is running
+    bool daemon;
+    // discover datasets and derive keys in the background after authentication
+    bool prepare;
+    // seconds to keep the datasets unlocked after the last session, 0 locks right away
+    unsigned linger;
+    // hand the lock after the last session to zfscrypt lock-queue instead of locking in process
+    bool lock_queue;
+    // compiled policy overriding these settings per user, NULL for policy in state_dir
+    const char* policy;
+    zfscrypt_mount_mode_t mount;
+    // NUL separated lists of datasets ending with an empty string, set by the policy. Only datasets
+    // below roots are considered unless it is empty, datasets below skip never are.
+    const char* roots;
+    const char* skip;
+    // seals raw keys of keyformat=raw datasets on password changes, a cost of 0 picks the default of kdf
+    zfscrypt_crypto_kdf_t kdf;
+    uint64_t kdf_cost;
+    // connection to zfscryptd, -1 if requests are served in process
+    int daemon_fd;
+    zfscrypt_stats_mode_t stats;
+    zfscrypt_stats_timings_t timings;
     const char* user;
+    // uid of user, -1 if unknown
+    uid_t uid;
+    // primary group of user, dropping privileges needs it along with uid
+    gid_t gid;
+    // owned by pam data, NULL for command line tools
+    zfscrypt_context_cache_t* cache;
+    // slot of user while locking after the last session, locking gives up once it counts a new session
+    zfscrypt_session_slot_t* guard;
+    // options of the module, passed on to the linger timer
+    int argc;
+    const char** argv;
     struct pam_modutil_privs privs;
     gid_t groups[PAM_MODUTIL_NGROUPS];
 } zfscrypt_context_t;
@@ -20,6 +105,9 @@ typedef struct zfscrypt_context {
 
 zfscrypt_err_t zfscrypt_context_begin(zfscrypt_context_t* self, pam_handle_t* handle, int flags, int argc, const char** argv);
 
+// for command line tools, logs to stderr instead of syslog
+zfscrypt_err_t zfscrypt_context_begin_tool(zfscrypt_context_t* self, const char* user, int argc, const char** argv);
+
 int zfscrypt_context_end(zfscrypt_context_t* self, zfscrypt_err_t err);
 
 void zfscrypt_context_log(zfscrypt_context_t* self, const int level, const char* format, ...);
@@ -42,10 +130,28 @@ zfscrypt_err_t zfscrypt_context_get_tokens(zfscrypt_context_t* self, const char*
 zfscrypt_err_t zfscrypt_context_drop_privs(zfscrypt_context_t* self);
 zfscrypt_err_t zfscrypt_context_regain_privs(zfscrypt_context_t* self);
 
+// drops the connection to zfscryptd, which did not answer, and initializes libzfs instead
+zfscrypt_err_t zfscrypt_context_serve_in_process(zfscrypt_context_t* self);
+
+// whether a session of the user was opened while locking under guard
+bool zfscrypt_context_cancelled(zfscrypt_context_t* self);
+
+// adds the duration of the pam call and its phases to the stats, if enabled
+void zfscrypt_context_record(zfscrypt_context_t* self, const zfscrypt_stats_metric_t call, const zfscrypt_err_t err);
+
 // private methods
 
+void zfscrypt_context_init(zfscrypt_context_t* self, pam_handle_t* handle, const char* user);
+
+// takes the handle of the pam handle cache if there is one, libzfs is NULL on failure
+void zfscrypt_context_init_libzfs(zfscrypt_context_t* self);
+
 void zfscrypt_parse_args(zfscrypt_context_t* self, int argc, const char** argv);
 
+// for command line tools, which have no pam handle to drop privileges with
+zfscrypt_err_t zfscrypt_context_drop_fsuid(zfscrypt_context_t* self);
+zfscrypt_err_t zfscrypt_context_regain_fsuid(zfscrypt_context_t* self);
+
 zfscrypt_err_t zfscrypt_context_pam_get_user(zfscrypt_context_t* self, const char** user);
 
 zfscrypt_err_t zfscrypt_context_pam_items_get_token(zfscrypt_context_t* self, const char** token);
@@ -53,12 +159,42 @@ zfscrypt_err_t zfscrypt_context_pam_items_get_old_token(zfscrypt_context_t* self
 zfscrypt_err_t zfscrypt_context_pam_ask_token(zfscrypt_context_t* self, const char** token);
 zfscrypt_err_t zfscrypt_context_pam_get_tokens(zfscrypt_context_t* self, const char** old_token, const char** new_token);
 
+zfscrypt_err_t zfscrypt_context_pam_data_get_cache(zfscrypt_context_t* self);
+zfscrypt_err_t zfscrypt_context_pam_data_set_cache(zfscrypt_context_t* self);
+void zfscrypt_context_cache_cleanup(pam_handle_t* handle, void* data, int error_status);
+
 zfscrypt_err_t zfscrypt_context_pam_data_set_token(zfscrypt_context_t* self, const char* token);
 zfscrypt_err_t zfscrypt_context_pam_data_get_token(zfscrypt_context_t* self, const char** token);
 zfscrypt_err_t zfscrypt_context_pam_data_clear_token(zfscrypt_context_t* self);
 
 // private constants
 
+extern const char ZFSCRYPT_CONTEXT_PAM_DATA_CACHE[];
 extern const char ZFSCRYPT_CONTEXT_ARG_DEBUG[];
+extern const char ZFSCRYPT_CONTEXT_ARG_DAEMON[];
+extern const char ZFSCRYPT_CONTEXT_ARG_PREPARE[];
+extern const char ZFSCRYPT_CONTEXT_ARG_LOCK_QUEUE[];
 extern const char ZFSCRYPT_CONTEXT_ARG_RUNTIME_DIR[];
 extern const size_t ZFSCRYPT_CONTEXT_ARG_RUNTIME_DIR_LEN;
+extern const char ZFSCRYPT_CONTEXT_ARG_STATE_DIR[];
+extern const size_t ZFSCRYPT_CONTEXT_ARG_STATE_DIR_LEN;
+extern const char ZFSCRYPT_CONTEXT_ARG_POLICY[];
+extern const size_t ZFSCRYPT_CONTEXT_ARG_POLICY_LEN;
+extern const char ZFSCRYPT_CONTEXT_ARG_WORKERS[];
+extern const size_t ZFSCRYPT_CONTEXT_ARG_WORKERS_LEN;
+extern const unsigned ZFSCRYPT_CONTEXT_MAX_WORKERS;
+extern const char ZFSCRYPT_CONTEXT_ARG_LINGER[];
+extern const size_t ZFSCRYPT_CONTEXT_ARG_LINGER_LEN;
+extern const char ZFSCRYPT_CONTEXT_ARG_KDF[];
+extern const size_t ZFSCRYPT_CONTEXT_ARG_KDF_LEN;
+extern const char ZFSCRYPT_CONTEXT_ARG_KDF_COST[];
+extern const size_t ZFSCRYPT_CONTEXT_ARG_KDF_COST_LEN;
+extern const unsigned ZFSCRYPT_CONTEXT_MAX_LINGER;
+extern const char ZFSCRYPT_CONTEXT_ARG_DISCOVERY_WALK[];
+extern const char ZFSCRYPT_CONTEXT_ARG_DISCOVERY_PROGRAM[];
+extern const char ZFSCRYPT_CONTEXT_ARG_DROP_CACHES_NONE[];
+extern const char ZFSCRYPT_CONTEXT_ARG_DROP_CACHES_SCOPED[];
+extern const char ZFSCRYPT_CONTEXT_ARG_DROP_CACHES_GLOBAL[];
+extern const char ZFSCRYPT_CONTEXT_ARG_STATS_NONE[];
+extern const char ZFSCRYPT_CONTEXT_ARG_STATS_FILE[];
+extern const char ZFSCRYPT_CONTEXT_ARG_STATS_SYSLOG[];
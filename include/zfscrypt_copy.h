@@ -0,0 +1,104 @@
+#pragma once
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include "zfscrypt_context.h"
+#include "zfscrypt_err.h"
+
+// Mirrors a directory tree into another one, e.g. a home into its new dataset. Workers take
+// directories from a shared queue, so large trees are walked and copied in parallel. File contents
+// are copied in the kernel with copy_file_range, holes are skipped. Owners, modes, timestamps,
+// extended attributes including ACLs and hardlinks are preserved. Files with the size and
+// modification time of their copy are not copied again and entries missing in the source are
+// removed, so repeated runs only catch up with the changes since the last one.
+// Both trees may belong to someone else than the root running the copy. Paths are therefore
+// resolved one directory at a time without following symlinks, and every entry is opened
+// relative to the descriptor of its directory.
+
+typedef struct zfscrypt_copy zfscrypt_copy_t;
+
+// called about once a second while copying and once at the end
+typedef void (*zfscrypt_copy_progress_f)(zfscrypt_copy_t const* self, const double seconds);
+
+typedef struct zfscrypt_copy_link {
+    dev_t dev;
+    ino_t ino;
+    char* path;
+} zfscrypt_copy_link_t;
+
+typedef struct zfscrypt_copy_queue {
+    char** paths;
+    size_t len;
+    size_t capacity;
+} zfscrypt_copy_queue_t;
+
+struct zfscrypt_copy {
+    zfscrypt_context_t* context;
+    int source_fd;
+    int target_fd;
+    // copy owner, mode and timestamps of the source root to the target root, otherwise it is left as it is
+    bool finish_root;
+    pthread_mutex_t mutex;
+    pthread_cond_t changed;
+    // directories waiting for a worker, relative to both roots
+    zfscrypt_copy_queue_t queue;
+    // queued directories and those being copied, the walk is done when it drops to 0
+    size_t busy;
+    // every directory copied, their metadata is set once nothing is written to them anymore
+    zfscrypt_copy_queue_t directories;
+    // first copy of each file with several links, keyed by device and inode
+    void* links;
+    // further names of these files, linked once all workers are done
+    zfscrypt_copy_link_t* deferred;
+    size_t deferred_len;
+    _Atomic uint64_t files;
+    _Atomic uint64_t skipped;
+    _Atomic uint64_t bytes;
+    _Atomic uint64_t removed;
+    _Atomic uint64_t failed;
+};
+
+// public functions
+
+// copies source into the existing directory target, fails if any entry could not be copied
+zfscrypt_err_t zfscrypt_copy_tree(zfscrypt_context_t* context, const char* source, const char* target, const unsigned workers, const bool finish_root, zfscrypt_copy_progress_f progress);
+
+// private methods
+
+void* zfscrypt_copy_worker(void* data);
+void zfscrypt_copy_directory(zfscrypt_copy_t* self, const char* path);
+// source and target are the directories holding path in both trees
+void zfscrypt_copy_entry(zfscrypt_copy_t* self, const int source, const int target, const char* path, struct stat const* status);
+int zfscrypt_copy_file(zfscrypt_copy_t* self, const int source_dir, const int target_dir, const char* path, struct stat const* status);
+// remembers the first name of a file with several links and returns 1, defers the others and returns 0
+int zfscrypt_copy_link(zfscrypt_copy_t* self, const char* path, struct stat const* status);
+int zfscrypt_copy_special(zfscrypt_copy_t* self, const int source, const int target, const char* name, struct stat const* status);
+// removes entries of the target directory missing in the source directory
+void zfscrypt_copy_prune(zfscrypt_copy_t* self, const char* path, const int source, const int target);
+void zfscrypt_copy_finish_links(zfscrypt_copy_t* self);
+int zfscrypt_copy_finish_directory(zfscrypt_copy_t* self, const char* path);
+void zfscrypt_copy_fail(zfscrypt_copy_t* self, const char* path, const int err);
+
+// private functions
+
+char* zfscrypt_copy_join(const char* path, const char* name);
+// last component of a path relative to the roots
+const char* zfscrypt_copy_name(const char* path);
+// opens the directory path below root one component at a time with O_NOFOLLOW, returns the descriptor or a negative errno
+int zfscrypt_copy_open_dir(const int root, const char* path);
+// opens the directory holding path below root like zfscrypt_copy_open_dir, name points to the last component
+int zfscrypt_copy_open_parent(const int root, const char* path, const char** name);
+int zfscrypt_copy_push(zfscrypt_copy_queue_t* queue, const char* path);
+void zfscrypt_copy_queue_free(zfscrypt_copy_queue_t* queue);
+int zfscrypt_copy_contents(const int source, const int target, const off_t size, _Atomic uint64_t* bytes);
+// sets the extended attributes of source on target and removes those source does not have
+int zfscrypt_copy_xattrs(const int source, const int target);
+// names is a list of NUL terminated names of len bytes, NULL if there are none
+int zfscrypt_copy_list_xattrs(const int fd, char** names, ssize_t* len);
+int zfscrypt_copy_metadata(const int source, const int target, struct stat const* status);
+int zfscrypt_copy_remove(const int dir_fd, const char* path);
+int zfscrypt_copy_link_compare(const void* a, const void* b);
+void zfscrypt_copy_link_free(void* data);
@@ -0,0 +1,41 @@
+#pragma once
+#include <stdint.h>
+
+// Length of the wrapping key zfs derives from a passphrase, WRAPPING_KEY_LEN in libzfs
+#define ZFSCRYPT_CRYPTO_KEY_LEN 32
+// Sizes of the parts of a sealed raw key, see zfscrypt_keywrap.h
+#define ZFSCRYPT_CRYPTO_SALT_LEN 16
+#define ZFSCRYPT_CRYPTO_NONCE_LEN 12
+#define ZFSCRYPT_CRYPTO_TAG_LEN 16
+
+// Key derivations for raw keys sealed with the login password
+typedef enum zfscrypt_crypto_kdf {
+    // PBKDF2-HMAC-SHA512, cost is the number of iterations
+    ZFSCRYPT_CRYPTO_KDF_PBKDF2,
+    // scrypt with r=8 and p=1, cost is log2 of N
+    ZFSCRYPT_CRYPTO_KDF_SCRYPT
+} zfscrypt_crypto_kdf_t;
+
+// public functions
+
+// Derives a wrapping key exactly like libzfs does for keyformat=passphrase (PBKDF2-HMAC-SHA1)
+int zfscrypt_crypto_derive_key(const char* passphrase, const uint64_t salt, const uint64_t iterations, uint8_t* key);
+
+int zfscrypt_crypto_random_salt(uint64_t* salt);
+int zfscrypt_crypto_random_bytes(uint8_t* bytes, const int len);
+
+// Derives a key for sealing with kdf, returns -EINVAL if cost is out of range
+int zfscrypt_crypto_kdf(const zfscrypt_crypto_kdf_t kdf, const uint64_t cost, const char* password, const uint8_t* salt, uint8_t* key);
+
+// Encrypts and authenticates a key with AES-256-GCM, sealed gets the ciphertext followed by the tag.
+// The additional data is authenticated, but not stored.
+int zfscrypt_crypto_seal(const uint8_t* key, const uint8_t* nonce, const uint8_t* aad, const int aad_len, const uint8_t* plain, uint8_t* sealed);
+
+// Reverse of zfscrypt_crypto_seal, returns -EACCES if the key or the additional data does not match
+int zfscrypt_crypto_open(const uint8_t* key, const uint8_t* nonce, const uint8_t* aad, const int aad_len, const uint8_t* sealed, uint8_t* plain);
+
+// private constants
+
+extern const char* const ZFSCRYPT_CRYPTO_KDF_NAMES[2];
+// upper bounds of cost, so a forged property can't stall a login: about two seconds of PBKDF2 and 128MiB for scrypt
+extern const uint64_t ZFSCRYPT_CRYPTO_MAX_COST[2];
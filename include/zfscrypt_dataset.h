@@ -4,73 +4,168 @@
 
 #include "zfscrypt_context.h"
 #include "zfscrypt_err.h"
+#include "zfscrypt_index.h"
+
+// Properties read once per dataset instead of on every check. A zero initialized snapshot has
+// not been taken yet.
+typedef struct zfscrypt_dataset_snapshot {
+    // set by zfscrypt_dataset_valid
+    bool validated;
+    bool valid;
+    // set on the first look at the state, then kept up to date by the operations on the dataset
+    bool observed;
+    bool lazy;
+    bool key_loaded;
+    bool mounted;
+} zfscrypt_dataset_snapshot_t;
 
 typedef struct zfscrypt_dataset {
     zfscrypt_context_t* context;
     zfs_handle_t* handle;
     const char* key;
     const char* new_key;
+    // wrapping key of an encryption root derived from key together with the other roots of a plan or
+    // taken from the preparation, in locked memory and owned by the plan, NULL if there is none
+    uint8_t* derived;
+    zfscrypt_dataset_snapshot_t snapshot;
 } zfscrypt_dataset_t;
 
-typedef zfscrypt_err_t (*zfscrypt_dataset_iter_f)(zfscrypt_dataset_t*);
+// see zfscrypt_plan.h
+typedef struct zfscrypt_plan_group zfscrypt_plan_group_t;
+typedef struct zfscrypt_plan zfscrypt_plan_t;
+
+typedef zfscrypt_err_t (*zfscrypt_dataset_iter_f)(zfscrypt_plan_t*);
 
 typedef struct zfscrypt_dataset_iter {
     zfscrypt_context_t* context;
     zfscrypt_dataset_iter_f callback;
     const char* key;
     const char* new_key;
+    // valid datasets of the context user, their handles are owned by the iterator
+    zfscrypt_dataset_t* datasets;
+    size_t len;
+    // every tagged dataset seen while walking all pools, used to refresh the index
+    zfscrypt_index_t index;
 } zfscrypt_dataset_iter_t;
 
 // public functions
 
 zfscrypt_err_t zfscrypt_dataset_lock_all(zfscrypt_context_t* context);
+// like zfscrypt_dataset_lock_all, but fails with EBUSY while a dataset is still mounted or a key of the user loaded
+zfscrypt_err_t zfscrypt_dataset_lock_all_checked(zfscrypt_context_t* context);
 zfscrypt_err_t zfscrypt_dataset_unlock_all(zfscrypt_context_t* context, const char* key);
+// checks the key against every encryption root of the user without loading it
+zfscrypt_err_t zfscrypt_dataset_verify_all(zfscrypt_context_t* context, const char* key);
+// rewraps every encryption root of the user or none of them
 zfscrypt_err_t zfscrypt_dataset_update_all(zfscrypt_context_t* context, const char* old_key, const char* new_key);
 
+// Turns a passphrase encryption root into a keyformat=raw one with a random raw key, sealed with
+// self->key in the zfscrypt key property. Returns EEXIST if it has a sealed key already.
+int zfscrypt_dataset_seal(zfscrypt_dataset_t* self);
+
+// walks all pools and rewrites the user to dataset index in the state dir
+zfscrypt_err_t zfscrypt_dataset_index_rebuild(zfscrypt_context_t* context);
+
+// replaces the index entries of names and the datasets below them with what is there now, falls
+// back to zfscrypt_dataset_index_rebuild without an index
+zfscrypt_err_t zfscrypt_dataset_index_update(zfscrypt_context_t* context, const char* const* names, const size_t len);
+
 // private methods, high level
 
+zfscrypt_err_t zfscrypt_dataset_lock_plan(zfscrypt_plan_t* plan);
+zfscrypt_err_t zfscrypt_dataset_lock_plan_checked(zfscrypt_plan_t* plan);
+zfscrypt_err_t zfscrypt_dataset_unlock_plan(zfscrypt_plan_t* plan);
+// key changes are all or nothing, see zfscrypt_rewrap.h
+zfscrypt_err_t zfscrypt_dataset_verify_plan(zfscrypt_plan_t* plan);
+zfscrypt_err_t zfscrypt_dataset_update_plan(zfscrypt_plan_t* plan);
+// derives the keys of all passphrase roots that need one in a single batch, see zfscrypt_pbkdf2.h
+int zfscrypt_dataset_derive_plan(zfscrypt_plan_t* plan);
+// stores the names of all members in the pam handle cache, so locking needs no discovery
+int zfscrypt_dataset_remember(zfscrypt_plan_t* plan);
+
 bool zfscrypt_dataset_locked(zfscrypt_dataset_t* self);
 bool zfscrypt_dataset_unlocked(zfscrypt_dataset_t* self);
 
-zfscrypt_err_t zfscrypt_dataset_lock(zfscrypt_dataset_t* self);
-zfscrypt_err_t zfscrypt_dataset_unlock(zfscrypt_dataset_t* self);
-zfscrypt_err_t zfscrypt_dataset_update(zfscrypt_dataset_t* self);
+// one key operation per encryption root, members are mounted and unmounted for the whole plan
+zfscrypt_err_t zfscrypt_dataset_lock(zfscrypt_plan_group_t* group);
+zfscrypt_err_t zfscrypt_dataset_unlock(zfscrypt_plan_group_t* group);
+
+// steps of unlocking a group, providing the key is safe to run on worker threads
+bool zfscrypt_dataset_needs_key(zfscrypt_plan_group_t* group);
+int zfscrypt_dataset_provide_key(zfscrypt_plan_group_t* group);
+// writes back, disarms the automount and unmounts a member, runs on the unmount workers
+int zfscrypt_dataset_release(zfscrypt_dataset_t* self);
 
 // private methods, low level
 
+// reads key status, mount status and mount mode into the snapshot, unless it already has them
+void zfscrypt_dataset_observe(zfscrypt_dataset_t* self);
+
 bool zfscrypt_dataset_key_loaded(zfscrypt_dataset_t* self);
 
 int zfscrypt_dataset_load_key(zfscrypt_dataset_t* self);
+// derives the wrapping key of a passphrase, or opens the sealed raw key of a keyformat=raw encryption root
+int zfscrypt_dataset_derive_key(zfscrypt_dataset_t* self, const char* password, uint8_t* key);
 int zfscrypt_dataset_unload_key(zfscrypt_dataset_t* self);
-int zfscrypt_dataset_change_key(zfscrypt_dataset_t* self);
 
 bool zfscrypt_dataset_mounted(zfscrypt_dataset_t* self);
 
 int zfscrypt_dataset_mount(zfscrypt_dataset_t* self);
+// writes back dirty data while the dataset is still mounted, so the unmount only has to evict clean caches
+int zfscrypt_dataset_sync(zfscrypt_dataset_t* self);
 int zfscrypt_dataset_unmount(zfscrypt_dataset_t* self);
 
 // private methods, validation
 
 int zfscrypt_dataset_properties_get_user(zfscrypt_dataset_t* self, const char** user);
+int zfscrypt_dataset_properties_get_key(zfscrypt_dataset_t* self, const char** value);
 bool zfscrypt_dataset_has_matching_user(zfscrypt_dataset_t* self);
 bool zfscrypt_dataset_has_mountpoint(zfscrypt_dataset_t* self);
 bool zfscrypt_dataset_can_mount(zfscrypt_dataset_t* self);
 bool zfscrypt_dataset_is_encrypted(zfscrypt_dataset_t* self);
 bool zfscrypt_dataset_does_prompt(zfscrypt_dataset_t* self);
 bool zfscrypt_dataset_has_passphrase(zfscrypt_dataset_t* self);
+// keyformat=raw with the raw key sealed in the zfscrypt key property, see zfscrypt_keywrap.h
+bool zfscrypt_dataset_has_sealed_key(zfscrypt_dataset_t* self);
+// below the roots and outside the skip list of the policy, see zfscrypt_policy.h
+bool zfscrypt_dataset_in_scope(zfscrypt_dataset_t* self);
 
+// checks the properties once, cheapest rejections first, and remembers the outcome in the snapshot
 bool zfscrypt_dataset_valid(zfscrypt_dataset_t* self);
 
+bool zfscrypt_dataset_is_lazy(zfscrypt_dataset_t* self);
+
 // private functions, iteration
 
 int zfscrypt_dataset_filesystem_visitor(zfs_handle_t* handle, void* data);
 int zfscrypt_dataset_root_visitor(zfs_handle_t* handle, void* data);
+int zfscrypt_dataset_program_visitor(zfs_handle_t* handle, void* data);
+
+int zfscrypt_dataset_iter_push(zfscrypt_dataset_iter_t* self, zfscrypt_dataset_t const* dataset);
+void zfscrypt_dataset_iter_free(zfscrypt_dataset_iter_t* self);
+
+// opens the datasets unlocked earlier through the same pam handle
+zfscrypt_err_t zfscrypt_dataset_discover_cached(zfscrypt_dataset_iter_t* self);
+// opens the datasets found while pam_sm_acct_mgmt prepared the unlock
+zfscrypt_err_t zfscrypt_dataset_discover_prepared(zfscrypt_dataset_iter_t* self);
+// opens the datasets listed in the index, fails if the index is missing or stale or lacks the user
+zfscrypt_err_t zfscrypt_dataset_discover_indexed(zfscrypt_dataset_iter_t* self);
+// walks all pools, slow on pools with many datasets unless the channel program is used
+zfscrypt_err_t zfscrypt_dataset_discover_all(zfscrypt_dataset_iter_t* self);
+// walks only the roots of the policy, which sees too little to refresh the index
+zfscrypt_err_t zfscrypt_dataset_discover_roots(zfscrypt_dataset_iter_t* self);
+
+// data is handed to callback as the data of the plan
+zfscrypt_err_t zfscrypt_dataset_iter(zfscrypt_context_t* context, const char* key, const char* new_key, zfscrypt_dataset_iter_f callback, void* data);
 
-zfscrypt_err_t zfscrypt_dataset_iter(zfscrypt_context_t* context, const char* key, const char* new_key, zfscrypt_dataset_iter_f callback);
+// walks all pools and writes the index, the caller holds the index lock
+zfscrypt_err_t zfscrypt_dataset_index_walk(zfscrypt_context_t* context);
 
 // private constants
 
 extern const char ZFSCRYPT_USER_PROPERTY[];
+extern const char ZFSCRYPT_MOUNT_PROPERTY[];
+extern const char ZFSCRYPT_KEY_PROPERTY[];
 
 // FIXME Copied from /usr/include/libzfs/sys/zio.h because including <sys/zio.h> results in compiler error about unknown type rlim64_t
 enum zio_encrypt {
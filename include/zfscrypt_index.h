@@ -0,0 +1,38 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+
+// Maps user names to the names of the datasets tagged with their zfscrypt user property.
+// Entries are hints only, callers have to verify them against the dataset properties.
+typedef struct zfscrypt_index {
+    char** users;
+    char** datasets;
+} zfscrypt_index_t;
+
+// public functions
+
+void zfscrypt_index_free(zfscrypt_index_t* self);
+
+int zfscrypt_index_add(zfscrypt_index_t* self, const char* user, const char* dataset);
+
+size_t zfscrypt_index_length(zfscrypt_index_t const* self);
+
+// Returns -ENOENT if no index has been written yet
+int zfscrypt_index_read(zfscrypt_index_t* self, const char* state_dir);
+
+// Replaces the index atomically, requires write access to state_dir. Only its owner may read it.
+int zfscrypt_index_write(zfscrypt_index_t const* self, const char* state_dir);
+
+// Takes the lock writers hold from reading or walking until the index is replaced, so concurrent
+// updates never drop each other's entries. Returns the fd to close for releasing it or -errno,
+// -EWOULDBLOCK if another writer holds it and wait is false.
+int zfscrypt_index_lock(const char* state_dir, const bool wait);
+
+// Collects all datasets of user, returns -ENOENT if the user is not in the index
+int zfscrypt_index_lookup(const char* state_dir, const char* user, char*** datasets);
+
+// private constants
+
+extern const char ZFSCRYPT_INDEX_FILE[];
+extern const char ZFSCRYPT_INDEX_LOCK_FILE[];
+extern const char ZFSCRYPT_INDEX_HEADER[];
@@ -0,0 +1,51 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#include "zfscrypt_crypto.h"
+
+// A raw key of a keyformat=raw encryption root, sealed with a key derived from the login password.
+// It is stored in the zfscrypt key property as 1$<kdf>$<cost>$<salt>$<nonce>$<sealed key>, with the
+// binary parts in hex. The GUID of the encryption root is authenticated along with the key, so a sealed
+// key copied onto another dataset does not open there. Unlike keyformat=passphrase, the kdf and its
+// cost are ours to choose, and a password change only seals the raw key again instead of rewrapping
+// the master key of zfs.
+
+#define ZFSCRYPT_KEYWRAP_MAX_LEN 256
+
+typedef struct zfscrypt_keywrap {
+    zfscrypt_crypto_kdf_t kdf;
+    uint64_t cost;
+    uint8_t salt[ZFSCRYPT_CRYPTO_SALT_LEN];
+    uint8_t nonce[ZFSCRYPT_CRYPTO_NONCE_LEN];
+    uint8_t sealed[ZFSCRYPT_CRYPTO_KEY_LEN + ZFSCRYPT_CRYPTO_TAG_LEN];
+} zfscrypt_keywrap_t;
+
+// public functions
+
+// returns -EINVAL if value is not a sealed key
+int zfscrypt_keywrap_parse(zfscrypt_keywrap_t* self, const char* value);
+
+// value needs ZFSCRYPT_KEYWRAP_MAX_LEN bytes
+void zfscrypt_keywrap_format(zfscrypt_keywrap_t const* self, char* value);
+
+// seals key of the encryption root with guid with password, using a fresh salt and nonce
+int zfscrypt_keywrap_seal(zfscrypt_keywrap_t* self, const zfscrypt_crypto_kdf_t kdf, const uint64_t cost, const uint64_t guid, const char* password, const uint8_t* key);
+
+// returns -EACCES if password or guid does not match
+int zfscrypt_keywrap_open(zfscrypt_keywrap_t const* self, const uint64_t guid, const char* password, uint8_t* key);
+
+// parses kdf=<name> module arguments, returns -EINVAL for unknown names
+int zfscrypt_keywrap_kdf_parse(const char* name, zfscrypt_crypto_kdf_t* kdf);
+
+// private functions
+
+int zfscrypt_keywrap_hex_decode(const char* hex, const size_t hex_len, uint8_t* bytes, const size_t len);
+void zfscrypt_keywrap_hex_encode(const uint8_t* bytes, const size_t len, char* hex);
+// the guid as additional data, in big endian
+void zfscrypt_keywrap_aad(const uint64_t guid, uint8_t* aad);
+
+// private constants
+
+// used if the module arguments set no cost: the OWASP minimum for PBKDF2-HMAC-SHA512, and 32MiB of memory for scrypt
+extern const uint64_t ZFSCRYPT_KEYWRAP_DEFAULT_COST[2];
@@ -0,0 +1,38 @@
+#pragma once
+#include <sys/types.h>
+
+#include "zfscrypt_dataset.h"
+
+// Datasets with io.github.benkerry:zfscrypt_mount=lazy are not mounted at login. Instead an
+// automount trigger is placed at their mountpoint and the wrapping key of their encryption root
+// waits in the persistent kernel keyring of the user, until zfscrypt-load-key@.service loads it
+// on first access or ZFSCRYPT_LAZY_KEY_TIMEOUT passes.
+
+// public functions
+
+// derives the wrapping key of root and adds it to the persistent keyring of uid, where it expires
+int zfscrypt_lazy_store_key(zfscrypt_dataset_t* root, const uid_t uid);
+
+// loads the key of root from the persistent keyring of uid and removes it from there
+int zfscrypt_lazy_load_key(zfscrypt_dataset_t* root, const uid_t uid);
+
+// removes the key of root from the persistent keyring of uid
+int zfscrypt_lazy_forget_key(zfscrypt_dataset_t* root, const uid_t uid);
+
+// creates a transient automount unit at the mountpoint of dataset
+int zfscrypt_lazy_arm(zfscrypt_dataset_t* dataset);
+
+// stops the automount unit and unmounts dataset
+int zfscrypt_lazy_disarm(zfscrypt_dataset_t* dataset);
+
+// private functions
+
+long zfscrypt_lazy_keyring(const uid_t uid);
+long zfscrypt_lazy_find_key(zfscrypt_dataset_t* root, const uid_t uid);
+
+// private constants
+
+extern const char ZFSCRYPT_LAZY_KEY_PREFIX[];
+extern const char ZFSCRYPT_LAZY_LOAD_KEY_UNIT[];
+// seconds a stored key waits for the first access
+extern const unsigned ZFSCRYPT_LAZY_KEY_TIMEOUT;
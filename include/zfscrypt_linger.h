@@ -0,0 +1,24 @@
+#pragma once
+#include <stdint.h>
+
+#include "zfscrypt_context.h"
+#include "zfscrypt_err.h"
+
+// With linger=<seconds> the last logout of a user does not lock the datasets right away. The
+// deadline is kept in the session registry and a transient systemd timer runs zfscrypt
+// linger-expire when it has passed, which locks the datasets unless a session was opened
+// meanwhile. Short sessions like ssh commands, scp or cron jobs then skip key derivation and
+// mounting on every connection.
+
+// public functions
+
+// marks the user as lingering and starts the timer, fails if the datasets have to be locked now
+zfscrypt_err_t zfscrypt_linger_schedule(zfscrypt_context_t* context);
+
+// private functions
+
+uint64_t zfscrypt_linger_now(void);
+
+// private constants
+
+extern const char ZFSCRYPT_LINGER_UNIT_PREFIX[];
@@ -0,0 +1,60 @@
+#pragma once
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "zfscrypt_context.h"
+#include "zfscrypt_copy.h"
+#include "zfscrypt_dataset.h"
+#include "zfscrypt_err.h"
+
+// Moves an existing home into a new encrypted dataset while the user keeps working. The dataset is
+// mounted next to the home and filled by repeated copies, each catching up with the changes since
+// the previous one. It carries no zfscrypt user property until the cutover, so logins ignore it.
+// Until the cutover the staging directory belongs to root with mode 0700, so the user can't plant
+// symlinks or hardlinks in the tree root writes to. The cutover needs the user to be logged out: it copies the last changes, checks the dataset
+// like a login would, moves the old home aside and mounts the dataset in its place.
+
+typedef struct zfscrypt_migrate {
+    zfscrypt_context_t* context;
+    const char* name;
+    // home of the user, the dataset is mounted next to it until the cutover
+    char* home;
+    char* staging;
+    // where the old home is kept after the cutover
+    char* backup;
+    gid_t gid;
+    // handle is NULL until the dataset exists
+    zfscrypt_dataset_t dataset;
+} zfscrypt_migrate_t;
+
+// public functions
+
+zfscrypt_err_t zfscrypt_migrate_init(zfscrypt_migrate_t* self, zfscrypt_context_t* context, const char* name);
+
+// true if the dataset does not exist yet or its key is not loaded, unlocking then needs the password
+bool zfscrypt_migrate_locked(zfscrypt_migrate_t* self);
+
+// creates the dataset or loads its key, then mounts it next to the home
+zfscrypt_err_t zfscrypt_migrate_unlock(zfscrypt_migrate_t* self, const char* password);
+
+// copies the changes of the home since the last copy
+zfscrypt_err_t zfscrypt_migrate_copy(zfscrypt_migrate_t* self, zfscrypt_copy_progress_f progress);
+
+// copies the last changes and swaps the home for the dataset, which is left locked
+zfscrypt_err_t zfscrypt_migrate_cutover(zfscrypt_migrate_t* self, zfscrypt_copy_progress_f progress);
+
+void zfscrypt_migrate_free(zfscrypt_migrate_t* self);
+
+// private methods
+
+int zfscrypt_migrate_create(zfscrypt_migrate_t* self, const char* password);
+// gives the staging directory to root with mode 0700 again, a cutover that failed may have handed it to the user
+int zfscrypt_migrate_seal_staging(zfscrypt_migrate_t* self);
+// sets the zfscrypt user property and checks the dataset with the rules of a login
+int zfscrypt_migrate_adopt(zfscrypt_migrate_t* self);
+int zfscrypt_migrate_swap(zfscrypt_migrate_t* self);
+
+// private constants
+
+extern const char ZFSCRYPT_MIGRATE_STAGING_SUFFIX[];
+extern const char ZFSCRYPT_MIGRATE_BACKUP_SUFFIX[];
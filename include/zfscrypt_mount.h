@@ -0,0 +1,72 @@
+#pragma once
+#include <pthread.h>
+#include <stdbool.h>
+
+#include "zfscrypt_dataset.h"
+#include "zfscrypt_plan.h"
+
+// Mounts and unmounts the members of a plan along their mountpoints instead of in discovery order.
+// zfs_foreach_mountpoint sorts the datasets of all encryption roots into a tree by mountpoint and
+// mounts independent subtrees in parallel, like zfs mount -a, so no dataset is mounted before the
+// one it is nested in. Unmounting goes level by level from the deepest mountpoints up. Mountpoints of
+// the same depth can not contain each other, so the workers unmount the datasets of a level in parallel.
+
+typedef enum zfscrypt_mount_state {
+    ZFSCRYPT_MOUNT_PENDING,
+    ZFSCRYPT_MOUNT_MOUNTED,
+    // the key of its encryption root could not be loaded
+    ZFSCRYPT_MOUNT_SKIPPED
+} zfscrypt_mount_state_t;
+
+typedef struct zfscrypt_mount_entry {
+    zfscrypt_dataset_t* dataset;
+    // index of the group in the plan
+    size_t group;
+    // only kept when mounting
+    char* mountpoint;
+    // number of path components of the mountpoint
+    size_t depth;
+    zfscrypt_mount_state_t state;
+} zfscrypt_mount_entry_t;
+
+typedef struct zfscrypt_mount {
+    zfscrypt_plan_t* plan;
+    pthread_mutex_t mutex;
+    // deepest mountpoints first when unmounting
+    zfscrypt_mount_entry_t* entries;
+    size_t len;
+    // next entry a worker picks up and end of the current level
+    size_t next;
+    size_t end;
+} zfscrypt_mount_t;
+
+// public functions
+
+// mounts the members of all groups whose key is available, automounts are armed once the others are mounted
+void zfscrypt_mount_plan(zfscrypt_plan_t* plan);
+
+// Mounts a plan while the keys of its groups are still being loaded, see zfscrypt_pipeline.h. Each call
+// of zfscrypt_mount_ready mounts the members of groups that are done and ready, unless one of them
+// would end up below the mountpoint of a group that is not done yet. Groups that are done but not ready
+// are skipped. Once every group is done, everything but members of skipped groups is mounted.
+int zfscrypt_mount_begin(zfscrypt_mount_t* self, zfscrypt_plan_t* plan);
+void zfscrypt_mount_ready(zfscrypt_mount_t* self, const bool* done);
+void zfscrypt_mount_end(zfscrypt_mount_t* self);
+
+// writes back, disarms and unmounts the members of all groups, a member left mounted stays mounted in its snapshot
+void zfscrypt_mount_release_plan(zfscrypt_plan_t* plan, const unsigned workers);
+
+// private methods
+
+int zfscrypt_mount_collect(zfscrypt_mount_t* self, const bool mount);
+int zfscrypt_mount_one(zfs_handle_t* handle, void* data);
+void* zfscrypt_mount_release_worker(void* data);
+void zfscrypt_mount_free(zfscrypt_mount_t* self);
+
+// private functions
+
+size_t zfscrypt_mount_depth(const char* mountpoint);
+// whether inner lies below the mountpoint outer
+bool zfscrypt_mount_contains(const char* outer, const char* inner);
+// deepest mountpoints first
+int zfscrypt_mount_entry_compare(const void* a, const void* b);
@@ -0,0 +1,50 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// PBKDF2-HMAC-SHA1 as used by libzfs for keyformat=passphrase, for many keys at once. Each key
+// needs two output blocks of SHA-1, each block is one lane. The pads of HMAC are hashed once per
+// lane, so an iteration costs two compressions instead of the four plus allocations of a generic
+// HMAC. Lanes with the same number of iterations run side by side in the 8 lanes of AVX2 registers
+// if the CPU has them, the rest one by one.
+
+#define ZFSCRYPT_PBKDF2_LANES 8
+
+typedef struct zfscrypt_pbkdf2_job {
+    const char* passphrase;
+    uint64_t salt;
+    uint64_t iterations;
+    // ZFSCRYPT_CRYPTO_KEY_LEN bytes
+    uint8_t* key;
+} zfscrypt_pbkdf2_job_t;
+
+// one output block of one job
+typedef struct zfscrypt_pbkdf2_lane {
+    // states after hashing the inner and the outer pad of the key
+    uint32_t inner[5];
+    uint32_t outer[5];
+    // last hmac and the xor of all of them
+    uint32_t u[5];
+    uint32_t t[5];
+    uint64_t iterations;
+    uint8_t* out;
+    size_t out_len;
+} zfscrypt_pbkdf2_lane_t;
+
+// public functions
+
+// derives the keys of all jobs, returns -ENOMEM or 0
+int zfscrypt_pbkdf2_derive(zfscrypt_pbkdf2_job_t const* jobs, const size_t len);
+
+// private functions
+
+void zfscrypt_pbkdf2_lane_init(zfscrypt_pbkdf2_lane_t* self, zfscrypt_pbkdf2_job_t const* job, const uint32_t block);
+void zfscrypt_pbkdf2_lane_finish(zfscrypt_pbkdf2_lane_t* self);
+// runs the remaining iterations of one lane
+void zfscrypt_pbkdf2_run_scalar(zfscrypt_pbkdf2_lane_t* lane);
+// runs the remaining iterations of len lanes with the same number of iterations, len <= ZFSCRYPT_PBKDF2_LANES
+void zfscrypt_pbkdf2_run_avx2(zfscrypt_pbkdf2_lane_t** lanes, const size_t len);
+bool zfscrypt_pbkdf2_has_avx2(void);
+int zfscrypt_pbkdf2_lane_compare(const void* a, const void* b);
+void zfscrypt_pbkdf2_sha1(uint32_t state[5], uint32_t w[16]);
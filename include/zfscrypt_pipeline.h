@@ -0,0 +1,35 @@
+#pragma once
+#include <pthread.h>
+#include <stdbool.h>
+
+#include "zfscrypt_err.h"
+#include "zfscrypt_plan.h"
+
+// Unlocks a plan with a bounded pool of workers that derive and load the keys of the encryption roots.
+// The calling thread mounts the members of each root as soon as its key is available, parents still
+// before children: a member below the mountpoint of a root whose key is still loading waits for it.
+// Mounting overlaps with the remaining key derivations, see zfscrypt_mount.h.
+typedef struct zfscrypt_pipeline {
+    zfscrypt_plan_t* plan;
+    pthread_mutex_t mutex;
+    pthread_cond_t loaded;
+    // next group a worker picks up and number of groups finished
+    size_t next;
+    size_t completed;
+    // per group: key has to be loaded, loading finished and its result
+    bool* pending;
+    bool* done;
+    int* results;
+    // done as seen by the calling thread on its last wait
+    bool* snapshot;
+} zfscrypt_pipeline_t;
+
+// public functions
+
+zfscrypt_err_t zfscrypt_pipeline_unlock(zfscrypt_plan_t* plan, const unsigned workers);
+
+// private methods
+
+void* zfscrypt_pipeline_worker(void* data);
+// waits until more than seen groups are finished, returns how many are
+size_t zfscrypt_pipeline_wait(zfscrypt_pipeline_t* self, const size_t seen);
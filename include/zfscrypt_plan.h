@@ -0,0 +1,53 @@
+#pragma once
+#include <libzfs.h>
+#include <stdbool.h>
+
+#include "zfscrypt_context.h"
+#include "zfscrypt_dataset.h"
+#include "zfscrypt_err.h"
+
+// Datasets of a user that share one encryption root, so they are unlocked with a single key derivation
+typedef struct zfscrypt_plan_group {
+    zfscrypt_dataset_t root;
+    // root belongs to the user, only then its key may be loaded, unloaded or changed
+    bool owned;
+    // root.handle is a separate handle that has to be closed with the plan
+    bool owns_handle;
+    // some members are mounted at login, their key has to be loaded then
+    bool eager;
+    // some members are mounted on first access, their key waits in the keyring
+    bool lazy;
+    // key is available, members are mounted once every group is unlocked
+    bool ready;
+    // in discovery order, parents before their children
+    zfscrypt_dataset_t* members;
+    size_t len;
+} zfscrypt_plan_group_t;
+
+typedef zfscrypt_err_t (*zfscrypt_plan_group_f)(zfscrypt_plan_group_t*);
+
+typedef struct zfscrypt_plan {
+    zfscrypt_context_t* context;
+    // passed through by the caller of zfscrypt_dataset_iter
+    void* data;
+    zfscrypt_plan_group_t* groups;
+    size_t len;
+} zfscrypt_plan_t;
+
+// public functions
+
+// Groups datasets by encryption root, handles stay owned by the caller
+zfscrypt_err_t zfscrypt_plan_build(zfscrypt_plan_t* self, zfscrypt_context_t* context, zfscrypt_dataset_t const* datasets, const size_t len);
+
+// Runs callback on each group in order and logs its errors
+zfscrypt_err_t zfscrypt_plan_each(zfscrypt_plan_t* self, zfscrypt_plan_group_f callback);
+
+void zfscrypt_plan_log(zfscrypt_plan_t const* self, zfscrypt_context_t* context);
+
+void zfscrypt_plan_free(zfscrypt_plan_t* self);
+
+// private methods
+
+zfscrypt_plan_group_t* zfscrypt_plan_find(zfscrypt_plan_t* self, const char* root);
+zfscrypt_err_t zfscrypt_plan_add_group(zfscrypt_plan_t* self, zfscrypt_dataset_t const* dataset, const char* root);
+int zfscrypt_plan_group_add(zfscrypt_plan_group_t* self, zfscrypt_dataset_t const* dataset);
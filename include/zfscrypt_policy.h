@@ -0,0 +1,130 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "zfscrypt_context.h"
+
+// Per user and per group policy from /etc/zfscrypt.conf, e.g.
+//
+//   [default]
+//   drop_caches = scoped
+//   [group students]
+//   roots = tank/home
+//   skip = tank/home/scratch
+//   workers = 4
+//   [user ben]
+//   mount = lazy
+//   linger = 300
+//
+// Sections override the module arguments in this order: default, the groups of the user in the order
+// of the file, the user. zfscrypt policy-compile turns the text into a binary file the module maps
+// read only. Users and groups are found through minimal perfect hashes, so resolving the policy of a
+// user costs a few memory reads no matter how many sections there are. The mapping is shared by all
+// calls of a process and replaced when the file is recompiled.
+
+// supplementary groups of a user looked up in the policy, further groups are ignored
+#define ZFSCRYPT_POLICY_MAX_GROUPS 256
+
+// lists in the strings area are NUL separated and end with an empty string
+typedef struct zfscrypt_policy_record {
+    // ZFSCRYPT_POLICY_FIELD_* set by the section
+    uint32_t fields;
+    // offset of the user name in the strings area, or the gid of a group
+    uint32_t key;
+    uint32_t linger;
+    uint32_t workers;
+    uint32_t drop_caches;
+    uint32_t mount;
+    // offsets of lists of datasets in the strings area
+    uint32_t roots;
+    uint32_t skip;
+} zfscrypt_policy_record_t;
+
+// followed by the records, the displacements and slots of the user hash, those of the group hash
+// and the strings area. Record 0 is the default section, then come the users and the groups in
+// the order of the file.
+typedef struct zfscrypt_policy_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;
+    uint32_t users;
+    uint32_t groups;
+    uint32_t strings;
+} zfscrypt_policy_header_t;
+
+typedef enum zfscrypt_policy_field {
+    ZFSCRYPT_POLICY_FIELD_LINGER = 1 << 0,
+    ZFSCRYPT_POLICY_FIELD_WORKERS = 1 << 1,
+    ZFSCRYPT_POLICY_FIELD_DROP_CACHES = 1 << 2,
+    ZFSCRYPT_POLICY_FIELD_MOUNT = 1 << 3,
+    ZFSCRYPT_POLICY_FIELD_ROOTS = 1 << 4,
+    ZFSCRYPT_POLICY_FIELD_SKIP = 1 << 5
+} zfscrypt_policy_field_t;
+
+// section being parsed, sections of one kind are kept in the order of the file
+typedef struct zfscrypt_policy_builder {
+    zfscrypt_policy_record_t* users;
+    size_t users_len;
+    zfscrypt_policy_record_t* groups;
+    size_t groups_len;
+    zfscrypt_policy_record_t fallback;
+    char* strings;
+    size_t strings_len;
+} zfscrypt_policy_builder_t;
+
+// public functions
+
+// overrides the settings of the context with the policy of its user, module arguments apply without a compiled policy
+void zfscrypt_policy_apply(zfscrypt_context_t* context);
+
+// undoes zfscrypt_policy_apply, e.g. before zfscryptd serves the next user
+void zfscrypt_policy_reset(zfscrypt_context_t* context, zfscrypt_context_t const* defaults);
+
+// compiles the text policy at source into the binary file policy in state_dir, line tells where parsing failed
+int zfscrypt_policy_compile(const char* source, const char* state_dir, size_t* line);
+
+// whether dataset is one of the datasets of list or below one of them
+bool zfscrypt_policy_list_covers(const char* list, const char* dataset);
+// whether dataset is parent or below it
+bool zfscrypt_policy_covers(const char* parent, const char* dataset);
+
+// private methods
+
+int zfscrypt_policy_builder_parse(zfscrypt_policy_builder_t* self, FILE* file, size_t* line);
+int zfscrypt_policy_builder_set(zfscrypt_policy_builder_t* self, zfscrypt_policy_record_t* record, const char* key, char* value);
+int zfscrypt_policy_builder_section(zfscrypt_policy_builder_t* self, char* header, zfscrypt_policy_record_t** record);
+int zfscrypt_policy_builder_string(zfscrypt_policy_builder_t* self, const char* value, const size_t len, uint32_t* offset);
+int zfscrypt_policy_builder_list(zfscrypt_policy_builder_t* self, char* value, uint32_t* offset);
+int zfscrypt_policy_builder_write(zfscrypt_policy_builder_t* self, const char* state_dir);
+void zfscrypt_policy_builder_free(zfscrypt_policy_builder_t* self);
+
+// private functions
+
+char* zfscrypt_policy_trim(char* value);
+int zfscrypt_policy_number(const char* value, uint32_t* number);
+// maps the compiled policy at path, or reuses the mapping if the file was not replaced since
+int zfscrypt_policy_map(zfscrypt_policy_header_t const** policy, const char* path);
+int zfscrypt_policy_check(zfscrypt_policy_header_t const* policy, const size_t size);
+zfscrypt_policy_record_t const* zfscrypt_policy_records(zfscrypt_policy_header_t const* policy);
+const char* zfscrypt_policy_strings(zfscrypt_policy_header_t const* policy);
+zfscrypt_policy_record_t const* zfscrypt_policy_find_user(zfscrypt_policy_header_t const* policy, const char* user);
+// index of the record of gid, 0 if the group has no section
+uint32_t zfscrypt_policy_find_group(zfscrypt_policy_header_t const* policy, const gid_t gid);
+void zfscrypt_policy_override(zfscrypt_context_t* context, zfscrypt_policy_header_t const* policy, zfscrypt_policy_record_t const* record);
+
+// FNV-1a like hash with a seed, 0 picks the default seed
+uint32_t zfscrypt_policy_hash(uint32_t seed, const void* key, const size_t len);
+// fills displacements and slots of a minimal perfect hash of n keys, -EEXIST on duplicate keys
+int zfscrypt_policy_hash_build(int32_t* displacements, uint32_t* slots, const size_t n, const void* keys[], const size_t lens[]);
+// slot of key in a minimal perfect hash, the caller has to compare the key stored there
+uint32_t zfscrypt_policy_hash_slot(int32_t const* displacements, const uint32_t n, const void* key, const size_t len);
+
+// private constants
+
+extern const char ZFSCRYPT_POLICY_SOURCE[];
+extern const char ZFSCRYPT_POLICY_FILE[];
+extern const uint32_t ZFSCRYPT_POLICY_MAGIC;
+extern const uint32_t ZFSCRYPT_POLICY_VERSION;
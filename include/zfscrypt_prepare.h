@@ -0,0 +1,58 @@
+#pragma once
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "zfscrypt_context.h"
+#include "zfscrypt_err.h"
+#include "zfscrypt_plan.h"
+
+// With the prepare argument, pam_sm_acct_mgmt starts a thread that discovers the datasets of the
+// user and derives the wrapping keys of their encryption roots, while the rest of the pam stack runs.
+// The account is only checked after the auth stack accepted the password, so the token is verified.
+// The next stage of the same pam handle joins it, so open_session only loads the keys and mounts.
+// Keys are kept in locked memory and wiped after open_session, or when the pam handle ends without one.
+
+typedef struct zfscrypt_prepare_key {
+    char* root;
+    // a key derived with other parameters would be rejected, e.g. after a password change
+    uint64_t salt;
+    uint64_t iterations;
+    uint8_t* key;
+} zfscrypt_prepare_key_t;
+
+typedef struct zfscrypt_prepare {
+    pthread_t thread;
+    // a child forked between the stages has the memory, but not the thread
+    pid_t pid;
+    bool joined;
+    // copy of the context of pam_sm_acct_mgmt, shares libzfs and the cache
+    zfscrypt_context_t context;
+    char* token;
+    size_t token_size;
+    // valid datasets of the user
+    char** datasets;
+    zfscrypt_prepare_key_t* keys;
+    size_t len;
+} zfscrypt_prepare_t;
+
+// public functions
+
+// starts preparing an unlock with token, replaces an earlier preparation of the same cache
+zfscrypt_err_t zfscrypt_prepare_start(zfscrypt_context_t* context, const char* token);
+
+// waits until the preparation of the cache, if any, has finished
+void zfscrypt_prepare_join(zfscrypt_context_cache_t* cache);
+
+// copies the prepared key of root to key, returns false if there is none for these parameters
+bool zfscrypt_prepare_take_key(zfscrypt_context_t* context, const char* root, const uint64_t salt, const uint64_t iterations, uint8_t* key);
+
+// joins and wipes the preparation of the cache, if any
+void zfscrypt_prepare_discard(zfscrypt_context_cache_t* cache);
+
+// private functions
+
+void* zfscrypt_prepare_run(void* data);
+zfscrypt_err_t zfscrypt_prepare_plan(zfscrypt_plan_t* plan);
+int zfscrypt_prepare_group(zfscrypt_prepare_t* self, zfscrypt_plan_group_t* group);
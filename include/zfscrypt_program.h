@@ -0,0 +1,16 @@
+#pragma once
+#include <libnvpair.h>
+#include <stddef.h>
+
+// public functions
+
+// Runs the discovery channel program on all filesystems below root in a single ioctl.
+// On success found maps the names of matching datasets to their key status and must be freed by the caller,
+// on failure message holds the error reported by the program, if any.
+int zfscrypt_program_discover(const char* root, const char* property, const char* user, nvlist_t** found, char* message, const size_t size);
+
+// private constants
+
+extern const char ZFSCRYPT_PROGRAM_DISCOVER[];
+extern const unsigned long ZFSCRYPT_PROGRAM_INSTRUCTION_LIMIT;
+extern const unsigned long ZFSCRYPT_PROGRAM_MEMORY_LIMIT;
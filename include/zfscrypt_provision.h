@@ -0,0 +1,71 @@
+#pragma once
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "zfscrypt_context.h"
+#include "zfscrypt_err.h"
+
+// Creates the home datasets of existing users below a parent dataset, with the properties, delegations
+// and wrapping key pam_zfscrypt expects. A home is either a fresh encryption root filled from a
+// skeleton directory, or a clone of a skeleton snapshot that gets its own wrapping key.
+// Workers with their own libzfs handle provision several users at once, so their dataset creations
+// and delegations are synced together in the same transaction groups.
+
+typedef struct zfscrypt_provision_user {
+    char* user;
+    uid_t uid;
+    gid_t gid;
+    // in locked memory, wiped once the key is derived
+    char* password;
+    size_t password_size;
+    char* dataset;
+    int result;
+} zfscrypt_provision_user_t;
+
+typedef struct zfscrypt_provision {
+    zfscrypt_context_t* context;
+    const char* parent;
+    // a snapshot is cloned, a directory is copied into a new dataset
+    const char* skeleton;
+    bool clone;
+    pthread_mutex_t mutex;
+    // next user a worker picks up
+    size_t next;
+    zfscrypt_provision_user_t* users;
+    size_t len;
+    // users whose result is an error once zfscrypt_provision_run returned
+    size_t failed;
+} zfscrypt_provision_t;
+
+// public functions
+
+void zfscrypt_provision_init(zfscrypt_provision_t* self, zfscrypt_context_t* context, const char* parent, const char* skeleton);
+
+// reads user:password lines like chpasswd, the users have to exist already
+zfscrypt_err_t zfscrypt_provision_read(zfscrypt_provision_t* self, FILE* file);
+
+// provisions all users read, the result of each is stored with it, fails with EIO if any user failed
+zfscrypt_err_t zfscrypt_provision_run(zfscrypt_provision_t* self);
+
+void zfscrypt_provision_free(zfscrypt_provision_t* self);
+
+// private methods
+
+void* zfscrypt_provision_worker(void* data);
+int zfscrypt_provision_user(zfscrypt_provision_t* self, zfscrypt_context_t* context, zfscrypt_provision_user_t* user);
+int zfscrypt_provision_create(zfscrypt_provision_user_t* user, uint8_t* key, const uint64_t salt);
+int zfscrypt_provision_clone(zfscrypt_provision_t* self, zfscrypt_provision_user_t* user, uint8_t* key, const uint64_t salt);
+// keyformat, keylocation and pbkdf2 parameters of a new encryption root
+int zfscrypt_provision_key_props(nvlist_t* props, const uint64_t salt);
+// lets the user load and change the key and mount, like zfs allow -u user load-key,change-key,mount
+int zfscrypt_provision_allow(zfscrypt_context_t* context, zfs_handle_t* handle, zfscrypt_provision_user_t* user);
+int zfscrypt_provision_populate(zfscrypt_provision_t* self, zfs_handle_t* handle, zfscrypt_provision_user_t* user);
+
+// private constants
+
+// default of zfs for keyformat=passphrase
+extern const uint64_t ZFSCRYPT_PROVISION_ITERATIONS;
+extern const char* const ZFSCRYPT_PROVISION_PERMISSIONS[3];
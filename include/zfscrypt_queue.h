@@ -0,0 +1,70 @@
+#pragma once
+#include <pthread.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "zfscrypt_context.h"
+#include "zfscrypt_err.h"
+#include "zfscrypt_session.h"
+
+// With lock_queue, the last logout of a user does not lock the datasets itself. It marks the lock
+// as queued in the session registry and creates a trigger file, whose path unit starts zfscrypt
+// lock-queue. The worker takes every queued lock at once, writes back all filesystems with a single
+// sync and locks the users in parallel, each worker with its own libzfs handle. Locks that fail
+// because a dataset is still busy are retried with backoff. The outcome stays in the registry: a login
+// cancels a lock that is still queued and keeps its datasets, or waits for a running one.
+
+typedef struct zfscrypt_queue_entry {
+    zfscrypt_session_slot_t* slot;
+    uid_t uid;
+    char* user;
+    int result;
+} zfscrypt_queue_entry_t;
+
+typedef struct zfscrypt_queue {
+    zfscrypt_context_t* context;
+    zfscrypt_session_registry_t* registry;
+    pthread_mutex_t mutex;
+    // next entry a worker picks up
+    size_t next;
+    // locks taken in the current round
+    zfscrypt_queue_entry_t* entries;
+    size_t len;
+    size_t capacity;
+} zfscrypt_queue_t;
+
+// public functions
+
+// queues the lock of the context user, fails if the datasets have to be locked now
+zfscrypt_err_t zfscrypt_queue_push(zfscrypt_context_t* context);
+
+// takes back a queued lock of the context user or waits for a running one to finish,
+// unlocked tells whether the datasets were never locked
+zfscrypt_err_t zfscrypt_queue_cancel(bool* unlocked, zfscrypt_context_t* context);
+
+// serves queued locks until none is left, run by zfscrypt lock-queue
+zfscrypt_err_t zfscrypt_queue_run(zfscrypt_context_t* context);
+
+// private methods
+
+// takes all queued locks of the registry
+int zfscrypt_queue_collect(zfscrypt_queue_t* self);
+void zfscrypt_queue_serve(zfscrypt_queue_t* self);
+void* zfscrypt_queue_worker(void* data);
+int zfscrypt_queue_lock(zfscrypt_context_t* context, zfscrypt_queue_entry_t* entry);
+void zfscrypt_queue_clear(zfscrypt_queue_t* self);
+
+// private functions
+
+char* zfscrypt_queue_trigger_path(const char* runtime_dir);
+// sleeps up to ms milliseconds, returns false as soon as the user opens a session
+bool zfscrypt_queue_backoff(zfscrypt_session_slot_t* slot, const unsigned ms);
+
+// private constants
+
+extern const char ZFSCRYPT_QUEUE_TRIGGER_FILE[];
+extern const unsigned ZFSCRYPT_QUEUE_ATTEMPTS;
+extern const unsigned ZFSCRYPT_QUEUE_BACKOFF_MS;
+// how long a login waits for a running lock before it unlocks anyway
+extern const unsigned ZFSCRYPT_QUEUE_WAIT_MS;
+extern const unsigned ZFSCRYPT_QUEUE_POLL_MS;
@@ -0,0 +1,83 @@
+#pragma once
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "zfscrypt_err.h"
+#include "zfscrypt_keywrap.h"
+#include "zfscrypt_plan.h"
+
+// Changes the password of every encryption root of a user or none of them. Workers derive and
+// check the old key of all roots first, then derive the new keys and rewrap the roots in parallel.
+// Each root commits its key change on its own. If any rewrap fails, the roots already changed get
+// their old key back. Roots with a sealed raw key keep their key, only the zfscrypt key property is
+// sealed again with the new password. Workers never touch libzfs handles, everything they need of a
+// root is read by zfscrypt_rewrap_init on the calling thread.
+
+typedef struct zfscrypt_rewrap zfscrypt_rewrap_t;
+
+typedef struct zfscrypt_rewrap_root {
+    zfscrypt_plan_group_t* group;
+    // read on the calling thread, libzfs handles must not be shared with workers
+    const char* name;
+    uint64_t old_salt;
+    uint64_t new_salt;
+    uint64_t iterations;
+    // bound to the sealed raw key
+    uint64_t guid;
+    // in locked memory, old_key is the raw key if sealed
+    uint8_t* old_key;
+    uint8_t* new_key;
+    bool sealed;
+    // zfscrypt key property before and after sealing the raw key with the new password
+    char old_value[ZFSCRYPT_KEYWRAP_MAX_LEN];
+    char new_value[ZFSCRYPT_KEYWRAP_MAX_LEN];
+    // key is not loaded, so it is loaded for the rewrap only and unloaded afterwards
+    bool load;
+    bool loaded;
+    bool changed;
+    int result;
+} zfscrypt_rewrap_root_t;
+
+typedef int (*zfscrypt_rewrap_step_f)(zfscrypt_rewrap_t*, zfscrypt_rewrap_root_t*);
+
+struct zfscrypt_rewrap {
+    zfscrypt_context_t* context;
+    pthread_mutex_t mutex;
+    // next root a worker picks up
+    size_t next;
+    zfscrypt_rewrap_step_f step;
+    zfscrypt_rewrap_root_t* roots;
+    size_t len;
+};
+
+// public functions
+
+// checks the old key against every owned encryption root without loading it
+zfscrypt_err_t zfscrypt_rewrap_verify(zfscrypt_plan_t* plan, const unsigned workers);
+
+// rewraps every owned encryption root with the new key, rolls back if any of them fails
+zfscrypt_err_t zfscrypt_rewrap_update(zfscrypt_plan_t* plan, const unsigned workers);
+
+// private methods
+
+int zfscrypt_rewrap_init(zfscrypt_rewrap_t* self, zfscrypt_plan_t* plan);
+// runs step on every root with a pool of workers, returns the first error
+zfscrypt_err_t zfscrypt_rewrap_each(zfscrypt_rewrap_t* self, const unsigned workers, zfscrypt_rewrap_step_f step, const char* message);
+void* zfscrypt_rewrap_worker(void* data);
+// derives the old key and checks it with a noop load, then derives the new key if there is one
+int zfscrypt_rewrap_check(zfscrypt_rewrap_t* self, zfscrypt_rewrap_root_t* root);
+// derives the old key from the properties read by zfscrypt_rewrap_init, without touching the handle
+int zfscrypt_rewrap_derive_old(zfscrypt_rewrap_root_t* root);
+int zfscrypt_rewrap_change(zfscrypt_rewrap_t* self, zfscrypt_rewrap_root_t* root);
+// wraps a changed root with its old key again
+int zfscrypt_rewrap_restore(zfscrypt_rewrap_t* self, zfscrypt_rewrap_root_t* root);
+// replaces the sealed keys on the calling thread, libzfs sets the properties
+zfscrypt_err_t zfscrypt_rewrap_store(zfscrypt_rewrap_t* self, const bool restore);
+int zfscrypt_rewrap_set_sealed(zfscrypt_rewrap_t* self, zfscrypt_rewrap_root_t* root, const char* value);
+void zfscrypt_rewrap_free(zfscrypt_rewrap_t* self);
+
+// private functions
+
+// same as zfs_crypto_rewrap: keyformat, salt and iterations are sent along with the wrapping key
+int zfscrypt_rewrap_change_key(const char* name, uint8_t* key, const uint64_t salt, const uint64_t iterations);
@@ -1,6 +1,135 @@
 #pragma once
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
 #include "zfscrypt_err.h"
 
+// Open sessions of all users live in a single file mapped into memory. Slots are indexed by
+// uid and updated with atomic operations, so once the file is mapped, opening or closing a
+// session needs no further system calls besides checking for crashed sessions.
+// A slot is given back once its user has no sessions and nothing pending. Released slots stay
+// marked, so probe sequences still run past them, and are claimed again by the next new user.
+// Claims take a lock on the runtime dir, which keeps two first logins of a user from claiming
+// two slots.
+
+#define ZFSCRYPT_SESSION_SLOTS 4096
+#define ZFSCRYPT_SESSION_PIDS 9
+// owner of a released slot
+#define ZFSCRYPT_SESSION_RELEASED UINT32_MAX
+
+// what became of the lock queued by the last logout of a user, see zfscrypt_queue.h
+typedef enum zfscrypt_session_lock {
+    ZFSCRYPT_SESSION_LOCK_NONE,
+    // waits for zfscrypt lock-queue, the datasets are still unlocked
+    ZFSCRYPT_SESSION_LOCK_QUEUED,
+    // zfscrypt lock-queue is locking the datasets right now
+    ZFSCRYPT_SESSION_LOCK_RUNNING,
+    // every dataset was unmounted and every key unloaded
+    ZFSCRYPT_SESSION_LOCK_DONE,
+    // given up, datasets may still be mounted or keys loaded until the next login and logout
+    ZFSCRYPT_SESSION_LOCK_FAILED
+} zfscrypt_session_lock_t;
+
+// fills exactly one cache line, so logins of different users never contend
+typedef struct zfscrypt_session_slot {
+    // uid + 1 of the user in the upper half, 0 while the slot was never used; a generation bumped by
+    // every session and the number of sessions in the lower half. All change together, so a session
+    // is never counted in a slot that was released meanwhile, nor a slot released under a session.
+    _Atomic uint64_t state;
+    // processes that opened a session, 0 for unused entries; sessions beyond these are counted, but not reaped
+    _Atomic uint32_t pids[ZFSCRYPT_SESSION_PIDS];
+    // zfscrypt_session_lock_t of the last queued or expired lock and its error
+    _Atomic uint32_t lock;
+    // while lingering after the last session, the CLOCK_BOOTTIME second the datasets get locked at, 0 otherwise
+    _Atomic uint64_t deadline;
+    _Atomic int32_t lock_err;
+    // pid of the process locking, set once it moved the lock to running, 0 otherwise
+    _Atomic int32_t locker;
+} __attribute__((aligned(64))) zfscrypt_session_slot_t;
+
+typedef struct zfscrypt_session_registry {
+    _Atomic uint32_t magic;
+    uint32_t version;
+    uint32_t slots;
+    zfscrypt_session_slot_t slot[ZFSCRYPT_SESSION_SLOTS] __attribute__((aligned(64)));
+} zfscrypt_session_registry_t;
+
 // public functions
 
-zfscrypt_err_t zfscrypt_session_counter_update(int* result, const char* base_dir, const char* file_name, const int delta);
+// adds or removes a session of the calling process and returns the number of sessions of uid
+zfscrypt_err_t zfscrypt_session_counter_update(int* result, const char* base_dir, const uid_t uid, const int delta);
+
+// returns the number of sessions of uid without modifying the registry
+zfscrypt_err_t zfscrypt_session_counter_get(int* result, const char* base_dir, const uid_t uid);
+
+// returns the state of the slot of uid, which changes with every session opened or closed, 0 without a slot
+zfscrypt_err_t zfscrypt_session_state_get(uint64_t* result, const char* base_dir, const uid_t uid);
+
+// marks uid as lingering until deadline, if it has no sessions
+zfscrypt_err_t zfscrypt_session_linger(const char* base_dir, const uid_t uid, const uint64_t deadline);
+
+// ends lingering of uid, cancelled tells whether its datasets are still unlocked
+zfscrypt_err_t zfscrypt_session_linger_cancel(bool* cancelled, const char* base_dir, const uid_t uid);
+
+// ends lingering of uid if the deadline is still the one given and no session was opened meanwhile.
+// Returns the slot of uid marked as locking like a lock taken from the queue, the caller locks and
+// finishes it with zfscrypt_session_lock_finish; NULL if the datasets stay unlocked.
+zfscrypt_session_slot_t* zfscrypt_session_linger_expire(zfscrypt_session_registry_t* registry, const uid_t uid, const uint64_t deadline);
+
+// queues the lock of uid for zfscrypt lock-queue, if it has no sessions
+zfscrypt_err_t zfscrypt_session_lock_queue(const char* base_dir, const uid_t uid);
+
+// takes back a queued lock of uid that has not started yet, state tells what became of the last queued
+// lock, anything but a running lock is cleared. A running lock whose process died is cleared and
+// reported as failed.
+zfscrypt_err_t zfscrypt_session_lock_cancel(zfscrypt_session_lock_t* state, const char* base_dir, const uid_t uid);
+
+// claims a queued lock for the worker, fails if the lock was cancelled or a session was opened meanwhile
+bool zfscrypt_session_lock_take(zfscrypt_session_slot_t* slot);
+
+// records the outcome of a claimed lock
+void zfscrypt_session_lock_finish(zfscrypt_session_slot_t* slot, const zfscrypt_session_lock_t state, const int err);
+
+// gives the slot of uid back if it has no sessions, no linger deadline and no lock in flight
+zfscrypt_err_t zfscrypt_session_release(const char* base_dir, const uid_t uid);
+
+// sessions counted in slot
+uint32_t zfscrypt_session_slot_count(zfscrypt_session_slot_t* slot);
+
+// uid owning slot, false if the slot is free or released
+bool zfscrypt_session_slot_uid(zfscrypt_session_slot_t* slot, uid_t* uid);
+
+// see zfscrypt_session_release
+bool zfscrypt_session_slot_release(zfscrypt_session_slot_t* slot);
+
+// maps the registry, read only registries are not created and never cached. A writable open
+// replaces a registry of an older layout, sessions counted in it are forgotten.
+zfscrypt_err_t zfscrypt_session_registry_open(zfscrypt_session_registry_t** registry, const char* base_dir, const bool writable);
+void zfscrypt_session_registry_close(zfscrypt_session_registry_t* registry);
+
+// whether pid is the live owner of a session
+bool zfscrypt_session_pid_alive(const uint32_t pid);
+
+// private functions
+
+zfscrypt_session_slot_t* zfscrypt_session_slot_find(zfscrypt_session_registry_t* registry, const uid_t uid);
+int zfscrypt_session_slot_claim(zfscrypt_session_slot_t** slot, zfscrypt_session_registry_t* registry, const char* base_dir, const uid_t uid);
+zfscrypt_session_slot_t* zfscrypt_session_slot_probe(zfscrypt_session_registry_t* registry, const uid_t uid, zfscrypt_session_slot_t** free_slot);
+void zfscrypt_session_slot_sweep(zfscrypt_session_registry_t* registry);
+// false if the slot was released since it was found
+bool zfscrypt_session_slot_add(zfscrypt_session_slot_t* slot, const uid_t uid, const uint32_t pid);
+void zfscrypt_session_slot_remove(zfscrypt_session_slot_t* slot, const uint32_t pid);
+void zfscrypt_session_slot_reap(zfscrypt_session_slot_t* slot);
+void zfscrypt_session_slot_decrement(zfscrypt_session_slot_t* slot);
+// serializes claiming slots and replacing the registry, returns the locked descriptor or a negative errno
+int zfscrypt_session_lock_dir(const char* base_dir);
+int zfscrypt_session_registry_map(zfscrypt_session_registry_t** registry, const char* path, const bool writable);
+int zfscrypt_session_registry_replace(const char* base_dir, const char* path);
+
+// private constants
+
+extern const char ZFSCRYPT_SESSION_REGISTRY_FILE[];
+extern const uint32_t ZFSCRYPT_SESSION_MAGIC;
+extern const uint32_t ZFSCRYPT_SESSION_VERSION;
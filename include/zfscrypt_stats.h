@@ -0,0 +1,102 @@
+#pragma once
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "zfscrypt_err.h"
+
+// With stats=file or stats=syslog every pam call measures its phases with the monotonic clock. When
+// it returns, the durations are added to fixed bucket histograms in a file in the runtime dir, shared
+// by all processes and updated with atomic operations. zfscrypt stats prints them, also for
+// node_exporter.
+
+#define ZFSCRYPT_STATS_BUCKETS 16
+
+typedef enum zfscrypt_stats_metric {
+    // pam calls, from entering the module until returning from it
+    ZFSCRYPT_STATS_AUTHENTICATE,
+    ZFSCRYPT_STATS_OPEN_SESSION,
+    ZFSCRYPT_STATS_CLOSE_SESSION,
+    // checks the old password against every encryption root before any module changes its password
+    ZFSCRYPT_STATS_CHAUTHTOK_PRELIM,
+    ZFSCRYPT_STATS_CHAUTHTOK,
+    // phases, summed up per call, a call may run each of them several times or not at all
+    ZFSCRYPT_STATS_INIT,
+    ZFSCRYPT_STATS_DISCOVER,
+    ZFSCRYPT_STATS_VALIDATE,
+    ZFSCRYPT_STATS_DERIVE,
+    ZFSCRYPT_STATS_LOAD_KEY,
+    ZFSCRYPT_STATS_MOUNT,
+    ZFSCRYPT_STATS_SYNC,
+    ZFSCRYPT_STATS_UNMOUNT,
+    ZFSCRYPT_STATS_UNLOAD_KEY,
+    ZFSCRYPT_STATS_CHANGE_KEY,
+    ZFSCRYPT_STATS_DROP_CACHES,
+    ZFSCRYPT_STATS_METRICS
+} zfscrypt_stats_metric_t;
+
+#define ZFSCRYPT_STATS_CALLS ZFSCRYPT_STATS_INIT
+
+typedef enum zfscrypt_stats_mode {
+    ZFSCRYPT_STATS_NONE,
+    // histograms in the stats file
+    ZFSCRYPT_STATS_FILE,
+    // additionally one log line per call with its phases
+    ZFSCRYPT_STATS_SYSLOG
+} zfscrypt_stats_mode_t;
+
+// phases of the current call, also updated by the workers of the pipeline
+typedef struct zfscrypt_stats_timings {
+    uint64_t begin;
+    _Atomic uint64_t ns[ZFSCRYPT_STATS_METRICS];
+    _Atomic uint32_t count[ZFSCRYPT_STATS_METRICS];
+} zfscrypt_stats_timings_t;
+
+typedef struct zfscrypt_stats_histogram {
+    // not cumulative, the last bucket counts everything beyond the largest bound
+    _Atomic uint64_t buckets[ZFSCRYPT_STATS_BUCKETS];
+    _Atomic uint64_t count;
+    _Atomic uint64_t sum_us;
+    // failed calls, always 0 for phases
+    _Atomic uint64_t errors;
+} __attribute__((aligned(64))) zfscrypt_stats_histogram_t;
+
+typedef struct zfscrypt_stats_file {
+    _Atomic uint32_t magic;
+    uint32_t version;
+    zfscrypt_stats_histogram_t histograms[ZFSCRYPT_STATS_METRICS] __attribute__((aligned(64)));
+} zfscrypt_stats_file_t;
+
+// public functions
+
+uint64_t zfscrypt_stats_now(void);
+
+void zfscrypt_stats_reset(zfscrypt_stats_timings_t* timings);
+
+// adds the time since begin to a phase
+void zfscrypt_stats_add(zfscrypt_stats_timings_t* timings, const zfscrypt_stats_metric_t phase, const uint64_t begin);
+
+// adds a finished call and its phases to the histograms of the stats file
+zfscrypt_err_t zfscrypt_stats_record(zfscrypt_stats_timings_t* timings, const char* base_dir, const zfscrypt_stats_metric_t call, const bool failed);
+
+// maps the stats file, read only files are not created and never cached
+zfscrypt_err_t zfscrypt_stats_file_open(zfscrypt_stats_file_t** file, const char* base_dir, const bool writable);
+void zfscrypt_stats_file_close(zfscrypt_stats_file_t* file);
+
+// upper bound in microseconds of the bucket holding quantile q of a histogram, 0 if it is empty, UINT64_MAX beyond the largest bound
+uint64_t zfscrypt_stats_quantile(zfscrypt_stats_histogram_t* histogram, const double q);
+
+// private functions
+
+size_t zfscrypt_stats_bucket(const uint64_t us);
+void zfscrypt_stats_observe(zfscrypt_stats_histogram_t* histogram, const uint64_t ns);
+
+// private constants
+
+extern const char ZFSCRYPT_STATS_FILE_NAME[];
+extern const uint32_t ZFSCRYPT_STATS_MAGIC;
+extern const uint32_t ZFSCRYPT_STATS_VERSION;
+// upper bounds of all but the last bucket
+extern const uint64_t ZFSCRYPT_STATS_BOUNDS_US[ZFSCRYPT_STATS_BUCKETS - 1];
+extern const char* const ZFSCRYPT_STATS_NAMES[ZFSCRYPT_STATS_METRICS];
@@ -0,0 +1,35 @@
+#pragma once
+
+// Static tracepoints of the provider zfscrypt for bpftrace, perf and systemtap, see trace/*.bt.
+// They are a single nop each while nobody is attached and compile to nothing when the headers of
+// systemtap-sdt are not installed, or with -DZFSCRYPT_NO_TRACE.
+//
+// Probes and their arguments, strings are char pointers, err is a positive errno or zfs error:
+//   pam__entry(call)                        pam__return(call, user, err)
+//   iter__entry(user)                       iter__return(user, err, datasets)
+//   dataset__valid(dataset, user, valid)
+//   load_key__entry(dataset)                load_key__return(dataset, err)
+//   change_key__entry(dataset)              change_key__return(dataset, err)
+//   mount__entry(dataset)                   mount__return(dataset, err)
+//   unmount__entry(dataset)                 unmount__return(dataset, err)
+//   session__update(uid, delta, count, err)
+
+#if !defined(ZFSCRYPT_NO_TRACE) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define ZFSCRYPT_TRACE_ENABLED 1
+#endif
+#endif
+
+#ifdef ZFSCRYPT_TRACE_ENABLED
+#define zfscrypt_trace1(name, a) DTRACE_PROBE1(zfscrypt, name, a)
+#define zfscrypt_trace2(name, a, b) DTRACE_PROBE2(zfscrypt, name, a, b)
+#define zfscrypt_trace3(name, a, b, c) DTRACE_PROBE3(zfscrypt, name, a, b, c)
+#define zfscrypt_trace4(name, a, b, c, d) DTRACE_PROBE4(zfscrypt, name, a, b, c, d)
+#else
+// sizeof keeps the arguments used without evaluating them
+#define zfscrypt_trace1(name, a) ((void) sizeof(a))
+#define zfscrypt_trace2(name, a, b) ((void) sizeof(a), (void) sizeof(b))
+#define zfscrypt_trace3(name, a, b, c) ((void) sizeof(a), (void) sizeof(b), (void) sizeof(c))
+#define zfscrypt_trace4(name, a, b, c, d) ((void) sizeof(a), (void) sizeof(b), (void) sizeof(c), (void) sizeof(d))
+#endif
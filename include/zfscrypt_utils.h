@@ -13,18 +13,38 @@
 void free_ptr(void* data);
 void close_file(FILE** file);
 void close_fd(int const* fd);
+void strv_free(char*** strv);
 
 bool streq(const char* a, const char* b);
 bool strnq(const char* a, const char* b);
 
 char* strfmt(const char* format, ...);
 
+// NULL terminated string vectors, appends a copy of value. Returns 0 or -ENOMEM.
+int strv_push(char*** strv, const char* value);
+size_t strv_length(char* const* strv);
+
+// Escapes a string for use as instance name of a systemd template unit, like systemd-escape
+char* systemd_escape(const char* value);
+
 int make_private_dir(const char* path);
 
-int open_exclusive(const char* path, const int flags);
+// Runs a command with a minimal environment and waits for it. Returns -errno or its exit status.
+int run_command(char* const argv[]);
+
+// Maps a file of size bytes shared with other processes, writable mappings create the file. Returns
+// 0, -ENOENT if a read only file does not exist or is empty, -EPROTO if its size differs or -errno.
+int map_shared_file(void** data, const char* path, const size_t size, const bool writable);
+
+// Writes back dirty data of the filesystem mounted at path, like sync but scoped to a single filesystem
+int sync_filesystem(const char* path);
 
 // Instructs kernel to free reclaimable inodes and dentries. This has the effect of making encrypted datasets whose keys are not present no longer accessible. Requires root privileges.
 int drop_filesystem_cache();
 
+// Allocates memory that is locked into RAM, so secrets never end up in swap
+void* secure_malloc(const size_t size);
+// Overwrites memory with zeros before freeing it
+void secure_free(void* data, size_t size);
 void* secure_dup(void const* const data);
 void secure_cleanup(pam_handle_t* handle, void* data, int error_status);
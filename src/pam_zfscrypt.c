@@ -4,16 +4,21 @@
 #include <string.h>
 #include <syslog.h>
 
+#include "zfscrypt_client.h"
 #include "zfscrypt_context.h"
-#include "zfscrypt_dataset.h"
 #include "zfscrypt_err.h"
+#include "zfscrypt_linger.h"
+#include "zfscrypt_prepare.h"
+#include "zfscrypt_queue.h"
 #include "zfscrypt_session.h"
+#include "zfscrypt_trace.h"
 #include "zfscrypt_utils.h"
 
 /*
  * Stores authentication token in pam data
  */
 extern int pam_sm_authenticate(pam_handle_t* handle, int flags, int argc, const char** argv) {
+    zfscrypt_trace1(pam__entry, "authenticate");
     zfscrypt_context_t context;
     zfscrypt_err_t err = zfscrypt_context_begin(&context, handle, flags, argc, argv);
     if (!err.value)
@@ -22,17 +27,32 @@ extern int pam_sm_authenticate(pam_handle_t* handle, int flags, int argc, const
         err = zfscrypt_context_persist_token(&context);
     if (context.privs.is_dropped)
         (void) zfscrypt_context_regain_privs(&context);
+    zfscrypt_context_record(&context, ZFSCRYPT_STATS_AUTHENTICATE, err);
+    zfscrypt_trace3(pam__return, "authenticate", context.user, err.value);
     return zfscrypt_context_end(&context, err);
 }
 
 /*
- * No-op
+ * Starts preparing the unlock with the prepare argument
  *
- * In this function we check that the user is allowed in the system. We already know
- * that he's authenticated, but we could apply restrictions based on time of the day,
- * resources in the system etc.
+ * Applications only check the account once the auth stack has accepted the password, so
+ * no key is derived from a token nobody verified. Never denies the account.
  */
-extern int pam_sm_acct_mgmt(unused pam_handle_t* handle, unused int flags, unused int argc, unused const char** argv) {
+extern int pam_sm_acct_mgmt(pam_handle_t* handle, int flags, int argc, const char** argv) {
+    zfscrypt_trace1(pam__entry, "acct_mgmt");
+    zfscrypt_context_t context;
+    zfscrypt_err_t err = zfscrypt_context_begin(&context, handle, flags, argc, argv);
+    const bool prepare = !err.value && context.prepare && context.daemon_fd < 0;
+    if (prepare)
+        err = zfscrypt_context_drop_privs(&context);
+    // a failed preparation only costs open_session the time it would have saved
+    const char* token = NULL;
+    if (prepare && !err.value && !zfscrypt_context_pam_data_get_token(&context, &token).value)
+        (void) zfscrypt_context_log_err(&context, zfscrypt_prepare_start(&context, token));
+    if (context.privs.is_dropped)
+        (void) zfscrypt_context_regain_privs(&context);
+    zfscrypt_trace3(pam__return, "acct_mgmt", context.user, err.value);
+    (void) zfscrypt_context_end(&context, err);
     return PAM_IGNORE;
 }
 
@@ -54,46 +74,81 @@ extern int pam_sm_setcred(unused pam_handle_t* handle, unused int flags, unused
  * build the user environment (setting environment variables, mounting directories etc).
  */
 extern int pam_sm_open_session(pam_handle_t* handle, int flags, int argc, char const** argv) {
+    zfscrypt_trace1(pam__entry, "open_session");
     zfscrypt_context_t context;
     zfscrypt_err_t err = zfscrypt_context_begin(&context, handle, flags, argc, argv);
     int counter = 0;
     const char* token = NULL;
-    if (!err.value)
-        err = zfscrypt_context_log_err(
-            &context,
-            zfscrypt_session_counter_update(&counter, context.runtime_dir, context.user, +1));
+    // an uncounted session still gets its datasets, it only never locks them on logout
+    if (!err.value && zfscrypt_context_log_err(&context, zfscrypt_session_counter_update(&counter, context.runtime_dir, context.uid, +1)).value)
+        counter = 1;
+    // within the linger window of the last session the datasets are still unlocked
+    bool lingering = false;
     if (!err.value && counter == 1)
+        (void) zfscrypt_context_log_err(&context, zfscrypt_session_linger_cancel(&lingering, context.runtime_dir, context.uid));
+    // so are they while their lock waits in the queue, other services may queue without the argument
+    bool queued = false;
+    zfscrypt_err_t cancel_err = zfscrypt_err_os(0, "No queued lock to cancel");
+    if (!err.value && counter == 1 && !lingering)
+        cancel_err = zfscrypt_context_log_err(&context, zfscrypt_queue_cancel(&queued, &context));
+    // a lock that is still running would unmount the datasets right after they were mounted
+    if (cancel_err.value == EBUSY) {
+        err = cancel_err;
+        (void) zfscrypt_session_counter_update(&counter, context.runtime_dir, context.uid, -1);
+    }
+    const bool unlock = counter == 1 && !lingering && !queued;
+    if (!err.value && unlock)
         err = zfscrypt_context_drop_privs(&context);
-    if (!err.value && counter == 1)
+    if (!err.value && unlock)
         err = zfscrypt_context_restore_token(&context, &token);
-    if (!err.value && counter == 1)
-        err = zfscrypt_dataset_unlock_all(&context, token);
+    if (!err.value && unlock)
+        err = zfscrypt_client_unlock_all(&context, token);
     if (context.privs.is_dropped)
         (void) zfscrypt_context_regain_privs(&context);
     (void) zfscrypt_context_clear_token(&context);
+    // prepared keys are not needed anymore, even if this was not the first session
+    if (context.cache != NULL)
+        zfscrypt_prepare_discard(context.cache);
+    zfscrypt_context_record(&context, ZFSCRYPT_STATS_OPEN_SESSION, err);
+    zfscrypt_trace3(pam__return, "open_session", context.user, err.value);
     return zfscrypt_context_end(&context, err);
 }
 
 /*
- * Counts active sessions, executes zfs umount and zfs unload-key, drops logsystem caches
+ * Counts active sessions, executes zfs umount and zfs unload-key, drops filesystem caches if configured
  *
  * Here we destroy the environment we have created above.
  */
 extern int pam_sm_close_session(pam_handle_t* handle, int flags, int argc, char const** argv) {
+    zfscrypt_trace1(pam__entry, "close_session");
     zfscrypt_context_t context;
     zfscrypt_err_t err = zfscrypt_context_begin(&context, handle, flags, argc, argv);
     int counter = 0;
     if (!err.value)
         err = zfscrypt_context_log_err(
             &context,
-            zfscrypt_session_counter_update(&counter, context.runtime_dir, context.user, -1));
-    if (!err.value && counter == 0)
+            zfscrypt_session_counter_update(&counter, context.runtime_dir, context.uid, -1));
+    // locks inline if the timer could not be started or the lock not be queued
+    const bool lock = !err.value && counter == 0
+        && (context.linger == 0 || zfscrypt_context_log_err(&context, zfscrypt_linger_schedule(&context)).value)
+        && (!context.lock_queue || zfscrypt_context_log_err(&context, zfscrypt_queue_push(&context)).value);
+    if (!err.value && lock)
         err = zfscrypt_context_drop_privs(&context);
-    if (!err.value && counter == 0)
-        err = zfscrypt_dataset_lock_all(&context);
+    if (!err.value && lock)
+        err = zfscrypt_client_lock_all(&context);
     if (context.privs.is_dropped)
         (void) zfscrypt_context_regain_privs(&context);
-    (void) drop_filesystem_cache();
+    // nothing is left pending for the user, so the next user may take the slot
+    if (lock)
+        (void) zfscrypt_session_release(context.runtime_dir, context.uid);
+    // scoped eviction happens per dataset while locking, this flushes every tenant on the machine
+    if (!err.value && lock && context.drop_caches == ZFSCRYPT_DROP_CACHES_GLOBAL) {
+        const uint64_t begin = zfscrypt_stats_now();
+        (void) drop_filesystem_cache();
+        zfscrypt_stats_add(&context.timings, ZFSCRYPT_STATS_DROP_CACHES, begin);
+    }
+    zfscrypt_context_record(&context, ZFSCRYPT_STATS_CLOSE_SESSION, err);
+    zfscrypt_trace3(pam__return, "close_session", context.user, err.value);
     return zfscrypt_context_end(&context, err);
 }
 
@@ -105,10 +160,25 @@ extern int pam_sm_close_session(pam_handle_t* handle, int flags, int argc, char
  */
 extern int pam_sm_chauthtok(pam_handle_t* handle, int flags, int argc, char const** argv) {
     if (flags & PAM_PRELIM_CHECK) {
-        // Should return PAM_TRY_AGAIN if not all pre requirements for changing the password are met
-        return PAM_SUCCESS;
+        // a wrong old password fails here, before any module of the stack changes its password
+        zfscrypt_trace1(pam__entry, "chauthtok_prelim");
+        zfscrypt_context_t context;
+        zfscrypt_err_t err = zfscrypt_context_begin(&context, handle, flags, argc, argv);
+        const char* old_token = NULL;
+        // root changing the password of someone else has no old password to check
+        const bool check = !err.value && !zfscrypt_context_pam_items_get_old_token(&context, &old_token).value;
+        if (check)
+            err = zfscrypt_context_drop_privs(&context);
+        if (check && !err.value)
+            err = zfscrypt_client_verify_all(&context, old_token);
+        if (context.privs.is_dropped)
+            (void) zfscrypt_context_regain_privs(&context);
+        zfscrypt_context_record(&context, ZFSCRYPT_STATS_CHAUTHTOK_PRELIM, err);
+        zfscrypt_trace3(pam__return, "chauthtok_prelim", context.user, err.value);
+        return zfscrypt_context_end(&context, err);
     }
     if (flags & PAM_UPDATE_AUTHTOK) {
+        zfscrypt_trace1(pam__entry, "chauthtok");
         zfscrypt_context_t context;
         zfscrypt_err_t err = zfscrypt_context_begin(&context, handle, flags, argc, argv);
         const char* old_token = NULL;
@@ -117,13 +187,15 @@ extern int pam_sm_chauthtok(pam_handle_t* handle, int flags, int argc, char cons
             err = zfscrypt_context_drop_privs(&context);
         if (!err.value)
             err = zfscrypt_context_get_tokens(&context, &old_token, &new_token);
-        // FIXME passwd updates the login password even if this module fails intentionally here
+        // passwd updates the login password even if this module fails here, unless it is required
         if (!err.value && strlen(new_token) < 8)
             err = zfscrypt_err_pam(PAM_AUTHTOK_ERR, "ZFS encryption requires a minimum password length of eight characters");
         if (!err.value)
-            err = zfscrypt_dataset_update_all(&context, old_token, new_token);
+            err = zfscrypt_client_update_all(&context, old_token, new_token);
         if (context.privs.is_dropped)
             (void) zfscrypt_context_regain_privs(&context);
+        zfscrypt_context_record(&context, ZFSCRYPT_STATS_CHAUTHTOK, err);
+        zfscrypt_trace3(pam__return, "chauthtok", context.user, err.value);
         return zfscrypt_context_end(&context, err);
     }
     return PAM_IGNORE;
@@ -0,0 +1,137 @@
+// struct ucred
+#define _GNU_SOURCE
+#include "zfscrypt_client.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "zfscrypt_dataset.h"
+#include "zfscrypt_utils.h"
+
+// public functions
+
+int zfscrypt_client_connect(const char* runtime_dir) {
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    const int len = snprintf(address.sun_path, sizeof(address.sun_path), "%s/%s", runtime_dir, ZFSCRYPT_CLIENT_SOCKET);
+    if (len < 0 || (size_t) len >= sizeof(address.sun_path))
+        return -ENAMETOOLONG;
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -errno;
+    struct ucred peer;
+    socklen_t size = sizeof(peer);
+    // a daemon that hangs must not hang the login with it
+    const struct timeval timeout = {.tv_sec = ZFSCRYPT_CLIENT_TIMEOUT_MS / 1000, .tv_usec = ZFSCRYPT_CLIENT_TIMEOUT_MS % 1000 * 1000};
+    int err = setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) < 0 || setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0 ? -errno : 0;
+    if (!err && connect(fd, (struct sockaddr*) &address, sizeof(address)) < 0)
+        err = -errno;
+    if (!err && getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &peer, &size) < 0)
+        err = -errno;
+    // tokens must only ever be sent to a daemon running as root
+    if (!err && peer.uid != 0)
+        err = -EPERM;
+    if (err) {
+        close(fd);
+        return err;
+    }
+    return fd;
+}
+
+zfscrypt_err_t zfscrypt_client_lock_all(zfscrypt_context_t* context) {
+    zfscrypt_err_t err;
+    return zfscrypt_client_call(&err, context, ZFSCRYPT_CLIENT_LOCK, NULL, NULL)
+        ? err
+        : zfscrypt_dataset_lock_all(context);
+}
+
+zfscrypt_err_t zfscrypt_client_unlock_all(zfscrypt_context_t* context, const char* key) {
+    zfscrypt_err_t err;
+    return zfscrypt_client_call(&err, context, ZFSCRYPT_CLIENT_UNLOCK, key, NULL)
+        ? err
+        : zfscrypt_dataset_unlock_all(context, key);
+}
+
+zfscrypt_err_t zfscrypt_client_verify_all(zfscrypt_context_t* context, const char* key) {
+    zfscrypt_err_t err;
+    return zfscrypt_client_call(&err, context, ZFSCRYPT_CLIENT_VERIFY, key, NULL)
+        ? err
+        : zfscrypt_dataset_verify_all(context, key);
+}
+
+zfscrypt_err_t zfscrypt_client_update_all(zfscrypt_context_t* context, const char* old_key, const char* new_key) {
+    zfscrypt_err_t err;
+    return zfscrypt_client_call(&err, context, ZFSCRYPT_CLIENT_UPDATE, old_key, new_key)
+        ? err
+        : zfscrypt_dataset_update_all(context, old_key, new_key);
+}
+
+// private functions
+
+bool zfscrypt_client_call(zfscrypt_err_t* result, zfscrypt_context_t* context, const zfscrypt_client_op_t op, const char* token, const char* new_token) {
+    if (context->daemon_fd < 0)
+        return false;
+    bool sent = false;
+    *result = zfscrypt_client_request(&sent, context, op, token, new_token);
+    // the daemon may still be locking, unlocking or rewrapping, serving it again would race it
+    if (sent)
+        return true;
+    // the daemon hangs or went away, the request is served in process like without it
+    zfscrypt_context_log(context, LOG_WARNING, "%s", "Could not send request to zfscryptd, serving request in process");
+    *result = zfscrypt_context_serve_in_process(context);
+    return result->value != 0;
+}
+
+zfscrypt_err_t zfscrypt_client_request(bool* sent, zfscrypt_context_t* context, const zfscrypt_client_op_t op, const char* token, const char* new_token) {
+    *sent = false;
+    const char* fields[] = {context->user, token, new_token};
+    zfscrypt_client_request_t request = {.version = ZFSCRYPT_CLIENT_VERSION, .op = op, .lengths = {0, 0, 0}};
+    size_t size = sizeof(request);
+    for (size_t i = 0; i < 3; ++i) {
+        request.lengths[i] = fields[i] == NULL ? 0 : strlen(fields[i]) + 1;
+        size += request.lengths[i];
+    }
+    if (size > ZFSCRYPT_CLIENT_MAX_MESSAGE)
+        return zfscrypt_context_log_err(context, zfscrypt_err_os(EMSGSIZE, "Request for zfscryptd too large"));
+    // the message carries tokens, so it lives in locked memory and is wiped afterwards
+    char* message = secure_malloc(size);
+    if (message == NULL)
+        return zfscrypt_context_log_err(context, zfscrypt_err_os(ENOMEM, "Memory allocation failed"));
+    memcpy(message, &request, sizeof(request));
+    for (size_t i = 0, offset = sizeof(request); i < 3; offset += request.lengths[i++])
+        if (request.lengths[i] > 0)
+            memcpy(&message[offset], fields[i], request.lengths[i]);
+    const ssize_t len = send(context->daemon_fd, message, size, MSG_NOSIGNAL);
+    const int send_err = len < 0 ? errno : 0;
+    secure_free(message, size);
+    if (len < 0)
+        return zfscrypt_context_log_err(context, zfscrypt_err_os(send_err, "Could not send request to zfscryptd"));
+    *sent = true;
+    zfscrypt_client_response_t response;
+    ssize_t received;
+    while ((received = recv(context->daemon_fd, &response, sizeof(response), 0)) < 0 && errno == EINTR)
+        continue;
+    if (received < 0)
+        return zfscrypt_context_log_err(context, zfscrypt_err_os(errno, "Could not receive response from zfscryptd"));
+    if (received != sizeof(response))
+        return zfscrypt_context_log_err(context, zfscrypt_err_os(ECONNRESET, "zfscryptd closed the connection"));
+    // details were logged by the daemon
+    switch (response.type) {
+    case ZFSCRYPT_ERR_PAM:
+        return zfscrypt_context_log_err(context, zfscrypt_err_pam(response.value, "Request served by zfscryptd"));
+    case ZFSCRYPT_ERR_ZFS:
+        return zfscrypt_context_log_err(context, zfscrypt_err_zfs(response.value, "Request served by zfscryptd"));
+    default:
+        return zfscrypt_context_log_err(context, zfscrypt_err_os(response.value, "Request served by zfscryptd"));
+    }
+}
+
+// private constants
+
+const char ZFSCRYPT_CLIENT_SOCKET[] = "zfscryptd.sock";
+const uint32_t ZFSCRYPT_CLIENT_VERSION = 1;
+const unsigned ZFSCRYPT_CLIENT_TIMEOUT_MS = 60000;
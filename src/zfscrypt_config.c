@@ -1,3 +1,4 @@
 #include "zfscrypt_config.h"
 
 const char ZFSCRYPT_DEFAULT_RUNTIME_DIR[] = "/run/zfscrypt";
+const char ZFSCRYPT_DEFAULT_STATE_DIR[] = "/var/lib/zfscrypt";
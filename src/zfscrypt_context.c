@@ -1,50 +1,97 @@
 #include "zfscrypt_context.h"
 
 #include <libzfs.h>
+#include <grp.h>
+#include <pwd.h>
 #include <security/pam_appl.h>
 #include <security/pam_ext.h>
 #include <security/pam_modules.h>
 #include <security/pam_modutil.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/fsuid.h>
+#include <sys/syscall.h>
 #include <syslog.h>
+#include <unistd.h>
 
+#include "zfscrypt_client.h"
 #include "zfscrypt_config.h"
 #include "zfscrypt_err.h"
+#include "zfscrypt_keywrap.h"
+#include "zfscrypt_policy.h"
+#include "zfscrypt_prepare.h"
+#include "zfscrypt_session.h"
 #include "zfscrypt_utils.h"
 
 // public methods
 
 zfscrypt_err_t zfscrypt_context_begin(zfscrypt_context_t* self, pam_handle_t* handle, unused int flags, int argc, const char** argv) {
-    self->pam = handle;
-    self->libzfs = libzfs_init();
-    self->debug = false;
-    self->runtime_dir = ZFSCRYPT_DEFAULT_RUNTIME_DIR;
-    self->user = NULL;
-    // taken from PAM_MODUTIL_DEF_PRIVS macro from <security/pam_modutil.h>
-    self->privs = (struct pam_modutil_privs) {
-        .grplist = self->groups,
-        .number_of_groups = PAM_MODUTIL_NGROUPS,
-        .allocated = 0,
-        .old_gid = -1,
-        .old_uid = -1,
-        .is_dropped = 0};
+    zfscrypt_context_init(self, handle, NULL);
     zfscrypt_parse_args(self, argc, argv);
     zfscrypt_err_t err = zfscrypt_context_pam_get_user(self, &self->user);
+    if (!err.value)
+        (void) zfscrypt_context_log_err(self, zfscrypt_context_pam_data_get_cache(self));
+    // the preparation shares libzfs and the cache with this stage
+    if (self->cache != NULL)
+        zfscrypt_prepare_join(self->cache);
+    struct passwd const* const pwd = err.value || self->cache != NULL ? NULL : pam_modutil_getpwnam(self->pam, self->user);
+    if (pwd != NULL) {
+        self->uid = pwd->pw_uid;
+        self->gid = pwd->pw_gid;
+    }
+    if (pwd != NULL)
+        (void) zfscrypt_context_log_err(self, zfscrypt_context_pam_data_set_cache(self));
+    zfscrypt_context_log_err(self, err);
+    if (!err.value)
+        zfscrypt_policy_apply(self);
+    // connects while still running as root, the socket is not accessible to the user
+    if (self->daemon)
+        self->daemon_fd = zfscrypt_client_connect(self->runtime_dir);
+    if (self->daemon && self->daemon_fd < 0 && self->debug)
+        zfscrypt_context_log(self, LOG_DEBUG, "zfscryptd not available, serving requests in process: %s", strerror(-self->daemon_fd));
+    if (self->daemon_fd < 0)
+        zfscrypt_context_init_libzfs(self);
+    return err;
+}
+
+zfscrypt_err_t zfscrypt_context_begin_tool(zfscrypt_context_t* self, const char* user, int argc, const char** argv) {
+    zfscrypt_context_init(self, NULL, user);
+    zfscrypt_parse_args(self, argc, argv);
+    struct passwd const* const pwd = user == NULL ? NULL : getpwnam(user);
+    if (pwd != NULL) {
+        self->uid = pwd->pw_uid;
+        self->gid = pwd->pw_gid;
+    }
+    zfscrypt_policy_apply(self);
+    const uint64_t begin = zfscrypt_stats_now();
+    self->libzfs = libzfs_init();
+    zfscrypt_stats_add(&self->timings, ZFSCRYPT_STATS_INIT, begin);
+    const zfscrypt_err_t err = self->libzfs == NULL
+        ? zfscrypt_err_os(errno, "Could not initialize libzfs")
+        : zfscrypt_err_os(0, "Initialized libzfs");
     zfscrypt_context_log_err(self, err);
     return err;
 }
 
 int zfscrypt_context_end(zfscrypt_context_t* self, zfscrypt_err_t err) {
-    libzfs_fini(self->libzfs);
+    // a cached handle is released by the cleanup of the pam data
+    if (self->libzfs != NULL && (self->cache == NULL || self->cache->libzfs != self->libzfs))
+        libzfs_fini(self->libzfs);
+    if (self->daemon_fd >= 0)
+        close(self->daemon_fd);
     return zfscrypt_err_for_pam(err);
 }
 
 void zfscrypt_context_log(zfscrypt_context_t* self, const int level, const char* format, ...) {
-    if (self->pam == NULL)
-        return;
     va_list args;
     va_start(args, format);
-    pam_vsyslog(self->pam, level, format, args);
+    if (self->pam != NULL) {
+        pam_vsyslog(self->pam, level, format, args);
+    } else if (level != LOG_DEBUG || self->debug) {
+        vfprintf(stderr, format, args);
+        fputc('\n', stderr);
+    }
     va_end(args);
 }
 
@@ -101,13 +148,16 @@ zfscrypt_err_t zfscrypt_context_get_tokens(zfscrypt_context_t* self, const char*
 }
 
 zfscrypt_err_t zfscrypt_context_drop_privs(zfscrypt_context_t* self) {
-    struct passwd const* const pwd = pam_modutil_getpwnam(self->pam, self->user);
+    if (self->pam == NULL)
+        return zfscrypt_context_drop_fsuid(self);
+    // resolved once per handle by zfscrypt_context_begin, pam_modutil_drop_priv reads only these
+    const struct passwd pwd = {.pw_name = (char*) self->user, .pw_uid = self->uid, .pw_gid = self->gid};
     int status = 0;
     zfscrypt_err_t err = zfscrypt_err_pam(status, "Dropped privileges");
-    if (pwd == NULL)
+    if (self->user == NULL || self->uid == (uid_t) -1 || self->gid == (gid_t) -1)
         err = zfscrypt_err_pam(PAM_SESSION_ERR, "Could not get passwd entry for user");
     if (!err.value)
-        status = pam_modutil_drop_priv(self->pam, &self->privs, pwd);
+        status = pam_modutil_drop_priv(self->pam, &self->privs, &pwd);
     if (status)
         err = zfscrypt_err_pam(status, "Could not drop privileges");
     zfscrypt_context_log_err(self, err);
@@ -115,6 +165,8 @@ zfscrypt_err_t zfscrypt_context_drop_privs(zfscrypt_context_t* self) {
 }
 
 zfscrypt_err_t zfscrypt_context_regain_privs(zfscrypt_context_t* self) {
+    if (self->pam == NULL)
+        return zfscrypt_context_regain_fsuid(self);
     const int status = pam_modutil_regain_priv(self->pam, &self->privs);
     const zfscrypt_err_t err = status == 0
         ? zfscrypt_err_pam(status, "Regained privileges")
@@ -123,23 +175,190 @@ zfscrypt_err_t zfscrypt_context_regain_privs(zfscrypt_context_t* self) {
     return err;
 }
 
+zfscrypt_err_t zfscrypt_context_serve_in_process(zfscrypt_context_t* self) {
+    if (self->daemon_fd >= 0)
+        close(self->daemon_fd);
+    self->daemon_fd = -1;
+    zfscrypt_context_init_libzfs(self);
+    return self->libzfs == NULL
+        ? zfscrypt_err_os(errno, "Could not initialize libzfs")
+        : zfscrypt_err_os(0, "Serving requests in process");
+}
+
+bool zfscrypt_context_cancelled(zfscrypt_context_t* self) {
+    return self->guard != NULL && zfscrypt_session_slot_count(self->guard) > 0;
+}
+
+void zfscrypt_context_record(zfscrypt_context_t* self, const zfscrypt_stats_metric_t call, const zfscrypt_err_t err) {
+    if (self->stats == ZFSCRYPT_STATS_NONE)
+        return;
+    zfscrypt_context_log_err(self, zfscrypt_stats_record(&self->timings, self->runtime_dir, call, err.value != 0));
+    if (self->stats != ZFSCRYPT_STATS_SYSLOG)
+        return;
+    // key=value pairs for the journal, phases that did not run are left out
+    char phases[512] = "";
+    size_t len = 0;
+    for (size_t i = ZFSCRYPT_STATS_CALLS; i < ZFSCRYPT_STATS_METRICS && len < sizeof(phases); ++i) {
+        if (atomic_load(&self->timings.count[i]) == 0)
+            continue;
+        const int written = snprintf(&phases[len], sizeof(phases) - len, " %s_us=%lu", ZFSCRYPT_STATS_NAMES[i], (unsigned long) (atomic_load(&self->timings.ns[i]) / 1000));
+        len += written < 0 ? 0 : (size_t) written;
+    }
+    zfscrypt_context_log(self, LOG_INFO, "stats call=%s status=%s total_us=%lu%s", ZFSCRYPT_STATS_NAMES[call], err.value ? "error" : "ok", (unsigned long) (atomic_load(&self->timings.ns[call]) / 1000), phases);
+}
+
 // private methods
 
+void zfscrypt_context_init(zfscrypt_context_t* self, pam_handle_t* handle, const char* user) {
+    self->pam = handle;
+    self->libzfs = NULL;
+    self->debug = false;
+    self->runtime_dir = ZFSCRYPT_DEFAULT_RUNTIME_DIR;
+    self->state_dir = ZFSCRYPT_DEFAULT_STATE_DIR;
+    self->discovery = ZFSCRYPT_DISCOVERY_WALK;
+    self->workers = 0;
+    self->drop_caches = ZFSCRYPT_DROP_CACHES_SCOPED;
+    self->daemon = false;
+    self->prepare = false;
+    self->linger = 0;
+    self->lock_queue = false;
+    self->policy = NULL;
+    self->mount = ZFSCRYPT_MOUNT_MODE_PROPERTY;
+    // the empty string, an empty list
+    self->roots = "";
+    self->skip = "";
+    self->kdf = ZFSCRYPT_CRYPTO_KDF_SCRYPT;
+    self->kdf_cost = 0;
+    self->argc = 0;
+    self->argv = NULL;
+    self->daemon_fd = -1;
+    self->stats = ZFSCRYPT_STATS_NONE;
+    zfscrypt_stats_reset(&self->timings);
+    self->user = user;
+    self->uid = (uid_t) -1;
+    self->gid = (gid_t) -1;
+    self->cache = NULL;
+    self->guard = NULL;
+    // taken from PAM_MODUTIL_DEF_PRIVS macro from <security/pam_modutil.h>
+    self->privs = (struct pam_modutil_privs) {
+        .grplist = self->groups,
+        .number_of_groups = PAM_MODUTIL_NGROUPS,
+        .allocated = 0,
+        .old_gid = -1,
+        .old_uid = -1,
+        .is_dropped = 0};
+}
+
+void zfscrypt_context_init_libzfs(zfscrypt_context_t* self) {
+    const bool cached = self->cache != NULL && self->cache->libzfs != NULL;
+    const uint64_t begin = zfscrypt_stats_now();
+    self->libzfs = cached ? self->cache->libzfs : libzfs_init();
+    if (!cached)
+        zfscrypt_stats_add(&self->timings, ZFSCRYPT_STATS_INIT, begin);
+    if (self->cache != NULL && self->cache->libzfs == NULL)
+        self->cache->libzfs = self->libzfs;
+}
+
 void zfscrypt_parse_args(zfscrypt_context_t* self, int argc, const char** argv) {
+    self->argc = argc;
+    self->argv = argv;
     for (int i = 0; i < argc; ++i) {
         const char* item = argv[i];
         if (streq(item, ZFSCRYPT_CONTEXT_ARG_DEBUG)) {
             self->debug = true;
             zfscrypt_context_log(self, LOG_DEBUG, "%s", "Debug mode on");
+        } else if (streq(item, ZFSCRYPT_CONTEXT_ARG_DAEMON)) {
+            self->daemon = true;
+        } else if (streq(item, ZFSCRYPT_CONTEXT_ARG_PREPARE)) {
+            self->prepare = true;
+        } else if (streq(item, ZFSCRYPT_CONTEXT_ARG_LOCK_QUEUE)) {
+            self->lock_queue = true;
         } else if (strncmp(item, ZFSCRYPT_CONTEXT_ARG_RUNTIME_DIR, ZFSCRYPT_CONTEXT_ARG_RUNTIME_DIR_LEN) == 0) {
             self->runtime_dir = &item[ZFSCRYPT_CONTEXT_ARG_RUNTIME_DIR_LEN];
             zfscrypt_context_log(self, LOG_DEBUG, "Using runtime dir %s", self->runtime_dir);
+        } else if (strncmp(item, ZFSCRYPT_CONTEXT_ARG_STATE_DIR, ZFSCRYPT_CONTEXT_ARG_STATE_DIR_LEN) == 0) {
+            self->state_dir = &item[ZFSCRYPT_CONTEXT_ARG_STATE_DIR_LEN];
+            zfscrypt_context_log(self, LOG_DEBUG, "Using state dir %s", self->state_dir);
+        } else if (strncmp(item, ZFSCRYPT_CONTEXT_ARG_POLICY, ZFSCRYPT_CONTEXT_ARG_POLICY_LEN) == 0) {
+            self->policy = &item[ZFSCRYPT_CONTEXT_ARG_POLICY_LEN];
+            zfscrypt_context_log(self, LOG_DEBUG, "Using policy %s", self->policy);
+        } else if (strncmp(item, ZFSCRYPT_CONTEXT_ARG_WORKERS, ZFSCRYPT_CONTEXT_ARG_WORKERS_LEN) == 0) {
+            const unsigned long workers = strtoul(&item[ZFSCRYPT_CONTEXT_ARG_WORKERS_LEN], NULL, 10);
+            self->workers = workers > ZFSCRYPT_CONTEXT_MAX_WORKERS ? ZFSCRYPT_CONTEXT_MAX_WORKERS : workers;
+            zfscrypt_context_log(self, LOG_DEBUG, "Using %u worker(s)", self->workers);
+        } else if (strncmp(item, ZFSCRYPT_CONTEXT_ARG_LINGER, ZFSCRYPT_CONTEXT_ARG_LINGER_LEN) == 0) {
+            const unsigned long linger = strtoul(&item[ZFSCRYPT_CONTEXT_ARG_LINGER_LEN], NULL, 10);
+            self->linger = linger > ZFSCRYPT_CONTEXT_MAX_LINGER ? ZFSCRYPT_CONTEXT_MAX_LINGER : linger;
+            zfscrypt_context_log(self, LOG_DEBUG, "Lingering %u second(s) after the last session", self->linger);
+        } else if (strncmp(item, ZFSCRYPT_CONTEXT_ARG_KDF_COST, ZFSCRYPT_CONTEXT_ARG_KDF_COST_LEN) == 0) {
+            self->kdf_cost = strtoull(&item[ZFSCRYPT_CONTEXT_ARG_KDF_COST_LEN], NULL, 10);
+        } else if (strncmp(item, ZFSCRYPT_CONTEXT_ARG_KDF, ZFSCRYPT_CONTEXT_ARG_KDF_LEN) == 0) {
+            if (zfscrypt_keywrap_kdf_parse(&item[ZFSCRYPT_CONTEXT_ARG_KDF_LEN], &self->kdf))
+                zfscrypt_context_log(self, LOG_WARNING, "Unknown key derivation %s", &item[ZFSCRYPT_CONTEXT_ARG_KDF_LEN]);
+        } else if (streq(item, ZFSCRYPT_CONTEXT_ARG_DISCOVERY_WALK)) {
+            self->discovery = ZFSCRYPT_DISCOVERY_WALK;
+        } else if (streq(item, ZFSCRYPT_CONTEXT_ARG_DISCOVERY_PROGRAM)) {
+            self->discovery = ZFSCRYPT_DISCOVERY_PROGRAM;
+            zfscrypt_context_log(self, LOG_DEBUG, "%s", "Using channel program for discovery");
+        } else if (streq(item, ZFSCRYPT_CONTEXT_ARG_DROP_CACHES_NONE)) {
+            self->drop_caches = ZFSCRYPT_DROP_CACHES_NONE;
+        } else if (streq(item, ZFSCRYPT_CONTEXT_ARG_DROP_CACHES_SCOPED)) {
+            self->drop_caches = ZFSCRYPT_DROP_CACHES_SCOPED;
+        } else if (streq(item, ZFSCRYPT_CONTEXT_ARG_DROP_CACHES_GLOBAL)) {
+            self->drop_caches = ZFSCRYPT_DROP_CACHES_GLOBAL;
+            zfscrypt_context_log(self, LOG_DEBUG, "%s", "Dropping caches of all filesystems after the last session");
+        } else if (streq(item, ZFSCRYPT_CONTEXT_ARG_STATS_NONE)) {
+            self->stats = ZFSCRYPT_STATS_NONE;
+        } else if (streq(item, ZFSCRYPT_CONTEXT_ARG_STATS_FILE)) {
+            self->stats = ZFSCRYPT_STATS_FILE;
+        } else if (streq(item, ZFSCRYPT_CONTEXT_ARG_STATS_SYSLOG)) {
+            self->stats = ZFSCRYPT_STATS_SYSLOG;
         } else {
             zfscrypt_context_log(self, LOG_WARNING, "Unknown module argument %s", item);
         }
     }
 }
 
+// Same as pam_modutil_drop_priv: the previous groups are saved in privs, only the filesystem ids change
+zfscrypt_err_t zfscrypt_context_drop_fsuid(zfscrypt_context_t* self) {
+    // zfscryptd drops privileges on several threads at once
+    struct passwd entry;
+    struct passwd* pwd = NULL;
+    char buffer[4096];
+    if (self->user == NULL || getpwnam_r(self->user, &entry, buffer, sizeof(buffer), &pwd) != 0 || pwd == NULL)
+        return zfscrypt_context_log_err(self, zfscrypt_err_pam(PAM_SESSION_ERR, "Could not get passwd entry for user"));
+    const int groups = getgroups(PAM_MODUTIL_NGROUPS, self->groups);
+    if (groups < 0)
+        return zfscrypt_context_log_err(self, zfscrypt_err_os(errno, "Could not get groups"));
+    self->privs.number_of_groups = groups;
+    self->privs.old_uid = geteuid();
+    self->privs.old_gid = getegid();
+    gid_t user_groups[PAM_MODUTIL_NGROUPS];
+    int count = PAM_MODUTIL_NGROUPS;
+    if (getgrouplist(pwd->pw_name, pwd->pw_gid, user_groups, &count) < 0)
+        return zfscrypt_context_log_err(self, zfscrypt_err_os(ERANGE, "Could not get groups of user"));
+    // the raw system call only changes the calling thread, unlike setgroups of glibc
+    if (syscall(SYS_setgroups, count, user_groups) < 0)
+        return zfscrypt_context_log_err(self, zfscrypt_err_os(errno, "Could not set groups"));
+    self->privs.is_dropped = 1;
+    // setfs[ug]id return the previous id, a second call tells whether the change took effect
+    (void) setfsgid(pwd->pw_gid);
+    (void) setfsuid(pwd->pw_uid);
+    if ((gid_t) setfsgid(-1) != pwd->pw_gid || (uid_t) setfsuid(-1) != pwd->pw_uid)
+        return zfscrypt_context_log_err(self, zfscrypt_err_pam(PAM_SESSION_ERR, "Could not drop privileges"));
+    return zfscrypt_context_log_err(self, zfscrypt_err_pam(0, "Dropped privileges"));
+}
+
+zfscrypt_err_t zfscrypt_context_regain_fsuid(zfscrypt_context_t* self) {
+    (void) setfsuid(self->privs.old_uid);
+    (void) setfsgid(self->privs.old_gid);
+    const int err = syscall(SYS_setgroups, self->privs.number_of_groups, self->groups) < 0 ? errno : 0;
+    self->privs.is_dropped = 0;
+    return err
+        ? zfscrypt_context_log_err(self, zfscrypt_err_os(err, "Could not regain privileges"))
+        : zfscrypt_context_log_err(self, zfscrypt_err_pam(0, "Regained privileges"));
+}
+
 zfscrypt_err_t zfscrypt_context_pam_get_user(zfscrypt_context_t* self, const char** user) {
     const int err = pam_get_user(self->pam, user, NULL);
     return err == 0 && user != NULL
@@ -149,14 +368,14 @@ zfscrypt_err_t zfscrypt_context_pam_get_user(zfscrypt_context_t* self, const cha
 
 zfscrypt_err_t zfscrypt_context_pam_items_get_token(zfscrypt_context_t* self, const char** token) {
     const int err = pam_get_item(self->pam, PAM_AUTHTOK, (const void**) token);
-    return err == 0 && token != NULL
+    return err == 0 && *token != NULL
         ? zfscrypt_err_pam(err, "Got token from pam items")
         : zfscrypt_err_pam(PAM_AUTHTOK_ERR, "Could not get current password from pam");
 }
 
 zfscrypt_err_t zfscrypt_context_pam_items_get_old_token(zfscrypt_context_t* self, const char** token) {
     const int err = pam_get_item(self->pam, PAM_OLDAUTHTOK, (const void**) token);
-    return err == 0 && token != NULL
+    return err == 0 && *token != NULL
         ? zfscrypt_err_pam(0, "Got old token from pam items")
         : zfscrypt_err_pam(PAM_AUTHTOK_ERR, "Could not get old login token from pam items");
     ;
@@ -169,6 +388,48 @@ zfscrypt_err_t zfscrypt_context_pam_ask_token(zfscrypt_context_t* self, const ch
         : zfscrypt_err_pam(err, "Could not ask for login token");
 }
 
+zfscrypt_err_t zfscrypt_context_pam_data_get_cache(zfscrypt_context_t* self) {
+    zfscrypt_context_cache_t* cache = NULL;
+    const int err = pam_get_data(self->pam, ZFSCRYPT_CONTEXT_PAM_DATA_CACHE, (const void**) &cache);
+    // the application may have changed the user since the previous stage
+    if (err || cache == NULL || !streq(cache->user, self->user))
+        return zfscrypt_err_pam(0, "No cached context");
+    self->cache = cache;
+    self->uid = cache->uid;
+    self->gid = cache->gid;
+    return zfscrypt_err_pam(0, "Reused cached context");
+}
+
+zfscrypt_err_t zfscrypt_context_pam_data_set_cache(zfscrypt_context_t* self) {
+    zfscrypt_context_cache_t* cache = calloc(1, sizeof(zfscrypt_context_cache_t));
+    char* user = strdup(self->user);
+    if (cache == NULL || user == NULL) {
+        free(cache);
+        free(user);
+        return zfscrypt_err_os(ENOMEM, "Could not cache context");
+    }
+    *cache = (zfscrypt_context_cache_t) {.user = user, .uid = self->uid, .gid = self->gid, .libzfs = NULL, .datasets = NULL, .prepare = NULL};
+    // replaces the cache of a previous user, which releases it
+    const int err = pam_set_data(self->pam, ZFSCRYPT_CONTEXT_PAM_DATA_CACHE, cache, zfscrypt_context_cache_cleanup);
+    if (err) {
+        zfscrypt_context_cache_cleanup(self->pam, cache, 0);
+        return zfscrypt_err_pam(err, "Could not cache context");
+    }
+    self->cache = cache;
+    return zfscrypt_err_pam(0, "Cached context");
+}
+
+void zfscrypt_context_cache_cleanup(unused pam_handle_t* handle, void* data, unused int error_status) {
+    zfscrypt_context_cache_t* cache = data;
+    // joins the thread before libzfs goes away and wipes keys of a session that was never opened
+    zfscrypt_prepare_discard(cache);
+    if (cache->libzfs != NULL)
+        libzfs_fini(cache->libzfs);
+    strv_free(&cache->datasets);
+    free(cache->user);
+    free(cache);
+}
+
 zfscrypt_err_t zfscrypt_context_pam_data_set_token(zfscrypt_context_t* self, const char* token) {
     const int err = pam_set_data(self->pam, "zfscrypt_token", (void*) token, secure_cleanup);
     return err == 0
@@ -192,7 +453,33 @@ zfscrypt_err_t zfscrypt_context_pam_data_clear_token(unused zfscrypt_context_t*
 
 // private constants
 
+const char ZFSCRYPT_CONTEXT_PAM_DATA_CACHE[] = "zfscrypt_context";
 const char ZFSCRYPT_CONTEXT_ARG_DEBUG[] = "debug";
+const char ZFSCRYPT_CONTEXT_ARG_DAEMON[] = "daemon";
+const char ZFSCRYPT_CONTEXT_ARG_PREPARE[] = "prepare";
+const char ZFSCRYPT_CONTEXT_ARG_LOCK_QUEUE[] = "lock_queue";
 const char ZFSCRYPT_CONTEXT_ARG_RUNTIME_DIR[] = "runtime_dir=";
 // -1 to remove trailing null byte
 const size_t ZFSCRYPT_CONTEXT_ARG_RUNTIME_DIR_LEN = sizeof(ZFSCRYPT_CONTEXT_ARG_RUNTIME_DIR) - 1;
+const char ZFSCRYPT_CONTEXT_ARG_STATE_DIR[] = "state_dir=";
+const size_t ZFSCRYPT_CONTEXT_ARG_STATE_DIR_LEN = sizeof(ZFSCRYPT_CONTEXT_ARG_STATE_DIR) - 1;
+const char ZFSCRYPT_CONTEXT_ARG_POLICY[] = "policy=";
+const size_t ZFSCRYPT_CONTEXT_ARG_POLICY_LEN = sizeof(ZFSCRYPT_CONTEXT_ARG_POLICY) - 1;
+const char ZFSCRYPT_CONTEXT_ARG_WORKERS[] = "workers=";
+const size_t ZFSCRYPT_CONTEXT_ARG_WORKERS_LEN = sizeof(ZFSCRYPT_CONTEXT_ARG_WORKERS) - 1;
+const unsigned ZFSCRYPT_CONTEXT_MAX_WORKERS = 64;
+const char ZFSCRYPT_CONTEXT_ARG_LINGER[] = "linger=";
+const size_t ZFSCRYPT_CONTEXT_ARG_LINGER_LEN = sizeof(ZFSCRYPT_CONTEXT_ARG_LINGER) - 1;
+const unsigned ZFSCRYPT_CONTEXT_MAX_LINGER = 86400;
+const char ZFSCRYPT_CONTEXT_ARG_KDF[] = "kdf=";
+const size_t ZFSCRYPT_CONTEXT_ARG_KDF_LEN = sizeof(ZFSCRYPT_CONTEXT_ARG_KDF) - 1;
+const char ZFSCRYPT_CONTEXT_ARG_KDF_COST[] = "kdf_cost=";
+const size_t ZFSCRYPT_CONTEXT_ARG_KDF_COST_LEN = sizeof(ZFSCRYPT_CONTEXT_ARG_KDF_COST) - 1;
+const char ZFSCRYPT_CONTEXT_ARG_DISCOVERY_WALK[] = "discovery=walk";
+const char ZFSCRYPT_CONTEXT_ARG_DISCOVERY_PROGRAM[] = "discovery=program";
+const char ZFSCRYPT_CONTEXT_ARG_DROP_CACHES_NONE[] = "drop_caches=none";
+const char ZFSCRYPT_CONTEXT_ARG_DROP_CACHES_SCOPED[] = "drop_caches=scoped";
+const char ZFSCRYPT_CONTEXT_ARG_DROP_CACHES_GLOBAL[] = "drop_caches=global";
+const char ZFSCRYPT_CONTEXT_ARG_STATS_NONE[] = "stats=none";
+const char ZFSCRYPT_CONTEXT_ARG_STATS_FILE[] = "stats=file";
+const char ZFSCRYPT_CONTEXT_ARG_STATS_SYSLOG[] = "stats=syslog";
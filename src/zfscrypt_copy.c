@@ -0,0 +1,551 @@
+// copy_file_range and tdestroy
+#define _GNU_SOURCE
+#include "zfscrypt_copy.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <search.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/xattr.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "zfscrypt_utils.h"
+
+// public functions
+
+zfscrypt_err_t zfscrypt_copy_tree(zfscrypt_context_t* context, const char* source, const char* target, const unsigned workers, const bool finish_root, zfscrypt_copy_progress_f progress) {
+    zfscrypt_copy_t self = {
+        .context = context,
+        .source_fd = open(source, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC),
+        .target_fd = open(target, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC),
+        .finish_root = finish_root,
+        .mutex = PTHREAD_MUTEX_INITIALIZER,
+        .changed = PTHREAD_COND_INITIALIZER,
+        .queue = {.paths = NULL, .len = 0, .capacity = 0},
+        .busy = 1,
+        .directories = {.paths = NULL, .len = 0, .capacity = 0},
+        .links = NULL,
+        .deferred = NULL,
+        .deferred_len = 0};
+    int err = self.source_fd < 0 || self.target_fd < 0 ? -errno : 0;
+    if (!err)
+        err = zfscrypt_copy_push(&self.directories, ".");
+    if (!err)
+        err = zfscrypt_copy_push(&self.queue, ".");
+    if (err) {
+        close_fd(&self.source_fd);
+        close_fd(&self.target_fd);
+        free(self.queue.paths);
+        zfscrypt_copy_queue_free(&self.directories);
+        return zfscrypt_err_os(err, "Could not start copying");
+    }
+
+    struct timespec begin, now;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    pthread_t threads[workers == 0 ? 1 : workers];
+    unsigned started = 0;
+    while (started < (workers == 0 ? 1 : workers) && pthread_create(&threads[started], NULL, zfscrypt_copy_worker, &self) == 0)
+        ++started;
+    // without any thread the calling thread walks the tree itself and reports only at the end
+    if (started == 0)
+        (void) zfscrypt_copy_worker(&self);
+    double reported = 0;
+    pthread_mutex_lock(&self.mutex);
+    while (self.busy > 0) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += 1;
+        (void) pthread_cond_timedwait(&self.changed, &self.mutex, &deadline);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        const double seconds = (now.tv_sec - begin.tv_sec) + (now.tv_nsec - begin.tv_nsec) / 1e9;
+        if (progress != NULL && self.busy > 0 && seconds - reported >= 1) {
+            reported = seconds;
+            pthread_mutex_unlock(&self.mutex);
+            progress(&self, seconds);
+            pthread_mutex_lock(&self.mutex);
+        }
+    }
+    pthread_mutex_unlock(&self.mutex);
+    for (unsigned i = 0; i < started; ++i)
+        pthread_join(threads[i], NULL);
+
+    // the workers are done, nothing is written below these directories anymore
+    zfscrypt_copy_finish_links(&self);
+    // directories[0] is the target itself
+    for (size_t i = self.directories.len; i > (self.finish_root ? 0 : 1); --i) {
+        err = zfscrypt_copy_finish_directory(&self, self.directories.paths[i - 1]);
+        if (err)
+            zfscrypt_copy_fail(&self, self.directories.paths[i - 1], err);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (progress != NULL)
+        progress(&self, (now.tv_sec - begin.tv_sec) + (now.tv_nsec - begin.tv_nsec) / 1e9);
+
+    tdestroy(self.links, zfscrypt_copy_link_free);
+    for (size_t i = 0; i < self.deferred_len; ++i)
+        free(self.deferred[i].path);
+    free(self.deferred);
+    free(self.queue.paths);
+    zfscrypt_copy_queue_free(&self.directories);
+    close_fd(&self.source_fd);
+    close_fd(&self.target_fd);
+    pthread_mutex_destroy(&self.mutex);
+    pthread_cond_destroy(&self.changed);
+    if (atomic_load(&self.failed) > 0)
+        return zfscrypt_err_os(EIO, "Could not copy every entry");
+    return zfscrypt_err_os(0, "Copied tree");
+}
+
+// private methods
+
+void* zfscrypt_copy_worker(void* data) {
+    zfscrypt_copy_t* self = data;
+    pthread_mutex_lock(&self->mutex);
+    for (;;) {
+        while (self->queue.len == 0 && self->busy > 0)
+            pthread_cond_wait(&self->changed, &self->mutex);
+        if (self->queue.len == 0)
+            break;
+        char* path = self->queue.paths[--self->queue.len];
+        pthread_mutex_unlock(&self->mutex);
+        zfscrypt_copy_directory(self, path);
+        free(path);
+        pthread_mutex_lock(&self->mutex);
+        --self->busy;
+        pthread_cond_broadcast(&self->changed);
+    }
+    pthread_mutex_unlock(&self->mutex);
+    return NULL;
+}
+
+void zfscrypt_copy_directory(zfscrypt_copy_t* self, const char* path) {
+    defer(close_fd) int target = zfscrypt_copy_open_dir(self->target_fd, path);
+    const int source = zfscrypt_copy_open_dir(self->source_fd, path);
+    DIR* dir = source < 0 || target < 0 ? NULL : fdopendir(source);
+    if (dir == NULL) {
+        zfscrypt_copy_fail(self, path, source < 0 ? source : target < 0 ? target : -errno);
+        close_fd(&source);
+        return;
+    }
+    struct dirent* entry = NULL;
+    while ((entry = readdir(dir)) != NULL) {
+        if (streq(entry->d_name, ".") || streq(entry->d_name, ".."))
+            continue;
+        defer(free_ptr) char* child = zfscrypt_copy_join(path, entry->d_name);
+        struct stat status;
+        if (child == NULL)
+            zfscrypt_copy_fail(self, path, -ENOMEM);
+        else if (fstatat(source, entry->d_name, &status, AT_SYMLINK_NOFOLLOW) < 0)
+            zfscrypt_copy_fail(self, child, -errno);
+        else
+            zfscrypt_copy_entry(self, source, target, child, &status);
+    }
+    zfscrypt_copy_prune(self, path, source, target);
+    closedir(dir);
+}
+
+void zfscrypt_copy_entry(zfscrypt_copy_t* self, const int source, const int target, const char* path, struct stat const* status) {
+    const char* name = zfscrypt_copy_name(path);
+    int err = 0;
+    if (S_ISDIR(status->st_mode)) {
+        struct stat existing;
+        if (fstatat(target, name, &existing, AT_SYMLINK_NOFOLLOW) == 0 && !S_ISDIR(existing.st_mode))
+            err = zfscrypt_copy_remove(target, name);
+        if (!err && mkdirat(target, name, 0700) < 0 && errno != EEXIST)
+            err = -errno;
+        pthread_mutex_lock(&self->mutex);
+        if (!err)
+            err = zfscrypt_copy_push(&self->directories, path);
+        if (!err)
+            err = zfscrypt_copy_push(&self->queue, path);
+        if (!err)
+            ++self->busy;
+        pthread_cond_broadcast(&self->changed);
+        pthread_mutex_unlock(&self->mutex);
+    } else if (S_ISREG(status->st_mode)) {
+        err = zfscrypt_copy_file(self, source, target, path, status);
+    } else {
+        err = zfscrypt_copy_special(self, source, target, name, status);
+    }
+    if (err)
+        zfscrypt_copy_fail(self, path, err);
+}
+
+int zfscrypt_copy_file(zfscrypt_copy_t* self, const int source_dir, const int target_dir, const char* path, struct stat const* status) {
+    if (status->st_nlink > 1) {
+        const int linked = zfscrypt_copy_link(self, path, status);
+        if (linked <= 0)
+            return linked;
+    }
+    const char* name = zfscrypt_copy_name(path);
+    struct stat existing;
+    const bool exists = fstatat(target_dir, name, &existing, AT_SYMLINK_NOFOLLOW) == 0;
+    // truncating a copy that is linked elsewhere, but no longer in the source, would change the other names too
+    const bool replaced = exists && (!S_ISREG(existing.st_mode) || (existing.st_nlink > 1 && status->st_nlink == 1));
+    if (replaced) {
+        const int err = zfscrypt_copy_remove(target_dir, name);
+        if (err)
+            return err;
+    }
+    const bool current = exists && !replaced && S_ISREG(existing.st_mode) && existing.st_size == status->st_size && existing.st_mtim.tv_sec == status->st_mtim.tv_sec && existing.st_mtim.tv_nsec == status->st_mtim.tv_nsec;
+    // O_NONBLOCK keeps a fifo swapped in since the stat from blocking the open
+    defer(close_fd) int source = openat(source_dir, name, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+    if (source < 0)
+        return -errno;
+    struct stat opened;
+    if (fstat(source, &opened) < 0)
+        return -errno;
+    if (!S_ISREG(opened.st_mode) || opened.st_dev != status->st_dev || opened.st_ino != status->st_ino)
+        return -ESTALE;
+    defer(close_fd) int target = openat(target_dir, name, O_WRONLY | O_CREAT | O_NOFOLLOW | O_CLOEXEC | (current ? 0 : O_TRUNC), 0600);
+    if (target < 0)
+        return -errno;
+    int err = current ? 0 : zfscrypt_copy_contents(source, target, status->st_size, &self->bytes);
+    if (!err)
+        err = zfscrypt_copy_metadata(source, target, status);
+    if (!err)
+        atomic_fetch_add(current ? &self->skipped : &self->files, 1);
+    return err;
+}
+
+int zfscrypt_copy_link(zfscrypt_copy_t* self, const char* path, struct stat const* status) {
+    zfscrypt_copy_link_t* link = malloc(sizeof(zfscrypt_copy_link_t));
+    if (link == NULL)
+        return -ENOMEM;
+    *link = (zfscrypt_copy_link_t) {.dev = status->st_dev, .ino = status->st_ino, .path = strdup(path)};
+    if (link->path == NULL) {
+        free(link);
+        return -ENOMEM;
+    }
+    int err = 0;
+    pthread_mutex_lock(&self->mutex);
+    zfscrypt_copy_link_t** found = tsearch(link, &self->links, zfscrypt_copy_link_compare);
+    const bool first = found != NULL && *found == link;
+    // the first copy may still be written by another worker, so the link is made once all are done
+    if (found == NULL) {
+        err = -ENOMEM;
+    } else if (!first) {
+        zfscrypt_copy_link_t* grown = realloc(self->deferred, (self->deferred_len + 1) * sizeof(zfscrypt_copy_link_t));
+        if (grown == NULL)
+            err = -ENOMEM;
+        else
+            (self->deferred = grown)[self->deferred_len++] = *link;
+    }
+    pthread_mutex_unlock(&self->mutex);
+    if (!first && err)
+        free(link->path);
+    if (!first)
+        free(link);
+    return err ? err : first;
+}
+
+int zfscrypt_copy_special(zfscrypt_copy_t* self, const int source, const int target, const char* name, struct stat const* status) {
+    // symlinks and device nodes are cheap, so they are recreated instead of compared
+    struct stat existing;
+    int err = fstatat(target, name, &existing, AT_SYMLINK_NOFOLLOW) == 0 ? zfscrypt_copy_remove(target, name) : 0;
+    if (!err && S_ISLNK(status->st_mode)) {
+        char destination[PATH_MAX];
+        const ssize_t len = readlinkat(source, name, destination, sizeof(destination) - 1);
+        if (len < 0)
+            return -errno;
+        destination[len] = '\0';
+        if (symlinkat(destination, target, name) < 0)
+            err = -errno;
+    } else if (!err && mknodat(target, name, status->st_mode, status->st_rdev) < 0) {
+        err = -errno;
+    }
+    if (!err && fchownat(target, name, status->st_uid, status->st_gid, AT_SYMLINK_NOFOLLOW) < 0)
+        err = -errno;
+    // follows a symlink, but nobody but root can swap one in below the staging root while copying
+    if (!err && !S_ISLNK(status->st_mode) && fchmodat(target, name, status->st_mode & 07777, 0) < 0)
+        err = -errno;
+    const struct timespec times[2] = {status->st_atim, status->st_mtim};
+    if (!err && utimensat(target, name, times, AT_SYMLINK_NOFOLLOW) < 0)
+        err = -errno;
+    if (!err)
+        atomic_fetch_add(&self->files, 1);
+    return err;
+}
+
+void zfscrypt_copy_prune(zfscrypt_copy_t* self, const char* path, const int source, const int target) {
+    // the directory stream takes over its own descriptor
+    const int fd = openat(target, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR* dir = fd < 0 ? NULL : fdopendir(fd);
+    if (dir == NULL) {
+        zfscrypt_copy_fail(self, path, -errno);
+        close_fd(&fd);
+        return;
+    }
+    struct dirent* entry = NULL;
+    while ((entry = readdir(dir)) != NULL) {
+        if (streq(entry->d_name, ".") || streq(entry->d_name, ".."))
+            continue;
+        defer(free_ptr) char* child = zfscrypt_copy_join(path, entry->d_name);
+        struct stat status;
+        if (child == NULL || fstatat(source, entry->d_name, &status, AT_SYMLINK_NOFOLLOW) == 0 || errno != ENOENT)
+            continue;
+        const int err = zfscrypt_copy_remove(target, entry->d_name);
+        if (err)
+            zfscrypt_copy_fail(self, child, err);
+        else
+            atomic_fetch_add(&self->removed, 1);
+    }
+    closedir(dir);
+}
+
+void zfscrypt_copy_finish_links(zfscrypt_copy_t* self) {
+    for (size_t i = 0; i < self->deferred_len; ++i) {
+        zfscrypt_copy_link_t const* link = &self->deferred[i];
+        zfscrypt_copy_link_t** first = tfind(link, &self->links, zfscrypt_copy_link_compare);
+        const char* first_name = NULL;
+        const char* name = NULL;
+        defer(close_fd) int first_dir = zfscrypt_copy_open_parent(self->target_fd, (*first)->path, &first_name);
+        defer(close_fd) int dir = zfscrypt_copy_open_parent(self->target_fd, link->path, &name);
+        struct stat linked, existing;
+        int err = first_dir < 0 ? first_dir : dir < 0 ? dir : 0;
+        if (!err && fstatat(first_dir, first_name, &linked, AT_SYMLINK_NOFOLLOW) < 0)
+            err = -errno;
+        const bool exists = !err && fstatat(dir, name, &existing, AT_SYMLINK_NOFOLLOW) == 0;
+        if (exists && existing.st_dev == linked.st_dev && existing.st_ino == linked.st_ino) {
+            atomic_fetch_add(&self->skipped, 1);
+            continue;
+        }
+        if (exists)
+            err = zfscrypt_copy_remove(dir, name);
+        if (!err && linkat(first_dir, first_name, dir, name, 0) < 0)
+            err = -errno;
+        if (err)
+            zfscrypt_copy_fail(self, link->path, err);
+        else
+            atomic_fetch_add(&self->files, 1);
+    }
+}
+
+int zfscrypt_copy_finish_directory(zfscrypt_copy_t* self, const char* path) {
+    defer(close_fd) int source = zfscrypt_copy_open_dir(self->source_fd, path);
+    defer(close_fd) int target = zfscrypt_copy_open_dir(self->target_fd, path);
+    struct stat status;
+    if (source < 0 || target < 0)
+        return source < 0 ? source : target;
+    if (fstat(source, &status) < 0)
+        return -errno;
+    return zfscrypt_copy_metadata(source, target, &status);
+}
+
+void zfscrypt_copy_fail(zfscrypt_copy_t* self, const char* path, const int err) {
+    atomic_fetch_add(&self->failed, 1);
+    zfscrypt_context_log(self->context, LOG_ERR, "Could not copy %s: %s", path, strerror(abs(err)));
+}
+
+// private functions
+
+char* zfscrypt_copy_join(const char* path, const char* name) {
+    return streq(path, ".") ? strdup(name) : strfmt("%s/%s", path, name);
+}
+
+const char* zfscrypt_copy_name(const char* path) {
+    const char* slash = strrchr(path, '/');
+    return slash == NULL ? path : slash + 1;
+}
+
+int zfscrypt_copy_open_dir(const int root, const char* path) {
+    defer(free_ptr) char* components = strdup(path);
+    if (components == NULL)
+        return -ENOMEM;
+    int fd = openat(root, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        return -errno;
+    char* state = NULL;
+    for (char* component = strtok_r(components, "/", &state); component != NULL; component = strtok_r(NULL, "/", &state)) {
+        if (streq(component, "."))
+            continue;
+        // a symlink anywhere on the way fails with ELOOP or ENOTDIR
+        const int next = openat(fd, component, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        const int err = next < 0 ? -errno : 0;
+        close_fd(&fd);
+        if (err)
+            return err;
+        fd = next;
+    }
+    return fd;
+}
+
+int zfscrypt_copy_open_parent(const int root, const char* path, const char** name) {
+    *name = zfscrypt_copy_name(path);
+    if (*name == path)
+        return zfscrypt_copy_open_dir(root, ".");
+    defer(free_ptr) char* parent = strndup(path, *name - path - 1);
+    return parent == NULL ? -ENOMEM : zfscrypt_copy_open_dir(root, parent);
+}
+
+int zfscrypt_copy_push(zfscrypt_copy_queue_t* queue, const char* path) {
+    if (queue->len == queue->capacity) {
+        const size_t capacity = queue->capacity == 0 ? 64 : queue->capacity * 2;
+        char** grown = realloc(queue->paths, capacity * sizeof(char*));
+        if (grown == NULL)
+            return -ENOMEM;
+        queue->paths = grown;
+        queue->capacity = capacity;
+    }
+    char* copy = strdup(path);
+    if (copy == NULL)
+        return -ENOMEM;
+    queue->paths[queue->len++] = copy;
+    return 0;
+}
+
+void zfscrypt_copy_queue_free(zfscrypt_copy_queue_t* queue) {
+    for (size_t i = 0; i < queue->len; ++i)
+        free(queue->paths[i]);
+    free(queue->paths);
+    *queue = (zfscrypt_copy_queue_t) {.paths = NULL, .len = 0, .capacity = 0};
+}
+
+int zfscrypt_copy_contents(const int source, const int target, const off_t size, _Atomic uint64_t* bytes) {
+    // copy_file_range refuses to copy between different filesystems on newer kernels, sendfile
+    // still copies without a round trip through user space
+    bool fallback = false;
+    off_t offset = 0;
+    while (offset < size) {
+        const off_t data = lseek(source, offset, SEEK_DATA);
+        // only a hole is left
+        if (data < 0 && errno == ENXIO)
+            break;
+        const off_t hole = data < 0 ? -1 : lseek(source, data, SEEK_HOLE);
+        if (hole < 0)
+            return -errno;
+        off_t in = data;
+        off_t out = data;
+        while (in < hole) {
+            ssize_t copied = fallback ? -1 : copy_file_range(source, &in, target, &out, hole - in, 0);
+            if (copied < 0 && !fallback && (errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP || errno == EINVAL))
+                fallback = true;
+            if (fallback && lseek(target, out, SEEK_SET) >= 0 && (copied = sendfile(target, source, &in, hole - in)) > 0)
+                out += copied;
+            if (copied < 0 && errno == EINTR)
+                continue;
+            if (copied < 0)
+                return -errno;
+            // the file shrank since it was looked at
+            if (copied == 0)
+                break;
+            atomic_fetch_add(bytes, copied);
+        }
+        if (in < hole)
+            break;
+        offset = hole;
+    }
+    // recreates a trailing hole
+    return ftruncate(target, size) < 0 ? -errno : 0;
+}
+
+int zfscrypt_copy_xattrs(const int source, const int target) {
+    defer(free_ptr) char* names = NULL;
+    ssize_t len = 0;
+    int err = zfscrypt_copy_list_xattrs(source, &names, &len);
+    defer(free_ptr) char* old_names = NULL;
+    ssize_t old_len = 0;
+    if (!err)
+        err = zfscrypt_copy_list_xattrs(target, &old_names, &old_len);
+    // a catch up pass removes what was removed from the source since the last one
+    for (const char* name = old_names; !err && name < old_names + old_len; name += strlen(name) + 1) {
+        bool kept = false;
+        for (const char* other = names; !kept && other < names + len; other += strlen(other) + 1)
+            kept = streq(name, other);
+        if (!kept && fremovexattr(target, name) < 0 && errno != ENODATA)
+            err = -errno;
+    }
+    if (err)
+        return err;
+    // POSIX ACLs are the attributes system.posix_acl_access and system.posix_acl_default
+    for (const char* name = names; name < names + len; name += strlen(name) + 1) {
+        const ssize_t value_size = fgetxattr(source, name, NULL, 0);
+        if (value_size < 0 && errno == ENODATA)
+            continue;
+        if (value_size < 0)
+            return -errno;
+        defer(free_ptr) char* value = malloc(value_size + 1);
+        if (value == NULL)
+            return -ENOMEM;
+        const ssize_t value_len = fgetxattr(source, name, value, value_size);
+        if (value_len < 0)
+            return -errno;
+        if (fsetxattr(target, name, value, value_len, 0) < 0)
+            return -errno;
+    }
+    return 0;
+}
+
+int zfscrypt_copy_list_xattrs(const int fd, char** names, ssize_t* len) {
+    *len = 0;
+    const ssize_t size = flistxattr(fd, NULL, 0);
+    if (size <= 0)
+        return size < 0 && errno != ENOTSUP ? -errno : 0;
+    *names = malloc(size);
+    if (*names == NULL)
+        return -ENOMEM;
+    *len = flistxattr(fd, *names, size);
+    if (*len >= 0)
+        return 0;
+    *len = 0;
+    return -errno;
+}
+
+int zfscrypt_copy_metadata(const int source, const int target, struct stat const* status) {
+    // owner first, because changing it clears setuid and setgid
+    if (fchown(target, status->st_uid, status->st_gid) < 0)
+        return -errno;
+    if (fchmod(target, status->st_mode & 07777) < 0)
+        return -errno;
+    const int err = zfscrypt_copy_xattrs(source, target);
+    if (err)
+        return err;
+    const struct timespec times[2] = {status->st_atim, status->st_mtim};
+    return futimens(target, times) < 0 ? -errno : 0;
+}
+
+int zfscrypt_copy_remove(const int dir_fd, const char* path) {
+    struct stat status;
+    if (fstatat(dir_fd, path, &status, AT_SYMLINK_NOFOLLOW) < 0)
+        return -errno;
+    if (!S_ISDIR(status.st_mode))
+        return unlinkat(dir_fd, path, 0) < 0 ? -errno : 0;
+    const int fd = openat(dir_fd, path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    DIR* dir = fd < 0 ? NULL : fdopendir(fd);
+    if (dir == NULL) {
+        const int err = -errno;
+        close_fd(&fd);
+        return err;
+    }
+    int err = 0;
+    struct dirent* entry = NULL;
+    while (!err && (entry = readdir(dir)) != NULL)
+        if (strnq(entry->d_name, ".") && strnq(entry->d_name, ".."))
+            err = zfscrypt_copy_remove(fd, entry->d_name);
+    closedir(dir);
+    if (!err && unlinkat(dir_fd, path, AT_REMOVEDIR) < 0)
+        err = -errno;
+    return err;
+}
+
+int zfscrypt_copy_link_compare(const void* a, const void* b) {
+    zfscrypt_copy_link_t const* left = a;
+    zfscrypt_copy_link_t const* right = b;
+    if (left->dev != right->dev)
+        return left->dev < right->dev ? -1 : 1;
+    if (left->ino != right->ino)
+        return left->ino < right->ino ? -1 : 1;
+    return 0;
+}
+
+void zfscrypt_copy_link_free(void* data) {
+    zfscrypt_copy_link_t* link = data;
+    free(link->path);
+    free(link);
+}
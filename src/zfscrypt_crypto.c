@@ -0,0 +1,80 @@
+#include "zfscrypt_crypto.h"
+
+#include <errno.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <string.h>
+
+#include "zfscrypt_pbkdf2.h"
+
+// public functions
+
+int zfscrypt_crypto_derive_key(const char* passphrase, const uint64_t salt, const uint64_t iterations, uint8_t* key) {
+    const zfscrypt_pbkdf2_job_t job = {.passphrase = passphrase, .salt = salt, .iterations = iterations, .key = key};
+    return iterations == 0 ? -EINVAL : zfscrypt_pbkdf2_derive(&job, 1);
+}
+
+int zfscrypt_crypto_random_salt(uint64_t* salt) {
+    return RAND_bytes((unsigned char*) salt, sizeof(*salt)) == 1 ? 0 : -EIO;
+}
+
+int zfscrypt_crypto_random_bytes(uint8_t* bytes, const int len) {
+    return RAND_bytes(bytes, len) == 1 ? 0 : -EIO;
+}
+
+int zfscrypt_crypto_kdf(const zfscrypt_crypto_kdf_t kdf, const uint64_t cost, const char* password, const uint8_t* salt, uint8_t* key) {
+    if (cost == 0 || cost > ZFSCRYPT_CRYPTO_MAX_COST[kdf])
+        return -EINVAL;
+    int ok = 0;
+    switch (kdf) {
+    case ZFSCRYPT_CRYPTO_KDF_PBKDF2:
+        ok = PKCS5_PBKDF2_HMAC(password, strlen(password), salt, ZFSCRYPT_CRYPTO_SALT_LEN, cost, EVP_sha512(), ZFSCRYPT_CRYPTO_KEY_LEN, key);
+        break;
+    case ZFSCRYPT_CRYPTO_KDF_SCRYPT:
+        // 128 * r * N bytes of memory plus some slack
+        ok = EVP_PBE_scrypt(password, strlen(password), salt, ZFSCRYPT_CRYPTO_SALT_LEN, UINT64_C(1) << cost, 8, 1, (UINT64_C(1) << cost) * 128 * 8 + (UINT64_C(1) << 20), key, ZFSCRYPT_CRYPTO_KEY_LEN);
+        break;
+    }
+    return ok ? 0 : -EINVAL;
+}
+
+int zfscrypt_crypto_seal(const uint8_t* key, const uint8_t* nonce, const uint8_t* aad, const int aad_len, const uint8_t* plain, uint8_t* sealed) {
+    EVP_CIPHER_CTX* cipher = EVP_CIPHER_CTX_new();
+    if (cipher == NULL)
+        return -ENOMEM;
+    int len = 0;
+    const int ok = EVP_EncryptInit_ex(cipher, EVP_aes_256_gcm(), NULL, key, nonce)
+        && EVP_EncryptUpdate(cipher, NULL, &len, aad, aad_len)
+        && EVP_EncryptUpdate(cipher, sealed, &len, plain, ZFSCRYPT_CRYPTO_KEY_LEN)
+        && EVP_EncryptFinal_ex(cipher, &sealed[len], &len)
+        && EVP_CIPHER_CTX_ctrl(cipher, EVP_CTRL_GCM_GET_TAG, ZFSCRYPT_CRYPTO_TAG_LEN, &sealed[ZFSCRYPT_CRYPTO_KEY_LEN]);
+    EVP_CIPHER_CTX_free(cipher);
+    return ok ? 0 : -EIO;
+}
+
+int zfscrypt_crypto_open(const uint8_t* key, const uint8_t* nonce, const uint8_t* aad, const int aad_len, const uint8_t* sealed, uint8_t* plain) {
+    EVP_CIPHER_CTX* cipher = EVP_CIPHER_CTX_new();
+    if (cipher == NULL)
+        return -ENOMEM;
+    uint8_t tag[ZFSCRYPT_CRYPTO_TAG_LEN];
+    memcpy(tag, &sealed[ZFSCRYPT_CRYPTO_KEY_LEN], sizeof(tag));
+    int len = 0;
+    int err = EVP_DecryptInit_ex(cipher, EVP_aes_256_gcm(), NULL, key, nonce)
+            && EVP_DecryptUpdate(cipher, NULL, &len, aad, aad_len)
+            && EVP_DecryptUpdate(cipher, plain, &len, sealed, ZFSCRYPT_CRYPTO_KEY_LEN)
+            && EVP_CIPHER_CTX_ctrl(cipher, EVP_CTRL_GCM_SET_TAG, sizeof(tag), tag)
+        ? 0
+        : -EIO;
+    // the final step checks the tag, a wrong password ends up here
+    if (!err && EVP_DecryptFinal_ex(cipher, &plain[len], &len) <= 0)
+        err = -EACCES;
+    if (err)
+        explicit_bzero(plain, ZFSCRYPT_CRYPTO_KEY_LEN);
+    EVP_CIPHER_CTX_free(cipher);
+    return err;
+}
+
+// private constants
+
+const char* const ZFSCRYPT_CRYPTO_KDF_NAMES[2] = {"pbkdf2", "scrypt"};
+const uint64_t ZFSCRYPT_CRYPTO_MAX_COST[2] = {2000000, 17};
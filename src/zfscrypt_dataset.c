@@ -1,9 +1,22 @@
 #include "zfscrypt_dataset.h"
 
+#include <libzfs_core.h>
+#include <stdlib.h>
 #include <string.h>
-#include <sys/wait.h>
-#include <unistd.h>
-
+#include <syslog.h>
+
+#include "zfscrypt_crypto.h"
+#include "zfscrypt_keywrap.h"
+#include "zfscrypt_lazy.h"
+#include "zfscrypt_mount.h"
+#include "zfscrypt_pbkdf2.h"
+#include "zfscrypt_pipeline.h"
+#include "zfscrypt_plan.h"
+#include "zfscrypt_policy.h"
+#include "zfscrypt_prepare.h"
+#include "zfscrypt_program.h"
+#include "zfscrypt_rewrap.h"
+#include "zfscrypt_trace.h"
 #include "zfscrypt_utils.h"
 
 // Note regarding error handling with libzfs: Normaly functions return directly an erro code, but zfs_(un)mount returns just -1 on error
@@ -11,15 +24,23 @@
 // public functions
 
 zfscrypt_err_t zfscrypt_dataset_lock_all(zfscrypt_context_t* context) {
-    return zfscrypt_dataset_iter(context, NULL, NULL, zfscrypt_dataset_lock);
+    return zfscrypt_dataset_iter(context, NULL, NULL, zfscrypt_dataset_lock_plan, NULL);
+}
+
+zfscrypt_err_t zfscrypt_dataset_lock_all_checked(zfscrypt_context_t* context) {
+    return zfscrypt_dataset_iter(context, NULL, NULL, zfscrypt_dataset_lock_plan_checked, NULL);
 }
 
 zfscrypt_err_t zfscrypt_dataset_unlock_all(zfscrypt_context_t* context, const char* key) {
-    return zfscrypt_dataset_iter(context, key, NULL, zfscrypt_dataset_unlock);
+    return zfscrypt_dataset_iter(context, key, NULL, zfscrypt_dataset_unlock_plan, NULL);
+}
+
+zfscrypt_err_t zfscrypt_dataset_verify_all(zfscrypt_context_t* context, const char* key) {
+    return zfscrypt_dataset_iter(context, key, NULL, zfscrypt_dataset_verify_plan, NULL);
 }
 
 zfscrypt_err_t zfscrypt_dataset_update_all(zfscrypt_context_t* context, const char* old_key, const char* new_key) {
-    return zfscrypt_dataset_iter(context, old_key, new_key, zfscrypt_dataset_update);
+    return zfscrypt_dataset_iter(context, old_key, new_key, zfscrypt_dataset_update_plan, NULL);
 }
 
 // public methods
@@ -32,110 +53,304 @@ bool zfscrypt_dataset_unlocked(zfscrypt_dataset_t* self) {
     return zfscrypt_dataset_key_loaded(self) && zfscrypt_dataset_mounted(self);
 }
 
-zfscrypt_err_t zfscrypt_dataset_lock(zfscrypt_dataset_t* self) {
-    int err = 0;
-    if (zfscrypt_dataset_mounted(self))
-        err = zfscrypt_dataset_unmount(self);
-    if (!err && zfscrypt_dataset_key_loaded(self))
-        err = zfscrypt_dataset_unload_key(self);
-    return zfscrypt_err_zfs(err, "Locked dataset");
+zfscrypt_err_t zfscrypt_dataset_lock_plan(zfscrypt_plan_t* plan) {
+    // members of all roots are unmounted along their mountpoints before any key is unloaded
+    zfscrypt_mount_release_plan(plan, plan->context->workers);
+    const zfscrypt_err_t err = zfscrypt_plan_each(plan, zfscrypt_dataset_lock);
+    if (plan->context->cache != NULL)
+        strv_free(&plan->context->cache->datasets);
+    return zfscrypt_context_cancelled(plan->context) ? zfscrypt_err_os(ECANCELED, "Session opened while locking") : err;
 }
 
-zfscrypt_err_t zfscrypt_dataset_unlock(zfscrypt_dataset_t* self) {
-    int err = 0;
-    if (!zfscrypt_dataset_key_loaded(self))
-        err = zfscrypt_dataset_load_key(self);
-    if (!err && !zfscrypt_dataset_mounted(self))
-        err = zfscrypt_dataset_mount(self);
-    return zfscrypt_err_zfs(err, "Unlocked dataset");
+zfscrypt_err_t zfscrypt_dataset_lock_plan_checked(zfscrypt_plan_t* plan) {
+    const zfscrypt_err_t err = zfscrypt_dataset_lock_plan(plan);
+    if (err.value == ECANCELED)
+        return err;
+    size_t busy = 0;
+    for (size_t i = 0; i < plan->len; ++i) {
+        zfscrypt_plan_group_t* group = &plan->groups[i];
+        for (size_t j = 0; j < group->len; ++j)
+            busy += zfscrypt_dataset_mounted(&group->members[j]);
+        busy += group->owned && zfscrypt_dataset_key_loaded(&group->root);
+    }
+    return zfscrypt_err_os(busy > 0 ? EBUSY : 0, "Checked that datasets are locked");
+}
+
+zfscrypt_err_t zfscrypt_dataset_unlock_plan(zfscrypt_plan_t* plan) {
+    // remembered even if some fail, locking copes with datasets that were never mounted
+    if (plan->context->cache != NULL)
+        (void) zfscrypt_dataset_remember(plan);
+    // workers derive the keys of different roots in parallel instead
+    if (plan->context->workers > 0)
+        return zfscrypt_pipeline_unlock(plan, plan->context->workers);
+    zfscrypt_context_log_err(plan->context, zfscrypt_err_os(zfscrypt_dataset_derive_plan(plan), "Derived keys of plan"));
+    const zfscrypt_err_t err = zfscrypt_plan_each(plan, zfscrypt_dataset_unlock);
+    zfscrypt_mount_plan(plan);
+    return err;
+}
+
+int zfscrypt_dataset_derive_plan(zfscrypt_plan_t* plan) {
+    zfscrypt_pbkdf2_job_t jobs[plan->len == 0 ? 1 : plan->len];
+    size_t len = 0;
+    for (size_t i = 0; i < plan->len; ++i) {
+        zfscrypt_dataset_t* root = &plan->groups[i].root;
+        if (root->derived != NULL || root->key == NULL || !zfscrypt_dataset_needs_key(&plan->groups[i]) || !zfscrypt_dataset_has_passphrase(root))
+            continue;
+        const uint64_t salt = zfs_prop_get_int(root->handle, ZFS_PROP_PBKDF2_SALT);
+        const uint64_t iterations = zfs_prop_get_int(root->handle, ZFS_PROP_PBKDF2_ITERS);
+        if ((root->derived = secure_malloc(ZFSCRYPT_CRYPTO_KEY_LEN)) == NULL)
+            break;
+        // a prepared key is taken once and used like a derived one
+        if (zfscrypt_prepare_take_key(plan->context, zfs_get_name(root->handle), salt, iterations, root->derived))
+            continue;
+        jobs[len++] = (zfscrypt_pbkdf2_job_t) {.passphrase = root->key, .salt = salt, .iterations = iterations, .key = root->derived};
+    }
+    const uint64_t begin = zfscrypt_stats_now();
+    const int err = zfscrypt_pbkdf2_derive(jobs, len);
+    if (len > 0)
+        zfscrypt_stats_add(&plan->context->timings, ZFSCRYPT_STATS_DERIVE, begin);
+    // roots without a key derive it on their own
+    for (size_t i = 0; err && i < plan->len; ++i) {
+        zfscrypt_dataset_t* root = &plan->groups[i].root;
+        if (root->derived != NULL)
+            secure_free(root->derived, ZFSCRYPT_CRYPTO_KEY_LEN);
+        root->derived = NULL;
+    }
+    return err;
 }
 
-zfscrypt_err_t zfscrypt_dataset_update(zfscrypt_dataset_t* self) {
+int zfscrypt_dataset_remember(zfscrypt_plan_t* plan) {
+    char*** datasets = &plan->context->cache->datasets;
+    strv_free(datasets);
+    int err = (*datasets = calloc(1, sizeof(char*))) == NULL ? -ENOMEM : 0;
+    for (size_t i = 0; !err && i < plan->len; ++i)
+        for (size_t j = 0; !err && j < plan->groups[i].len; ++j)
+            err = strv_push(datasets, zfs_get_name(plan->groups[i].members[j].handle));
+    // a partial list would leave datasets mounted on logout
+    if (err)
+        strv_free(datasets);
+    return err;
+}
+
+zfscrypt_err_t zfscrypt_dataset_verify_plan(zfscrypt_plan_t* plan) {
+    return zfscrypt_rewrap_verify(plan, plan->context->workers);
+}
+
+zfscrypt_err_t zfscrypt_dataset_update_plan(zfscrypt_plan_t* plan) {
+    return zfscrypt_rewrap_update(plan, plan->context->workers);
+}
+
+zfscrypt_err_t zfscrypt_dataset_lock(zfscrypt_plan_group_t* group) {
+    // the key stays loaded for the session opened meanwhile
+    if (zfscrypt_context_cancelled(group->root.context))
+        return zfscrypt_err_os(0, "Kept encryption root for new session");
     int err = 0;
-    const bool loaded = zfscrypt_dataset_key_loaded(self);
-    if (!loaded)
-        err = zfscrypt_dataset_load_key(self);
-    if (!err)
-        err = zfscrypt_dataset_change_key(self);
-    if (!loaded)
-        (void) zfscrypt_dataset_unload_key(self);
-    return zfscrypt_err_zfs(err, "Updated dataset key");
+    // members were released already, the key stays loaded while one of them is still mounted
+    for (size_t i = 0; i < group->len; ++i)
+        if (zfscrypt_dataset_mounted(&group->members[i]))
+            err = EBUSY;
+    if (!err && group->owned && zfscrypt_dataset_key_loaded(&group->root))
+        err = zfscrypt_dataset_unload_key(&group->root);
+    if (group->owned && group->lazy)
+        zfscrypt_context_log_err(group->root.context, zfscrypt_err_os(zfscrypt_lazy_forget_key(&group->root, group->root.context->uid), "Removed key from keyring"));
+    return zfscrypt_err_zfs(err, "Locked encryption root");
+}
+
+zfscrypt_err_t zfscrypt_dataset_unlock(zfscrypt_plan_group_t* group) {
+    const int err = zfscrypt_dataset_needs_key(group) ? zfscrypt_dataset_provide_key(group) : 0;
+    group->ready = !err;
+    return zfscrypt_err_zfs(err, "Unlocked encryption root");
+}
+
+bool zfscrypt_dataset_needs_key(zfscrypt_plan_group_t* group) {
+    return group->owned && !zfscrypt_dataset_key_loaded(&group->root);
+}
+
+int zfscrypt_dataset_provide_key(zfscrypt_plan_group_t* group) {
+    // when every member is mounted lazily, the key is loaded on first access
+    return group->eager
+        ? zfscrypt_dataset_load_key(&group->root)
+        : zfscrypt_lazy_store_key(&group->root, group->root.context->uid);
+}
+
+int zfscrypt_dataset_release(zfscrypt_dataset_t* self) {
+    if (self->context->drop_caches != ZFSCRYPT_DROP_CACHES_NONE)
+        (void) zfscrypt_dataset_sync(self);
+    // the automount would mount the dataset again on the next access
+    if (zfscrypt_dataset_is_lazy(self) && !zfscrypt_context_log_err(self->context, zfscrypt_err_os(zfscrypt_lazy_disarm(self), "Stopped automount")).value)
+        self->snapshot.mounted = false;
+    const int err = zfscrypt_dataset_mounted(self) ? zfscrypt_dataset_unmount(self) : 0;
+    if (err)
+        zfscrypt_context_log_err(self->context, zfscrypt_err_zfs(err, "Could not unmount dataset"));
+    return err;
 }
 
 // private methods, locking and unlocking
 
+void zfscrypt_dataset_observe(zfscrypt_dataset_t* self) {
+    zfscrypt_dataset_snapshot_t* snapshot = &self->snapshot;
+    if (snapshot->observed)
+        return;
+    nvlist_t* prop = NULL;
+    char* mode = NULL;
+    snapshot->lazy = nvlist_lookup_nvlist(zfs_get_user_props(self->handle), ZFSCRYPT_MOUNT_PROPERTY, &prop) == 0 && nvlist_lookup_string(prop, ZPROP_VALUE, &mode) == 0 && streq(mode, "lazy");
+    if (self->context->mount != ZFSCRYPT_MOUNT_MODE_PROPERTY)
+        snapshot->lazy = self->context->mount == ZFSCRYPT_MOUNT_MODE_LAZY;
+    snapshot->key_loaded = zfs_prop_get_int(self->handle, ZFS_PROP_KEYSTATUS) == ZFS_KEYSTATUS_AVAILABLE;
+    snapshot->mounted = zfs_is_mounted(self->handle, NULL);
+    snapshot->observed = true;
+}
+
 bool zfscrypt_dataset_key_loaded(zfscrypt_dataset_t* self) {
-    const int status = zfs_prop_get_int(self->handle, ZFS_PROP_KEYSTATUS);
-    return status == ZFS_KEYSTATUS_AVAILABLE;
+    zfscrypt_dataset_observe(self);
+    return self->snapshot.key_loaded;
 }
 
 int zfscrypt_dataset_load_key(zfscrypt_dataset_t* self) {
-    // libzfs does not provide an interface that simply takes a string as passphrase,
-    // instead it wants to read the key from stdin itself (or from a file).
-    int in_fds[2];
-    pipe(in_fds);
-    const pid_t pid = fork();
-    if (pid < 0) {
-        return -errno;
-    } else if (pid == 0) {
-        dup2(in_fds[0], STDIN_FILENO);
-        close(in_fds[0]);
-        close(in_fds[1]);
-        // zfs_crypto_load_key(zfs_handle_t *zhp, boolean_t noop, char *alt_keylocation)
-        const int err = zfs_crypto_load_key(self->handle, B_FALSE, NULL);
-        exit(err);
-    } else {
-        close(in_fds[0]);
-        write(in_fds[1], self->key, strlen(self->key));
-        close(in_fds[1]);
-        int rc = 0;
-        const int pid2 = waitpid(pid, &rc, 0);
-        return pid2 < 0 ? -errno : -WEXITSTATUS(rc);
+    // Derive the wrapping key in process instead of letting libzfs read the passphrase
+    // from stdin, which would require forking the whole host process.
+    uint8_t* key = secure_malloc(ZFSCRYPT_CRYPTO_KEY_LEN);
+    if (key == NULL)
+        return -ENOMEM;
+    const uint64_t salt = zfs_prop_get_int(self->handle, ZFS_PROP_PBKDF2_SALT);
+    const uint64_t iterations = zfs_prop_get_int(self->handle, ZFS_PROP_PBKDF2_ITERS);
+    zfscrypt_trace1(load_key__entry, zfs_get_name(self->handle));
+    uint64_t begin = zfscrypt_stats_now();
+    int err = 0;
+    if (!zfscrypt_prepare_take_key(self->context, zfs_get_name(self->handle), salt, iterations, key)) {
+        err = zfscrypt_dataset_derive_key(self, self->key, key);
+        zfscrypt_stats_add(&self->context->timings, ZFSCRYPT_STATS_DERIVE, begin);
     }
+    begin = zfscrypt_stats_now();
+    if (!err)
+        err = lzc_load_key(zfs_get_name(self->handle), B_FALSE, key, ZFSCRYPT_CRYPTO_KEY_LEN);
+    if (!err)
+        zfscrypt_stats_add(&self->context->timings, ZFSCRYPT_STATS_LOAD_KEY, begin);
+    if (!err)
+        self->snapshot.key_loaded = true;
+    zfscrypt_trace2(load_key__return, zfs_get_name(self->handle), abs(err));
+    secure_free(key, ZFSCRYPT_CRYPTO_KEY_LEN);
+    return err;
 }
 
-int zfscrypt_dataset_unload_key(zfscrypt_dataset_t* self) {
-    return zfs_crypto_unload_key(self->handle);
-}
-
-int zfscrypt_dataset_change_key(zfscrypt_dataset_t* self) {
-    // libzfs does not provide an direct interface to change datasets keys,
-    // it always wants to read them from stdin itself.
-    int in_fds[2];
-    pipe(in_fds);
-    const pid_t pid = fork();
-    if (pid < 0) {
-        return -errno;
-    } else if (pid == 0) {
-        dup2(in_fds[0], STDIN_FILENO);
-        close(in_fds[0]);
-        close(in_fds[1]);
-        // zfs_crypto_rewrap(zfs_handle_t *zhp, nvlist_t *raw_props, boolean_t inheritkey)
-        exit(zfs_crypto_rewrap(self->handle, NULL, B_FALSE));
-    } else {
-        close(in_fds[0]);
-        write(in_fds[1], self->new_key, strlen(self->new_key));
-        close(in_fds[1]);
-        int rc;
-        const int pid2 = waitpid(pid, &rc, 0);
-        return pid2 < 0 ? -errno : -WEXITSTATUS(rc);
+int zfscrypt_dataset_derive_key(zfscrypt_dataset_t* self, const char* password, uint8_t* key) {
+    if (self->derived != NULL && password == self->key) {
+        memcpy(key, self->derived, ZFSCRYPT_CRYPTO_KEY_LEN);
+        return 0;
     }
+    if (zfscrypt_dataset_has_passphrase(self))
+        return zfscrypt_crypto_derive_key(password, zfs_prop_get_int(self->handle, ZFS_PROP_PBKDF2_SALT), zfs_prop_get_int(self->handle, ZFS_PROP_PBKDF2_ITERS), key);
+    const char* value = NULL;
+    zfscrypt_keywrap_t keywrap;
+    int err = -zfscrypt_dataset_properties_get_key(self, &value);
+    if (!err)
+        err = zfscrypt_keywrap_parse(&keywrap, value);
+    if (!err)
+        err = zfscrypt_keywrap_open(&keywrap, zfs_prop_get_int(self->handle, ZFS_PROP_GUID), password, key);
+    return err;
+}
+
+int zfscrypt_dataset_seal(zfscrypt_dataset_t* self) {
+    const char* name = zfs_get_name(self->handle);
+    char root[ZFS_MAXPROPLEN];
+    if (zfs_prop_get(self->handle, ZFS_PROP_ENCRYPTION_ROOT, root, sizeof(root), NULL, NULL, 0, B_TRUE) || strnq(root, name))
+        return EINVAL;
+    if (zfscrypt_dataset_has_sealed_key(self))
+        return EEXIST;
+    if (!zfscrypt_dataset_has_passphrase(self))
+        return EINVAL;
+    uint8_t* key = secure_malloc(ZFSCRYPT_CRYPTO_KEY_LEN);
+    uint8_t* raw_key = secure_malloc(ZFSCRYPT_CRYPTO_KEY_LEN);
+    nvlist_t* props = NULL;
+    zfscrypt_keywrap_t keywrap;
+    char value[ZFSCRYPT_KEYWRAP_MAX_LEN];
+    // a loaded key is only checked, change-key needs it loaded either way
+    const bool loaded = zfscrypt_dataset_key_loaded(self);
+    int err = key == NULL || raw_key == NULL ? ENOMEM : 0;
+    // the helpers report negative errno values, libzfs and libzfs_core positive ones
+    if (!err)
+        err = -zfscrypt_dataset_derive_key(self, self->key, key);
+    if (!err)
+        err = lzc_load_key(name, loaded, key, ZFSCRYPT_CRYPTO_KEY_LEN);
+    const bool load = !err && !loaded;
+    if (!err)
+        err = -zfscrypt_crypto_random_bytes(raw_key, ZFSCRYPT_CRYPTO_KEY_LEN);
+    if (!err)
+        err = -zfscrypt_keywrap_seal(&keywrap, self->context->kdf, self->context->kdf_cost, zfs_prop_get_int(self->handle, ZFS_PROP_GUID), self->key, raw_key);
+    if (!err)
+        zfscrypt_keywrap_format(&keywrap, value);
+    if (!err)
+        err = nvlist_alloc(&props, NV_UNIQUE_NAME, 0);
+    if (!err)
+        err = nvlist_add_uint64(props, zfs_prop_to_name(ZFS_PROP_KEYFORMAT), ZFS_KEYFORMAT_RAW);
+    if (!err)
+        err = nvlist_add_string(props, zfs_prop_to_name(ZFS_PROP_KEYLOCATION), "prompt");
+    // the sealed key is stored first, so a raw key is never set without a way to get it back
+    if (!err && zfs_prop_set(self->handle, ZFSCRYPT_KEY_PROPERTY, value))
+        err = libzfs_errno(self->context->libzfs);
+    if (!err) {
+        err = lzc_change_key(name, DCP_CMD_NEW_KEY, props, raw_key, ZFSCRYPT_CRYPTO_KEY_LEN);
+        if (err)
+            (void) zfs_prop_inherit(self->handle, ZFSCRYPT_KEY_PROPERTY, B_FALSE);
+    }
+    if (load)
+        (void) lzc_unload_key(name);
+    nvlist_free(props);
+    if (key != NULL)
+        secure_free(key, ZFSCRYPT_CRYPTO_KEY_LEN);
+    if (raw_key != NULL)
+        secure_free(raw_key, ZFSCRYPT_CRYPTO_KEY_LEN);
+    return err;
+}
+
+int zfscrypt_dataset_unload_key(zfscrypt_dataset_t* self) {
+    const uint64_t begin = zfscrypt_stats_now();
+    const int err = zfs_crypto_unload_key(self->handle);
+    zfscrypt_stats_add(&self->context->timings, ZFSCRYPT_STATS_UNLOAD_KEY, begin);
+    if (!err)
+        self->snapshot.key_loaded = false;
+    return err;
 }
 
 bool zfscrypt_dataset_mounted(zfscrypt_dataset_t* self) {
-    return zfs_is_mounted(self->handle, NULL);
+    zfscrypt_dataset_observe(self);
+    return self->snapshot.mounted;
 }
 
 int zfscrypt_dataset_mount(zfscrypt_dataset_t* self) {
     // zfs_mount(zfs_handle_t *zhp, const char *options, int flags)
-    const int err = zfs_mount(self->handle, NULL, 0);
-    return err < 0 ? libzfs_errno(self->context->libzfs) : 0;
+    zfscrypt_trace1(mount__entry, zfs_get_name(self->handle));
+    const uint64_t begin = zfscrypt_stats_now();
+    const int err = zfs_mount(self->handle, NULL, 0) < 0 ? libzfs_errno(self->context->libzfs) : 0;
+    zfscrypt_stats_add(&self->context->timings, ZFSCRYPT_STATS_MOUNT, begin);
+    if (!err)
+        self->snapshot.mounted = true;
+    zfscrypt_trace2(mount__return, zfs_get_name(self->handle), err);
+    return err;
+}
+
+int zfscrypt_dataset_sync(zfscrypt_dataset_t* self) {
+    defer(free_ptr) char* mountpoint = NULL;
+    if (!zfscrypt_dataset_mounted(self) || !zfs_is_mounted(self->handle, &mountpoint))
+        return 0;
+    const uint64_t begin = zfscrypt_stats_now();
+    const int err = sync_filesystem(mountpoint);
+    zfscrypt_stats_add(&self->context->timings, ZFSCRYPT_STATS_SYNC, begin);
+    if (err)
+        zfscrypt_context_log_err(self->context, zfscrypt_err_os(err, "Could not write back dataset"));
+    return err;
 }
 
 int zfscrypt_dataset_unmount(zfscrypt_dataset_t* self) {
     // zfs_unmount(zfs_handle_t *zhp, const char *mountpoint, int flags)
-    const int err = zfs_unmount(self->handle, NULL, 0);
-    return err < 0 ? libzfs_errno(self->context->libzfs) : 0;
+    zfscrypt_trace1(unmount__entry, zfs_get_name(self->handle));
+    const uint64_t begin = zfscrypt_stats_now();
+    const int err = zfs_unmount(self->handle, NULL, 0) < 0 ? libzfs_errno(self->context->libzfs) : 0;
+    zfscrypt_stats_add(&self->context->timings, ZFSCRYPT_STATS_UNMOUNT, begin);
+    if (!err)
+        self->snapshot.mounted = false;
+    zfscrypt_trace2(unmount__return, zfs_get_name(self->handle), err);
+    return err;
 }
 
 // private methods, validation
@@ -149,12 +364,27 @@ int zfscrypt_dataset_properties_get_user(zfscrypt_dataset_t* self, const char**
     return nvlist_lookup_string(prop, ZPROP_VALUE, (char**) user);
 }
 
+int zfscrypt_dataset_properties_get_key(zfscrypt_dataset_t* self, const char** value) {
+    nvlist_t* props = zfs_get_user_props(self->handle);
+    nvlist_t* prop = NULL;
+    const int err = nvlist_lookup_nvlist(props, ZFSCRYPT_KEY_PROPERTY, &prop);
+    if (err)
+        return err;
+    return nvlist_lookup_string(prop, ZPROP_VALUE, (char**) value);
+}
+
 bool zfscrypt_dataset_has_matching_user(zfscrypt_dataset_t* self) {
     const char* user = NULL;
     const int err = zfscrypt_dataset_properties_get_user(self, &user);
     return !err && streq(user, self->context->user);
 }
 
+bool zfscrypt_dataset_in_scope(zfscrypt_dataset_t* self) {
+    const char* name = zfs_get_name(self->handle);
+    const char* roots = self->context->roots;
+    return (*roots == '\0' || zfscrypt_policy_list_covers(roots, name)) && !zfscrypt_policy_list_covers(self->context->skip, name);
+}
+
 bool zfscrypt_dataset_has_mountpoint(zfscrypt_dataset_t* self) {
     char mountpoint[ZFS_MAXPROPLEN];
     const int err = zfs_prop_get(self->handle, ZFS_PROP_MOUNTPOINT, mountpoint, sizeof(mountpoint), NULL, NULL, 0, B_FALSE);
@@ -177,7 +407,16 @@ bool zfscrypt_dataset_does_prompt(zfscrypt_dataset_t* self) {
     // err = zfs_prop_get_numeric(zfs_handle, ZFS_PROP_KEYLOCATION, &keylocation, NULL, NULL, 0);
     char keylocation[ZFS_MAXPROPLEN];
     const int err = zfs_prop_get(self->handle, ZFS_PROP_KEYLOCATION, keylocation, sizeof(keylocation), NULL, NULL, 0, B_TRUE);
-    return !err && streq(keylocation, "prompt");
+    if (err)
+        return false;
+    if (streq(keylocation, "prompt"))
+        return true;
+    // children inheriting the key of their encryption root report none, the plan unlocks them with
+    // their root, an encryption root itself has to prompt
+    char root[ZFS_MAXPROPLEN];
+    return streq(keylocation, "none")
+        && !zfs_prop_get(self->handle, ZFS_PROP_ENCRYPTION_ROOT, root, sizeof(root), NULL, NULL, 0, B_TRUE)
+        && strnq(root, zfs_get_name(self->handle));
 }
 
 bool zfscrypt_dataset_has_passphrase(zfscrypt_dataset_t* self) {
@@ -185,8 +424,30 @@ bool zfscrypt_dataset_has_passphrase(zfscrypt_dataset_t* self) {
     return keyformat == ZFS_KEYFORMAT_PASSPHRASE;
 }
 
+bool zfscrypt_dataset_has_sealed_key(zfscrypt_dataset_t* self) {
+    const char* value = NULL;
+    const int keyformat = zfs_prop_get_int(self->handle, ZFS_PROP_KEYFORMAT);
+    return keyformat == ZFS_KEYFORMAT_RAW && !zfscrypt_dataset_properties_get_key(self, &value);
+}
+
+bool zfscrypt_dataset_is_lazy(zfscrypt_dataset_t* self) {
+    zfscrypt_dataset_observe(self);
+    return self->snapshot.lazy;
+}
+
 bool zfscrypt_dataset_valid(zfscrypt_dataset_t* self) {
-    return zfscrypt_dataset_has_matching_user(self) && zfscrypt_dataset_has_mountpoint(self) && zfscrypt_dataset_can_mount(self) && zfscrypt_dataset_is_encrypted(self) && zfscrypt_dataset_does_prompt(self) && zfscrypt_dataset_has_passphrase(self);
+    if (self->snapshot.validated)
+        return self->snapshot.valid;
+    const uint64_t begin = zfscrypt_stats_now();
+    // On big pools most datasets belong to someone else, so the user property goes first. Numeric
+    // properties come straight from the nvlist cached in the handle, mountpoint and keylocation
+    // have to be formatted as strings. The policy only compares names, so it goes before all of them.
+    const bool valid = zfscrypt_dataset_in_scope(self) && zfscrypt_dataset_has_matching_user(self) && zfscrypt_dataset_can_mount(self) && zfscrypt_dataset_is_encrypted(self) && (zfscrypt_dataset_has_passphrase(self) || zfscrypt_dataset_has_sealed_key(self)) && zfscrypt_dataset_has_mountpoint(self) && zfscrypt_dataset_does_prompt(self);
+    self->snapshot.valid = valid;
+    self->snapshot.validated = true;
+    zfscrypt_stats_add(&self->context->timings, ZFSCRYPT_STATS_VALIDATE, begin);
+    zfscrypt_trace3(dataset__valid, zfs_get_name(self->handle), self->context->user, valid);
+    return valid;
 }
 
 // private methods, iteration
@@ -194,24 +455,244 @@ bool zfscrypt_dataset_valid(zfscrypt_dataset_t* self) {
 int zfscrypt_dataset_filesystem_visitor(zfs_handle_t* handle, void* data) {
     zfscrypt_dataset_iter_t* iter = data;
     zfscrypt_dataset_t dataset = {.context = iter->context, .handle = handle, .key = iter->key, .new_key = iter->new_key};
-    if (zfscrypt_dataset_valid(&dataset)) {
-        const zfscrypt_err_t err = iter->callback(&dataset);
-        zfscrypt_context_log_err(iter->context, err);
+    const char* user = NULL;
+    bool keep = false;
+    if (!zfscrypt_dataset_properties_get_user(&dataset, &user)) {
+        (void) zfscrypt_index_add(&iter->index, user, zfs_get_name(handle));
+        keep = iter->context->user != NULL && zfscrypt_dataset_valid(&dataset);
     }
-    return zfs_iter_filesystems(handle, zfscrypt_dataset_filesystem_visitor, data);
+    // parents are collected before their children, so they get mounted first
+    if (keep && zfscrypt_dataset_iter_push(iter, &dataset))
+        keep = false;
+    const int err = zfs_iter_filesystems(handle, zfscrypt_dataset_filesystem_visitor, data);
+    if (!keep)
+        zfs_close(handle);
+    return err;
 }
 
 int zfscrypt_dataset_root_visitor(zfs_handle_t* handle, void* data) {
-    return zfs_iter_filesystems(handle, zfscrypt_dataset_filesystem_visitor, data);
+    const int err = zfs_iter_filesystems(handle, zfscrypt_dataset_filesystem_visitor, data);
+    zfs_close(handle);
+    return err;
+}
+
+int zfscrypt_dataset_program_visitor(zfs_handle_t* handle, void* data) {
+    zfscrypt_dataset_iter_t* iter = data;
+    zfscrypt_context_t* context = iter->context;
+    nvlist_t* found = NULL;
+    char message[256];
+    const int err = zfscrypt_program_discover(zfs_get_name(handle), ZFSCRYPT_USER_PROPERTY, context->user, &found, message, sizeof(message));
+    if (err) {
+        if (context->debug)
+            zfscrypt_context_log(context, LOG_DEBUG, "Channel program failed on %s: %s %s, walking pool", zfs_get_name(handle), strerror(err), message);
+        return zfscrypt_dataset_root_visitor(handle, data);
+    }
+    for (nvpair_t* pair = nvlist_next_nvpair(found, NULL); pair != NULL; pair = nvlist_next_nvpair(found, pair)) {
+        zfs_handle_t* child = zfs_open(context->libzfs, nvpair_name(pair), ZFS_TYPE_FILESYSTEM);
+        zfscrypt_dataset_t dataset = {.context = context, .handle = child, .key = iter->key, .new_key = iter->new_key};
+        if (child != NULL && (!zfscrypt_dataset_valid(&dataset) || zfscrypt_dataset_iter_push(iter, &dataset)))
+            zfs_close(child);
+    }
+    nvlist_free(found);
+    zfs_close(handle);
+    return 0;
+}
+
+int zfscrypt_dataset_iter_push(zfscrypt_dataset_iter_t* self, zfscrypt_dataset_t const* dataset) {
+    zfscrypt_dataset_t* grown = realloc(self->datasets, (self->len + 1) * sizeof(zfscrypt_dataset_t));
+    if (grown == NULL)
+        return -ENOMEM;
+    grown[self->len++] = *dataset;
+    self->datasets = grown;
+    return 0;
+}
+
+void zfscrypt_dataset_iter_free(zfscrypt_dataset_iter_t* self) {
+    for (size_t i = 0; i < self->len; ++i)
+        zfs_close(self->datasets[i].handle);
+    free(self->datasets);
+    self->datasets = NULL;
+    self->len = 0;
+    zfscrypt_index_free(&self->index);
+}
+
+zfscrypt_err_t zfscrypt_dataset_discover_cached(zfscrypt_dataset_iter_t* self) {
+    zfscrypt_context_t* context = self->context;
+    if (context->cache == NULL || context->cache->datasets == NULL)
+        return zfscrypt_err_os(ENOENT, "No datasets unlocked by this pam handle");
+    for (char** name = context->cache->datasets; *name != NULL; ++name) {
+        zfs_handle_t* handle = zfs_open(context->libzfs, *name, ZFS_TYPE_FILESYSTEM);
+        zfscrypt_dataset_t dataset = {.context = context, .handle = handle, .key = self->key, .new_key = self->new_key};
+        // a dataset destroyed or reassigned during the session has nothing left to lock
+        if (handle != NULL && (!zfscrypt_dataset_has_matching_user(&dataset) || zfscrypt_dataset_iter_push(self, &dataset)))
+            zfs_close(handle);
+    }
+    return zfscrypt_err_os(0, "Found datasets unlocked by this pam handle");
 }
 
-zfscrypt_err_t zfscrypt_dataset_iter(zfscrypt_context_t* context, const char* key, const char* new_key, zfscrypt_dataset_iter_f callback) {
-    zfscrypt_dataset_iter_t iter = {.context = context, .callback = callback, .key = key, .new_key = new_key};
-    const int err = zfs_iter_root(context->libzfs, zfscrypt_dataset_root_visitor, &iter);
+zfscrypt_err_t zfscrypt_dataset_discover_prepared(zfscrypt_dataset_iter_t* self) {
+    zfscrypt_context_t* context = self->context;
+    zfscrypt_prepare_t const* prepare = context->cache == NULL ? NULL : context->cache->prepare;
+    if (prepare == NULL || !prepare->joined || prepare->datasets == NULL)
+        return zfscrypt_err_os(ENOENT, "No datasets prepared by this pam handle");
+    for (char** name = prepare->datasets; *name != NULL; ++name) {
+        zfs_handle_t* handle = zfs_open(context->libzfs, *name, ZFS_TYPE_FILESYSTEM);
+        zfscrypt_dataset_t dataset = {.context = context, .handle = handle, .key = self->key, .new_key = self->new_key};
+        if (handle != NULL && (!zfscrypt_dataset_valid(&dataset) || zfscrypt_dataset_iter_push(self, &dataset)))
+            zfs_close(handle);
+    }
+    return zfscrypt_err_os(0, "Found datasets prepared by this pam handle");
+}
+
+zfscrypt_err_t zfscrypt_dataset_discover_indexed(zfscrypt_dataset_iter_t* self) {
+    zfscrypt_context_t* context = self->context;
+    defer(strv_free) char** names = NULL;
+    // the index is only readable by root
+    const bool dropped = context->privs.is_dropped;
+    if (dropped && zfscrypt_context_regain_privs(context).value)
+        return zfscrypt_err_os(EPERM, "Could not read dataset index");
+    const int err = zfscrypt_index_lookup(context->state_dir, context->user, &names);
+    if (dropped)
+        (void) zfscrypt_context_drop_privs(context);
+    if (err)
+        return zfscrypt_err_os(err, err == -ENOENT ? "User not found in dataset index" : "Could not read dataset index");
+    for (char** name = names; *name != NULL; ++name) {
+        zfs_handle_t* handle = zfs_open(context->libzfs, *name, ZFS_TYPE_FILESYSTEM);
+        zfscrypt_dataset_t dataset = {.context = context, .handle = handle, .key = self->key, .new_key = self->new_key};
+        // renamed, destroyed or reassigned since the index was written
+        if (handle == NULL || !zfscrypt_dataset_has_matching_user(&dataset)) {
+            if (handle != NULL)
+                zfs_close(handle);
+            zfscrypt_dataset_iter_free(self);
+            return zfscrypt_err_os(ESTALE, "Dataset index is stale");
+        }
+        if (!zfscrypt_dataset_valid(&dataset) || zfscrypt_dataset_iter_push(self, &dataset))
+            zfs_close(handle);
+    }
+    return zfscrypt_err_os(0, "Found datasets in index");
+}
+
+zfscrypt_err_t zfscrypt_dataset_discover_all(zfscrypt_dataset_iter_t* self) {
+    zfscrypt_context_t* context = self->context;
+    if (*context->roots != '\0')
+        return zfscrypt_dataset_discover_roots(self);
+    const bool walk = context->discovery == ZFSCRYPT_DISCOVERY_WALK;
+    // an update finished during the walk would be lost by writing it, a login never waits for other
+    // writers and leaves the index to them; fails while privileges are dropped, the index is then
+    // left to zfscrypt index-rebuild
+    defer(close_fd) int lock = walk ? zfscrypt_index_lock(context->state_dir, false) : -1;
+    const int err = zfs_iter_root(context->libzfs, walk ? zfscrypt_dataset_root_visitor : zfscrypt_dataset_program_visitor, self);
+    if (err)
+        return zfscrypt_err_zfs(err, "Could not iterate over all datasets");
+    // the channel program only reports datasets of one user, so only a walk can refresh the index
+    if (!walk)
+        return zfscrypt_err_zfs(err, "Ran discovery channel program on all pools");
+    const int index_err = lock < 0 ? lock : zfscrypt_index_write(&self->index, context->state_dir);
+    if (index_err && context->debug)
+        zfscrypt_context_log(context, LOG_DEBUG, "Could not refresh dataset index: %s", strerror(-index_err));
     return zfscrypt_err_zfs(err, "Iterated over all datasets");
 }
 
+zfscrypt_err_t zfscrypt_dataset_discover_roots(zfscrypt_dataset_iter_t* self) {
+    zfscrypt_context_t* context = self->context;
+    int err = 0;
+    for (const char* root = context->roots; !err && *root != '\0'; root += strlen(root) + 1) {
+        // a root below another root, or listed twice, would be walked twice
+        bool nested = false;
+        for (const char* other = context->roots; !nested && *other != '\0'; other += strlen(other) + 1)
+            nested = other != root && zfscrypt_policy_covers(other, root) && (strnq(other, root) || other < root);
+        zfs_handle_t* handle = nested ? NULL : zfs_open(context->libzfs, root, ZFS_TYPE_FILESYSTEM);
+        // a root missing on this host is not an error, the policy may be shared between hosts
+        if (handle != NULL)
+            err = zfscrypt_dataset_filesystem_visitor(handle, self);
+    }
+    return zfscrypt_err_zfs(err, err ? "Could not iterate over the roots of the policy" : "Iterated over the roots of the policy");
+}
+
+zfscrypt_err_t zfscrypt_dataset_iter(zfscrypt_context_t* context, const char* key, const char* new_key, zfscrypt_dataset_iter_f callback, void* data) {
+    zfscrypt_dataset_iter_t iter = {.context = context, .callback = callback, .key = key, .new_key = new_key, .datasets = NULL, .len = 0, .index = {NULL, NULL}};
+    zfscrypt_trace1(iter__entry, context->user);
+    const uint64_t begin = zfscrypt_stats_now();
+    zfscrypt_err_t err = zfscrypt_dataset_discover_cached(&iter);
+    if (err.value)
+        err = zfscrypt_dataset_discover_prepared(&iter);
+    if (err.value)
+        err = zfscrypt_dataset_discover_indexed(&iter);
+    if (err.value && context->debug)
+        zfscrypt_context_log(context, LOG_DEBUG, "%s: %s, walking all pools", err.message, err.description);
+    if (err.value)
+        err = zfscrypt_dataset_discover_all(&iter);
+    zfscrypt_stats_add(&context->timings, ZFSCRYPT_STATS_DISCOVER, begin);
+    zfscrypt_plan_t plan;
+    zfscrypt_context_log_err(context, zfscrypt_plan_build(&plan, context, iter.datasets, iter.len));
+    plan.data = data;
+    zfscrypt_plan_log(&plan, context);
+    // locking and unlocking only log failures of single roots, a key change fails as a whole
+    const zfscrypt_err_t callback_err = zfscrypt_context_log_err(context, callback(&plan));
+    if (!err.value)
+        err = callback_err;
+    zfscrypt_plan_free(&plan);
+    zfscrypt_trace3(iter__return, context->user, err.value, iter.len);
+    zfscrypt_dataset_iter_free(&iter);
+    return err;
+}
+
+zfscrypt_err_t zfscrypt_dataset_index_rebuild(zfscrypt_context_t* context) {
+    defer(close_fd) int lock = zfscrypt_index_lock(context->state_dir, true);
+    return lock < 0 ? zfscrypt_err_os(lock, "Could not lock dataset index") : zfscrypt_dataset_index_walk(context);
+}
+
+zfscrypt_err_t zfscrypt_dataset_index_walk(zfscrypt_context_t* context) {
+    zfscrypt_dataset_iter_t iter = {.context = context, .callback = NULL, .key = NULL, .new_key = NULL, .datasets = NULL, .len = 0, .index = {NULL, NULL}};
+    zfscrypt_err_t err = zfscrypt_err_zfs(zfs_iter_root(context->libzfs, zfscrypt_dataset_root_visitor, &iter), "Iterated over all datasets");
+    if (!err.value)
+        err = zfscrypt_err_os(zfscrypt_index_write(&iter.index, context->state_dir), "Wrote dataset index");
+    zfscrypt_dataset_iter_free(&iter);
+    return err;
+}
+
+zfscrypt_err_t zfscrypt_dataset_index_update(zfscrypt_context_t* context, const char* const* names, const size_t len) {
+    // zed runs zedlets concurrently, e.g. for zfs create -p, each reads the entries of the others
+    defer(close_fd) int lock = zfscrypt_index_lock(context->state_dir, true);
+    if (lock < 0)
+        return zfscrypt_err_os(lock, "Could not lock dataset index");
+    zfscrypt_index_t old = {.users = NULL, .datasets = NULL};
+    const int read_err = zfscrypt_index_read(&old, context->state_dir);
+    // without an index there is nothing to update, only a walk of all pools writes a complete one
+    if (read_err) {
+        zfscrypt_index_free(&old);
+        return zfscrypt_dataset_index_walk(context);
+    }
+    zfscrypt_dataset_iter_t iter = {.context = context, .callback = NULL, .key = NULL, .new_key = NULL, .datasets = NULL, .len = 0, .index = {NULL, NULL}};
+    int err = 0;
+    for (size_t i = 0; !err && i < zfscrypt_index_length(&old); ++i) {
+        bool changed = false;
+        for (size_t j = 0; !changed && j < len; ++j)
+            changed = zfscrypt_policy_covers(names[j], old.datasets[i]);
+        if (!changed)
+            err = zfscrypt_index_add(&iter.index, old.users[i], old.datasets[i]);
+    }
+    zfscrypt_index_free(&old);
+    for (size_t i = 0; !err && i < len; ++i) {
+        // a name below another one is walked along with it
+        bool covered = false;
+        for (size_t j = 0; !covered && j < len; ++j)
+            covered = j != i && zfscrypt_policy_covers(names[j], names[i]) && (strnq(names[i], names[j]) || j < i);
+        zfs_handle_t* handle = covered ? NULL : zfs_open(context->libzfs, names[i], ZFS_TYPE_FILESYSTEM);
+        // destroyed or renamed away, its entries are gone already
+        if (handle != NULL)
+            err = zfscrypt_dataset_filesystem_visitor(handle, &iter);
+    }
+    zfscrypt_err_t result = zfscrypt_err_zfs(err, "Could not walk the changed datasets");
+    if (!err)
+        result = zfscrypt_err_os(zfscrypt_index_write(&iter.index, context->state_dir), "Updated dataset index");
+    zfscrypt_dataset_iter_free(&iter);
+    return result;
+}
+
 // private constants
 
 const int zfscrypt_dataset_iter_error_len = 32;
 const char ZFSCRYPT_USER_PROPERTY[] = "io.github.benkerry:zfscrypt_user";
+const char ZFSCRYPT_MOUNT_PROPERTY[] = "io.github.benkerry:zfscrypt_mount";
+const char ZFSCRYPT_KEY_PROPERTY[] = "io.github.benkerry:zfscrypt_key";
@@ -39,7 +39,8 @@ zfscrypt_err_t zfscrypt_err_zfs_create(const int value, const char* message, con
     zfscrypt_err_t err = {
         .type = ZFSCRYPT_ERR_ZFS,
         .value = abs(value),
-        .description = libzfs_error_description((libzfs_handle_t*) &dummy),
+        // libzfs_core and the kernel report plain errno values, libzfs its own EZFS codes
+        .description = value != 0 && abs(value) < EZFS_NOMEM ? strerror(abs(value)) : libzfs_error_description((libzfs_handle_t*) &dummy),
         .message = message,
         .file = file,
         .line = line,
@@ -0,0 +1,132 @@
+#include "zfscrypt_index.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "zfscrypt_utils.h"
+
+// File format: a header line followed by one "<user>\t<dataset>\n" line per entry.
+// User names can not contain tabs or newlines and dataset names can not contain newlines.
+
+// public functions
+
+void zfscrypt_index_free(zfscrypt_index_t* self) {
+    strv_free(&self->users);
+    strv_free(&self->datasets);
+}
+
+int zfscrypt_index_add(zfscrypt_index_t* self, const char* user, const char* dataset) {
+    if (strpbrk(user, "\t\n") != NULL || strchr(dataset, '\n') != NULL)
+        return -EINVAL;
+    int err = strv_push(&self->users, user);
+    if (!err)
+        err = strv_push(&self->datasets, dataset);
+    return err;
+}
+
+size_t zfscrypt_index_length(zfscrypt_index_t const* self) {
+    return strv_length(self->datasets);
+}
+
+int zfscrypt_index_read(zfscrypt_index_t* self, const char* state_dir) {
+    defer(free_ptr) char* path = strfmt("%s/%s", state_dir, ZFSCRYPT_INDEX_FILE);
+    if (path == NULL)
+        return -ENOMEM;
+    defer(close_file) FILE* file = fopen(path, "re");
+    if (file == NULL)
+        return -errno;
+    defer(free_ptr) char* line = NULL;
+    size_t size = 0;
+    ssize_t len = getline(&line, &size, file);
+    if (len < 0 || strncmp(line, ZFSCRYPT_INDEX_HEADER, strlen(ZFSCRYPT_INDEX_HEADER)) != 0)
+        return -EBADMSG;
+    while ((len = getline(&line, &size, file)) > 0) {
+        if (line[len - 1] == '\n')
+            line[len - 1] = '\0';
+        char* dataset = strchr(line, '\t');
+        if (dataset == NULL)
+            return -EBADMSG;
+        *dataset++ = '\0';
+        const int err = zfscrypt_index_add(self, line, dataset);
+        if (err)
+            return err;
+    }
+    return ferror(file) ? -EIO : 0;
+}
+
+int zfscrypt_index_write(zfscrypt_index_t const* self, const char* state_dir) {
+    if (mkdir(state_dir, 0755) < 0 && errno != EEXIST)
+        return -errno;
+    defer(free_ptr) char* path = strfmt("%s/%s", state_dir, ZFSCRYPT_INDEX_FILE);
+    defer(free_ptr) char* tmp_path = strfmt("%s/.%s.XXXXXX", state_dir, ZFSCRYPT_INDEX_FILE);
+    if (path == NULL || tmp_path == NULL)
+        return -ENOMEM;
+    const int fd = mkstemp(tmp_path);
+    if (fd < 0)
+        return -errno;
+    defer(close_file) FILE* file = fdopen(fd, "w");
+    if (file == NULL) {
+        const int err = -errno;
+        close(fd);
+        unlink(tmp_path);
+        return err;
+    }
+    // tells who owns which dataset, so only root reads it
+    int err = fchmod(fd, 0600) < 0 ? -errno : 0;
+    if (!err && fprintf(file, "%s\n", ZFSCRYPT_INDEX_HEADER) < 0)
+        err = -EIO;
+    for (size_t i = 0; !err && i < zfscrypt_index_length(self); ++i)
+        if (fprintf(file, "%s\t%s\n", self->users[i], self->datasets[i]) < 0)
+            err = -EIO;
+    if (!err && (fflush(file) != 0 || fsync(fd) < 0))
+        err = -errno;
+    if (!err && rename(tmp_path, path) < 0)
+        err = -errno;
+    if (err)
+        unlink(tmp_path);
+    return err;
+}
+
+int zfscrypt_index_lock(const char* state_dir, const bool wait) {
+    if (mkdir(state_dir, 0755) < 0 && errno != EEXIST)
+        return -errno;
+    defer(free_ptr) char* path = strfmt("%s/%s", state_dir, ZFSCRYPT_INDEX_LOCK_FILE);
+    if (path == NULL)
+        return -ENOMEM;
+    const int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC | O_NOFOLLOW, 0600);
+    if (fd < 0)
+        return -errno;
+    while (flock(fd, wait ? LOCK_EX : LOCK_EX | LOCK_NB) < 0) {
+        if (errno == EINTR)
+            continue;
+        const int err = -errno;
+        close(fd);
+        return err;
+    }
+    return fd;
+}
+
+int zfscrypt_index_lookup(const char* state_dir, const char* user, char*** datasets) {
+    zfscrypt_index_t index = {.users = NULL, .datasets = NULL};
+    int err = zfscrypt_index_read(&index, state_dir);
+    for (size_t i = 0; !err && i < zfscrypt_index_length(&index); ++i)
+        if (streq(index.users[i], user))
+            err = strv_push(datasets, index.datasets[i]);
+    // an entry may have been lost or not be written yet, only a walk tells that the user has no datasets
+    if (!err && *datasets == NULL)
+        err = -ENOENT;
+    zfscrypt_index_free(&index);
+    return err;
+}
+
+// private constants
+
+const char ZFSCRYPT_INDEX_FILE[] = "index";
+const char ZFSCRYPT_INDEX_LOCK_FILE[] = "index.lock";
+const char ZFSCRYPT_INDEX_HEADER[] = "# zfscrypt index v1";
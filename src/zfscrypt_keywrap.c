@@ -0,0 +1,130 @@
+#include "zfscrypt_keywrap.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "zfscrypt_utils.h"
+
+// public functions
+
+int zfscrypt_keywrap_parse(zfscrypt_keywrap_t* self, const char* value) {
+    const char* fields[6];
+    size_t lens[6];
+    size_t len = 0;
+    for (const char* field = value; field != NULL; ++len) {
+        // a seventh field is as malformed as a missing one
+        if (len == 6)
+            return -EINVAL;
+        const char* end = strchr(field, '$');
+        fields[len] = field;
+        lens[len] = end == NULL ? strlen(field) : (size_t) (end - field);
+        field = end == NULL ? NULL : end + 1;
+    }
+    if (len != 6 || lens[0] != 1 || fields[0][0] != '1')
+        return -EINVAL;
+    char kdf[16];
+    if (lens[1] >= sizeof(kdf))
+        return -EINVAL;
+    memcpy(kdf, fields[1], lens[1]);
+    kdf[lens[1]] = '\0';
+    char* end = NULL;
+    self->cost = strtoull(fields[2], &end, 10);
+    if (zfscrypt_keywrap_kdf_parse(kdf, &self->kdf) || end != fields[2] + lens[2] || lens[2] == 0)
+        return -EINVAL;
+    if (zfscrypt_keywrap_hex_decode(fields[3], lens[3], self->salt, sizeof(self->salt))
+        || zfscrypt_keywrap_hex_decode(fields[4], lens[4], self->nonce, sizeof(self->nonce))
+        || zfscrypt_keywrap_hex_decode(fields[5], lens[5], self->sealed, sizeof(self->sealed)))
+        return -EINVAL;
+    return 0;
+}
+
+void zfscrypt_keywrap_format(zfscrypt_keywrap_t const* self, char* value) {
+    const int len = snprintf(value, ZFSCRYPT_KEYWRAP_MAX_LEN, "1$%s$%" PRIu64 "$", ZFSCRYPT_CRYPTO_KDF_NAMES[self->kdf], self->cost);
+    char* hex = &value[len];
+    zfscrypt_keywrap_hex_encode(self->salt, sizeof(self->salt), hex);
+    hex += 2 * sizeof(self->salt);
+    *hex++ = '$';
+    zfscrypt_keywrap_hex_encode(self->nonce, sizeof(self->nonce), hex);
+    hex += 2 * sizeof(self->nonce);
+    *hex++ = '$';
+    zfscrypt_keywrap_hex_encode(self->sealed, sizeof(self->sealed), hex);
+}
+
+int zfscrypt_keywrap_seal(zfscrypt_keywrap_t* self, const zfscrypt_crypto_kdf_t kdf, const uint64_t cost, const uint64_t guid, const char* password, const uint8_t* key) {
+    uint8_t* sealing_key = secure_malloc(ZFSCRYPT_CRYPTO_KEY_LEN);
+    if (sealing_key == NULL)
+        return -ENOMEM;
+    self->kdf = kdf;
+    self->cost = cost == 0 ? ZFSCRYPT_KEYWRAP_DEFAULT_COST[kdf] : cost;
+    int err = zfscrypt_crypto_random_bytes(self->salt, sizeof(self->salt));
+    // a nonce is never used twice with the same sealing key, because every seal has a fresh salt
+    if (!err)
+        err = zfscrypt_crypto_random_bytes(self->nonce, sizeof(self->nonce));
+    if (!err)
+        err = zfscrypt_crypto_kdf(self->kdf, self->cost, password, self->salt, sealing_key);
+    uint8_t aad[sizeof(guid)];
+    zfscrypt_keywrap_aad(guid, aad);
+    if (!err)
+        err = zfscrypt_crypto_seal(sealing_key, self->nonce, aad, sizeof(aad), key, self->sealed);
+    secure_free(sealing_key, ZFSCRYPT_CRYPTO_KEY_LEN);
+    return err;
+}
+
+int zfscrypt_keywrap_open(zfscrypt_keywrap_t const* self, const uint64_t guid, const char* password, uint8_t* key) {
+    uint8_t* sealing_key = secure_malloc(ZFSCRYPT_CRYPTO_KEY_LEN);
+    if (sealing_key == NULL)
+        return -ENOMEM;
+    int err = zfscrypt_crypto_kdf(self->kdf, self->cost, password, self->salt, sealing_key);
+    uint8_t aad[sizeof(guid)];
+    zfscrypt_keywrap_aad(guid, aad);
+    if (!err)
+        err = zfscrypt_crypto_open(sealing_key, self->nonce, aad, sizeof(aad), self->sealed, key);
+    secure_free(sealing_key, ZFSCRYPT_CRYPTO_KEY_LEN);
+    return err;
+}
+
+int zfscrypt_keywrap_kdf_parse(const char* name, zfscrypt_crypto_kdf_t* kdf) {
+    for (size_t i = 0; i < sizeof(ZFSCRYPT_CRYPTO_KDF_NAMES) / sizeof(ZFSCRYPT_CRYPTO_KDF_NAMES[0]); ++i) {
+        if (streq(name, ZFSCRYPT_CRYPTO_KDF_NAMES[i])) {
+            *kdf = (zfscrypt_crypto_kdf_t) i;
+            return 0;
+        }
+    }
+    return -EINVAL;
+}
+
+// private functions
+
+int zfscrypt_keywrap_hex_decode(const char* hex, const size_t hex_len, uint8_t* bytes, const size_t len) {
+    if (hex_len != 2 * len)
+        return -EINVAL;
+    for (size_t i = 0; i < hex_len; ++i) {
+        const char c = hex[i];
+        const int nibble = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+        if (nibble < 0)
+            return -EINVAL;
+        bytes[i / 2] = i % 2 == 0 ? (uint8_t) (nibble << 4) : (uint8_t) (bytes[i / 2] | nibble);
+    }
+    return 0;
+}
+
+void zfscrypt_keywrap_hex_encode(const uint8_t* bytes, const size_t len, char* hex) {
+    static const char digits[] = "0123456789abcdef";
+    for (size_t i = 0; i < len; ++i) {
+        hex[2 * i] = digits[bytes[i] >> 4];
+        hex[2 * i + 1] = digits[bytes[i] & 0xf];
+    }
+    hex[2 * len] = '\0';
+}
+
+void zfscrypt_keywrap_aad(const uint64_t guid, uint8_t* aad) {
+    for (size_t i = 0; i < sizeof(guid); ++i)
+        aad[i] = (uint8_t) (guid >> (8 * (sizeof(guid) - 1 - i)));
+}
+
+// private constants
+
+const uint64_t ZFSCRYPT_KEYWRAP_DEFAULT_COST[2] = {210000, 15};
@@ -0,0 +1,117 @@
+#include "zfscrypt_lazy.h"
+
+#include <errno.h>
+#include <libzfs_core.h>
+#include <linux/keyctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "zfscrypt_crypto.h"
+#include "zfscrypt_utils.h"
+
+// Note: the persistent keyring is used because it survives the end of the PAM call and root
+// may access it for any uid, the session keyring of the user would not be reachable by the unit.
+// The keyring itself lives for days, so every key gets a timeout of its own and is removed as soon
+// as zfs has it.
+
+// public functions
+
+int zfscrypt_lazy_store_key(zfscrypt_dataset_t* root, const uid_t uid) {
+    const long keyring = zfscrypt_lazy_keyring(uid);
+    if (keyring < 0)
+        return keyring;
+    defer(free_ptr) char* description = strfmt("%s%s", ZFSCRYPT_LAZY_KEY_PREFIX, zfs_get_name(root->handle));
+    uint8_t* key = secure_malloc(ZFSCRYPT_CRYPTO_KEY_LEN);
+    if (description == NULL || key == NULL) {
+        if (key != NULL)
+            secure_free(key, ZFSCRYPT_CRYPTO_KEY_LEN);
+        return -ENOMEM;
+    }
+    int err = zfscrypt_dataset_derive_key(root, root->key, key);
+    const long id = err ? -1 : syscall(SYS_add_key, "user", description, key, ZFSCRYPT_CRYPTO_KEY_LEN, keyring);
+    if (!err && id < 0)
+        err = -errno;
+    secure_free(key, ZFSCRYPT_CRYPTO_KEY_LEN);
+    if (!err && syscall(SYS_keyctl, KEYCTL_SET_TIMEOUT, id, ZFSCRYPT_LAZY_KEY_TIMEOUT) < 0) {
+        err = -errno;
+        (void) syscall(SYS_keyctl, KEYCTL_INVALIDATE, id);
+    }
+    return err;
+}
+
+int zfscrypt_lazy_load_key(zfscrypt_dataset_t* root, const uid_t uid) {
+    const long id = zfscrypt_lazy_find_key(root, uid);
+    if (id < 0)
+        return id;
+    uint8_t* key = secure_malloc(ZFSCRYPT_CRYPTO_KEY_LEN);
+    if (key == NULL)
+        return -ENOMEM;
+    const long len = syscall(SYS_keyctl, KEYCTL_READ, id, key, ZFSCRYPT_CRYPTO_KEY_LEN);
+    int err = len < 0 ? -errno : 0;
+    if (!err && len != ZFSCRYPT_CRYPTO_KEY_LEN)
+        err = -EKEYREJECTED;
+    if (!err)
+        err = lzc_load_key(zfs_get_name(root->handle), B_FALSE, key, ZFSCRYPT_CRYPTO_KEY_LEN);
+    secure_free(key, ZFSCRYPT_CRYPTO_KEY_LEN);
+    // zfs keeps the key until logout, the copy in the keyring is of no use anymore
+    if (!err)
+        (void) syscall(SYS_keyctl, KEYCTL_INVALIDATE, id);
+    return err;
+}
+
+int zfscrypt_lazy_forget_key(zfscrypt_dataset_t* root, const uid_t uid) {
+    const long id = zfscrypt_lazy_find_key(root, uid);
+    if (id < 0)
+        return id == -ENOKEY || id == -EKEYEXPIRED ? 0 : id;
+    return syscall(SYS_keyctl, KEYCTL_INVALIDATE, id) < 0 ? -errno : 0;
+}
+
+int zfscrypt_lazy_arm(zfscrypt_dataset_t* dataset) {
+    char mountpoint[ZFS_MAXPROPLEN];
+    if (zfs_prop_get(dataset->handle, ZFS_PROP_MOUNTPOINT, mountpoint, sizeof(mountpoint), NULL, NULL, 0, B_FALSE))
+        return -EINVAL;
+    defer(free_ptr) char* instance = systemd_escape(zfs_get_name(dataset->handle));
+    defer(free_ptr) char* requires = instance == NULL ? NULL : strfmt("--property=Requires=%s@%s.service", ZFSCRYPT_LAZY_LOAD_KEY_UNIT, instance);
+    defer(free_ptr) char* after = instance == NULL ? NULL : strfmt("--property=After=%s@%s.service", ZFSCRYPT_LAZY_LOAD_KEY_UNIT, instance);
+    if (requires == NULL || after == NULL)
+        return -ENOMEM;
+    char* const argv[] = {
+        "systemd-mount", "--no-block", "--automount=yes", "--collect", "--type=zfs", "--options=zfsutil",
+        requires, after, (char*) zfs_get_name(dataset->handle), mountpoint, NULL};
+    const int status = run_command(argv);
+    return status > 0 ? -ECHILD : status;
+}
+
+int zfscrypt_lazy_disarm(zfscrypt_dataset_t* dataset) {
+    char mountpoint[ZFS_MAXPROPLEN];
+    if (zfs_prop_get(dataset->handle, ZFS_PROP_MOUNTPOINT, mountpoint, sizeof(mountpoint), NULL, NULL, 0, B_FALSE))
+        return -EINVAL;
+    char* const argv[] = {"systemd-mount", "--umount", mountpoint, NULL};
+    const int status = run_command(argv);
+    return status > 0 ? -ECHILD : status;
+}
+
+// private functions
+
+long zfscrypt_lazy_keyring(const uid_t uid) {
+    // links the keyring into the keyring of this process, which keeps it possessed and thus readable
+    const long keyring = syscall(SYS_keyctl, KEYCTL_GET_PERSISTENT, uid, KEY_SPEC_PROCESS_KEYRING);
+    return keyring < 0 ? -errno : keyring;
+}
+
+long zfscrypt_lazy_find_key(zfscrypt_dataset_t* root, const uid_t uid) {
+    const long keyring = zfscrypt_lazy_keyring(uid);
+    if (keyring < 0)
+        return keyring;
+    defer(free_ptr) char* description = strfmt("%s%s", ZFSCRYPT_LAZY_KEY_PREFIX, zfs_get_name(root->handle));
+    if (description == NULL)
+        return -ENOMEM;
+    const long id = syscall(SYS_keyctl, KEYCTL_SEARCH, keyring, "user", description, 0);
+    return id < 0 ? -errno : id;
+}
+
+// private constants
+
+const char ZFSCRYPT_LAZY_KEY_PREFIX[] = "zfscrypt:";
+const char ZFSCRYPT_LAZY_LOAD_KEY_UNIT[] = "zfscrypt-load-key";
+const unsigned ZFSCRYPT_LAZY_KEY_TIMEOUT = 43200;
@@ -0,0 +1,53 @@
+#include "zfscrypt_linger.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "zfscrypt_crypto.h"
+#include "zfscrypt_session.h"
+#include "zfscrypt_utils.h"
+
+// public functions
+
+zfscrypt_err_t zfscrypt_linger_schedule(zfscrypt_context_t* context) {
+    const uint64_t deadline = zfscrypt_linger_now() + context->linger;
+    zfscrypt_err_t err = zfscrypt_session_linger(context->runtime_dir, context->uid, deadline);
+    if (err.value)
+        return err;
+    // timers of earlier logouts expire without effect, the random suffix keeps logouts within the same second apart
+    uint64_t nonce = 0;
+    (void) zfscrypt_crypto_random_salt(&nonce);
+    defer(free_ptr) char* unit = strfmt("--unit=%s%u-%lu-%016lx", ZFSCRYPT_LINGER_UNIT_PREFIX, (unsigned) context->uid, (unsigned long) deadline, (unsigned long) nonce);
+    defer(free_ptr) char* on_active = strfmt("--on-active=%u", context->linger);
+    defer(free_ptr) char* argument = strfmt("%lu", (unsigned long) deadline);
+    const char* fixed[] = {"systemd-run", "--quiet", "--collect", "--timer-property=AccuracySec=1s", unit, on_active, "zfscrypt", "linger-expire", context->user, argument};
+    const size_t len = sizeof(fixed) / sizeof(fixed[0]);
+    // the timer locks with the options of the module, e.g. runtime_dir and drop_caches
+    const char* argv[len + context->argc + 1];
+    for (size_t i = 0; i < len; ++i)
+        argv[i] = fixed[i];
+    for (int i = 0; i < context->argc; ++i)
+        argv[len + i] = context->argv[i];
+    argv[len + context->argc] = NULL;
+    const int status = unit == NULL || on_active == NULL || argument == NULL ? -ENOMEM : run_command((char* const*) argv);
+    if (!status)
+        return zfscrypt_err_os(0, "Scheduled lock after linger window");
+    // without the timer nobody would lock, unless a new session took over in the meantime
+    bool cancelled = false;
+    (void) zfscrypt_session_linger_cancel(&cancelled, context->runtime_dir, context->uid);
+    return zfscrypt_err_os(cancelled ? (status > 0 ? ECHILD : status) : 0, cancelled ? "Could not start linger timer" : "Session opened while starting linger timer");
+}
+
+// private functions
+
+uint64_t zfscrypt_linger_now(void) {
+    // the timer decides when to lock, the deadline identifies it and tells zfscrypt status the time left
+    struct timespec now;
+    clock_gettime(CLOCK_BOOTTIME, &now);
+    return now.tv_sec;
+}
+
+// private constants
+
+const char ZFSCRYPT_LINGER_UNIT_PREFIX[] = "zfscrypt-linger-";
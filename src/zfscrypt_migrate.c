@@ -0,0 +1,196 @@
+#include "zfscrypt_migrate.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libzfs_core.h>
+#include <pwd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "zfscrypt_crypto.h"
+#include "zfscrypt_provision.h"
+#include "zfscrypt_session.h"
+#include "zfscrypt_utils.h"
+
+// public functions
+
+zfscrypt_err_t zfscrypt_migrate_init(zfscrypt_migrate_t* self, zfscrypt_context_t* context, const char* name) {
+    *self = (zfscrypt_migrate_t) {
+        .context = context,
+        .name = name,
+        .home = NULL,
+        .staging = NULL,
+        .backup = NULL,
+        .gid = -1,
+        .dataset = {.context = context, .handle = NULL, .key = NULL, .new_key = NULL}};
+    struct passwd const* const entry = context->user == NULL ? NULL : getpwnam(context->user);
+    if (entry == NULL)
+        return zfscrypt_err_os(ENOENT, "Unknown user");
+    self->gid = entry->pw_gid;
+    self->home = strdup(entry->pw_dir);
+    self->staging = strfmt("%s%s", entry->pw_dir, ZFSCRYPT_MIGRATE_STAGING_SUFFIX);
+    self->backup = strfmt("%s%s", entry->pw_dir, ZFSCRYPT_MIGRATE_BACKUP_SUFFIX);
+    if (self->home == NULL || self->staging == NULL || self->backup == NULL)
+        return zfscrypt_err_os(ENOMEM, "Memory allocation failed");
+    // a dataset created by an earlier copy is picked up again
+    if (!zfs_dataset_exists(context->libzfs, name, ZFS_TYPE_FILESYSTEM))
+        return zfscrypt_err_os(0, "Dataset will be created");
+    self->dataset.handle = zfs_open(context->libzfs, name, ZFS_TYPE_FILESYSTEM);
+    if (self->dataset.handle == NULL)
+        return zfscrypt_err_zfs(libzfs_errno(context->libzfs), "Could not open dataset");
+    const char* user = NULL;
+    if (!zfscrypt_dataset_properties_get_user(&self->dataset, &user))
+        return zfscrypt_err_os(EEXIST, "Dataset belongs to a zfscrypt user already");
+    if (!zfscrypt_dataset_is_encrypted(&self->dataset) || !zfscrypt_dataset_has_passphrase(&self->dataset) || !zfscrypt_dataset_does_prompt(&self->dataset) || !zfscrypt_dataset_can_mount(&self->dataset))
+        return zfscrypt_err_os(EINVAL, "Dataset is not encrypted with a passphrase");
+    return zfscrypt_err_os(0, "Opened dataset");
+}
+
+bool zfscrypt_migrate_locked(zfscrypt_migrate_t* self) {
+    return self->dataset.handle == NULL || !zfscrypt_dataset_key_loaded(&self->dataset);
+}
+
+zfscrypt_err_t zfscrypt_migrate_unlock(zfscrypt_migrate_t* self, const char* password) {
+    zfscrypt_context_t* context = self->context;
+    if (zfscrypt_migrate_locked(self) && password == NULL)
+        return zfscrypt_err_os(ENOKEY, "Password needed");
+    int err = 0;
+    if (self->dataset.handle == NULL) {
+        err = zfscrypt_migrate_create(self, password);
+        if (!err && (self->dataset.handle = zfs_open(context->libzfs, self->name, ZFS_TYPE_FILESYSTEM)) == NULL)
+            err = libzfs_errno(context->libzfs);
+        zfscrypt_provision_user_t user = {.user = (char*) context->user, .uid = context->uid, .gid = self->gid};
+        if (!err)
+            err = zfscrypt_provision_allow(context, self->dataset.handle, &user);
+    } else if (!zfscrypt_dataset_key_loaded(&self->dataset)) {
+        self->dataset.key = password;
+        err = zfscrypt_dataset_load_key(&self->dataset);
+        self->dataset.key = NULL;
+    }
+    if (!err && !zfscrypt_dataset_mounted(&self->dataset))
+        err = zfscrypt_dataset_mount(&self->dataset);
+    return zfscrypt_err_zfs(err, "Unlocked dataset next to home");
+}
+
+zfscrypt_err_t zfscrypt_migrate_copy(zfscrypt_migrate_t* self, zfscrypt_copy_progress_f progress) {
+    const int err = zfscrypt_migrate_seal_staging(self);
+    if (err)
+        return zfscrypt_err_os(err, "Could not restrict the staging directory to root");
+    return zfscrypt_copy_tree(self->context, self->home, self->staging, self->context->workers, false, progress);
+}
+
+zfscrypt_err_t zfscrypt_migrate_cutover(zfscrypt_migrate_t* self, zfscrypt_copy_progress_f progress) {
+    zfscrypt_context_t* context = self->context;
+    // counts as a session of the user while it runs, which keeps the slot and its state in place
+    int count = 0;
+    zfscrypt_err_t err = zfscrypt_session_counter_update(&count, context->runtime_dir, context->uid, +1);
+    if (err.value)
+        return err;
+    uint64_t state = 0;
+    // anything written after the last copy would be lost
+    if (count > 1)
+        err = zfscrypt_err_os(EBUSY, "User has open sessions");
+    if (!err.value)
+        err = zfscrypt_session_state_get(&state, context->runtime_dir, context->uid);
+    const int sealed = err.value ? 0 : zfscrypt_migrate_seal_staging(self);
+    if (sealed)
+        err = zfscrypt_err_os(sealed, "Could not restrict the staging directory to root");
+    // the staging root gets the owner and mode of the home only now, right before it replaces it
+    if (!err.value)
+        err = zfscrypt_copy_tree(context, self->home, self->staging, context->workers, true, progress);
+    // a login during the copy, even one that ended again, may have written into the old home
+    uint64_t copied = 0;
+    if (!err.value)
+        err = zfscrypt_session_state_get(&copied, context->runtime_dir, context->uid);
+    if (!err.value && copied != state)
+        err = zfscrypt_err_os(EBUSY, "User logged in during the cutover, run it again");
+    int status = 0;
+    if (!err.value)
+        status = zfscrypt_migrate_adopt(self);
+    if (!err.value && !status)
+        status = zfscrypt_migrate_swap(self);
+    (void) zfscrypt_session_counter_update(&count, context->runtime_dir, context->uid, -1);
+    return err.value ? err : zfscrypt_err_zfs(status, "Moved home into dataset");
+}
+
+void zfscrypt_migrate_free(zfscrypt_migrate_t* self) {
+    if (self->dataset.handle != NULL)
+        zfs_close(self->dataset.handle);
+    self->dataset.handle = NULL;
+    free(self->home);
+    free(self->staging);
+    free(self->backup);
+}
+
+// private methods
+
+int zfscrypt_migrate_create(zfscrypt_migrate_t* self, const char* password) {
+    uint8_t* key = secure_malloc(ZFSCRYPT_CRYPTO_KEY_LEN);
+    if (key == NULL)
+        return -ENOMEM;
+    nvlist_t* props = NULL;
+    uint64_t salt = 0;
+    int err = zfscrypt_crypto_random_salt(&salt);
+    if (!err)
+        err = zfscrypt_crypto_derive_key(password, salt, ZFSCRYPT_PROVISION_ITERATIONS, key);
+    if (!err)
+        err = nvlist_alloc(&props, NV_UNIQUE_NAME, 0);
+    if (!err)
+        err = nvlist_add_string(props, zfs_prop_to_name(ZFS_PROP_MOUNTPOINT), self->staging);
+    if (!err)
+        err = nvlist_add_uint64(props, zfs_prop_to_name(ZFS_PROP_CANMOUNT), ZFS_CANMOUNT_NOAUTO);
+    if (!err)
+        err = nvlist_add_uint64(props, zfs_prop_to_name(ZFS_PROP_ENCRYPTION), ZIO_CRYPT_AES_256_GCM);
+    if (!err)
+        err = zfscrypt_provision_key_props(props, salt);
+    if (!err)
+        err = lzc_create(self->name, LZC_DATSET_TYPE_ZFS, props, key, ZFSCRYPT_CRYPTO_KEY_LEN);
+    nvlist_free(props);
+    secure_free(key, ZFSCRYPT_CRYPTO_KEY_LEN);
+    return err;
+}
+
+int zfscrypt_migrate_seal_staging(zfscrypt_migrate_t* self) {
+    defer(close_fd) int fd = open(self->staging, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0)
+        return -errno;
+    if (fchown(fd, 0, 0) < 0 || fchmod(fd, 0700) < 0)
+        return -errno;
+    return 0;
+}
+
+int zfscrypt_migrate_adopt(zfscrypt_migrate_t* self) {
+    if (zfs_prop_set(self->dataset.handle, ZFSCRYPT_USER_PROPERTY, self->context->user))
+        return libzfs_errno(self->context->libzfs);
+    self->dataset.snapshot.validated = false;
+    if (zfscrypt_dataset_valid(&self->dataset))
+        return 0;
+    (void) zfs_prop_inherit(self->dataset.handle, ZFSCRYPT_USER_PROPERTY, B_FALSE);
+    return -EINVAL;
+}
+
+int zfscrypt_migrate_swap(zfscrypt_migrate_t* self) {
+    // unmounted first, so changing the mountpoint doesn't mount it at the home right away
+    int err = zfscrypt_dataset_unmount(&self->dataset);
+    if (!err && rename(self->home, self->backup) < 0)
+        err = -errno;
+    if (!err && zfs_prop_set(self->dataset.handle, zfs_prop_to_name(ZFS_PROP_MOUNTPOINT), self->home)) {
+        err = libzfs_errno(self->context->libzfs);
+        (void) rename(self->backup, self->home);
+    }
+    if (err) {
+        (void) zfs_prop_inherit(self->dataset.handle, ZFSCRYPT_USER_PROPERTY, B_FALSE);
+        return err;
+    }
+    (void) rmdir(self->staging);
+    // locked like after a logout, the next login mounts the dataset at the home
+    return zfscrypt_dataset_unload_key(&self->dataset);
+}
+
+// private constants
+
+const char ZFSCRYPT_MIGRATE_STAGING_SUFFIX[] = ".zfscrypt";
+const char ZFSCRYPT_MIGRATE_BACKUP_SUFFIX[] = ".premigrate";
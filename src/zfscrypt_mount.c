@@ -0,0 +1,193 @@
+#include "zfscrypt_mount.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "zfscrypt_lazy.h"
+#include "zfscrypt_utils.h"
+
+// Note: mounting and unmounting on several threads shares the libzfs handle of the context, like
+// zfs mount -a does. libzfs guards its mount table cache for that, only libzfs_errno may report the
+// error of another thread. Everything else the workers need is observed on the calling thread first.
+
+// public functions
+
+void zfscrypt_mount_plan(zfscrypt_plan_t* plan) {
+    zfscrypt_mount_t self;
+    if (zfscrypt_mount_begin(&self, plan))
+        return;
+    bool done[plan->len == 0 ? 1 : plan->len];
+    for (size_t i = 0; i < plan->len; ++i)
+        done[i] = true;
+    zfscrypt_mount_ready(&self, done);
+    zfscrypt_mount_end(&self);
+}
+
+int zfscrypt_mount_begin(zfscrypt_mount_t* self, zfscrypt_plan_t* plan) {
+    *self = (zfscrypt_mount_t) {.plan = plan, .mutex = PTHREAD_MUTEX_INITIALIZER, .entries = NULL, .len = 0, .next = 0, .end = 0};
+    const int err = zfscrypt_context_log_err(plan->context, zfscrypt_err_os(zfscrypt_mount_collect(self, true), "Collected datasets to mount")).value;
+    if (err)
+        zfscrypt_mount_free(self);
+    return err;
+}
+
+void zfscrypt_mount_ready(zfscrypt_mount_t* self, const bool* done) {
+    zfscrypt_plan_t* plan = self->plan;
+    // mountpoints still waiting for the key of their encryption root
+    size_t waiting[self->len == 0 ? 1 : self->len];
+    size_t waiting_len = 0;
+    for (size_t i = 0; i < self->len; ++i)
+        if (self->entries[i].state == ZFSCRYPT_MOUNT_PENDING && !done[self->entries[i].group])
+            waiting[waiting_len++] = i;
+    zfs_handle_t* handles[self->len == 0 ? 1 : self->len];
+    size_t len = 0;
+    for (size_t i = 0; i < self->len; ++i) {
+        zfscrypt_mount_entry_t* entry = &self->entries[i];
+        if (entry->state != ZFSCRYPT_MOUNT_PENDING || !done[entry->group])
+            continue;
+        if (!plan->groups[entry->group].ready) {
+            entry->state = ZFSCRYPT_MOUNT_SKIPPED;
+            continue;
+        }
+        // mounting now would hide the dataset mounted above it later
+        bool blocked = false;
+        for (size_t j = 0; !blocked && j < waiting_len; ++j)
+            blocked = zfscrypt_mount_contains(self->entries[waiting[j]].mountpoint, entry->mountpoint);
+        if (blocked)
+            continue;
+        entry->state = ZFSCRYPT_MOUNT_MOUNTED;
+        if (!zfscrypt_dataset_is_lazy(entry->dataset))
+            handles[len++] = entry->dataset->handle;
+    }
+    if (len > 0)
+        zfs_foreach_mountpoint(plan->context->libzfs, handles, len, zfscrypt_mount_one, self, plan->context->workers > 0 ? B_TRUE : B_FALSE);
+}
+
+void zfscrypt_mount_end(zfscrypt_mount_t* self) {
+    // an automount below a dataset mounted afterwards would be hidden by it
+    for (size_t i = 0; i < self->len; ++i) {
+        zfscrypt_dataset_t* dataset = self->entries[i].dataset;
+        if (self->entries[i].state == ZFSCRYPT_MOUNT_MOUNTED && zfscrypt_dataset_is_lazy(dataset))
+            zfscrypt_context_log_err(dataset->context, zfscrypt_err_os(zfscrypt_lazy_arm(dataset), "Could not create automount"));
+    }
+    zfscrypt_mount_free(self);
+}
+
+void zfscrypt_mount_release_plan(zfscrypt_plan_t* plan, const unsigned workers) {
+    zfscrypt_mount_t self = {.plan = plan, .mutex = PTHREAD_MUTEX_INITIALIZER};
+    if (zfscrypt_context_log_err(plan->context, zfscrypt_err_os(zfscrypt_mount_collect(&self, false), "Collected datasets to unmount")).value)
+        return;
+    qsort(self.entries, self.len, sizeof(zfscrypt_mount_entry_t), zfscrypt_mount_entry_compare);
+    for (size_t begin = 0; begin < self.len; begin = self.end) {
+        size_t end = begin + 1;
+        while (end < self.len && self.entries[end].depth == self.entries[begin].depth)
+            ++end;
+        self.next = begin;
+        self.end = end;
+        const size_t wanted = workers < end - begin ? workers : end - begin;
+        pthread_t threads[wanted == 0 ? 1 : wanted];
+        size_t started = 0;
+        while (started < wanted && pthread_create(&threads[started], NULL, zfscrypt_mount_release_worker, &self) == 0)
+            ++started;
+        // without any worker the calling thread unmounts the level itself
+        if (started == 0)
+            (void) zfscrypt_mount_release_worker(&self);
+        for (size_t i = 0; i < started; ++i)
+            pthread_join(threads[i], NULL);
+    }
+    zfscrypt_mount_free(&self);
+}
+
+// private methods
+
+int zfscrypt_mount_collect(zfscrypt_mount_t* self, const bool mount) {
+    size_t capacity = 0;
+    for (size_t i = 0; i < self->plan->len; ++i)
+        capacity += self->plan->groups[i].len;
+    if (capacity > 0 && (self->entries = calloc(capacity, sizeof(zfscrypt_mount_entry_t))) == NULL)
+        return -ENOMEM;
+    for (size_t i = 0; i < self->plan->len; ++i) {
+        zfscrypt_plan_group_t* group = &self->plan->groups[i];
+        for (size_t j = 0; j < group->len; ++j) {
+            zfscrypt_dataset_t* dataset = &group->members[j];
+            // observes the snapshot here, so workers only read it
+            const bool mounted = zfscrypt_dataset_mounted(dataset);
+            if (mount && mounted)
+                continue;
+            char mountpoint[ZFS_MAXPROPLEN];
+            if (zfs_prop_get(dataset->handle, ZFS_PROP_MOUNTPOINT, mountpoint, sizeof(mountpoint), NULL, NULL, 0, B_FALSE))
+                mountpoint[0] = '\0';
+            // only mounting has to know which mountpoints contain each other
+            char* copy = mount ? strdup(mountpoint) : NULL;
+            if (mount && copy == NULL)
+                return -ENOMEM;
+            self->entries[self->len++] = (zfscrypt_mount_entry_t) {.dataset = dataset, .group = i, .mountpoint = copy, .depth = zfscrypt_mount_depth(mountpoint), .state = ZFSCRYPT_MOUNT_PENDING};
+        }
+    }
+    return 0;
+}
+
+int zfscrypt_mount_one(zfs_handle_t* handle, void* data) {
+    zfscrypt_mount_t* self = data;
+    for (size_t i = 0; i < self->len; ++i) {
+        zfscrypt_dataset_t* dataset = self->entries[i].dataset;
+        if (dataset->handle != handle)
+            continue;
+        const int err = zfscrypt_dataset_mount(dataset);
+        if (err)
+            zfscrypt_context_log_err(dataset->context, zfscrypt_err_zfs(err, "Could not mount dataset"));
+        return err;
+    }
+    return 0;
+}
+
+void* zfscrypt_mount_release_worker(void* data) {
+    zfscrypt_mount_t* self = data;
+    for (;;) {
+        pthread_mutex_lock(&self->mutex);
+        const size_t index = self->next++;
+        pthread_mutex_unlock(&self->mutex);
+        if (index >= self->end)
+            return NULL;
+        // the rest stays mounted for the session opened meanwhile
+        zfscrypt_dataset_t* dataset = self->entries[index].dataset;
+        if (!zfscrypt_context_cancelled(dataset->context))
+            (void) zfscrypt_dataset_release(dataset);
+    }
+}
+
+void zfscrypt_mount_free(zfscrypt_mount_t* self) {
+    pthread_mutex_destroy(&self->mutex);
+    for (size_t i = 0; i < self->len; ++i)
+        free(self->entries[i].mountpoint);
+    free(self->entries);
+    self->entries = NULL;
+    self->len = 0;
+}
+
+// private functions
+
+size_t zfscrypt_mount_depth(const char* mountpoint) {
+    size_t depth = 0;
+    for (const char* c = mountpoint; *c != '\0'; ++c)
+        if (*c == '/' && c[1] != '/' && c[1] != '\0')
+            ++depth;
+    return depth;
+}
+
+bool zfscrypt_mount_contains(const char* outer, const char* inner) {
+    // legacy, none and unknown mountpoints contain nothing
+    if (outer == NULL || inner == NULL || outer[0] != '/')
+        return false;
+    const size_t len = strlen(outer);
+    if (len == 1)
+        return inner[0] == '/' && inner[1] != '\0';
+    return strncmp(outer, inner, len) == 0 && inner[len] == '/';
+}
+
+int zfscrypt_mount_entry_compare(const void* a, const void* b) {
+    const size_t left = ((zfscrypt_mount_entry_t const*) a)->depth;
+    const size_t right = ((zfscrypt_mount_entry_t const*) b)->depth;
+    return left < right ? 1 : left > right ? -1 : 0;
+}
@@ -0,0 +1,290 @@
+#include "zfscrypt_pbkdf2.h"
+
+#include <endian.h>
+#include <errno.h>
+#include <openssl/sha.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "zfscrypt_crypto.h"
+#include "zfscrypt_utils.h"
+
+// Messages of the iterations are always a 20 byte digest after a 64 byte pad, so their blocks are
+// built from words directly: the digest, the 0x80 terminator, zeros and the length in bits.
+
+// public functions
+
+int zfscrypt_pbkdf2_derive(zfscrypt_pbkdf2_job_t const* jobs, const size_t len) {
+    const size_t blocks = (ZFSCRYPT_CRYPTO_KEY_LEN + SHA_DIGEST_LENGTH - 1) / SHA_DIGEST_LENGTH;
+    // the lanes hold the pads of the passphrases
+    zfscrypt_pbkdf2_lane_t* lanes = secure_malloc(len * blocks * sizeof(zfscrypt_pbkdf2_lane_t));
+    zfscrypt_pbkdf2_lane_t** order = calloc(len * blocks, sizeof(zfscrypt_pbkdf2_lane_t*));
+    if (lanes == NULL || order == NULL) {
+        if (lanes != NULL)
+            secure_free(lanes, len * blocks * sizeof(zfscrypt_pbkdf2_lane_t));
+        free(order);
+        return -ENOMEM;
+    }
+    for (size_t i = 0; i < len * blocks; ++i) {
+        zfscrypt_pbkdf2_lane_init(&lanes[i], &jobs[i / blocks], i % blocks + 1);
+        order[i] = &lanes[i];
+    }
+    // lanes that run side by side need the same number of iterations
+    qsort(order, len * blocks, sizeof(zfscrypt_pbkdf2_lane_t*), zfscrypt_pbkdf2_lane_compare);
+    const bool avx2 = zfscrypt_pbkdf2_has_avx2();
+    for (size_t i = 0; i < len * blocks;) {
+        size_t n = 1;
+        while (n < ZFSCRYPT_PBKDF2_LANES && i + n < len * blocks && order[i + n]->iterations == order[i]->iterations)
+            ++n;
+        if (avx2 && n > 1)
+            zfscrypt_pbkdf2_run_avx2(&order[i], n);
+        else
+            for (size_t j = 0; j < n; ++j)
+                zfscrypt_pbkdf2_run_scalar(order[i + j]);
+        i += n;
+    }
+    for (size_t i = 0; i < len * blocks; ++i)
+        zfscrypt_pbkdf2_lane_finish(&lanes[i]);
+    secure_free(lanes, len * blocks * sizeof(zfscrypt_pbkdf2_lane_t));
+    free(order);
+    return 0;
+}
+
+// private functions
+
+void zfscrypt_pbkdf2_lane_init(zfscrypt_pbkdf2_lane_t* self, zfscrypt_pbkdf2_job_t const* job, const uint32_t block) {
+    static const uint32_t initial[5] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0};
+    // keys longer than a block are hashed first, like HMAC does
+    uint8_t key[SHA_CBLOCK] = {0};
+    const size_t key_len = strlen(job->passphrase);
+    if (key_len > SHA_CBLOCK)
+        SHA1((const unsigned char*) job->passphrase, key_len, key);
+    else
+        memcpy(key, job->passphrase, key_len);
+    uint32_t w[16];
+    for (size_t i = 0; i < 16; ++i)
+        w[i] = (((uint32_t) key[4 * i] << 24) | ((uint32_t) key[4 * i + 1] << 16) | ((uint32_t) key[4 * i + 2] << 8) | key[4 * i + 3]) ^ 0x36363636;
+    memcpy(self->inner, initial, sizeof(initial));
+    zfscrypt_pbkdf2_sha1(self->inner, w);
+    for (size_t i = 0; i < 16; ++i)
+        w[i] = (((uint32_t) key[4 * i] << 24) | ((uint32_t) key[4 * i + 1] << 16) | ((uint32_t) key[4 * i + 2] << 8) | key[4 * i + 3]) ^ 0x5c5c5c5c;
+    memcpy(self->outer, initial, sizeof(initial));
+    zfscrypt_pbkdf2_sha1(self->outer, w);
+    explicit_bzero(key, sizeof(key));
+    // first iteration: the little endian salt and the big endian block number, 12 bytes after the pad
+    const uint64_t salt = htole64(job->salt);
+    uint32_t state[5];
+    memcpy(state, self->inner, sizeof(state));
+    memcpy(w, &salt, sizeof(salt));
+    w[0] = be32toh(w[0]);
+    w[1] = be32toh(w[1]);
+    w[2] = block;
+    w[3] = 0x80000000;
+    memset(&w[4], 0, 11 * sizeof(uint32_t));
+    w[15] = (SHA_CBLOCK + 12) * 8;
+    zfscrypt_pbkdf2_sha1(state, w);
+    memcpy(w, state, sizeof(state));
+    w[5] = 0x80000000;
+    memset(&w[6], 0, 9 * sizeof(uint32_t));
+    w[15] = (SHA_CBLOCK + SHA_DIGEST_LENGTH) * 8;
+    memcpy(self->u, self->outer, sizeof(self->u));
+    zfscrypt_pbkdf2_sha1(self->u, w);
+    memcpy(self->t, self->u, sizeof(self->t));
+    explicit_bzero(w, sizeof(w));
+    self->iterations = job->iterations;
+    self->out = &job->key[(block - 1) * SHA_DIGEST_LENGTH];
+    self->out_len = ZFSCRYPT_CRYPTO_KEY_LEN - (block - 1) * SHA_DIGEST_LENGTH < SHA_DIGEST_LENGTH ? ZFSCRYPT_CRYPTO_KEY_LEN - (block - 1) * SHA_DIGEST_LENGTH : SHA_DIGEST_LENGTH;
+}
+
+void zfscrypt_pbkdf2_lane_finish(zfscrypt_pbkdf2_lane_t* self) {
+    uint8_t digest[SHA_DIGEST_LENGTH];
+    for (size_t i = 0; i < 5; ++i) {
+        const uint32_t word = htobe32(self->t[i]);
+        memcpy(&digest[4 * i], &word, sizeof(word));
+    }
+    memcpy(self->out, digest, self->out_len);
+    explicit_bzero(digest, sizeof(digest));
+}
+
+void zfscrypt_pbkdf2_run_scalar(zfscrypt_pbkdf2_lane_t* lane) {
+    uint32_t w[16];
+    for (uint64_t i = 1; i < lane->iterations; ++i) {
+        uint32_t state[5];
+        memcpy(state, lane->inner, sizeof(state));
+        memcpy(w, lane->u, sizeof(lane->u));
+        w[5] = 0x80000000;
+        memset(&w[6], 0, 9 * sizeof(uint32_t));
+        w[15] = (SHA_CBLOCK + SHA_DIGEST_LENGTH) * 8;
+        zfscrypt_pbkdf2_sha1(state, w);
+        memcpy(w, state, sizeof(state));
+        w[5] = 0x80000000;
+        memset(&w[6], 0, 9 * sizeof(uint32_t));
+        w[15] = (SHA_CBLOCK + SHA_DIGEST_LENGTH) * 8;
+        memcpy(lane->u, lane->outer, sizeof(lane->u));
+        zfscrypt_pbkdf2_sha1(lane->u, w);
+        for (size_t j = 0; j < 5; ++j)
+            lane->t[j] ^= lane->u[j];
+    }
+    explicit_bzero(w, sizeof(w));
+}
+
+#if defined(__x86_64__)
+
+#define ZFSCRYPT_PBKDF2_ROL(x, n) _mm256_or_si256(_mm256_slli_epi32((x), (n)), _mm256_srli_epi32((x), 32 - (n)))
+
+__attribute__((target("avx2"))) static void zfscrypt_pbkdf2_sha1_x8(__m256i state[5], __m256i w[16]) {
+    __m256i a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+    for (int t = 0; t < 80; ++t) {
+        if (t >= 16) {
+            const __m256i x = _mm256_xor_si256(_mm256_xor_si256(w[(t - 3) & 15], w[(t - 8) & 15]), _mm256_xor_si256(w[(t - 14) & 15], w[t & 15]));
+            w[t & 15] = ZFSCRYPT_PBKDF2_ROL(x, 1);
+        }
+        __m256i f;
+        uint32_t k;
+        if (t < 20) {
+            f = _mm256_xor_si256(d, _mm256_and_si256(b, _mm256_xor_si256(c, d)));
+            k = 0x5a827999;
+        } else if (t < 40) {
+            f = _mm256_xor_si256(_mm256_xor_si256(b, c), d);
+            k = 0x6ed9eba1;
+        } else if (t < 60) {
+            f = _mm256_or_si256(_mm256_and_si256(b, c), _mm256_and_si256(d, _mm256_or_si256(b, c)));
+            k = 0x8f1bbcdc;
+        } else {
+            f = _mm256_xor_si256(_mm256_xor_si256(b, c), d);
+            k = 0xca62c1d6;
+        }
+        const __m256i temp = _mm256_add_epi32(_mm256_add_epi32(ZFSCRYPT_PBKDF2_ROL(a, 5), f), _mm256_add_epi32(_mm256_add_epi32(e, _mm256_set1_epi32((int) k)), w[t & 15]));
+        e = d;
+        d = c;
+        c = ZFSCRYPT_PBKDF2_ROL(b, 30);
+        b = a;
+        a = temp;
+    }
+    state[0] = _mm256_add_epi32(state[0], a);
+    state[1] = _mm256_add_epi32(state[1], b);
+    state[2] = _mm256_add_epi32(state[2], c);
+    state[3] = _mm256_add_epi32(state[3], d);
+    state[4] = _mm256_add_epi32(state[4], e);
+}
+
+__attribute__((target("avx2"))) void zfscrypt_pbkdf2_run_avx2(zfscrypt_pbkdf2_lane_t** lanes, const size_t len) {
+    // one word of every lane per register, missing lanes repeat the first one
+    uint32_t words[4][5][ZFSCRYPT_PBKDF2_LANES];
+    for (size_t i = 0; i < ZFSCRYPT_PBKDF2_LANES; ++i) {
+        zfscrypt_pbkdf2_lane_t const* lane = lanes[i < len ? i : 0];
+        for (size_t j = 0; j < 5; ++j) {
+            words[0][j][i] = lane->inner[j];
+            words[1][j][i] = lane->outer[j];
+            words[2][j][i] = lane->u[j];
+            words[3][j][i] = lane->t[j];
+        }
+    }
+    __m256i inner[5], outer[5], u[5], t[5];
+    for (size_t j = 0; j < 5; ++j) {
+        inner[j] = _mm256_loadu_si256((const __m256i*) words[0][j]);
+        outer[j] = _mm256_loadu_si256((const __m256i*) words[1][j]);
+        u[j] = _mm256_loadu_si256((const __m256i*) words[2][j]);
+        t[j] = _mm256_loadu_si256((const __m256i*) words[3][j]);
+    }
+    const __m256i terminator = _mm256_set1_epi32((int) 0x80000000);
+    const __m256i length = _mm256_set1_epi32((SHA_CBLOCK + SHA_DIGEST_LENGTH) * 8);
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i w[16];
+    for (uint64_t i = 1; i < lanes[0]->iterations; ++i) {
+        __m256i state[5];
+        for (size_t j = 0; j < 5; ++j) {
+            state[j] = inner[j];
+            w[j] = u[j];
+        }
+        w[5] = terminator;
+        for (size_t j = 6; j < 15; ++j)
+            w[j] = zero;
+        w[15] = length;
+        zfscrypt_pbkdf2_sha1_x8(state, w);
+        for (size_t j = 0; j < 5; ++j) {
+            w[j] = state[j];
+            u[j] = outer[j];
+        }
+        w[5] = terminator;
+        for (size_t j = 6; j < 15; ++j)
+            w[j] = zero;
+        w[15] = length;
+        zfscrypt_pbkdf2_sha1_x8(u, w);
+        for (size_t j = 0; j < 5; ++j)
+            t[j] = _mm256_xor_si256(t[j], u[j]);
+    }
+    for (size_t j = 0; j < 5; ++j) {
+        _mm256_storeu_si256((__m256i*) words[2][j], u[j]);
+        _mm256_storeu_si256((__m256i*) words[3][j], t[j]);
+    }
+    for (size_t i = 0; i < len; ++i) {
+        for (size_t j = 0; j < 5; ++j) {
+            lanes[i]->u[j] = words[2][j][i];
+            lanes[i]->t[j] = words[3][j][i];
+        }
+    }
+    explicit_bzero(words, sizeof(words));
+    explicit_bzero(w, sizeof(w));
+}
+
+bool zfscrypt_pbkdf2_has_avx2(void) {
+    return __builtin_cpu_supports("avx2");
+}
+
+#else
+
+void zfscrypt_pbkdf2_run_avx2(zfscrypt_pbkdf2_lane_t** lanes, const size_t len) {
+    for (size_t i = 0; i < len; ++i)
+        zfscrypt_pbkdf2_run_scalar(lanes[i]);
+}
+
+bool zfscrypt_pbkdf2_has_avx2(void) {
+    return false;
+}
+
+#endif
+
+int zfscrypt_pbkdf2_lane_compare(const void* a, const void* b) {
+    const uint64_t x = (*(zfscrypt_pbkdf2_lane_t* const*) a)->iterations;
+    const uint64_t y = (*(zfscrypt_pbkdf2_lane_t* const*) b)->iterations;
+    return x < y ? -1 : x > y;
+}
+
+void zfscrypt_pbkdf2_sha1(uint32_t state[5], uint32_t w[16]) {
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+    for (int t = 0; t < 80; ++t) {
+        if (t >= 16) {
+            const uint32_t x = w[(t - 3) & 15] ^ w[(t - 8) & 15] ^ w[(t - 14) & 15] ^ w[t & 15];
+            w[t & 15] = (x << 1) | (x >> 31);
+        }
+        uint32_t f, k;
+        if (t < 20) {
+            f = d ^ (b & (c ^ d));
+            k = 0x5a827999;
+        } else if (t < 40) {
+            f = b ^ c ^ d;
+            k = 0x6ed9eba1;
+        } else if (t < 60) {
+            f = (b & c) | (d & (b | c));
+            k = 0x8f1bbcdc;
+        } else {
+            f = b ^ c ^ d;
+            k = 0xca62c1d6;
+        }
+        const uint32_t temp = ((a << 5) | (a >> 27)) + f + e + k + w[t & 15];
+        e = d;
+        d = c;
+        c = (b << 30) | (b >> 2);
+        b = a;
+        a = temp;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+}
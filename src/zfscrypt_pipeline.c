@@ -0,0 +1,106 @@
+#include "zfscrypt_pipeline.h"
+
+#include <errno.h>
+#include <stdlib.h>
+
+#include "zfscrypt_dataset.h"
+#include "zfscrypt_mount.h"
+
+// Note: workers must not touch libzfs state shared with the calling thread. Providing a key only
+// reads cached properties of the root handle, derives the key and calls libzfs_core or the keyring,
+// which are thread safe.
+
+// public functions
+
+zfscrypt_err_t zfscrypt_pipeline_unlock(zfscrypt_plan_t* plan, const unsigned workers) {
+    zfscrypt_context_t* context = plan->context;
+    zfscrypt_pipeline_t self = {
+        .plan = plan,
+        .mutex = PTHREAD_MUTEX_INITIALIZER,
+        .loaded = PTHREAD_COND_INITIALIZER,
+        .next = 0,
+        .completed = 0,
+        .pending = calloc(plan->len, sizeof(bool)),
+        .done = calloc(plan->len, sizeof(bool)),
+        .snapshot = calloc(plan->len, sizeof(bool)),
+        .results = calloc(plan->len, sizeof(int))};
+    if (plan->len > 0 && (self.pending == NULL || self.done == NULL || self.snapshot == NULL || self.results == NULL)) {
+        free(self.pending);
+        free(self.done);
+        free(self.snapshot);
+        free(self.results);
+        return zfscrypt_err_os(ENOMEM, "Memory allocation failed");
+    }
+    // key status and mountpoints are read up front, workers only see groups that need a key derivation
+    for (size_t i = 0; i < plan->len; ++i)
+        self.pending[i] = zfscrypt_dataset_needs_key(&plan->groups[i]);
+    zfscrypt_mount_t mount;
+    const bool mounting = zfscrypt_mount_begin(&mount, plan) == 0;
+    pthread_t threads[workers];
+    unsigned started = 0;
+    while (started < workers && started < plan->len && pthread_create(&threads[started], NULL, zfscrypt_pipeline_worker, &self) == 0)
+        ++started;
+    // without any worker the calling thread loads the keys itself
+    if (started == 0)
+        (void) zfscrypt_pipeline_worker(&self);
+    // mounts what became ready while the workers go on with the remaining keys
+    bool done[plan->len == 0 ? 1 : plan->len];
+    for (size_t i = 0; i < plan->len; ++i)
+        done[i] = false;
+    for (size_t seen = 0; seen < plan->len;) {
+        const size_t completed = zfscrypt_pipeline_wait(&self, seen);
+        for (size_t i = 0; i < plan->len; ++i) {
+            if (done[i] || !self.snapshot[i])
+                continue;
+            done[i] = true;
+            plan->groups[i].ready = !self.results[i];
+            zfscrypt_context_log_err(context, zfscrypt_err_zfs(self.results[i], "Unlocked encryption root"));
+        }
+        if (mounting)
+            zfscrypt_mount_ready(&mount, done);
+        seen = completed;
+    }
+    for (unsigned i = 0; i < started; ++i)
+        pthread_join(threads[i], NULL);
+    if (mounting)
+        zfscrypt_mount_end(&mount);
+    pthread_mutex_destroy(&self.mutex);
+    pthread_cond_destroy(&self.loaded);
+    free(self.pending);
+    free(self.done);
+    free(self.snapshot);
+    free(self.results);
+    return zfscrypt_err_os(0, "Unlocked datasets with worker pool");
+}
+
+// private methods
+
+void* zfscrypt_pipeline_worker(void* data) {
+    zfscrypt_pipeline_t* self = data;
+    for (;;) {
+        pthread_mutex_lock(&self->mutex);
+        const size_t index = self->next++;
+        pthread_mutex_unlock(&self->mutex);
+        if (index >= self->plan->len)
+            return NULL;
+        const int err = self->pending[index] ? zfscrypt_dataset_provide_key(&self->plan->groups[index]) : 0;
+        pthread_mutex_lock(&self->mutex);
+        self->results[index] = err;
+        self->done[index] = true;
+        ++self->completed;
+        pthread_cond_broadcast(&self->loaded);
+        pthread_mutex_unlock(&self->mutex);
+    }
+}
+
+size_t zfscrypt_pipeline_wait(zfscrypt_pipeline_t* self, const size_t seen) {
+    pthread_mutex_lock(&self->mutex);
+    while (self->completed == seen)
+        pthread_cond_wait(&self->loaded, &self->mutex);
+    const size_t completed = self->completed;
+    // results of finished groups are never written again
+    for (size_t i = 0; i < self->plan->len; ++i)
+        self->snapshot[i] = self->done[i];
+    pthread_mutex_unlock(&self->mutex);
+    return completed;
+}
@@ -0,0 +1,118 @@
+#include "zfscrypt_plan.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "zfscrypt_crypto.h"
+#include "zfscrypt_utils.h"
+
+// public functions
+
+zfscrypt_err_t zfscrypt_plan_build(zfscrypt_plan_t* self, zfscrypt_context_t* context, zfscrypt_dataset_t const* datasets, const size_t len) {
+    self->context = context;
+    self->data = NULL;
+    self->groups = NULL;
+    self->len = 0;
+    for (size_t i = 0; i < len; ++i) {
+        zfscrypt_dataset_t const* dataset = &datasets[i];
+        char root[ZFS_MAXPROPLEN];
+        int err = zfs_prop_get(dataset->handle, ZFS_PROP_ENCRYPTION_ROOT, root, sizeof(root), NULL, NULL, 0, B_TRUE);
+        if (err) {
+            zfscrypt_context_log_err(context, zfscrypt_err_zfs(libzfs_errno(context->libzfs), "Could not get encryption root"));
+            continue;
+        }
+        zfscrypt_plan_group_t* group = zfscrypt_plan_find(self, root);
+        if (group == NULL) {
+            const zfscrypt_err_t group_err = zfscrypt_plan_add_group(self, dataset, root);
+            if (group_err.value)
+                return group_err;
+            group = &self->groups[self->len - 1];
+        }
+        err = zfscrypt_plan_group_add(group, dataset);
+        if (err)
+            return zfscrypt_err_os(err, "Memory allocation failed");
+    }
+    return zfscrypt_err_os(0, "Planned datasets by encryption root");
+}
+
+zfscrypt_err_t zfscrypt_plan_each(zfscrypt_plan_t* self, zfscrypt_plan_group_f callback) {
+    for (size_t i = 0; i < self->len; ++i)
+        zfscrypt_context_log_err(self->context, callback(&self->groups[i]));
+    return zfscrypt_err_os(0, "Executed plan");
+}
+
+void zfscrypt_plan_log(zfscrypt_plan_t const* self, zfscrypt_context_t* context) {
+    if (!context->debug)
+        return;
+    for (size_t i = 0; i < self->len; ++i) {
+        zfscrypt_plan_group_t const* group = &self->groups[i];
+        zfscrypt_context_log(context, LOG_DEBUG, "Plan: encryption root %s (%s) for %zu dataset(s)", zfs_get_name(group->root.handle), group->owned ? "owned" : "not owned", group->len);
+        for (size_t j = 0; j < group->len; ++j)
+            zfscrypt_context_log(context, LOG_DEBUG, "Plan:   %s (%s)", zfs_get_name(group->members[j].handle), zfscrypt_dataset_is_lazy(&group->members[j]) ? "lazy" : "eager");
+    }
+}
+
+void zfscrypt_plan_free(zfscrypt_plan_t* self) {
+    for (size_t i = 0; i < self->len; ++i) {
+        if (self->groups[i].owns_handle)
+            zfs_close(self->groups[i].root.handle);
+        if (self->groups[i].root.derived != NULL)
+            secure_free(self->groups[i].root.derived, ZFSCRYPT_CRYPTO_KEY_LEN);
+        free(self->groups[i].members);
+    }
+    free(self->groups);
+    self->groups = NULL;
+    self->len = 0;
+}
+
+// private methods
+
+zfscrypt_plan_group_t* zfscrypt_plan_find(zfscrypt_plan_t* self, const char* root) {
+    for (size_t i = 0; i < self->len; ++i)
+        if (streq(zfs_get_name(self->groups[i].root.handle), root))
+            return &self->groups[i];
+    return NULL;
+}
+
+zfscrypt_err_t zfscrypt_plan_add_group(zfscrypt_plan_t* self, zfscrypt_dataset_t const* dataset, const char* root) {
+    zfscrypt_context_t* context = dataset->context;
+    // the home dataset usually is its own encryption root, reuse its handle and snapshot then
+    const bool same = streq(zfs_get_name(dataset->handle), root);
+    zfs_handle_t* handle = same ? dataset->handle : zfs_open(context->libzfs, root, ZFS_TYPE_FILESYSTEM);
+    if (handle == NULL)
+        return zfscrypt_err_zfs(libzfs_errno(context->libzfs), "Could not open encryption root");
+    zfscrypt_plan_group_t* grown = realloc(self->groups, (self->len + 1) * sizeof(zfscrypt_plan_group_t));
+    if (grown == NULL) {
+        if (!same)
+            zfs_close(handle);
+        return zfscrypt_err_os(ENOMEM, "Memory allocation failed");
+    }
+    self->groups = grown;
+    zfscrypt_plan_group_t* group = &self->groups[self->len++];
+    *group = (zfscrypt_plan_group_t) {
+        .root = {.context = context, .handle = handle, .key = dataset->key, .new_key = dataset->new_key, .derived = NULL, .snapshot = same ? dataset->snapshot : (zfscrypt_dataset_snapshot_t) {0}},
+        .owned = false,
+        .owns_handle = !same,
+        .eager = false,
+        .lazy = false,
+        .ready = false,
+        .members = NULL,
+        .len = 0};
+    // a shared parent like tank/home must never be unloaded or rewrapped on behalf of a single user
+    group->owned = zfscrypt_dataset_has_matching_user(&group->root);
+    return zfscrypt_err_os(0, "Added encryption root to plan");
+}
+
+int zfscrypt_plan_group_add(zfscrypt_plan_group_t* self, zfscrypt_dataset_t const* dataset) {
+    zfscrypt_dataset_t* grown = realloc(self->members, (self->len + 1) * sizeof(zfscrypt_dataset_t));
+    if (grown == NULL)
+        return -ENOMEM;
+    grown[self->len++] = *dataset;
+    self->members = grown;
+    if (zfscrypt_dataset_is_lazy(&grown[self->len - 1]))
+        self->lazy = true;
+    else
+        self->eager = true;
+    return 0;
+}
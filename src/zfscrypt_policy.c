@@ -0,0 +1,558 @@
+#include "zfscrypt_policy.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <grp.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "zfscrypt_utils.h"
+
+// Hash and displace: keys are spread over n buckets by a first hash. Buckets with several keys store
+// the seed of a second hash that puts all of them into free slots, buckets with a single key store
+// its slot directly as -slot - 1. A lookup is one hash, one displacement, one slot and one record.
+
+// A superseded mapping is never unmapped, contexts of other threads may still point into it. Policies
+// are small and recompiled rarely.
+static pthread_mutex_t zfscrypt_policy_mutex = PTHREAD_MUTEX_INITIALIZER;
+static zfscrypt_policy_header_t const* zfscrypt_policy_cached = NULL;
+static dev_t zfscrypt_policy_cached_dev = 0;
+static ino_t zfscrypt_policy_cached_ino = 0;
+
+// pam_end unloads the module, its mapping must not outlive it
+__attribute__((destructor)) static void zfscrypt_policy_unmap(void) {
+    if (zfscrypt_policy_cached != NULL)
+        munmap((void*) zfscrypt_policy_cached, zfscrypt_policy_cached->size);
+    zfscrypt_policy_cached = NULL;
+}
+
+// public functions
+
+void zfscrypt_policy_apply(zfscrypt_context_t* context) {
+    if (context->user == NULL)
+        return;
+    defer(free_ptr) char* path = context->policy == NULL ? strfmt("%s/%s", context->state_dir, ZFSCRYPT_POLICY_FILE) : NULL;
+    zfscrypt_policy_header_t const* policy = NULL;
+    const int err = context->policy == NULL && path == NULL ? -ENOMEM : zfscrypt_policy_map(&policy, context->policy == NULL ? path : context->policy);
+    if (err == -ENOENT)
+        return;
+    if (err) {
+        zfscrypt_context_log(context, LOG_WARNING, "Could not map policy, using module arguments: %s", strerror(-err));
+        return;
+    }
+    zfscrypt_policy_record_t const* records = zfscrypt_policy_records(policy);
+    zfscrypt_policy_override(context, policy, &records[0]);
+    // zfscryptd and zfscrypt lock-queue apply policies on several threads at once
+    struct passwd entry;
+    struct passwd* pwd = NULL;
+    char buffer[4096];
+    if (policy->groups != 0 && context->pam != NULL)
+        pwd = pam_modutil_getpwnam(context->pam, context->user);
+    else if (policy->groups != 0 && getpwnam_r(context->user, &entry, buffer, sizeof(buffer), &pwd) != 0)
+        pwd = NULL;
+    gid_t gids[ZFSCRYPT_POLICY_MAX_GROUPS];
+    int count = ZFSCRYPT_POLICY_MAX_GROUPS;
+    if (pwd == NULL || getgrouplist(context->user, pwd->pw_gid, gids, &count) < 0)
+        count = pwd == NULL ? 0 : ZFSCRYPT_POLICY_MAX_GROUPS;
+    // group sections apply in the order of the file, which is the order of their records
+    uint32_t matched[ZFSCRYPT_POLICY_MAX_GROUPS];
+    size_t len = 0;
+    for (int i = 0; i < count; ++i) {
+        const uint32_t index = zfscrypt_policy_find_group(policy, gids[i]);
+        size_t at = len;
+        while (at > 0 && matched[at - 1] > index)
+            --at;
+        if (index == 0 || (at > 0 && matched[at - 1] == index))
+            continue;
+        memmove(&matched[at + 1], &matched[at], (len - at) * sizeof(uint32_t));
+        matched[at] = index;
+        ++len;
+    }
+    for (size_t i = 0; i < len; ++i)
+        zfscrypt_policy_override(context, policy, &records[matched[i]]);
+    zfscrypt_policy_record_t const* user = zfscrypt_policy_find_user(policy, context->user);
+    if (user != NULL)
+        zfscrypt_policy_override(context, policy, user);
+    if (context->debug)
+        zfscrypt_context_log(context, LOG_DEBUG, "Applied policy with %zu group section(s)%s", len, user == NULL ? "" : " and a user section");
+}
+
+void zfscrypt_policy_reset(zfscrypt_context_t* context, zfscrypt_context_t const* defaults) {
+    context->linger = defaults->linger;
+    context->workers = defaults->workers;
+    context->drop_caches = defaults->drop_caches;
+    context->mount = defaults->mount;
+    context->roots = defaults->roots;
+    context->skip = defaults->skip;
+}
+
+int zfscrypt_policy_compile(const char* source, const char* state_dir, size_t* line) {
+    *line = 0;
+    zfscrypt_policy_builder_t builder = {.users = NULL, .users_len = 0, .groups = NULL, .groups_len = 0, .fallback = {0}, .strings = calloc(1, 1), .strings_len = 1};
+    if (builder.strings == NULL)
+        return -ENOMEM;
+    defer(close_file) FILE* file = fopen(source, "re");
+    int err = file == NULL ? -errno : zfscrypt_policy_builder_parse(&builder, file, line);
+    if (!err)
+        err = zfscrypt_policy_builder_write(&builder, state_dir);
+    zfscrypt_policy_builder_free(&builder);
+    return err;
+}
+
+bool zfscrypt_policy_list_covers(const char* list, const char* dataset) {
+    for (const char* item = list; item != NULL && *item != '\0'; item += strlen(item) + 1)
+        if (zfscrypt_policy_covers(item, dataset))
+            return true;
+    return false;
+}
+
+bool zfscrypt_policy_covers(const char* parent, const char* dataset) {
+    const size_t len = strlen(parent);
+    return strncmp(dataset, parent, len) == 0 && (dataset[len] == '\0' || dataset[len] == '/');
+}
+
+// private methods
+
+int zfscrypt_policy_builder_parse(zfscrypt_policy_builder_t* self, FILE* file, size_t* line) {
+    defer(free_ptr) char* text = NULL;
+    size_t size = 0;
+    // settings before the first section have nowhere to go
+    zfscrypt_policy_record_t* record = NULL;
+    while (getline(&text, &size, file) >= 0) {
+        ++*line;
+        text[strcspn(text, "#\n")] = '\0';
+        char* item = zfscrypt_policy_trim(text);
+        if (*item == '\0')
+            continue;
+        if (*item == '[') {
+            const int err = zfscrypt_policy_builder_section(self, item, &record);
+            if (err)
+                return err;
+            continue;
+        }
+        char* value = strchr(item, '=');
+        if (record == NULL || value == NULL)
+            return -EINVAL;
+        *value++ = '\0';
+        const int err = zfscrypt_policy_builder_set(self, record, zfscrypt_policy_trim(item), zfscrypt_policy_trim(value));
+        if (err)
+            return err;
+    }
+    *line = 0;
+    return ferror(file) ? -EIO : 0;
+}
+
+int zfscrypt_policy_builder_set(zfscrypt_policy_builder_t* self, zfscrypt_policy_record_t* record, const char* key, char* value) {
+    int err = 0;
+    if (streq(key, "linger")) {
+        err = zfscrypt_policy_number(value, &record->linger);
+        record->fields |= ZFSCRYPT_POLICY_FIELD_LINGER;
+    } else if (streq(key, "workers")) {
+        err = zfscrypt_policy_number(value, &record->workers);
+        record->fields |= ZFSCRYPT_POLICY_FIELD_WORKERS;
+    } else if (streq(key, "drop_caches")) {
+        record->drop_caches = streq(value, "none") ? ZFSCRYPT_DROP_CACHES_NONE : streq(value, "scoped") ? ZFSCRYPT_DROP_CACHES_SCOPED : ZFSCRYPT_DROP_CACHES_GLOBAL;
+        err = streq(value, "none") || streq(value, "scoped") || streq(value, "global") ? 0 : -EINVAL;
+        record->fields |= ZFSCRYPT_POLICY_FIELD_DROP_CACHES;
+    } else if (streq(key, "mount")) {
+        record->mount = streq(value, "eager") ? ZFSCRYPT_MOUNT_MODE_EAGER : streq(value, "lazy") ? ZFSCRYPT_MOUNT_MODE_LAZY : ZFSCRYPT_MOUNT_MODE_PROPERTY;
+        err = streq(value, "eager") || streq(value, "lazy") || streq(value, "property") ? 0 : -EINVAL;
+        record->fields |= ZFSCRYPT_POLICY_FIELD_MOUNT;
+    } else if (streq(key, "roots")) {
+        err = zfscrypt_policy_builder_list(self, value, &record->roots);
+        record->fields |= ZFSCRYPT_POLICY_FIELD_ROOTS;
+    } else if (streq(key, "skip")) {
+        err = zfscrypt_policy_builder_list(self, value, &record->skip);
+        record->fields |= ZFSCRYPT_POLICY_FIELD_SKIP;
+    } else {
+        err = -EINVAL;
+    }
+    return err;
+}
+
+int zfscrypt_policy_builder_section(zfscrypt_policy_builder_t* self, char* header, zfscrypt_policy_record_t** record) {
+    const size_t len = strlen(header);
+    if (len < 2 || header[len - 1] != ']')
+        return -EINVAL;
+    header[len - 1] = '\0';
+    char* kind = zfscrypt_policy_trim(&header[1]);
+    if (streq(kind, "default")) {
+        *record = &self->fallback;
+        return 0;
+    }
+    char* name = strpbrk(kind, " \t");
+    if (name == NULL)
+        return -EINVAL;
+    *name++ = '\0';
+    name = zfscrypt_policy_trim(name);
+    const bool user = streq(kind, "user");
+    if ((!user && strnq(kind, "group")) || *name == '\0' || strpbrk(name, " \t") != NULL)
+        return -EINVAL;
+    zfscrypt_policy_record_t entry = {.fields = 0, .key = 0, .roots = 0, .skip = 0};
+    int err = 0;
+    if (user) {
+        err = zfscrypt_policy_builder_string(self, name, strlen(name), &entry.key);
+    } else {
+        struct group const* const group = getgrnam(name);
+        err = group == NULL ? -ENOENT : 0;
+        entry.key = group == NULL ? 0 : group->gr_gid;
+    }
+    if (err)
+        return err;
+    zfscrypt_policy_record_t** records = user ? &self->users : &self->groups;
+    size_t* records_len = user ? &self->users_len : &self->groups_len;
+    zfscrypt_policy_record_t* grown = realloc(*records, (*records_len + 1) * sizeof(zfscrypt_policy_record_t));
+    if (grown == NULL)
+        return -ENOMEM;
+    grown[*records_len] = entry;
+    *records = grown;
+    *record = &grown[(*records_len)++];
+    return 0;
+}
+
+int zfscrypt_policy_builder_string(zfscrypt_policy_builder_t* self, const char* value, const size_t len, uint32_t* offset) {
+    if (self->strings_len + len + 1 > UINT32_MAX)
+        return -E2BIG;
+    char* grown = realloc(self->strings, self->strings_len + len + 1);
+    if (grown == NULL)
+        return -ENOMEM;
+    memcpy(&grown[self->strings_len], value, len);
+    grown[self->strings_len + len] = '\0';
+    *offset = self->strings_len;
+    self->strings = grown;
+    self->strings_len += len + 1;
+    return 0;
+}
+
+int zfscrypt_policy_builder_list(zfscrypt_policy_builder_t* self, char* value, uint32_t* offset) {
+    // offset 0 is the empty string, which is also the empty list
+    *offset = 0;
+    char* state = NULL;
+    uint32_t ignored = 0;
+    for (char* item = strtok_r(value, " \t", &state); item != NULL; item = strtok_r(NULL, " \t", &state)) {
+        const int err = zfscrypt_policy_builder_string(self, item, strlen(item), *offset == 0 ? offset : &ignored);
+        if (err)
+            return err;
+    }
+    return *offset == 0 ? 0 : zfscrypt_policy_builder_string(self, "", 0, &ignored);
+}
+
+int zfscrypt_policy_builder_write(zfscrypt_policy_builder_t* self, const char* state_dir) {
+    uint32_t ignored = 0;
+    // two trailing NULs end every string and list of the area, see zfscrypt_policy_check
+    int err = zfscrypt_policy_builder_string(self, "", 0, &ignored);
+    const size_t records = 1 + self->users_len + self->groups_len;
+    // a displacement and a slot per user and group, the default section is not hashed
+    const size_t size = sizeof(zfscrypt_policy_header_t) + records * sizeof(zfscrypt_policy_record_t) + (records - 1) * 2 * sizeof(uint32_t) + self->strings_len;
+    if (!err && size > UINT32_MAX)
+        err = -E2BIG;
+    defer(free_ptr) uint8_t* data = err ? NULL : calloc(1, size);
+    if (!err && data == NULL)
+        err = -ENOMEM;
+    if (err)
+        return err;
+    zfscrypt_policy_header_t* header = (zfscrypt_policy_header_t*) data;
+    *header = (zfscrypt_policy_header_t) {.magic = ZFSCRYPT_POLICY_MAGIC, .version = ZFSCRYPT_POLICY_VERSION, .size = size, .users = self->users_len, .groups = self->groups_len, .strings = self->strings_len};
+    zfscrypt_policy_record_t* record = (zfscrypt_policy_record_t*) (header + 1);
+    record[0] = self->fallback;
+    memcpy(&record[1], self->users, self->users_len * sizeof(zfscrypt_policy_record_t));
+    memcpy(&record[1 + self->users_len], self->groups, self->groups_len * sizeof(zfscrypt_policy_record_t));
+    int32_t* user_displacements = (int32_t*) &record[records];
+    uint32_t* user_slots = (uint32_t*) &user_displacements[self->users_len];
+    int32_t* group_displacements = (int32_t*) &user_slots[self->users_len];
+    uint32_t* group_slots = (uint32_t*) &group_displacements[self->groups_len];
+    memcpy(&group_slots[self->groups_len], self->strings, self->strings_len);
+    const void* keys[records];
+    size_t lens[records];
+    for (size_t i = 0; i < self->users_len; ++i) {
+        keys[i] = &self->strings[self->users[i].key];
+        lens[i] = strlen(keys[i]);
+    }
+    err = zfscrypt_policy_hash_build(user_displacements, user_slots, self->users_len, keys, lens);
+    for (size_t i = 0; !err && i < self->groups_len; ++i) {
+        keys[i] = &self->groups[i].key;
+        lens[i] = sizeof(uint32_t);
+    }
+    if (!err)
+        err = zfscrypt_policy_hash_build(group_displacements, group_slots, self->groups_len, keys, lens);
+    for (size_t i = 0; i < self->users_len; ++i)
+        user_slots[i] += 1;
+    for (size_t i = 0; i < self->groups_len; ++i)
+        group_slots[i] += 1 + self->users_len;
+    if (err)
+        return err;
+
+    if (mkdir(state_dir, 0755) < 0 && errno != EEXIST)
+        return -errno;
+    defer(free_ptr) char* path = strfmt("%s/%s", state_dir, ZFSCRYPT_POLICY_FILE);
+    defer(free_ptr) char* tmp_path = strfmt("%s/.%s.XXXXXX", state_dir, ZFSCRYPT_POLICY_FILE);
+    if (path == NULL || tmp_path == NULL)
+        return -ENOMEM;
+    defer(close_fd) int fd = mkstemp(tmp_path);
+    if (fd < 0)
+        return -errno;
+    // mapped by running processes, so it is never written in place
+    err = fchmod(fd, 0644) < 0 ? -errno : 0;
+    for (size_t written = 0; !err && written < size;) {
+        const ssize_t len = write(fd, &data[written], size - written);
+        if (len < 0 && errno != EINTR)
+            err = -errno;
+        written += len < 0 ? 0 : (size_t) len;
+    }
+    if (!err && fsync(fd) < 0)
+        err = -errno;
+    if (!err && rename(tmp_path, path) < 0)
+        err = -errno;
+    if (err)
+        unlink(tmp_path);
+    return err;
+}
+
+void zfscrypt_policy_builder_free(zfscrypt_policy_builder_t* self) {
+    free(self->users);
+    free(self->groups);
+    free(self->strings);
+    self->users = NULL;
+    self->groups = NULL;
+    self->strings = NULL;
+    self->users_len = 0;
+    self->groups_len = 0;
+    self->strings_len = 0;
+}
+
+// private functions
+
+char* zfscrypt_policy_trim(char* value) {
+    value += strspn(value, " \t");
+    size_t len = strlen(value);
+    while (len > 0 && (value[len - 1] == ' ' || value[len - 1] == '\t'))
+        value[--len] = '\0';
+    return value;
+}
+
+int zfscrypt_policy_number(const char* value, uint32_t* number) {
+    char* end = NULL;
+    errno = 0;
+    const unsigned long parsed = strtoul(value, &end, 10);
+    if (errno || end == value || *end != '\0' || parsed > UINT32_MAX)
+        return -EINVAL;
+    *number = parsed;
+    return 0;
+}
+
+int zfscrypt_policy_map(zfscrypt_policy_header_t const** policy, const char* path) {
+    struct stat status;
+    if (stat(path, &status) < 0)
+        return -errno;
+    pthread_mutex_lock(&zfscrypt_policy_mutex);
+    const bool cached = zfscrypt_policy_cached != NULL && zfscrypt_policy_cached_dev == status.st_dev && zfscrypt_policy_cached_ino == status.st_ino;
+    if (cached)
+        *policy = zfscrypt_policy_cached;
+    pthread_mutex_unlock(&zfscrypt_policy_mutex);
+    if (cached)
+        return 0;
+
+    defer(close_fd) int fd = open(path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+    if (fd < 0)
+        return -errno;
+    if (fstat(fd, &status) < 0)
+        return -errno;
+    // the policy decides what gets unlocked, so only root may write it
+    if (status.st_uid != 0 || (status.st_mode & (S_IWGRP | S_IWOTH)))
+        return -EPERM;
+    if ((size_t) status.st_size < sizeof(zfscrypt_policy_header_t) || (uint64_t) status.st_size > UINT32_MAX)
+        return -EBADMSG;
+    void* data = mmap(NULL, status.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED)
+        return -errno;
+    const int err = zfscrypt_policy_check(data, status.st_size);
+    if (err) {
+        munmap(data, status.st_size);
+        return err;
+    }
+    pthread_mutex_lock(&zfscrypt_policy_mutex);
+    zfscrypt_policy_cached = data;
+    zfscrypt_policy_cached_dev = status.st_dev;
+    zfscrypt_policy_cached_ino = status.st_ino;
+    *policy = data;
+    pthread_mutex_unlock(&zfscrypt_policy_mutex);
+    return 0;
+}
+
+int zfscrypt_policy_check(zfscrypt_policy_header_t const* policy, const size_t size) {
+    if (policy->magic != ZFSCRYPT_POLICY_MAGIC || policy->version != ZFSCRYPT_POLICY_VERSION || policy->size != size)
+        return -EPROTO;
+    const uint64_t records = 1 + (uint64_t) policy->users + policy->groups;
+    const uint64_t expected = sizeof(zfscrypt_policy_header_t) + records * sizeof(zfscrypt_policy_record_t) + (records - 1) * 2 * sizeof(uint32_t) + policy->strings;
+    if (expected != size || policy->strings < 2)
+        return -EBADMSG;
+    // lookups then need no bounds checks: every offset is inside the strings area, which ends with two NULs
+    const char* strings = zfscrypt_policy_strings(policy);
+    if (strings[policy->strings - 1] != '\0' || strings[policy->strings - 2] != '\0')
+        return -EBADMSG;
+    zfscrypt_policy_record_t const* record = zfscrypt_policy_records(policy);
+    for (uint64_t i = 0; i < records; ++i) {
+        const bool user = i >= 1 && i < 1 + (uint64_t) policy->users;
+        if (record[i].roots >= policy->strings || record[i].skip >= policy->strings || (user && record[i].key >= policy->strings))
+            return -EBADMSG;
+    }
+    int32_t const* displacements = (int32_t const*) &record[records];
+    uint32_t const* slots = (uint32_t const*) &displacements[policy->users];
+    for (uint32_t i = 0; i < policy->users; ++i)
+        if ((displacements[i] < 0 && (uint32_t) (-(int64_t) displacements[i] - 1) >= policy->users) || slots[i] < 1 || slots[i] >= 1 + policy->users)
+            return -EBADMSG;
+    displacements = (int32_t const*) &slots[policy->users];
+    slots = (uint32_t const*) &displacements[policy->groups];
+    for (uint32_t i = 0; i < policy->groups; ++i)
+        if ((displacements[i] < 0 && (uint32_t) (-(int64_t) displacements[i] - 1) >= policy->groups) || slots[i] < 1 + policy->users || slots[i] >= records)
+            return -EBADMSG;
+    return 0;
+}
+
+zfscrypt_policy_record_t const* zfscrypt_policy_records(zfscrypt_policy_header_t const* policy) {
+    return (zfscrypt_policy_record_t const*) (policy + 1);
+}
+
+const char* zfscrypt_policy_strings(zfscrypt_policy_header_t const* policy) {
+    const size_t records = 1 + (size_t) policy->users + policy->groups;
+    return (const char*) policy + sizeof(zfscrypt_policy_header_t) + records * sizeof(zfscrypt_policy_record_t) + (records - 1) * 2 * sizeof(uint32_t);
+}
+
+zfscrypt_policy_record_t const* zfscrypt_policy_find_user(zfscrypt_policy_header_t const* policy, const char* user) {
+    if (policy->users == 0)
+        return NULL;
+    zfscrypt_policy_record_t const* records = zfscrypt_policy_records(policy);
+    int32_t const* displacements = (int32_t const*) &records[1 + policy->users + policy->groups];
+    uint32_t const* slots = (uint32_t const*) &displacements[policy->users];
+    zfscrypt_policy_record_t const* record = &records[slots[zfscrypt_policy_hash_slot(displacements, policy->users, user, strlen(user))]];
+    return streq(&zfscrypt_policy_strings(policy)[record->key], user) ? record : NULL;
+}
+
+uint32_t zfscrypt_policy_find_group(zfscrypt_policy_header_t const* policy, const gid_t gid) {
+    if (policy->groups == 0)
+        return 0;
+    zfscrypt_policy_record_t const* records = zfscrypt_policy_records(policy);
+    int32_t const* displacements = (int32_t const*) &records[1 + policy->users + policy->groups];
+    displacements = (int32_t const*) &displacements[2 * policy->users];
+    uint32_t const* slots = (uint32_t const*) &displacements[policy->groups];
+    const uint32_t key = gid;
+    const uint32_t index = slots[zfscrypt_policy_hash_slot(displacements, policy->groups, &key, sizeof(key))];
+    return records[index].key == key ? index : 0;
+}
+
+void zfscrypt_policy_override(zfscrypt_context_t* context, zfscrypt_policy_header_t const* policy, zfscrypt_policy_record_t const* record) {
+    const char* strings = zfscrypt_policy_strings(policy);
+    // same limits as the module arguments
+    if (record->fields & ZFSCRYPT_POLICY_FIELD_LINGER)
+        context->linger = record->linger > ZFSCRYPT_CONTEXT_MAX_LINGER ? ZFSCRYPT_CONTEXT_MAX_LINGER : record->linger;
+    if (record->fields & ZFSCRYPT_POLICY_FIELD_WORKERS)
+        context->workers = record->workers > ZFSCRYPT_CONTEXT_MAX_WORKERS ? ZFSCRYPT_CONTEXT_MAX_WORKERS : record->workers;
+    if (record->fields & ZFSCRYPT_POLICY_FIELD_DROP_CACHES && record->drop_caches <= ZFSCRYPT_DROP_CACHES_GLOBAL)
+        context->drop_caches = record->drop_caches;
+    if (record->fields & ZFSCRYPT_POLICY_FIELD_MOUNT && record->mount <= ZFSCRYPT_MOUNT_MODE_LAZY)
+        context->mount = record->mount;
+    if (record->fields & ZFSCRYPT_POLICY_FIELD_ROOTS)
+        context->roots = &strings[record->roots];
+    if (record->fields & ZFSCRYPT_POLICY_FIELD_SKIP)
+        context->skip = &strings[record->skip];
+}
+
+uint32_t zfscrypt_policy_hash(uint32_t seed, const void* key, const size_t len) {
+    const uint8_t* bytes = key;
+    uint32_t hash = seed == 0 ? 0x811c9dc5 : seed;
+    for (size_t i = 0; i < len; ++i)
+        hash = (hash ^ bytes[i]) * 0x01000193;
+    return hash;
+}
+
+int zfscrypt_policy_hash_build(int32_t* displacements, uint32_t* slots, const size_t n, const void* keys[], const size_t lens[]) {
+    if (n == 0)
+        return 0;
+    if (n > INT32_MAX)
+        return -E2BIG;
+    defer(free_ptr) uint32_t* buckets = malloc(n * sizeof(uint32_t));
+    // members of bucket b are members[starts[b]] to members[starts[b + 1] - 1]
+    defer(free_ptr) uint32_t* starts = calloc(n + 1, sizeof(uint32_t));
+    defer(free_ptr) uint32_t* members = malloc(n * sizeof(uint32_t));
+    defer(free_ptr) uint32_t* placed = malloc(n * sizeof(uint32_t));
+    defer(free_ptr) bool* used = calloc(n, sizeof(bool));
+    if (buckets == NULL || starts == NULL || members == NULL || placed == NULL || used == NULL)
+        return -ENOMEM;
+    for (size_t i = 0; i < n; ++i) {
+        buckets[i] = zfscrypt_policy_hash(0, keys[i], lens[i]) % n;
+        ++starts[buckets[i] + 1];
+    }
+    uint32_t largest = 0;
+    for (size_t b = 0; b < n; ++b) {
+        largest = starts[b + 1] > largest ? starts[b + 1] : largest;
+        starts[b + 1] += starts[b];
+    }
+    for (size_t i = 0; i < n; ++i)
+        members[starts[buckets[i]]++] = i;
+    // the fill above advanced every start to the start of the next bucket
+    memmove(&starts[1], starts, n * sizeof(uint32_t));
+    starts[0] = 0;
+    // the largest buckets are the hardest to place, so they go first while most slots are free
+    for (uint32_t size = largest; size >= 2; --size) {
+        for (size_t b = 0; b < n; ++b) {
+            if (starts[b + 1] - starts[b] != size)
+                continue;
+            uint32_t const* bucket = &members[starts[b]];
+            for (uint32_t i = 1; i < size; ++i)
+                for (uint32_t j = 0; j < i; ++j)
+                    if (lens[bucket[i]] == lens[bucket[j]] && memcmp(keys[bucket[i]], keys[bucket[j]], lens[bucket[i]]) == 0)
+                        return -EEXIST;
+            uint32_t seed = 1;
+            for (uint32_t i = 0; i < size; seed = i < size ? seed + 1 : seed) {
+                for (i = 0; i < size; ++i) {
+                    placed[i] = zfscrypt_policy_hash(seed, keys[bucket[i]], lens[bucket[i]]) % n;
+                    bool taken = used[placed[i]];
+                    for (uint32_t j = 0; j < i && !taken; ++j)
+                        taken = placed[j] == placed[i];
+                    if (taken)
+                        break;
+                }
+                if (seed > INT32_MAX - 1)
+                    return -ELOOP;
+            }
+            for (uint32_t i = 0; i < size; ++i) {
+                used[placed[i]] = true;
+                slots[placed[i]] = bucket[i];
+            }
+            displacements[b] = seed;
+        }
+    }
+    size_t free_slot = 0;
+    for (size_t b = 0; b < n; ++b) {
+        if (starts[b + 1] - starts[b] > 1)
+            continue;
+        displacements[b] = 0;
+        if (starts[b + 1] == starts[b])
+            continue;
+        while (used[free_slot])
+            ++free_slot;
+        used[free_slot] = true;
+        slots[free_slot] = members[starts[b]];
+        displacements[b] = -(int32_t) free_slot - 1;
+    }
+    return 0;
+}
+
+uint32_t zfscrypt_policy_hash_slot(int32_t const* displacements, const uint32_t n, const void* key, const size_t len) {
+    const int32_t displacement = displacements[zfscrypt_policy_hash(0, key, len) % n];
+    return displacement < 0 ? (uint32_t) (-(int64_t) displacement - 1) : zfscrypt_policy_hash(displacement, key, len) % n;
+}
+
+// private constants
+
+const char ZFSCRYPT_POLICY_SOURCE[] = "/etc/zfscrypt.conf";
+const char ZFSCRYPT_POLICY_FILE[] = "policy";
+// "ZFCP" in little endian
+const uint32_t ZFSCRYPT_POLICY_MAGIC = 0x5043465a;
+const uint32_t ZFSCRYPT_POLICY_VERSION = 1;
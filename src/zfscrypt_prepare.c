@@ -0,0 +1,140 @@
+#include "zfscrypt_prepare.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "zfscrypt_crypto.h"
+#include "zfscrypt_dataset.h"
+#include "zfscrypt_utils.h"
+
+// public functions
+
+zfscrypt_err_t zfscrypt_prepare_start(zfscrypt_context_t* context, const char* token) {
+    zfscrypt_context_cache_t* cache = context->cache;
+    if (cache == NULL || context->libzfs == NULL)
+        return zfscrypt_err_os(ENOTSUP, "Preparing needs a cached context served in process");
+    zfscrypt_prepare_discard(cache);
+    zfscrypt_prepare_t* self = calloc(1, sizeof(zfscrypt_prepare_t));
+    if (self == NULL)
+        return zfscrypt_err_os(ENOMEM, "Memory allocation failed");
+    self->pid = getpid();
+    self->context = *context;
+    // the user of pam_sm_acct_mgmt may be released before the thread is done
+    self->context.user = cache->user;
+    self->context.stats = ZFSCRYPT_STATS_NONE;
+    self->token_size = strlen(token) + 1;
+    self->token = secure_dup(token);
+    if (self->token == NULL) {
+        free(self);
+        return zfscrypt_err_os(ENOMEM, "Memory allocation failed");
+    }
+    // published first, so discovery on the thread sees a preparation that is not joined yet
+    cache->prepare = self;
+    // the thread starts with the filesystem ids of the caller, so it runs with dropped privileges
+    const int err = pthread_create(&self->thread, NULL, zfscrypt_prepare_run, self);
+    if (err) {
+        cache->prepare = NULL;
+        secure_free(self->token, self->token_size);
+        free(self);
+        return zfscrypt_err_os(err, "Could not start preparing");
+    }
+    return zfscrypt_err_os(0, "Started preparing");
+}
+
+void zfscrypt_prepare_join(zfscrypt_context_cache_t* cache) {
+    zfscrypt_prepare_t* self = cache->prepare;
+    if (self == NULL || self->joined)
+        return;
+    if (self->pid == getpid())
+        (void) pthread_join(self->thread, NULL);
+    self->joined = true;
+}
+
+bool zfscrypt_prepare_take_key(zfscrypt_context_t* context, const char* root, const uint64_t salt, const uint64_t iterations, uint8_t* key) {
+    zfscrypt_prepare_t* self = context->cache == NULL ? NULL : context->cache->prepare;
+    // workers of the pipeline only read, the thread was joined when the stage began
+    if (self == NULL || !self->joined)
+        return false;
+    for (size_t i = 0; i < self->len; ++i) {
+        zfscrypt_prepare_key_t const* prepared = &self->keys[i];
+        if (streq(prepared->root, root) && prepared->salt == salt && prepared->iterations == iterations) {
+            memcpy(key, prepared->key, ZFSCRYPT_CRYPTO_KEY_LEN);
+            return true;
+        }
+    }
+    return false;
+}
+
+void zfscrypt_prepare_discard(zfscrypt_context_cache_t* cache) {
+    zfscrypt_prepare_t* self = cache->prepare;
+    if (self == NULL)
+        return;
+    zfscrypt_prepare_join(cache);
+    for (size_t i = 0; i < self->len; ++i) {
+        secure_free(self->keys[i].key, ZFSCRYPT_CRYPTO_KEY_LEN);
+        free(self->keys[i].root);
+    }
+    free(self->keys);
+    strv_free(&self->datasets);
+    if (self->token != NULL)
+        secure_free(self->token, self->token_size);
+    free(self);
+    cache->prepare = NULL;
+}
+
+// private functions
+
+void* zfscrypt_prepare_run(void* data) {
+    zfscrypt_prepare_t* self = data;
+    zfscrypt_context_t* context = &self->context;
+    zfscrypt_context_log_err(context, zfscrypt_dataset_iter(context, self->token, NULL, zfscrypt_prepare_plan, self));
+    // not needed anymore, open_session restores its own copy from pam data
+    secure_free(self->token, self->token_size);
+    self->token = NULL;
+    if (context->debug)
+        zfscrypt_context_log(context, LOG_DEBUG, "Prepared %zu key(s) for %zu dataset(s)", self->len, strv_length(self->datasets));
+    return NULL;
+}
+
+zfscrypt_err_t zfscrypt_prepare_plan(zfscrypt_plan_t* plan) {
+    zfscrypt_prepare_t* self = plan->data;
+    int err = (self->datasets = calloc(1, sizeof(char*))) == NULL ? -ENOMEM : 0;
+    for (size_t i = 0; !err && i < plan->len; ++i)
+        for (size_t j = 0; !err && j < plan->groups[i].len; ++j)
+            err = strv_push(&self->datasets, zfs_get_name(plan->groups[i].members[j].handle));
+    // open_session falls back to discovery without the complete list
+    if (err)
+        strv_free(&self->datasets);
+    zfscrypt_context_log_err(plan->context, zfscrypt_err_os(zfscrypt_dataset_derive_plan(plan), "Derived keys of plan"));
+    for (size_t i = 0; i < plan->len; ++i)
+        if (plan->groups[i].eager && zfscrypt_dataset_needs_key(&plan->groups[i]))
+            zfscrypt_context_log_err(plan->context, zfscrypt_err_os(zfscrypt_prepare_group(self, &plan->groups[i]), "Could not prepare key"));
+    return zfscrypt_err_os(err, "Prepared unlock");
+}
+
+int zfscrypt_prepare_group(zfscrypt_prepare_t* self, zfscrypt_plan_group_t* group) {
+    zfscrypt_prepare_key_t* grown = realloc(self->keys, (self->len + 1) * sizeof(zfscrypt_prepare_key_t));
+    if (grown == NULL)
+        return -ENOMEM;
+    self->keys = grown;
+    zfscrypt_prepare_key_t prepared = {
+        .root = strdup(zfs_get_name(group->root.handle)),
+        .salt = zfs_prop_get_int(group->root.handle, ZFS_PROP_PBKDF2_SALT),
+        .iterations = zfs_prop_get_int(group->root.handle, ZFS_PROP_PBKDF2_ITERS),
+        .key = secure_malloc(ZFSCRYPT_CRYPTO_KEY_LEN)};
+    int err = prepared.root == NULL || prepared.key == NULL ? -ENOMEM : 0;
+    const uint64_t begin = zfscrypt_stats_now();
+    if (!err)
+        err = zfscrypt_dataset_derive_key(&group->root, self->token, prepared.key);
+    zfscrypt_stats_add(&self->context.timings, ZFSCRYPT_STATS_DERIVE, begin);
+    if (err) {
+        if (prepared.key != NULL)
+            secure_free(prepared.key, ZFSCRYPT_CRYPTO_KEY_LEN);
+        free(prepared.root);
+        return err;
+    }
+    self->keys[self->len++] = prepared;
+    return 0;
+}
@@ -0,0 +1,88 @@
+#include "zfscrypt_program.h"
+
+#include <libzfs_core.h>
+#include <stdio.h>
+#include <string.h>
+
+
+// Note: channel programs need pools created with ZFS 0.8 or later and root privileges.
+// Callers are expected to fall back to iterating with libzfs on any error.
+
+// public functions
+
+int zfscrypt_program_discover(const char* root, const char* property, const char* user, nvlist_t** found, char* message, const size_t size) {
+    nvlist_t* args = NULL;
+    nvlist_t* out = NULL;
+    nvlist_t* result = NULL;
+    char* argv[] = {(char*) root, (char*) property, (char*) user};
+    char* error = NULL;
+    *found = NULL;
+    message[0] = '\0';
+    int err = nvlist_alloc(&args, NV_UNIQUE_NAME, 0);
+    if (!err)
+        err = nvlist_add_string_array(args, "argv", argv, sizeof(argv) / sizeof(argv[0]));
+    // the pool name is the part of root up to the first slash
+    char pool[ZFS_MAX_DATASET_NAME_LEN];
+    (void) snprintf(pool, sizeof(pool), "%.*s", (int) strcspn(root, "/"), root);
+    if (!err)
+        err = lzc_channel_program_nosync(pool, ZFSCRYPT_PROGRAM_DISCOVER, ZFSCRYPT_PROGRAM_INSTRUCTION_LIMIT, ZFSCRYPT_PROGRAM_MEMORY_LIMIT, args, &out);
+    if (err && out != NULL && nvlist_lookup_string(out, "error", &error) == 0)
+        (void) snprintf(message, size, "%s", error);
+    if (!err)
+        err = nvlist_lookup_nvlist(out, "return", &result);
+    if (!err)
+        err = nvlist_dup(result, found, 0);
+    nvlist_free(args);
+    nvlist_free(out);
+    return err;
+}
+
+// private constants
+
+const char ZFSCRYPT_PROGRAM_DISCOVER[] =
+    "-- Collects the filesystems below root that pam_zfscrypt would unlock for user,\n"
+    "-- see zfscrypt_dataset_valid for the equivalent checks done with libzfs.\n"
+    "args = ...\n"
+    "argv = args['argv']\n"
+    "root, property, user = argv[1], argv[2], argv[3]\n"
+    "found = {}\n"
+    "\n"
+    "function prop(dataset, name)\n"
+    "    local ok, value = pcall(zfs.get_prop, dataset, name)\n"
+    "    if ok then\n"
+    "        return value\n"
+    "    end\n"
+    "    return nil\n"
+    "end\n"
+    "\n"
+    "-- children of an encryption root report keylocation none and are unlocked with their root,\n"
+    "-- zfscrypt_dataset_valid checks the datasets found again if encryptionroot can't be read\n"
+    "function inherits_key(dataset)\n"
+    "    return prop(dataset, 'keylocation') == 'none' and prop(dataset, 'encryptionroot') ~= dataset\n"
+    "end\n"
+    "\n"
+    "function matches(dataset)\n"
+    "    return prop(dataset, property) == user\n"
+    "        and prop(dataset, 'type') == 'filesystem'\n"
+    "        and prop(dataset, 'mountpoint') ~= 'none'\n"
+    "        and prop(dataset, 'canmount') ~= 'off'\n"
+    "        and prop(dataset, 'encryption') ~= 'off'\n"
+    "        and (prop(dataset, 'keylocation') == 'prompt' or inherits_key(dataset))\n"
+    "        and prop(dataset, 'keyformat') == 'passphrase'\n"
+    "end\n"
+    "\n"
+    "function visit(dataset)\n"
+    "    for child in zfs.list.children(dataset) do\n"
+    "        if matches(child) then\n"
+    "            found[child] = prop(child, 'keystatus') or 'unknown'\n"
+    "        end\n"
+    "        visit(child)\n"
+    "    end\n"
+    "end\n"
+    "\n"
+    "visit(root)\n"
+    "return found\n";
+
+// defaults of zfs program, roughly 100 instructions are spent per dataset
+const unsigned long ZFSCRYPT_PROGRAM_INSTRUCTION_LIMIT = 10 * 1000 * 1000;
+const unsigned long ZFSCRYPT_PROGRAM_MEMORY_LIMIT = 10 * 1024 * 1024;
@@ -0,0 +1,274 @@
+#include "zfscrypt_provision.h"
+
+#include <errno.h>
+#include <libzfs_core.h>
+#include <pwd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <syslog.h>
+
+#include "zfscrypt_crypto.h"
+#include "zfscrypt_dataset.h"
+#include "zfscrypt_utils.h"
+
+// public functions
+
+void zfscrypt_provision_init(zfscrypt_provision_t* self, zfscrypt_context_t* context, const char* parent, const char* skeleton) {
+    *self = (zfscrypt_provision_t) {
+        .context = context,
+        .parent = parent,
+        .skeleton = skeleton,
+        .clone = strchr(skeleton, '@') != NULL,
+        .mutex = PTHREAD_MUTEX_INITIALIZER,
+        .next = 0,
+        .users = NULL,
+        .len = 0,
+        .failed = 0};
+}
+
+zfscrypt_err_t zfscrypt_provision_read(zfscrypt_provision_t* self, FILE* file) {
+    char* line = NULL;
+    size_t size = 0;
+    ssize_t len = 0;
+    int err = 0;
+    while (!err && (len = getline(&line, &size, file)) >= 0) {
+        if (len > 0 && line[len - 1] == '\n')
+            line[--len] = '\0';
+        if (len == 0)
+            continue;
+        char* password = strchr(line, ':');
+        if (password == NULL) {
+            err = -EINVAL;
+            break;
+        }
+        *password++ = '\0';
+        struct passwd* entry = getpwnam(line);
+        if (entry == NULL) {
+            zfscrypt_context_log(self->context, LOG_ERR, "Unknown user %s", line);
+            err = -ENOENT;
+            break;
+        }
+        zfscrypt_provision_user_t* grown = realloc(self->users, (self->len + 1) * sizeof(zfscrypt_provision_user_t));
+        if (grown == NULL) {
+            err = -ENOMEM;
+            break;
+        }
+        self->users = grown;
+        zfscrypt_provision_user_t* user = &self->users[self->len++];
+        *user = (zfscrypt_provision_user_t) {
+            .user = strdup(line),
+            .uid = entry->pw_uid,
+            .gid = entry->pw_gid,
+            .password = secure_dup(password),
+            .password_size = strlen(password) + 1,
+            .dataset = strfmt("%s/%s", self->parent, line),
+            .result = 0};
+        if (user->user == NULL || user->password == NULL || user->dataset == NULL)
+            err = -ENOMEM;
+    }
+    // getline may have grown the buffer, the passwords are somewhere in it
+    if (line != NULL) {
+        explicit_bzero(line, size);
+        free(line);
+    }
+    if (err == -EINVAL)
+        return zfscrypt_err_os(err, "Expected lines of user:password");
+    return zfscrypt_err_os(err, "Read users");
+}
+
+zfscrypt_err_t zfscrypt_provision_run(zfscrypt_provision_t* self) {
+    const unsigned workers = self->context->workers;
+    pthread_t threads[workers == 0 ? 1 : workers];
+    unsigned started = 0;
+    while (started < workers && started < self->len && pthread_create(&threads[started], NULL, zfscrypt_provision_worker, self) == 0)
+        ++started;
+    // without any worker the calling thread provisions the users itself
+    if (started == 0)
+        (void) zfscrypt_provision_worker(self);
+    for (unsigned i = 0; i < started; ++i)
+        pthread_join(threads[i], NULL);
+    self->failed = 0;
+    for (size_t i = 0; i < self->len; ++i)
+        self->failed += self->users[i].result != 0;
+    return self->failed > 0
+        ? zfscrypt_err_os(EIO, "Could not provision some users")
+        : zfscrypt_err_os(0, "Provisioned users");
+}
+
+void zfscrypt_provision_free(zfscrypt_provision_t* self) {
+    for (size_t i = 0; i < self->len; ++i) {
+        free(self->users[i].user);
+        free(self->users[i].dataset);
+        if (self->users[i].password != NULL)
+            secure_free(self->users[i].password, self->users[i].password_size);
+    }
+    free(self->users);
+    self->users = NULL;
+    self->len = 0;
+    pthread_mutex_destroy(&self->mutex);
+}
+
+// private methods
+
+void* zfscrypt_provision_worker(void* data) {
+    zfscrypt_provision_t* self = data;
+    // libzfs handles must not be shared between threads, so every worker opens its own
+    zfscrypt_context_t context = *self->context;
+    context.libzfs = libzfs_init();
+    for (;;) {
+        pthread_mutex_lock(&self->mutex);
+        const size_t index = self->next++;
+        pthread_mutex_unlock(&self->mutex);
+        if (index >= self->len)
+            break;
+        zfscrypt_provision_user_t* user = &self->users[index];
+        user->result = context.libzfs == NULL ? -ENOMEM : zfscrypt_provision_user(self, &context, user);
+        zfscrypt_context_log_err(&context, zfscrypt_err_zfs(user->result, "Provisioned user"));
+    }
+    if (context.libzfs != NULL)
+        libzfs_fini(context.libzfs);
+    return NULL;
+}
+
+int zfscrypt_provision_user(zfscrypt_provision_t* self, zfscrypt_context_t* context, zfscrypt_provision_user_t* user) {
+    uint8_t* key = secure_malloc(ZFSCRYPT_CRYPTO_KEY_LEN);
+    if (key == NULL)
+        return -ENOMEM;
+    uint64_t salt = 0;
+    int err = zfscrypt_crypto_random_salt(&salt);
+    const uint64_t begin = zfscrypt_stats_now();
+    if (!err)
+        err = zfscrypt_crypto_derive_key(user->password, salt, ZFSCRYPT_PROVISION_ITERATIONS, key);
+    zfscrypt_stats_add(&context->timings, ZFSCRYPT_STATS_DERIVE, begin);
+    secure_free(user->password, user->password_size);
+    user->password = NULL;
+    if (!err)
+        err = self->clone ? zfscrypt_provision_clone(self, user, key, salt) : zfscrypt_provision_create(user, key, salt);
+    secure_free(key, ZFSCRYPT_CRYPTO_KEY_LEN);
+    if (err)
+        return err;
+
+    // the key is loaded after creating, the dataset is left unmounted and locked like after a logout
+    zfscrypt_dataset_t dataset = {.context = context, .handle = zfs_open(context->libzfs, user->dataset, ZFS_TYPE_FILESYSTEM), .key = NULL, .new_key = NULL};
+    if (dataset.handle == NULL) {
+        (void) lzc_destroy(user->dataset);
+        return -ENOENT;
+    }
+    err = zfscrypt_provision_allow(context, dataset.handle, user);
+    if (!err)
+        err = zfscrypt_dataset_mount(&dataset);
+    if (!err)
+        err = zfscrypt_provision_populate(self, dataset.handle, user);
+    const int unmounted = zfscrypt_dataset_mounted(&dataset) ? zfscrypt_dataset_unmount(&dataset) : 0;
+    const int unloaded = zfscrypt_dataset_key_loaded(&dataset) ? zfscrypt_dataset_unload_key(&dataset) : 0;
+    zfs_close(dataset.handle);
+    if (!err)
+        err = unmounted ? unmounted : unloaded;
+    // a half provisioned home is destroyed, so provisioning can simply be repeated
+    else if (unmounted)
+        zfscrypt_context_log(context, LOG_ERR, "Could not unmount half provisioned %s, destroy it before provisioning again", user->dataset);
+    else if (lzc_destroy(user->dataset))
+        zfscrypt_context_log(context, LOG_ERR, "Could not destroy half provisioned %s, destroy it before provisioning again", user->dataset);
+    return err;
+}
+
+int zfscrypt_provision_create(zfscrypt_provision_user_t* user, uint8_t* key, const uint64_t salt) {
+    nvlist_t* props = NULL;
+    int err = nvlist_alloc(&props, NV_UNIQUE_NAME, 0);
+    if (!err)
+        err = nvlist_add_string(props, ZFSCRYPT_USER_PROPERTY, user->user);
+    if (!err)
+        err = nvlist_add_uint64(props, zfs_prop_to_name(ZFS_PROP_CANMOUNT), ZFS_CANMOUNT_NOAUTO);
+    // encryption=on, spelled out because only the userland tools resolve it
+    if (!err)
+        err = nvlist_add_uint64(props, zfs_prop_to_name(ZFS_PROP_ENCRYPTION), ZIO_CRYPT_AES_256_GCM);
+    if (!err)
+        err = zfscrypt_provision_key_props(props, salt);
+    if (!err)
+        err = lzc_create(user->dataset, LZC_DATSET_TYPE_ZFS, props, key, ZFSCRYPT_CRYPTO_KEY_LEN);
+    nvlist_free(props);
+    return err;
+}
+
+int zfscrypt_provision_clone(zfscrypt_provision_t* self, zfscrypt_provision_user_t* user, uint8_t* key, const uint64_t salt) {
+    nvlist_t* props = NULL;
+    nvlist_t* key_props = NULL;
+    int err = nvlist_alloc(&props, NV_UNIQUE_NAME, 0);
+    if (!err)
+        err = nvlist_alloc(&key_props, NV_UNIQUE_NAME, 0);
+    if (!err)
+        err = nvlist_add_string(props, ZFSCRYPT_USER_PROPERTY, user->user);
+    if (!err)
+        err = nvlist_add_uint64(props, zfs_prop_to_name(ZFS_PROP_CANMOUNT), ZFS_CANMOUNT_NOAUTO);
+    if (!err)
+        err = zfscrypt_provision_key_props(key_props, salt);
+    // shares the blocks and the encryption root of the skeleton, whose key has to be loaded
+    if (!err)
+        err = lzc_clone(user->dataset, self->skeleton, props);
+    // like zfs change-key on the clone, which becomes an encryption root with the wrapping key of the user
+    if (!err && (err = lzc_change_key(user->dataset, DCP_CMD_NEW_KEY, key_props, key, ZFSCRYPT_CRYPTO_KEY_LEN)))
+        (void) lzc_destroy(user->dataset);
+    nvlist_free(key_props);
+    nvlist_free(props);
+    return err;
+}
+
+int zfscrypt_provision_key_props(nvlist_t* props, const uint64_t salt) {
+    int err = nvlist_add_uint64(props, zfs_prop_to_name(ZFS_PROP_KEYFORMAT), ZFS_KEYFORMAT_PASSPHRASE);
+    if (!err)
+        err = nvlist_add_string(props, zfs_prop_to_name(ZFS_PROP_KEYLOCATION), "prompt");
+    if (!err)
+        err = nvlist_add_uint64(props, zfs_prop_to_name(ZFS_PROP_PBKDF2_SALT), salt);
+    if (!err)
+        err = nvlist_add_uint64(props, zfs_prop_to_name(ZFS_PROP_PBKDF2_ITERS), ZFSCRYPT_PROVISION_ITERATIONS);
+    return err;
+}
+
+int zfscrypt_provision_allow(zfscrypt_context_t* context, zfs_handle_t* handle, zfscrypt_provision_user_t* user) {
+    nvlist_t* acl = NULL;
+    nvlist_t* permissions = NULL;
+    // who keys as built by zfs_deleg_whokey: user, local or descendent, separator and uid
+    defer(free_ptr) char* local = strfmt("ul$%u", (unsigned) user->uid);
+    defer(free_ptr) char* descendent = strfmt("ud$%u", (unsigned) user->uid);
+    int err = local == NULL || descendent == NULL ? -ENOMEM : 0;
+    if (!err)
+        err = nvlist_alloc(&acl, NV_UNIQUE_NAME, 0);
+    if (!err)
+        err = nvlist_alloc(&permissions, NV_UNIQUE_NAME, 0);
+    for (size_t i = 0; !err && i < sizeof(ZFSCRYPT_PROVISION_PERMISSIONS) / sizeof(ZFSCRYPT_PROVISION_PERMISSIONS[0]); ++i)
+        err = nvlist_add_boolean(permissions, ZFSCRYPT_PROVISION_PERMISSIONS[i]);
+    if (!err)
+        err = nvlist_add_nvlist(acl, local, permissions);
+    if (!err)
+        err = nvlist_add_nvlist(acl, descendent, permissions);
+    if (!err && zfs_set_fsacl(handle, B_FALSE, acl))
+        err = libzfs_errno(context->libzfs);
+    nvlist_free(permissions);
+    nvlist_free(acl);
+    return err;
+}
+
+int zfscrypt_provision_populate(zfscrypt_provision_t* self, zfs_handle_t* handle, zfscrypt_provision_user_t* user) {
+    char mountpoint[ZFS_MAXPROPLEN];
+    if (zfs_prop_get(handle, ZFS_PROP_MOUNTPOINT, mountpoint, sizeof(mountpoint), NULL, NULL, 0, B_FALSE))
+        return -EINVAL;
+    defer(free_ptr) char* source = strfmt("%s/.", self->skeleton);
+    defer(free_ptr) char* owner = strfmt("%u:%u", (unsigned) user->uid, (unsigned) user->gid);
+    if (source == NULL || owner == NULL)
+        return -ENOMEM;
+    char* const copy[] = {"cp", "-a", source, mountpoint, NULL};
+    char* const own[] = {"chown", "-R", owner, mountpoint, NULL};
+    // a clone already has the files of the skeleton, but they belong to whoever created them
+    int err = self->clone ? 0 : run_command(copy);
+    if (!err)
+        err = run_command(own);
+    if (!err && chmod(mountpoint, 0700) < 0)
+        err = -errno;
+    return err;
+}
+
+// private constants
+
+const uint64_t ZFSCRYPT_PROVISION_ITERATIONS = 350000;
+const char* const ZFSCRYPT_PROVISION_PERMISSIONS[3] = {"load-key", "change-key", "mount"};
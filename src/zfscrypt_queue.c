@@ -0,0 +1,221 @@
+#include "zfscrypt_queue.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pwd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "zfscrypt_dataset.h"
+#include "zfscrypt_policy.h"
+#include "zfscrypt_utils.h"
+
+// public functions
+
+zfscrypt_err_t zfscrypt_queue_push(zfscrypt_context_t* context) {
+    zfscrypt_err_t err = zfscrypt_session_lock_queue(context->runtime_dir, context->uid);
+    if (err.value)
+        return err;
+    defer(free_ptr) char* path = zfscrypt_queue_trigger_path(context->runtime_dir);
+    const int fd = path == NULL ? -1 : open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0600);
+    const int trigger_err = path == NULL ? ENOMEM : fd < 0 ? errno : 0;
+    if (fd >= 0)
+        close(fd);
+    if (!trigger_err)
+        return zfscrypt_err_os(0, "Queued lock");
+    // without the trigger nobody would lock, unless the worker took the lock in the meantime
+    zfscrypt_session_lock_t state = ZFSCRYPT_SESSION_LOCK_NONE;
+    (void) zfscrypt_session_lock_cancel(&state, context->runtime_dir, context->uid);
+    const bool cancelled = state == ZFSCRYPT_SESSION_LOCK_QUEUED;
+    return zfscrypt_err_os(cancelled ? trigger_err : 0, cancelled ? "Could not trigger lock queue" : "Lock queue took the lock while triggering it");
+}
+
+zfscrypt_err_t zfscrypt_queue_cancel(bool* unlocked, zfscrypt_context_t* context) {
+    *unlocked = false;
+    zfscrypt_session_lock_t state = ZFSCRYPT_SESSION_LOCK_NONE;
+    zfscrypt_err_t err = zfscrypt_session_lock_cancel(&state, context->runtime_dir, context->uid);
+    const struct timespec poll = {.tv_sec = 0, .tv_nsec = ZFSCRYPT_QUEUE_POLL_MS * 1000000L};
+    // the worker gives up before its next unmount or key once it sees the session, so this rarely waits long
+    for (unsigned waited = 0; !err.value && state == ZFSCRYPT_SESSION_LOCK_RUNNING && waited < ZFSCRYPT_QUEUE_WAIT_MS; waited += ZFSCRYPT_QUEUE_POLL_MS) {
+        nanosleep(&poll, NULL);
+        err = zfscrypt_session_lock_cancel(&state, context->runtime_dir, context->uid);
+    }
+    if (err.value)
+        return err;
+    // unlocking now would mount datasets the lock unmounts right after
+    if (state == ZFSCRYPT_SESSION_LOCK_RUNNING)
+        return zfscrypt_err_os(EBUSY, "Queued lock still running");
+    if (state == ZFSCRYPT_SESSION_LOCK_FAILED)
+        zfscrypt_context_log(context, LOG_NOTICE, "%s", "Queued lock had failed, datasets may still be unlocked");
+    *unlocked = state == ZFSCRYPT_SESSION_LOCK_QUEUED;
+    return zfscrypt_err_os(0, *unlocked ? "Cancelled queued lock" : "No queued lock to cancel");
+}
+
+zfscrypt_err_t zfscrypt_queue_run(zfscrypt_context_t* context) {
+    zfscrypt_queue_t self = {.context = context, .registry = NULL, .mutex = PTHREAD_MUTEX_INITIALIZER, .next = 0, .entries = NULL, .len = 0, .capacity = 0};
+    zfscrypt_err_t err = zfscrypt_session_registry_open(&self.registry, context->runtime_dir, true);
+    if (err.value)
+        return err;
+    defer(free_ptr) char* path = zfscrypt_queue_trigger_path(context->runtime_dir);
+    if (path == NULL)
+        err = zfscrypt_err_os(ENOMEM, "Memory allocation failed");
+    size_t served = 0;
+    size_t failed = 0;
+    while (!err.value) {
+        // a lock queued after this recreates the trigger, so the path unit starts the worker again
+        (void) unlink(path);
+        const int collect_err = zfscrypt_queue_collect(&self);
+        if (collect_err)
+            err = zfscrypt_err_os(collect_err, "Could not take queued locks");
+        if (self.len == 0)
+            break;
+        zfscrypt_queue_serve(&self);
+        for (size_t i = 0; i < self.len; ++i)
+            failed += self.entries[i].result != 0 && self.entries[i].result != ECANCELED;
+        served += self.len;
+        zfscrypt_queue_clear(&self);
+    }
+    zfscrypt_queue_clear(&self);
+    free(self.entries);
+    pthread_mutex_destroy(&self.mutex);
+    zfscrypt_session_registry_close(self.registry);
+    if (served > 0)
+        zfscrypt_context_log(context, LOG_INFO, "Served %zu queued lock(s), %zu failed", served, failed);
+    return err.value ? err : zfscrypt_err_os(0, "Served queued locks");
+}
+
+// private methods
+
+int zfscrypt_queue_collect(zfscrypt_queue_t* self) {
+    for (size_t i = 0; i < ZFSCRYPT_SESSION_SLOTS; ++i) {
+        zfscrypt_session_slot_t* slot = &self->registry->slot[i];
+        uid_t uid = 0;
+        if (!zfscrypt_session_slot_uid(slot, &uid) || atomic_load(&slot->lock) != ZFSCRYPT_SESSION_LOCK_QUEUED)
+            continue;
+        if (self->len == self->capacity) {
+            const size_t capacity = self->capacity == 0 ? 16 : self->capacity * 2;
+            zfscrypt_queue_entry_t* entries = realloc(self->entries, capacity * sizeof(zfscrypt_queue_entry_t));
+            // locks left queued are taken by the next round
+            if (entries == NULL)
+                return self->len == 0 ? -ENOMEM : 0;
+            self->entries = entries;
+            self->capacity = capacity;
+        }
+        if (!zfscrypt_session_lock_take(slot))
+            continue;
+        struct passwd const* const entry = getpwuid(uid);
+        char* user = entry == NULL ? NULL : strdup(entry->pw_name);
+        if (user == NULL) {
+            zfscrypt_session_lock_finish(slot, ZFSCRYPT_SESSION_LOCK_FAILED, entry == NULL ? ENOENT : ENOMEM);
+            continue;
+        }
+        self->entries[self->len++] = (zfscrypt_queue_entry_t) {.slot = slot, .uid = uid, .user = user, .result = 0};
+    }
+    return 0;
+}
+
+void zfscrypt_queue_serve(zfscrypt_queue_t* self) {
+    zfscrypt_context_t* context = self->context;
+    // one sync for the whole batch, writing back each dataset before its unmount then finds nothing dirty
+    uint64_t begin = zfscrypt_stats_now();
+    sync();
+    zfscrypt_stats_add(&context->timings, ZFSCRYPT_STATS_SYNC, begin);
+    self->next = 0;
+    const size_t wanted = context->workers < self->len ? context->workers : self->len;
+    pthread_t threads[wanted == 0 ? 1 : wanted];
+    size_t started = 0;
+    while (started < wanted && pthread_create(&threads[started], NULL, zfscrypt_queue_worker, self) == 0)
+        ++started;
+    // without any worker the calling thread locks the users itself
+    if (started == 0)
+        (void) zfscrypt_queue_worker(self);
+    for (size_t i = 0; i < started; ++i)
+        pthread_join(threads[i], NULL);
+    for (size_t i = 0; i < self->len; ++i) {
+        zfscrypt_queue_entry_t* entry = &self->entries[i];
+        // a session opened while locking, its login unlocks what was locked already
+        if (entry->result == ECANCELED)
+            zfscrypt_session_lock_finish(entry->slot, ZFSCRYPT_SESSION_LOCK_NONE, 0);
+        else
+            zfscrypt_session_lock_finish(entry->slot, entry->result ? ZFSCRYPT_SESSION_LOCK_FAILED : ZFSCRYPT_SESSION_LOCK_DONE, entry->result);
+        (void) zfscrypt_session_slot_release(entry->slot);
+    }
+    if (context->drop_caches == ZFSCRYPT_DROP_CACHES_GLOBAL) {
+        begin = zfscrypt_stats_now();
+        (void) drop_filesystem_cache();
+        zfscrypt_stats_add(&context->timings, ZFSCRYPT_STATS_DROP_CACHES, begin);
+    }
+}
+
+void* zfscrypt_queue_worker(void* data) {
+    zfscrypt_queue_t* self = data;
+    // libzfs handles must not be shared between threads, so every worker opens its own
+    zfscrypt_context_t context = *self->context;
+    context.libzfs = libzfs_init();
+    for (;;) {
+        pthread_mutex_lock(&self->mutex);
+        const size_t index = self->next++;
+        pthread_mutex_unlock(&self->mutex);
+        if (index >= self->len)
+            break;
+        zfscrypt_queue_entry_t* entry = &self->entries[index];
+        entry->result = context.libzfs == NULL ? ENOMEM : zfscrypt_queue_lock(&context, entry);
+    }
+    if (context.libzfs != NULL)
+        libzfs_fini(context.libzfs);
+    return NULL;
+}
+
+int zfscrypt_queue_lock(zfscrypt_context_t* context, zfscrypt_queue_entry_t* entry) {
+    const zfscrypt_context_t defaults = *context;
+    context->user = entry->user;
+    context->uid = entry->uid;
+    // stops before the next unmount or key once a login of the user is counted
+    context->guard = entry->slot;
+    zfscrypt_policy_apply(context);
+    int err = 0;
+    for (unsigned attempt = 0; attempt < ZFSCRYPT_QUEUE_ATTEMPTS; ++attempt) {
+        err = zfscrypt_context_log_err(context, zfscrypt_dataset_lock_all_checked(context)).value;
+        // processes of the session that are still exiting keep mounts busy for a moment
+        if (err != EBUSY || attempt + 1 == ZFSCRYPT_QUEUE_ATTEMPTS || !zfscrypt_queue_backoff(entry->slot, ZFSCRYPT_QUEUE_BACKOFF_MS << attempt))
+            break;
+    }
+    zfscrypt_policy_reset(context, &defaults);
+    context->user = NULL;
+    context->uid = (uid_t) -1;
+    context->guard = NULL;
+    return err;
+}
+
+void zfscrypt_queue_clear(zfscrypt_queue_t* self) {
+    for (size_t i = 0; i < self->len; ++i)
+        free(self->entries[i].user);
+    self->len = 0;
+}
+
+// private functions
+
+char* zfscrypt_queue_trigger_path(const char* runtime_dir) {
+    return strfmt("%s/%s", runtime_dir, ZFSCRYPT_QUEUE_TRIGGER_FILE);
+}
+
+bool zfscrypt_queue_backoff(zfscrypt_session_slot_t* slot, const unsigned ms) {
+    const struct timespec poll = {.tv_sec = 0, .tv_nsec = ZFSCRYPT_QUEUE_POLL_MS * 1000000L};
+    for (unsigned slept = 0; slept < ms; slept += ZFSCRYPT_QUEUE_POLL_MS) {
+        if (zfscrypt_session_slot_count(slot) > 0)
+            return false;
+        nanosleep(&poll, NULL);
+    }
+    return zfscrypt_session_slot_count(slot) == 0;
+}
+
+// private constants
+
+const char ZFSCRYPT_QUEUE_TRIGGER_FILE[] = "lock-queue";
+const unsigned ZFSCRYPT_QUEUE_ATTEMPTS = 5;
+const unsigned ZFSCRYPT_QUEUE_BACKOFF_MS = 100;
+const unsigned ZFSCRYPT_QUEUE_WAIT_MS = 30000;
+const unsigned ZFSCRYPT_QUEUE_POLL_MS = 10;
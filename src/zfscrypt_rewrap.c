@@ -0,0 +1,277 @@
+#include "zfscrypt_rewrap.h"
+
+#include <errno.h>
+#include <libzfs_core.h>
+#include <security/pam_modules.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "zfscrypt_crypto.h"
+#include "zfscrypt_dataset.h"
+#include "zfscrypt_trace.h"
+#include "zfscrypt_utils.h"
+
+// Note: like the unlock pipeline, workers only use properties read up front on the calling thread,
+// the key derivation and libzfs_core, which is thread safe.
+
+// public functions
+
+zfscrypt_err_t zfscrypt_rewrap_verify(zfscrypt_plan_t* plan, const unsigned workers) {
+    zfscrypt_rewrap_t self;
+    zfscrypt_err_t err = zfscrypt_err_os(zfscrypt_rewrap_init(&self, plan), "Prepared key check");
+    if (!err.value)
+        err = zfscrypt_rewrap_each(&self, workers, zfscrypt_rewrap_check, "Checked old key of encryption root");
+    zfscrypt_rewrap_free(&self);
+    return err;
+}
+
+zfscrypt_err_t zfscrypt_rewrap_update(zfscrypt_plan_t* plan, const unsigned workers) {
+    zfscrypt_rewrap_t self;
+    zfscrypt_err_t err = zfscrypt_err_os(zfscrypt_rewrap_init(&self, plan), "Prepared key change");
+    // nothing is changed unless the old key opens every root
+    if (!err.value)
+        err = zfscrypt_rewrap_each(&self, workers, zfscrypt_rewrap_check, "Checked old key of encryption root");
+    if (!err.value)
+        err = zfscrypt_rewrap_each(&self, workers, zfscrypt_rewrap_change, "Changed key of encryption root");
+    if (!err.value)
+        err = zfscrypt_rewrap_store(&self, false);
+    if (err.value) {
+        const zfscrypt_err_t restore_err = zfscrypt_rewrap_each(&self, workers, zfscrypt_rewrap_restore, "Restored old key of encryption root");
+        const zfscrypt_err_t store_err = zfscrypt_rewrap_store(&self, true);
+        if (restore_err.value || store_err.value)
+            zfscrypt_context_log(self.context, LOG_CRIT, "%s", "Some encryption roots are still wrapped with the new password");
+    }
+    for (size_t i = 0; i < self.len; ++i) {
+        zfscrypt_rewrap_root_t* root = &self.roots[i];
+        if (!root->loaded)
+            continue;
+        const uint64_t begin = zfscrypt_stats_now();
+        const int unload_err = lzc_unload_key(root->name);
+        zfscrypt_stats_add(&self.context->timings, ZFSCRYPT_STATS_UNLOAD_KEY, begin);
+        zfscrypt_context_log_err(self.context, zfscrypt_err_zfs(unload_err, "Unloaded key loaded for the key change"));
+    }
+    zfscrypt_rewrap_free(&self);
+    return err;
+}
+
+// private methods
+
+int zfscrypt_rewrap_init(zfscrypt_rewrap_t* self, zfscrypt_plan_t* plan) {
+    *self = (zfscrypt_rewrap_t) {
+        .context = plan->context,
+        .mutex = PTHREAD_MUTEX_INITIALIZER,
+        .next = 0,
+        .step = NULL,
+        .roots = calloc(plan->len, sizeof(zfscrypt_rewrap_root_t)),
+        .len = 0};
+    if (plan->len > 0 && self->roots == NULL)
+        return -ENOMEM;
+    for (size_t i = 0; i < plan->len; ++i) {
+        zfscrypt_plan_group_t* group = &plan->groups[i];
+        // children only inherit the key, rewrapping them would turn them into encryption roots
+        if (!group->owned) {
+            zfscrypt_context_log(self->context, LOG_NOTICE, "Not changing key of encryption root %s that belongs to someone else", zfs_get_name(group->root.handle));
+            continue;
+        }
+        zfscrypt_rewrap_root_t* root = &self->roots[self->len++];
+        *root = (zfscrypt_rewrap_root_t) {
+            .group = group,
+            .name = zfs_get_name(group->root.handle),
+            .old_salt = zfs_prop_get_int(group->root.handle, ZFS_PROP_PBKDF2_SALT),
+            .new_salt = 0,
+            .iterations = zfs_prop_get_int(group->root.handle, ZFS_PROP_PBKDF2_ITERS),
+            .guid = zfs_prop_get_int(group->root.handle, ZFS_PROP_GUID),
+            .old_key = secure_malloc(ZFSCRYPT_CRYPTO_KEY_LEN),
+            .new_key = group->root.new_key == NULL ? NULL : secure_malloc(ZFSCRYPT_CRYPTO_KEY_LEN),
+            .sealed = !zfscrypt_dataset_has_passphrase(&group->root),
+            .old_value = "",
+            .new_value = "",
+            .load = !zfscrypt_dataset_key_loaded(&group->root),
+            .loaded = false,
+            .changed = false,
+            .result = 0};
+        if (root->old_key == NULL || (group->root.new_key != NULL && root->new_key == NULL))
+            return -ENOMEM;
+        const char* value = NULL;
+        if (root->sealed && !zfscrypt_dataset_properties_get_key(&group->root, &value) && strlen(value) < sizeof(root->old_value))
+            strcpy(root->old_value, value);
+        // the raw key never changes, so it needs no loading
+        if (root->sealed)
+            root->load = false;
+    }
+    return 0;
+}
+
+zfscrypt_err_t zfscrypt_rewrap_each(zfscrypt_rewrap_t* self, const unsigned workers, zfscrypt_rewrap_step_f step, const char* message) {
+    self->step = step;
+    self->next = 0;
+    pthread_t threads[workers == 0 ? 1 : workers];
+    unsigned started = 0;
+    while (started < workers && started < self->len && pthread_create(&threads[started], NULL, zfscrypt_rewrap_worker, self) == 0)
+        ++started;
+    // without any worker the calling thread takes every step itself
+    if (started == 0)
+        (void) zfscrypt_rewrap_worker(self);
+    for (unsigned i = 0; i < started; ++i)
+        pthread_join(threads[i], NULL);
+    zfscrypt_err_t err = zfscrypt_err_zfs(0, message);
+    for (size_t i = 0; i < self->len; ++i) {
+        const zfscrypt_rewrap_root_t* root = &self->roots[i];
+        const zfscrypt_err_t root_err = zfscrypt_err_zfs(root->result, message);
+        if (root->result)
+            zfscrypt_context_log(self->context, LOG_ERR, "%s %s: %s", message, root->name, root_err.description);
+        if (root->result && !err.value)
+            err = root_err;
+    }
+    // a wrong old password is a matter of the user, not of the system
+    if (err.value == EACCES && step == zfscrypt_rewrap_check)
+        return zfscrypt_err_pam(PAM_AUTHTOK_ERR, "Old password does not open every encryption root");
+    return err;
+}
+
+void* zfscrypt_rewrap_worker(void* data) {
+    zfscrypt_rewrap_t* self = data;
+    for (;;) {
+        pthread_mutex_lock(&self->mutex);
+        const size_t index = self->next++;
+        pthread_mutex_unlock(&self->mutex);
+        if (index >= self->len)
+            return NULL;
+        zfscrypt_rewrap_root_t* root = &self->roots[index];
+        root->result = self->step(self, root);
+    }
+}
+
+int zfscrypt_rewrap_check(zfscrypt_rewrap_t* self, zfscrypt_rewrap_root_t* root) {
+    zfscrypt_dataset_t* dataset = &root->group->root;
+    uint64_t begin = zfscrypt_stats_now();
+    int err = zfscrypt_rewrap_derive_old(root);
+    zfscrypt_stats_add(&self->context->timings, ZFSCRYPT_STATS_DERIVE, begin);
+    if (!err)
+        err = lzc_load_key(root->name, B_TRUE, root->old_key, ZFSCRYPT_CRYPTO_KEY_LEN);
+    if (err || root->new_key == NULL)
+        return err;
+    begin = zfscrypt_stats_now();
+    if (root->sealed) {
+        zfscrypt_keywrap_t keywrap;
+        err = zfscrypt_keywrap_seal(&keywrap, self->context->kdf, self->context->kdf_cost, root->guid, dataset->new_key, root->old_key);
+        if (!err)
+            zfscrypt_keywrap_format(&keywrap, root->new_value);
+    } else {
+        err = zfscrypt_crypto_random_salt(&root->new_salt);
+        if (!err)
+            err = zfscrypt_crypto_derive_key(dataset->new_key, root->new_salt, root->iterations, root->new_key);
+    }
+    zfscrypt_stats_add(&self->context->timings, ZFSCRYPT_STATS_DERIVE, begin);
+    return err;
+}
+
+int zfscrypt_rewrap_derive_old(zfscrypt_rewrap_root_t* root) {
+    zfscrypt_dataset_t* dataset = &root->group->root;
+    if (dataset->derived != NULL) {
+        memcpy(root->old_key, dataset->derived, ZFSCRYPT_CRYPTO_KEY_LEN);
+        return 0;
+    }
+    if (!root->sealed)
+        return zfscrypt_crypto_derive_key(dataset->key, root->old_salt, root->iterations, root->old_key);
+    zfscrypt_keywrap_t keywrap;
+    int err = zfscrypt_keywrap_parse(&keywrap, root->old_value);
+    if (!err)
+        err = zfscrypt_keywrap_open(&keywrap, root->guid, dataset->key, root->old_key);
+    return err;
+}
+
+int zfscrypt_rewrap_change(zfscrypt_rewrap_t* self, zfscrypt_rewrap_root_t* root) {
+    if (root->sealed)
+        return 0;
+    zfscrypt_trace1(change_key__entry, root->name);
+    const uint64_t begin = zfscrypt_stats_now();
+    int err = 0;
+    // the key has to be loaded to be rewrapped, it was derived and checked already
+    if (root->load)
+        err = lzc_load_key(root->name, B_FALSE, root->old_key, ZFSCRYPT_CRYPTO_KEY_LEN);
+    if (root->load && !err)
+        root->loaded = true;
+    if (!err)
+        err = zfscrypt_rewrap_change_key(root->name, root->new_key, root->new_salt, root->iterations);
+    if (!err)
+        root->changed = true;
+    if (!err)
+        zfscrypt_stats_add(&self->context->timings, ZFSCRYPT_STATS_CHANGE_KEY, begin);
+    zfscrypt_trace2(change_key__return, root->name, abs(err));
+    return err;
+}
+
+int zfscrypt_rewrap_restore(zfscrypt_rewrap_t* self, zfscrypt_rewrap_root_t* root) {
+    (void) self;
+    if (!root->changed || root->sealed)
+        return 0;
+    const int err = zfscrypt_rewrap_change_key(root->name, root->old_key, root->old_salt, root->iterations);
+    if (!err)
+        root->changed = false;
+    return err;
+}
+
+zfscrypt_err_t zfscrypt_rewrap_store(zfscrypt_rewrap_t* self, const bool restore) {
+    zfscrypt_err_t err = zfscrypt_err_zfs(0, restore ? "Restored sealed key" : "Sealed key with new password");
+    for (size_t i = 0; i < self->len; ++i) {
+        zfscrypt_rewrap_root_t* root = &self->roots[i];
+        if (!root->sealed || root->changed != restore)
+            continue;
+        const int root_err = zfscrypt_rewrap_set_sealed(self, root, restore ? root->old_value : root->new_value);
+        if (!root_err)
+            root->changed = !restore;
+        if (root_err)
+            zfscrypt_context_log(self->context, LOG_ERR, "Could not store sealed key of %s: %s", root->name, zfscrypt_err_zfs(root_err, "").description);
+        if (root_err && !err.value)
+            err = zfscrypt_err_zfs(root_err, restore ? "Could not restore sealed key" : "Could not seal key with new password");
+        // nothing else is changed once the first root failed
+        if (root_err && !restore)
+            break;
+    }
+    return err;
+}
+
+int zfscrypt_rewrap_set_sealed(zfscrypt_rewrap_t* self, zfscrypt_rewrap_root_t* root, const char* value) {
+    zfscrypt_context_t* context = self->context;
+    // unlike change-key there is no delegation for a single user property, and userprop would let the
+    // user retag the dataset. Opening the sealed key and the noop load have proven the old password.
+    const bool dropped = context->privs.is_dropped;
+    if (dropped && zfscrypt_context_regain_privs(context).value)
+        return EPERM;
+    const int err = zfs_prop_set(root->group->root.handle, ZFSCRYPT_KEY_PROPERTY, value) ? libzfs_errno(context->libzfs) : 0;
+    if (dropped)
+        (void) zfscrypt_context_drop_privs(context);
+    return err;
+}
+
+void zfscrypt_rewrap_free(zfscrypt_rewrap_t* self) {
+    for (size_t i = 0; i < self->len; ++i) {
+        if (self->roots[i].old_key != NULL)
+            secure_free(self->roots[i].old_key, ZFSCRYPT_CRYPTO_KEY_LEN);
+        if (self->roots[i].new_key != NULL)
+            secure_free(self->roots[i].new_key, ZFSCRYPT_CRYPTO_KEY_LEN);
+    }
+    free(self->roots);
+    self->roots = NULL;
+    self->len = 0;
+    pthread_mutex_destroy(&self->mutex);
+}
+
+// private functions
+
+int zfscrypt_rewrap_change_key(const char* name, uint8_t* key, const uint64_t salt, const uint64_t iterations) {
+    nvlist_t* props = NULL;
+    int err = nvlist_alloc(&props, NV_UNIQUE_NAME, 0);
+    if (!err)
+        err = nvlist_add_uint64(props, zfs_prop_to_name(ZFS_PROP_KEYFORMAT), ZFS_KEYFORMAT_PASSPHRASE);
+    if (!err)
+        err = nvlist_add_uint64(props, zfs_prop_to_name(ZFS_PROP_PBKDF2_SALT), salt);
+    if (!err)
+        err = nvlist_add_uint64(props, zfs_prop_to_name(ZFS_PROP_PBKDF2_ITERS), iterations);
+    if (!err)
+        err = lzc_change_key(name, DCP_CMD_NEW_KEY, props, key, ZFSCRYPT_CRYPTO_KEY_LEN);
+    nvlist_free(props);
+    return err;
+}
@@ -2,38 +2,450 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/file.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
+#include "zfscrypt_trace.h"
 #include "zfscrypt_utils.h"
 
+// The writable mapping is kept for the lifetime of the module, so the close of a session
+// reuses the mapping created by its open.
+static pthread_mutex_t zfscrypt_session_mutex = PTHREAD_MUTEX_INITIALIZER;
+static zfscrypt_session_registry_t* zfscrypt_session_cached = NULL;
+
+// pam_end unloads the module, its mapping must not outlive it
+__attribute__((destructor)) static void zfscrypt_session_unmap(void) {
+    if (zfscrypt_session_cached != NULL)
+        munmap(zfscrypt_session_cached, sizeof(zfscrypt_session_registry_t));
+    zfscrypt_session_cached = NULL;
+}
+
 // public functions
 
-zfscrypt_err_t zfscrypt_session_counter_update(int* result, const char* base_dir, const char* file_name, const int delta) {
-    int err = make_private_dir(base_dir);
+zfscrypt_err_t zfscrypt_session_counter_update(int* result, const char* base_dir, const uid_t uid, const int delta) {
+    if (uid == (uid_t) -1)
+        return zfscrypt_err_os(EINVAL, "Unknown uid");
+    if (uid >= (uid_t) ZFSCRYPT_SESSION_RELEASED - 1)
+        return zfscrypt_err_os(EINVAL, "Uid does not fit into session registry");
+    zfscrypt_session_registry_t* registry = NULL;
+    zfscrypt_err_t err = zfscrypt_session_registry_open(&registry, base_dir, true);
+    if (err.value)
+        return err;
+    zfscrypt_session_slot_t* slot = zfscrypt_session_slot_find(registry, uid);
+    const uint32_t pid = getpid();
+    int claim_err = 0;
+    // a slot released between finding and counting is claimed again
+    for (int i = 0; !claim_err && i < delta; ++i)
+        while (!claim_err && (slot == NULL || !zfscrypt_session_slot_add(slot, uid, pid)))
+            claim_err = zfscrypt_session_slot_claim(&slot, registry, base_dir, uid);
+    // closing a session that was never counted must not lock the datasets under other sessions
+    const int update_err = claim_err ? claim_err : slot == NULL && delta < 0 ? -ENOENT : 0;
+    if (update_err) {
+        zfscrypt_trace4(session__update, uid, delta, 0, -update_err);
+        zfscrypt_session_registry_close(registry);
+        return zfscrypt_err_os(update_err, update_err == -ENOSPC ? "Session registry is full" : claim_err ? "Could not claim session slot" : "Session was not counted");
+    }
+    for (int i = 0; slot != NULL && i > delta; --i)
+        zfscrypt_session_slot_remove(slot, pid);
+    // only worth checking when it prevents locking the datasets
+    if (slot != NULL && delta < 0 && zfscrypt_session_slot_count(slot) > 0)
+        zfscrypt_session_slot_reap(slot);
+    *result = slot == NULL ? 0 : (int) zfscrypt_session_slot_count(slot);
+    zfscrypt_trace4(session__update, uid, delta, *result, 0);
+    zfscrypt_session_registry_close(registry);
+    return zfscrypt_err_os(0, "Updated session counter");
+}
+
+zfscrypt_err_t zfscrypt_session_counter_get(int* result, const char* base_dir, const uid_t uid) {
+    zfscrypt_session_registry_t* registry = NULL;
+    zfscrypt_err_t err = zfscrypt_session_registry_open(&registry, base_dir, false);
+    if (err.value == ENOENT) {
+        *result = 0;
+        return zfscrypt_err_os(0, "No sessions registered");
+    }
+    if (err.value)
+        return err;
+    zfscrypt_session_slot_t* slot = zfscrypt_session_slot_find(registry, uid);
+    *result = slot == NULL ? 0 : (int) zfscrypt_session_slot_count(slot);
+    zfscrypt_session_registry_close(registry);
+    return zfscrypt_err_os(0, "Read session counter");
+}
+
+zfscrypt_err_t zfscrypt_session_state_get(uint64_t* result, const char* base_dir, const uid_t uid) {
+    zfscrypt_session_registry_t* registry = NULL;
+    zfscrypt_err_t err = zfscrypt_session_registry_open(&registry, base_dir, false);
+    *result = 0;
+    if (err.value == ENOENT)
+        return zfscrypt_err_os(0, "No sessions registered");
+    if (err.value)
+        return err;
+    zfscrypt_session_slot_t* slot = zfscrypt_session_slot_find(registry, uid);
+    if (slot != NULL)
+        *result = atomic_load(&slot->state);
+    zfscrypt_session_registry_close(registry);
+    return zfscrypt_err_os(0, "Read session state");
+}
+
+zfscrypt_err_t zfscrypt_session_linger(const char* base_dir, const uid_t uid, const uint64_t deadline) {
+    zfscrypt_session_registry_t* registry = NULL;
+    const zfscrypt_err_t err = zfscrypt_session_registry_open(&registry, base_dir, true);
+    if (err.value)
+        return err;
+    zfscrypt_session_slot_t* slot = zfscrypt_session_slot_find(registry, uid);
+    const bool idle = slot != NULL && zfscrypt_session_slot_count(slot) == 0;
+    if (idle)
+        atomic_store(&slot->deadline, deadline);
+    zfscrypt_session_registry_close(registry);
+    return zfscrypt_err_os(idle ? 0 : EBUSY, "Lingering after last session");
+}
+
+zfscrypt_err_t zfscrypt_session_linger_cancel(bool* cancelled, const char* base_dir, const uid_t uid) {
+    *cancelled = false;
+    zfscrypt_session_registry_t* registry = NULL;
+    const zfscrypt_err_t err = zfscrypt_session_registry_open(&registry, base_dir, true);
+    if (err.value)
+        return err;
+    zfscrypt_session_slot_t* slot = zfscrypt_session_slot_find(registry, uid);
+    // races with zfscrypt_session_linger_expire, whoever clears the deadline decides
+    uint64_t deadline = slot == NULL ? 0 : atomic_load(&slot->deadline);
+    *cancelled = deadline != 0 && atomic_compare_exchange_strong(&slot->deadline, &deadline, 0);
+    zfscrypt_session_registry_close(registry);
+    return zfscrypt_err_os(0, "Cancelled lingering");
+}
+
+zfscrypt_session_slot_t* zfscrypt_session_linger_expire(zfscrypt_session_registry_t* registry, const uid_t uid, const uint64_t deadline) {
+    zfscrypt_session_slot_t* slot = zfscrypt_session_slot_find(registry, uid);
+    uint64_t expected = deadline;
+    if (slot == NULL || !atomic_compare_exchange_strong(&slot->deadline, &expected, 0))
+        return NULL;
+    // a login that lost the deadline to this waits for the running lock, like for one from the queue
+    uint32_t lock = atomic_load(&slot->lock);
+    do {
+        if (lock == ZFSCRYPT_SESSION_LOCK_QUEUED || lock == ZFSCRYPT_SESSION_LOCK_RUNNING)
+            return NULL;
+    } while (!atomic_compare_exchange_weak(&slot->lock, &lock, ZFSCRYPT_SESSION_LOCK_RUNNING));
+    atomic_store(&slot->locker, getpid());
+    // a session that is counted, but has not cancelled yet, keeps its datasets
+    if (zfscrypt_session_slot_count(slot) == 0)
+        return slot;
+    atomic_store(&slot->locker, 0);
+    atomic_store(&slot->lock, ZFSCRYPT_SESSION_LOCK_NONE);
+    return NULL;
+}
+
+zfscrypt_err_t zfscrypt_session_lock_queue(const char* base_dir, const uid_t uid) {
+    zfscrypt_session_registry_t* registry = NULL;
+    const zfscrypt_err_t err = zfscrypt_session_registry_open(&registry, base_dir, true);
+    if (err.value)
+        return err;
+    zfscrypt_session_slot_t* slot = zfscrypt_session_slot_find(registry, uid);
+    const bool idle = slot != NULL && zfscrypt_session_slot_count(slot) == 0;
+    if (idle) {
+        atomic_store(&slot->lock_err, 0);
+        atomic_store(&slot->lock, ZFSCRYPT_SESSION_LOCK_QUEUED);
+    }
+    zfscrypt_session_registry_close(registry);
+    return zfscrypt_err_os(idle ? 0 : EBUSY, "Queued lock after last session");
+}
+
+zfscrypt_err_t zfscrypt_session_lock_cancel(zfscrypt_session_lock_t* state, const char* base_dir, const uid_t uid) {
+    *state = ZFSCRYPT_SESSION_LOCK_NONE;
+    zfscrypt_session_registry_t* registry = NULL;
+    const zfscrypt_err_t err = zfscrypt_session_registry_open(&registry, base_dir, true);
+    if (err.value)
+        return err;
+    zfscrypt_session_slot_t* slot = zfscrypt_session_slot_find(registry, uid);
+    uint32_t current = slot == NULL ? ZFSCRYPT_SESSION_LOCK_NONE : atomic_load(&slot->lock);
+    // races with zfscrypt_session_lock_take, whoever moves the lock out of queued decides
+    while (current != ZFSCRYPT_SESSION_LOCK_NONE && current != ZFSCRYPT_SESSION_LOCK_RUNNING && !atomic_compare_exchange_weak(&slot->lock, &current, ZFSCRYPT_SESSION_LOCK_NONE))
+        continue;
+    // a locker that died left its datasets half locked, which is reported like a failed lock, a lock
+    // moved to running by a process that has not stored its pid yet counts as alive
+    const int32_t locker = current == ZFSCRYPT_SESSION_LOCK_RUNNING ? atomic_load(&slot->locker) : 0;
+    if (locker > 0 && !zfscrypt_session_pid_alive(locker) && atomic_compare_exchange_strong(&slot->lock, &current, ZFSCRYPT_SESSION_LOCK_NONE))
+        current = ZFSCRYPT_SESSION_LOCK_FAILED;
+    *state = current;
+    zfscrypt_session_registry_close(registry);
+    return zfscrypt_err_os(0, "Cancelled queued lock");
+}
+
+bool zfscrypt_session_lock_take(zfscrypt_session_slot_t* slot) {
+    uint32_t expected = ZFSCRYPT_SESSION_LOCK_QUEUED;
+    if (!atomic_compare_exchange_strong(&slot->lock, &expected, ZFSCRYPT_SESSION_LOCK_RUNNING))
+        return false;
+    atomic_store(&slot->locker, getpid());
+    // a session that is counted, but has not cancelled yet, waits for the running lock and keeps its datasets
+    if (zfscrypt_session_slot_count(slot) == 0)
+        return true;
+    atomic_store(&slot->locker, 0);
+    atomic_store(&slot->lock, ZFSCRYPT_SESSION_LOCK_NONE);
+    return false;
+}
+
+void zfscrypt_session_lock_finish(zfscrypt_session_slot_t* slot, const zfscrypt_session_lock_t state, const int err) {
+    atomic_store(&slot->lock_err, err);
+    atomic_store(&slot->locker, 0);
+    atomic_store(&slot->lock, state);
+}
+
+zfscrypt_err_t zfscrypt_session_release(const char* base_dir, const uid_t uid) {
+    zfscrypt_session_registry_t* registry = NULL;
+    const zfscrypt_err_t err = zfscrypt_session_registry_open(&registry, base_dir, true);
+    if (err.value)
+        return err;
+    zfscrypt_session_slot_t* slot = zfscrypt_session_slot_find(registry, uid);
+    const bool released = slot != NULL && zfscrypt_session_slot_release(slot);
+    zfscrypt_session_registry_close(registry);
+    return zfscrypt_err_os(0, released ? "Released session slot" : "Session slot still in use");
+}
+
+uint32_t zfscrypt_session_slot_count(zfscrypt_session_slot_t* slot) {
+    return atomic_load(&slot->state) & 0xffff;
+}
+
+bool zfscrypt_session_slot_uid(zfscrypt_session_slot_t* slot, uid_t* uid) {
+    const uint32_t owner = atomic_load(&slot->state) >> 32;
+    if (owner == 0 || owner == ZFSCRYPT_SESSION_RELEASED)
+        return false;
+    *uid = owner - 1;
+    return true;
+}
+
+bool zfscrypt_session_slot_release(zfscrypt_session_slot_t* slot) {
+    uint64_t state = atomic_load(&slot->state);
+    const uint32_t owner = state >> 32;
+    if (owner == 0 || owner == ZFSCRYPT_SESSION_RELEASED || (state & 0xffff) != 0)
+        return false;
+    // a failed lock is kept until the next login of its user reports it
+    const uint32_t lock = atomic_load(&slot->lock);
+    if (atomic_load(&slot->deadline) != 0 || (lock != ZFSCRYPT_SESSION_LOCK_NONE && lock != ZFSCRYPT_SESSION_LOCK_DONE))
+        return false;
+    // deadlines and locks are only set after a logout, whose login changed the generation
+    return atomic_compare_exchange_strong(&slot->state, &state, (uint64_t) ZFSCRYPT_SESSION_RELEASED << 32);
+}
+
+zfscrypt_err_t zfscrypt_session_registry_open(zfscrypt_session_registry_t** registry, const char* base_dir, const bool writable) {
+    pthread_mutex_lock(&zfscrypt_session_mutex);
+    const bool cached = writable && zfscrypt_session_cached != NULL;
+    if (cached)
+        *registry = zfscrypt_session_cached;
+    pthread_mutex_unlock(&zfscrypt_session_mutex);
+    if (cached)
+        return zfscrypt_err_os(0, "Reused session registry");
+
+    const int err = writable ? make_private_dir(base_dir) : 0;
     if (err)
         return zfscrypt_err_os(err, "Could not create private dir");
-
-    defer(free_ptr) char* path = strfmt("%s/%s", base_dir, file_name);
+    defer(free_ptr) char* path = strfmt("%s/%s", base_dir, ZFSCRYPT_SESSION_REGISTRY_FILE);
     if (path == NULL)
         return zfscrypt_err_os(errno, "Memory allocation failed");
-    const int fd = open_exclusive(path, O_RDWR | O_CLOEXEC | O_CREAT | O_NOFOLLOW);
+    zfscrypt_session_registry_t* mapped = NULL;
+    int map_err = zfscrypt_session_registry_map(&mapped, path, writable);
+    // left behind by an older version of the module, refusing it would refuse every login
+    if (map_err == -EPROTO && writable) {
+        const int replace_err = zfscrypt_session_registry_replace(base_dir, path);
+        if (replace_err)
+            return zfscrypt_err_os(replace_err, "Could not replace outdated session registry");
+        map_err = zfscrypt_session_registry_map(&mapped, path, writable);
+    }
+    if (map_err)
+        return zfscrypt_err_os(map_err, map_err == -EPROTO ? "Session registry has unknown layout" : "Could not map session registry");
+    *registry = mapped;
+    pthread_mutex_lock(&zfscrypt_session_mutex);
+    if (writable && zfscrypt_session_cached == NULL)
+        zfscrypt_session_cached = mapped;
+    pthread_mutex_unlock(&zfscrypt_session_mutex);
+    return zfscrypt_err_os(0, "Mapped session registry");
+}
+
+void zfscrypt_session_registry_close(zfscrypt_session_registry_t* registry) {
+    pthread_mutex_lock(&zfscrypt_session_mutex);
+    const bool cached = registry == zfscrypt_session_cached;
+    pthread_mutex_unlock(&zfscrypt_session_mutex);
+    if (!cached)
+        munmap(registry, sizeof(zfscrypt_session_registry_t));
+}
+
+bool zfscrypt_session_pid_alive(const uint32_t pid) {
+    return kill((pid_t) pid, 0) == 0 || errno == EPERM;
+}
+
+// private functions
+
+zfscrypt_session_slot_t* zfscrypt_session_slot_find(zfscrypt_session_registry_t* registry, const uid_t uid) {
+    if (uid >= (uid_t) ZFSCRYPT_SESSION_RELEASED - 1)
+        return NULL;
+    return zfscrypt_session_slot_probe(registry, uid, NULL);
+}
+
+int zfscrypt_session_slot_claim(zfscrypt_session_slot_t** slot, zfscrypt_session_registry_t* registry, const char* base_dir, const uid_t uid) {
+    defer(close_fd) int fd = zfscrypt_session_lock_dir(base_dir);
     if (fd < 0)
-        return zfscrypt_err_os(fd, "Could not open file exclusively");
-
-    defer(close_file) FILE* file = fdopen(fd, "w+");
-    if (file == NULL)
-        return zfscrypt_err_os(errno, "Could not create file from fd");
-    int value = 0;
-    (void) fscanf(file, "%d", &value);
-    value = value < 0 ? 0 : value;
-    value += delta;
-    value = value < 0 ? 0 : value;
-    rewind(file);
-    err = fprintf(file, "%d", value);
-    if (err < 0)
-        return zfscrypt_err_os(errno, "Could not write file");
-    *result = value;
-    return zfscrypt_err_os(0, "Updated session counter");
+        return fd;
+    // another login of the user may have claimed a slot while this waited for the lock
+    zfscrypt_session_slot_t* free_slot = NULL;
+    *slot = zfscrypt_session_slot_probe(registry, uid, &free_slot);
+    if (*slot != NULL)
+        return 0;
+    if (free_slot == NULL) {
+        zfscrypt_session_slot_sweep(registry);
+        (void) zfscrypt_session_slot_probe(registry, uid, &free_slot);
+    }
+    if (free_slot == NULL)
+        return -ENOSPC;
+    // nobody touches a released slot, so it is reset before lookups can see it again
+    for (size_t i = 0; i < ZFSCRYPT_SESSION_PIDS; ++i)
+        atomic_store(&free_slot->pids[i], 0);
+    atomic_store(&free_slot->deadline, 0);
+    atomic_store(&free_slot->lock, ZFSCRYPT_SESSION_LOCK_NONE);
+    atomic_store(&free_slot->lock_err, 0);
+    atomic_store(&free_slot->locker, 0);
+    atomic_store(&free_slot->state, (uint64_t) ((uint32_t) uid + 1) << 32);
+    *slot = free_slot;
+    return 0;
+}
+
+zfscrypt_session_slot_t* zfscrypt_session_slot_probe(zfscrypt_session_registry_t* registry, const uid_t uid, zfscrypt_session_slot_t** free_slot) {
+    const uint32_t owner = (uint32_t) uid + 1;
+    // released slots may sit in the middle of a probe sequence, only a slot that was never used ends it
+    for (uint32_t i = 0; i < ZFSCRYPT_SESSION_SLOTS; ++i) {
+        zfscrypt_session_slot_t* slot = &registry->slot[(uid + i) % ZFSCRYPT_SESSION_SLOTS];
+        const uint32_t current = atomic_load(&slot->state) >> 32;
+        if (current == owner)
+            return slot;
+        if ((current == 0 || current == ZFSCRYPT_SESSION_RELEASED) && free_slot != NULL && *free_slot == NULL)
+            *free_slot = slot;
+        if (current == 0)
+            return NULL;
+    }
+    return NULL;
+}
+
+void zfscrypt_session_slot_sweep(zfscrypt_session_registry_t* registry) {
+    // only a full registry pays for this, it gives back the slots of users whose sessions crashed
+    for (size_t i = 0; i < ZFSCRYPT_SESSION_SLOTS; ++i) {
+        zfscrypt_session_slot_t* slot = &registry->slot[i];
+        uid_t uid = 0;
+        if (!zfscrypt_session_slot_uid(slot, &uid))
+            continue;
+        if (zfscrypt_session_slot_count(slot) > 0)
+            zfscrypt_session_slot_reap(slot);
+        (void) zfscrypt_session_slot_release(slot);
+    }
+}
+
+bool zfscrypt_session_slot_add(zfscrypt_session_slot_t* slot, const uid_t uid, const uint32_t pid) {
+    const uint64_t owner = (uint64_t) ((uint32_t) uid + 1) << 32;
+    uint64_t state = atomic_load(&slot->state);
+    for (;;) {
+        if ((state >> 32) != (owner >> 32))
+            return false;
+        const uint64_t generation = ((state >> 16) + 1) & 0xffff;
+        const uint64_t count = (state & 0xffff) + ((state & 0xffff) < 0xffff);
+        if (atomic_compare_exchange_weak(&slot->state, &state, owner | generation << 16 | count))
+            break;
+    }
+    for (size_t i = 0; i < ZFSCRYPT_SESSION_PIDS; ++i) {
+        uint32_t expected = 0;
+        if (atomic_compare_exchange_strong(&slot->pids[i], &expected, pid))
+            break;
+    }
+    return true;
 }
+
+void zfscrypt_session_slot_remove(zfscrypt_session_slot_t* slot, const uint32_t pid) {
+    for (size_t i = 0; i < ZFSCRYPT_SESSION_PIDS; ++i) {
+        uint32_t expected = pid;
+        if (atomic_compare_exchange_strong(&slot->pids[i], &expected, 0))
+            break;
+    }
+    zfscrypt_session_slot_decrement(slot);
+}
+
+void zfscrypt_session_slot_reap(zfscrypt_session_slot_t* slot) {
+    for (size_t i = 0; i < ZFSCRYPT_SESSION_PIDS; ++i) {
+        uint32_t pid = atomic_load(&slot->pids[i]);
+        // whoever clears the entry accounts for the session
+        if (pid != 0 && !zfscrypt_session_pid_alive(pid) && atomic_compare_exchange_strong(&slot->pids[i], &pid, 0))
+            zfscrypt_session_slot_decrement(slot);
+    }
+}
+
+void zfscrypt_session_slot_decrement(zfscrypt_session_slot_t* slot) {
+    uint64_t state = atomic_load(&slot->state);
+    while ((state & 0xffff) > 0 && !atomic_compare_exchange_weak(&slot->state, &state, state - 1))
+        continue;
+}
+
+int zfscrypt_session_lock_dir(const char* base_dir) {
+    const int fd = open(base_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        return -errno;
+    while (flock(fd, LOCK_EX) < 0) {
+        if (errno == EINTR)
+            continue;
+        const int err = -errno;
+        close(fd);
+        return err;
+    }
+    return fd;
+}
+
+int zfscrypt_session_registry_map(zfscrypt_session_registry_t** registry, const char* path, const bool writable) {
+    void* data = NULL;
+    const int err = map_shared_file(&data, path, sizeof(zfscrypt_session_registry_t), writable);
+    if (err)
+        return err;
+    zfscrypt_session_registry_t* mapped = data;
+    if (writable && atomic_load(&mapped->magic) == 0) {
+        mapped->version = ZFSCRYPT_SESSION_VERSION;
+        mapped->slots = ZFSCRYPT_SESSION_SLOTS;
+        atomic_store(&mapped->magic, ZFSCRYPT_SESSION_MAGIC);
+    }
+    const uint32_t magic = atomic_load(&mapped->magic);
+    if (magic != 0 && (magic != ZFSCRYPT_SESSION_MAGIC || mapped->version != ZFSCRYPT_SESSION_VERSION)) {
+        munmap(data, sizeof(zfscrypt_session_registry_t));
+        return -EPROTO;
+    }
+    *registry = mapped;
+    return 0;
+}
+
+int zfscrypt_session_registry_replace(const char* base_dir, const char* path) {
+    defer(close_fd) int lock_fd = zfscrypt_session_lock_dir(base_dir);
+    if (lock_fd < 0)
+        return lock_fd;
+    // another login may have replaced it while this waited for the lock
+    zfscrypt_session_registry_t* mapped = NULL;
+    const int map_err = zfscrypt_session_registry_map(&mapped, path, false);
+    if (map_err != -EPROTO) {
+        if (mapped != NULL)
+            munmap(mapped, sizeof(zfscrypt_session_registry_t));
+        return map_err == -ENOENT ? 0 : map_err;
+    }
+    // sessions of the old layout are forgotten, their logouts find no slot and leave the datasets alone
+    defer(free_ptr) char* temp = strfmt("%s/.%s.XXXXXX", base_dir, ZFSCRYPT_SESSION_REGISTRY_FILE);
+    if (temp == NULL)
+        return -ENOMEM;
+    defer(close_fd) int fd = mkstemp(temp);
+    if (fd < 0)
+        return -errno;
+    if (ftruncate(fd, sizeof(zfscrypt_session_registry_t)) < 0 || rename(temp, path) < 0) {
+        const int err = -errno;
+        (void) unlink(temp);
+        return err;
+    }
+    return 0;
+}
+
+// private constants
+
+const char ZFSCRYPT_SESSION_REGISTRY_FILE[] = "sessions";
+// "ZFSC" in little endian
+const uint32_t ZFSCRYPT_SESSION_MAGIC = 0x4353465a;
+const uint32_t ZFSCRYPT_SESSION_VERSION = 5;
@@ -0,0 +1,159 @@
+#include "zfscrypt_stats.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include "zfscrypt_utils.h"
+
+// Like the session registry, the writable mapping is reused by all calls of the module.
+static pthread_mutex_t zfscrypt_stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+static zfscrypt_stats_file_t* zfscrypt_stats_cached = NULL;
+
+__attribute__((destructor)) static void zfscrypt_stats_unmap(void) {
+    if (zfscrypt_stats_cached != NULL)
+        munmap(zfscrypt_stats_cached, sizeof(zfscrypt_stats_file_t));
+    zfscrypt_stats_cached = NULL;
+}
+
+// public functions
+
+uint64_t zfscrypt_stats_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void zfscrypt_stats_reset(zfscrypt_stats_timings_t* timings) {
+    timings->begin = zfscrypt_stats_now();
+    for (size_t i = 0; i < ZFSCRYPT_STATS_METRICS; ++i) {
+        atomic_store(&timings->ns[i], 0);
+        atomic_store(&timings->count[i], 0);
+    }
+}
+
+void zfscrypt_stats_add(zfscrypt_stats_timings_t* timings, const zfscrypt_stats_metric_t phase, const uint64_t begin) {
+    atomic_fetch_add(&timings->ns[phase], zfscrypt_stats_now() - begin);
+    atomic_fetch_add(&timings->count[phase], 1);
+}
+
+zfscrypt_err_t zfscrypt_stats_record(zfscrypt_stats_timings_t* timings, const char* base_dir, const zfscrypt_stats_metric_t call, const bool failed) {
+    atomic_store(&timings->ns[call], zfscrypt_stats_now() - timings->begin);
+    atomic_store(&timings->count[call], 1);
+    zfscrypt_stats_file_t* file = NULL;
+    const zfscrypt_err_t err = zfscrypt_stats_file_open(&file, base_dir, true);
+    if (err.value)
+        return err;
+    zfscrypt_stats_observe(&file->histograms[call], atomic_load(&timings->ns[call]));
+    if (failed)
+        atomic_fetch_add(&file->histograms[call].errors, 1);
+    for (size_t i = ZFSCRYPT_STATS_CALLS; i < ZFSCRYPT_STATS_METRICS; ++i)
+        if (atomic_load(&timings->count[i]) > 0)
+            zfscrypt_stats_observe(&file->histograms[i], atomic_load(&timings->ns[i]));
+    zfscrypt_stats_file_close(file);
+    return zfscrypt_err_os(0, "Recorded stats");
+}
+
+zfscrypt_err_t zfscrypt_stats_file_open(zfscrypt_stats_file_t** file, const char* base_dir, const bool writable) {
+    pthread_mutex_lock(&zfscrypt_stats_mutex);
+    const bool cached = writable && zfscrypt_stats_cached != NULL;
+    if (cached)
+        *file = zfscrypt_stats_cached;
+    pthread_mutex_unlock(&zfscrypt_stats_mutex);
+    if (cached)
+        return zfscrypt_err_os(0, "Reused stats file");
+
+    const int err = writable ? make_private_dir(base_dir) : 0;
+    if (err)
+        return zfscrypt_err_os(err, "Could not create private dir");
+    defer(free_ptr) char* path = strfmt("%s/%s", base_dir, ZFSCRYPT_STATS_FILE_NAME);
+    if (path == NULL)
+        return zfscrypt_err_os(errno, "Memory allocation failed");
+    void* data = NULL;
+    const int map_err = map_shared_file(&data, path, sizeof(zfscrypt_stats_file_t), writable);
+    if (map_err)
+        return zfscrypt_err_os(map_err, "Could not map stats file");
+    zfscrypt_stats_file_t* mapped = data;
+    if (writable && atomic_load(&mapped->magic) == 0) {
+        mapped->version = ZFSCRYPT_STATS_VERSION;
+        atomic_store(&mapped->magic, ZFSCRYPT_STATS_MAGIC);
+    }
+    const uint32_t magic = atomic_load(&mapped->magic);
+    if (magic != 0 && (magic != ZFSCRYPT_STATS_MAGIC || mapped->version != ZFSCRYPT_STATS_VERSION)) {
+        munmap(data, sizeof(zfscrypt_stats_file_t));
+        return zfscrypt_err_os(EPROTO, "Stats file has unknown layout");
+    }
+    *file = mapped;
+    pthread_mutex_lock(&zfscrypt_stats_mutex);
+    if (writable && zfscrypt_stats_cached == NULL)
+        zfscrypt_stats_cached = mapped;
+    pthread_mutex_unlock(&zfscrypt_stats_mutex);
+    return zfscrypt_err_os(0, "Mapped stats file");
+}
+
+void zfscrypt_stats_file_close(zfscrypt_stats_file_t* file) {
+    pthread_mutex_lock(&zfscrypt_stats_mutex);
+    const bool cached = file == zfscrypt_stats_cached;
+    pthread_mutex_unlock(&zfscrypt_stats_mutex);
+    if (!cached)
+        munmap(file, sizeof(zfscrypt_stats_file_t));
+}
+
+uint64_t zfscrypt_stats_quantile(zfscrypt_stats_histogram_t* histogram, const double q) {
+    const uint64_t count = atomic_load(&histogram->count);
+    if (count == 0)
+        return 0;
+    const uint64_t rank = (uint64_t) (q * count + 0.5) < 1 ? 1 : (uint64_t) (q * count + 0.5);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < ZFSCRYPT_STATS_BUCKETS - 1; ++i)
+        if ((seen += atomic_load(&histogram->buckets[i])) >= rank)
+            return ZFSCRYPT_STATS_BOUNDS_US[i];
+    return UINT64_MAX;
+}
+
+// private functions
+
+size_t zfscrypt_stats_bucket(const uint64_t us) {
+    size_t i = 0;
+    while (i < ZFSCRYPT_STATS_BUCKETS - 1 && us > ZFSCRYPT_STATS_BOUNDS_US[i])
+        ++i;
+    return i;
+}
+
+void zfscrypt_stats_observe(zfscrypt_stats_histogram_t* histogram, const uint64_t ns) {
+    const uint64_t us = ns / 1000;
+    atomic_fetch_add(&histogram->buckets[zfscrypt_stats_bucket(us)], 1);
+    atomic_fetch_add(&histogram->sum_us, us);
+    atomic_fetch_add(&histogram->count, 1);
+}
+
+// private constants
+
+const char ZFSCRYPT_STATS_FILE_NAME[] = "stats";
+// "ZCST" in little endian
+const uint32_t ZFSCRYPT_STATS_MAGIC = 0x5453435a;
+const uint32_t ZFSCRYPT_STATS_VERSION = 2;
+const uint64_t ZFSCRYPT_STATS_BOUNDS_US[ZFSCRYPT_STATS_BUCKETS - 1] = {
+    100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000, 2500000, 5000000,
+};
+const char* const ZFSCRYPT_STATS_NAMES[ZFSCRYPT_STATS_METRICS] = {
+    "authenticate",
+    "open_session",
+    "close_session",
+    "chauthtok_prelim",
+    "chauthtok",
+    "init",
+    "discover",
+    "validate",
+    "derive",
+    "load_key",
+    "mount",
+    "sync",
+    "unmount",
+    "unload_key",
+    "change_key",
+    "drop_caches",
+};
@@ -1,7 +1,10 @@
 #include "zfscrypt_utils.h"
 
 #include <assert.h>
+#include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <spawn.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -9,7 +12,9 @@
 #include <sys/file.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
 // public functions
@@ -35,6 +40,16 @@ void close_fd(int const* fd) {
     }
 }
 
+// from https://github.com/systemd/systemd/blob/master/src/basic/strv.h
+void strv_free(char*** strv) {
+    if (*strv == NULL)
+        return;
+    for (char** item = *strv; *item != NULL; ++item)
+        free(*item);
+    free(*strv);
+    *strv = NULL;
+}
+
 bool streq(const char* a, const char* b) {
     return strcmp(a, b) == 0;
 }
@@ -62,6 +77,49 @@ char* strfmt(const char* format, ...) {
     return result;
 }
 
+int strv_push(char*** strv, const char* value) {
+    const size_t len = strv_length(*strv);
+    char* copy = strdup(value);
+    if (copy == NULL)
+        return -ENOMEM;
+    char** grown = realloc(*strv, (len + 2) * sizeof(char*));
+    if (grown == NULL) {
+        free(copy);
+        return -ENOMEM;
+    }
+    grown[len] = copy;
+    grown[len + 1] = NULL;
+    *strv = grown;
+    return 0;
+}
+
+size_t strv_length(char* const* strv) {
+    size_t len = 0;
+    while (strv != NULL && strv[len] != NULL)
+        ++len;
+    return len;
+}
+
+// from https://github.com/systemd/systemd/blob/master/src/basic/unit-name.c
+char* systemd_escape(const char* value) {
+    // every byte expands to at most four (\xXX)
+    char* result = malloc(strlen(value) * 4 + 1);
+    if (result == NULL)
+        return NULL;
+    char* out = result;
+    for (const char* in = value; *in != '\0'; ++in) {
+        const unsigned char c = *in;
+        if (c == '/')
+            *out++ = '-';
+        else if (isalnum(c) || c == ':' || c == '_' || (c == '.' && in != value))
+            *out++ = c;
+        else
+            out += sprintf(out, "\\x%02x", c);
+    }
+    *out = '\0';
+    return result;
+}
+
 int make_private_dir(const char* path) {
     int err = mkdir(path, 0700);
     if (err < 0 && errno != EEXIST)
@@ -75,14 +133,47 @@ int make_private_dir(const char* path) {
     return 0;
 }
 
-int open_exclusive(const char* path, const int flags) {
-    const int fd = open(path, flags, 0600);
+int run_command(char* const argv[]) {
+    static char* const environment[] = {"PATH=/usr/local/sbin:/usr/local/bin:/usr/sbin:/usr/bin:/sbin:/bin", NULL};
+    pid_t pid = 0;
+    // posix_spawn uses vfork, so this stays cheap even in processes with a large address space
+    const int err = posix_spawnp(&pid, argv[0], NULL, NULL, argv, environment);
+    if (err)
+        return -err;
+    int status = 0;
+    while (waitpid(pid, &status, 0) < 0)
+        if (errno != EINTR)
+            return -errno;
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -ECHILD;
+}
+
+int map_shared_file(void** data, const char* path, const size_t size, const bool writable) {
+    const int flags = writable ? O_RDWR | O_CREAT : O_RDONLY;
+    defer(close_fd) int fd = open(path, flags | O_CLOEXEC | O_NOFOLLOW, 0600);
     if (fd < 0)
         return -errno;
-    const int err = flock(fd, LOCK_EX);
-    if (err < 0)
+    struct stat status;
+    if (fstat(fd, &status) < 0)
+        return -errno;
+    // concurrent creators truncate to the same size, which is harmless
+    if (status.st_size == 0 && writable && ftruncate(fd, size) < 0)
+        return -errno;
+    if (status.st_size == 0 && !writable)
+        return -ENOENT;
+    if (status.st_size != 0 && (size_t) status.st_size != size)
+        return -EPROTO;
+    void* mapped = mmap(NULL, size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    if (mapped == MAP_FAILED)
+        return -errno;
+    *data = mapped;
+    return 0;
+}
+
+int sync_filesystem(const char* path) {
+    defer(close_fd) int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
         return -errno;
-    return fd;
+    return syscall(SYS_syncfs, fd) < 0 ? -errno : 0;
 }
 
 // Stolen from https://github.com/google/fscrypt/blob/master/security/cache.go
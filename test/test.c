@@ -1,10 +1,13 @@
 #include <errno.h>
+#include <pwd.h>
 #include <security/pam_appl.h>
 #include <security/pam_misc.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "zfscrypt_session.h"
+
 #define TEST_POOL "tank"
 #define TEST_USER "tester"
 #define TEST_PASSWORD "passw0rd"
@@ -16,7 +19,6 @@
 #define TEST_DATASET_PARENT TEST_POOL "/zfscrypt-test"
 #define TEST_DATASET TEST_DATASET_PARENT "/" TEST_USER
 #define TEST_RUNTIME_DIR TEST_BASE_DIR "/run"
-#define TEST_RUNTIME_FILE TEST_RUNTIME_DIR "/" TEST_USER
 
 #define assert(expr) \
     if (!(expr)) { \
@@ -155,11 +157,10 @@ error:
 }
 
 int get_session_counter() {
-    FILE* file = fopen(TEST_RUNTIME_FILE, "r");
-    assert(file != NULL);
+    struct passwd* entry = getpwnam(TEST_USER);
+    assert(entry != NULL);
     int value = -1;
-    assert(fscanf(file, "%d", &value) >= 0);
-    assert(fclose(file) >= 0);
+    assert(zfscrypt_session_counter_get(&value, TEST_RUNTIME_DIR, entry->pw_uid).value == 0);
     assert(value >= 0);
     return value;
 }
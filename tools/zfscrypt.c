@@ -0,0 +1,504 @@
+#include <errno.h>
+#include <pwd.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "zfscrypt_context.h"
+#include "zfscrypt_dataset.h"
+#include "zfscrypt_err.h"
+#include "zfscrypt_index.h"
+#include "zfscrypt_lazy.h"
+#include "zfscrypt_linger.h"
+#include "zfscrypt_migrate.h"
+#include "zfscrypt_plan.h"
+#include "zfscrypt_policy.h"
+#include "zfscrypt_provision.h"
+#include "zfscrypt_queue.h"
+#include "zfscrypt_session.h"
+#include "zfscrypt_stats.h"
+#include "zfscrypt_utils.h"
+
+/*
+ * Administrative command line interface, accepts the same options as the PAM module
+ */
+
+typedef int (*zfscrypt_command_f)(int argc, const char** argv);
+
+static int zfscrypt_usage(FILE* file);
+
+typedef struct zfscrypt_command {
+    const char* name;
+    const char* args;
+    const char* help;
+    zfscrypt_command_f run;
+} zfscrypt_command_t;
+
+/*
+ * Walks all pools and rewrites the user to dataset index, called by the zedlet
+ */
+static int zfscrypt_index_rebuild_command(int argc, const char** argv) {
+    zfscrypt_context_t context;
+    zfscrypt_err_t err = zfscrypt_context_begin_tool(&context, NULL, argc, argv);
+    if (!err.value)
+        err = zfscrypt_context_log_err(&context, zfscrypt_dataset_index_rebuild(&context));
+    return zfscrypt_context_end(&context, err) ? 1 : 0;
+}
+
+/*
+ * Updates the index entries of the given datasets and those below them, called by the zedlet
+ */
+static int zfscrypt_index_update_command(int argc, const char** argv) {
+    // dataset names never contain '=', unlike the options after them
+    int names = 0;
+    while (names < argc && strchr(argv[names], '=') == NULL)
+        ++names;
+    if (names == 0)
+        return zfscrypt_usage(stderr);
+    zfscrypt_context_t context;
+    zfscrypt_err_t err = zfscrypt_context_begin_tool(&context, NULL, argc - names, &argv[names]);
+    if (!err.value)
+        err = zfscrypt_context_log_err(&context, zfscrypt_dataset_index_update(&context, argv, names));
+    return zfscrypt_context_end(&context, err) ? 1 : 0;
+}
+
+/*
+ * Prints the user to dataset index
+ */
+static int zfscrypt_index_show_command(int argc, const char** argv) {
+    zfscrypt_context_t context;
+    zfscrypt_err_t err = zfscrypt_context_begin_tool(&context, NULL, argc, argv);
+    zfscrypt_index_t index = {.users = NULL, .datasets = NULL};
+    const int status = err.value ? 0 : zfscrypt_index_read(&index, context.state_dir);
+    if (status)
+        err = zfscrypt_context_log_err(&context, zfscrypt_err_os(status, "Could not read dataset index"));
+    for (size_t i = 0; !err.value && i < zfscrypt_index_length(&index); ++i)
+        printf("%s\t%s\n", index.users[i], index.datasets[i]);
+    zfscrypt_index_free(&index);
+    return zfscrypt_context_end(&context, err) ? 1 : 0;
+}
+
+/*
+ * Compiles the text policy into the binary file the module maps, see zfscrypt_policy.h
+ */
+static int zfscrypt_policy_compile_command(int argc, const char** argv) {
+    // the source is optional, module arguments all contain =
+    const bool source = argc > 0 && strchr(argv[0], '=') == NULL;
+    zfscrypt_context_t context;
+    zfscrypt_err_t err = zfscrypt_context_begin_tool(&context, NULL, argc - source, &argv[source]);
+    size_t line = 0;
+    if (!err.value)
+        err = zfscrypt_err_os(zfscrypt_policy_compile(source ? argv[0] : ZFSCRYPT_POLICY_SOURCE, context.state_dir, &line), "Compiled policy");
+    if (err.value && line > 0)
+        fprintf(stderr, "%s:%zu: invalid line\n", source ? argv[0] : ZFSCRYPT_POLICY_SOURCE, line);
+    zfscrypt_context_log_err(&context, err);
+    return zfscrypt_context_end(&context, err) ? 1 : 0;
+}
+
+static void zfscrypt_policy_print_list(const char* name, const char* list) {
+    printf("%s\t", name);
+    for (const char* item = list; *item != '\0'; item += strlen(item) + 1)
+        printf("%s%s", item == list ? "" : " ", item);
+    printf("\n");
+}
+
+/*
+ * Prints the settings of a user after the policy is applied to the module arguments
+ */
+static int zfscrypt_policy_show_command(int argc, const char** argv) {
+    if (argc < 1)
+        return zfscrypt_usage(stderr);
+    zfscrypt_context_t context;
+    zfscrypt_err_t err = zfscrypt_context_begin_tool(&context, argv[0], argc - 1, &argv[1]);
+    static const char* const drop_caches[] = {"none", "scoped", "global"};
+    static const char* const mount[] = {"property", "eager", "lazy"};
+    if (!err.value) {
+        printf("linger\t%u\nworkers\t%u\n", context.linger, context.workers);
+        printf("drop_caches\t%s\nmount\t%s\n", drop_caches[context.drop_caches], mount[context.mount]);
+        zfscrypt_policy_print_list("roots", context.roots);
+        zfscrypt_policy_print_list("skip", context.skip);
+    }
+    return zfscrypt_context_end(&context, err) ? 1 : 0;
+}
+
+static zfscrypt_err_t zfscrypt_discover_print(zfscrypt_plan_t* plan) {
+    for (size_t i = 0; i < plan->len; ++i)
+        for (size_t j = 0; j < plan->groups[i].len; ++j)
+            printf("%s\t%s\n", zfs_get_name(plan->groups[i].members[j].handle), zfs_get_name(plan->groups[i].root.handle));
+    return zfscrypt_err_zfs(0, "Printed datasets");
+}
+
+/*
+ * Prints the datasets that would be unlocked for a user and how long it took to find them
+ */
+static int zfscrypt_discover_command(int argc, const char** argv) {
+    if (argc < 1)
+        return zfscrypt_usage(stderr);
+    struct timespec begin, end;
+    zfscrypt_context_t context;
+    zfscrypt_err_t err = zfscrypt_context_begin_tool(&context, argv[0], argc - 1, &argv[1]);
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    if (!err.value)
+        err = zfscrypt_context_log_err(&context, zfscrypt_dataset_iter(&context, NULL, NULL, zfscrypt_discover_print, NULL));
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    fprintf(stderr, "discovery took %.3f ms\n", (end.tv_sec - begin.tv_sec) * 1e3 + (end.tv_nsec - begin.tv_nsec) / 1e6);
+    return zfscrypt_context_end(&context, err) ? 1 : 0;
+}
+
+static int zfscrypt_load_key_root(zfscrypt_context_t* context, zfscrypt_dataset_t* dataset) {
+    const char* user = NULL;
+    if (zfscrypt_dataset_properties_get_user(dataset, &user))
+        return -ENOKEY;
+    struct passwd* entry = getpwnam(user);
+    if (entry == NULL)
+        return -ENOENT;
+    char name[ZFS_MAX_DATASET_NAME_LEN];
+    if (zfs_prop_get(dataset->handle, ZFS_PROP_ENCRYPTION_ROOT, name, sizeof(name), NULL, NULL, 0, B_TRUE))
+        return -EINVAL;
+    zfscrypt_dataset_t root = {.context = context, .handle = zfs_open(context->libzfs, name, ZFS_TYPE_FILESYSTEM), .key = NULL, .new_key = NULL};
+    if (root.handle == NULL)
+        return -ENOENT;
+    const int err = zfscrypt_dataset_key_loaded(&root) ? 0 : zfscrypt_lazy_load_key(&root, entry->pw_uid);
+    zfs_close(root.handle);
+    return err;
+}
+
+/*
+ * Loads the key of a lazily mounted dataset from the keyring of its user, run by zfscrypt-load-key@.service
+ */
+static int zfscrypt_load_key_command(int argc, const char** argv) {
+    if (argc < 1)
+        return zfscrypt_usage(stderr);
+    zfscrypt_context_t context;
+    zfscrypt_err_t err = zfscrypt_context_begin_tool(&context, NULL, argc - 1, &argv[1]);
+    zfscrypt_dataset_t dataset = {.context = &context, .handle = NULL, .key = NULL, .new_key = NULL};
+    if (!err.value) {
+        dataset.handle = zfs_open(context.libzfs, argv[0], ZFS_TYPE_FILESYSTEM);
+        if (dataset.handle == NULL)
+            err = zfscrypt_context_log_err(&context, zfscrypt_err_os(-ENOENT, "Could not open dataset"));
+    }
+    if (!err.value)
+        err = zfscrypt_context_log_err(&context, zfscrypt_err_os(zfscrypt_load_key_root(&context, &dataset), "Loaded key from keyring"));
+    if (dataset.handle != NULL)
+        zfs_close(dataset.handle);
+    return zfscrypt_context_end(&context, err) ? 1 : 0;
+}
+
+/*
+ * Locks the datasets of a user whose linger window has passed, run by the timer started on logout
+ */
+static int zfscrypt_linger_expire_command(int argc, const char** argv) {
+    if (argc < 2)
+        return zfscrypt_usage(stderr);
+    // strtoull takes a sign and wraps negative numbers around
+    char* end = NULL;
+    errno = 0;
+    const uint64_t deadline = strtoull(argv[1], &end, 10);
+    if (errno || end == argv[1] || *end != '\0' || argv[1][0] == '-')
+        return zfscrypt_usage(stderr);
+    zfscrypt_context_t context;
+    zfscrypt_err_t err = zfscrypt_context_begin_tool(&context, argv[0], argc - 2, &argv[2]);
+    if (!err.value && context.uid == (uid_t) -1)
+        err = zfscrypt_context_log_err(&context, zfscrypt_err_os(ENOENT, "Unknown user"));
+    zfscrypt_session_registry_t* registry = NULL;
+    if (!err.value)
+        err = zfscrypt_context_log_err(&context, zfscrypt_session_registry_open(&registry, context.runtime_dir, true));
+    // a login in the meantime waits for the lock, which gives up as soon as it is counted
+    zfscrypt_session_slot_t* slot = err.value ? NULL : zfscrypt_session_linger_expire(registry, context.uid, deadline);
+    context.guard = slot;
+    if (slot != NULL)
+        err = zfscrypt_context_log_err(&context, zfscrypt_dataset_lock_all(&context));
+    if (slot != NULL && !err.value && context.drop_caches == ZFSCRYPT_DROP_CACHES_GLOBAL)
+        (void) drop_filesystem_cache();
+    if (slot != NULL)
+        zfscrypt_session_lock_finish(slot, err.value == ECANCELED ? ZFSCRYPT_SESSION_LOCK_NONE : err.value ? ZFSCRYPT_SESSION_LOCK_FAILED : ZFSCRYPT_SESSION_LOCK_DONE, err.value);
+    if (slot != NULL && !err.value)
+        (void) zfscrypt_session_slot_release(slot);
+    if (err.value == ECANCELED)
+        err = zfscrypt_err_os(0, "Session opened while locking");
+    if (registry != NULL)
+        zfscrypt_session_registry_close(registry);
+    return zfscrypt_context_end(&context, err) ? 1 : 0;
+}
+
+/*
+ * Locks the datasets of all users whose last logout queued the lock, run by zfscrypt-lock-queue.service
+ */
+static int zfscrypt_lock_queue_command(int argc, const char** argv) {
+    zfscrypt_context_t context;
+    zfscrypt_err_t err = zfscrypt_context_begin_tool(&context, NULL, argc, argv);
+    if (!err.value)
+        err = zfscrypt_context_log_err(&context, zfscrypt_queue_run(&context));
+    return zfscrypt_context_end(&context, err) ? 1 : 0;
+}
+
+// a lock of the queue that has not finished or failed, the datasets may still be unlocked
+static bool zfscrypt_status_pending(zfscrypt_session_slot_t* slot) {
+    const uint32_t lock = atomic_load(&slot->lock);
+    return lock == ZFSCRYPT_SESSION_LOCK_QUEUED || lock == ZFSCRYPT_SESSION_LOCK_RUNNING || lock == ZFSCRYPT_SESSION_LOCK_FAILED;
+}
+
+static void zfscrypt_status_print(zfscrypt_session_slot_t* slot, const uid_t uid) {
+    struct passwd* entry = getpwuid(uid);
+    printf("%s\t%u\t%u\t", entry == NULL ? "-" : entry->pw_name, uid, zfscrypt_session_slot_count(slot));
+    const uint64_t deadline = atomic_load(&slot->deadline);
+    if (deadline != 0) {
+        const uint64_t now = zfscrypt_linger_now();
+        printf("lingering %lus\n", (unsigned long) (deadline > now ? deadline - now : 0));
+        return;
+    }
+    switch (atomic_load(&slot->lock)) {
+    case ZFSCRYPT_SESSION_LOCK_QUEUED:
+        printf("lock queued\n");
+        return;
+    case ZFSCRYPT_SESSION_LOCK_RUNNING:
+        printf("locking\n");
+        return;
+    case ZFSCRYPT_SESSION_LOCK_FAILED:
+        printf("lock failed: %s\n", strerror(atomic_load(&slot->lock_err)));
+        return;
+    default:
+        break;
+    }
+    const char* separator = "";
+    for (size_t i = 0; i < ZFSCRYPT_SESSION_PIDS; ++i) {
+        const uint32_t pid = atomic_load(&slot->pids[i]);
+        if (pid == 0)
+            continue;
+        printf("%s%u%s", separator, pid, zfscrypt_session_pid_alive(pid) ? "" : "(stale)");
+        separator = ",";
+    }
+    printf("\n");
+}
+
+/*
+ * Prints the open sessions of all users and the users lingering after their last session, stale
+ * sessions are reaped by the next logout of their user
+ */
+static int zfscrypt_status_command(int argc, const char** argv) {
+    zfscrypt_context_t context;
+    zfscrypt_err_t err = zfscrypt_context_begin_tool(&context, NULL, argc, argv);
+    zfscrypt_session_registry_t* registry = NULL;
+    if (!err.value)
+        err = zfscrypt_session_registry_open(&registry, context.runtime_dir, false);
+    if (err.value == ENOENT)
+        err = zfscrypt_err_os(0, "No sessions registered");
+    else if (err.value)
+        err = zfscrypt_context_log_err(&context, err);
+    for (size_t i = 0; registry != NULL && i < ZFSCRYPT_SESSION_SLOTS; ++i) {
+        zfscrypt_session_slot_t* slot = &registry->slot[i];
+        uid_t uid = 0;
+        if (zfscrypt_session_slot_uid(slot, &uid) && (zfscrypt_session_slot_count(slot) != 0 || atomic_load(&slot->deadline) != 0 || zfscrypt_status_pending(slot)))
+            zfscrypt_status_print(slot, uid);
+    }
+    if (registry != NULL)
+        zfscrypt_session_registry_close(registry);
+    return zfscrypt_context_end(&context, err) ? 1 : 0;
+}
+
+static void zfscrypt_stats_print_quantile(zfscrypt_stats_histogram_t* histogram, const double q) {
+    const uint64_t us = zfscrypt_stats_quantile(histogram, q);
+    if (us == UINT64_MAX)
+        printf(" %11s", ">5000");
+    else
+        printf(" %11.1f", us / 1e3);
+}
+
+static void zfscrypt_stats_print_table(zfscrypt_stats_file_t* file) {
+    printf("%-14s %8s %8s %11s %11s %11s\n", "metric", "count", "errors", "mean_ms", "p50_ms<=", "p99_ms<=");
+    for (size_t i = 0; i < ZFSCRYPT_STATS_METRICS; ++i) {
+        zfscrypt_stats_histogram_t* histogram = &file->histograms[i];
+        const uint64_t count = atomic_load(&histogram->count);
+        if (count == 0)
+            continue;
+        printf("%-14s %8lu %8lu %11.1f", ZFSCRYPT_STATS_NAMES[i], (unsigned long) count, (unsigned long) atomic_load(&histogram->errors), atomic_load(&histogram->sum_us) / 1e3 / count);
+        zfscrypt_stats_print_quantile(histogram, 0.5);
+        zfscrypt_stats_print_quantile(histogram, 0.99);
+        printf("\n");
+    }
+}
+
+static void zfscrypt_stats_print_histogram(zfscrypt_stats_histogram_t* histogram, const char* metric, const char* label, const char* name) {
+    uint64_t cumulative = 0;
+    for (size_t i = 0; i < ZFSCRYPT_STATS_BUCKETS - 1; ++i) {
+        cumulative += atomic_load(&histogram->buckets[i]);
+        printf("%s_bucket{%s=\"%s\",le=\"%g\"} %lu\n", metric, label, name, ZFSCRYPT_STATS_BOUNDS_US[i] / 1e6, (unsigned long) cumulative);
+    }
+    cumulative += atomic_load(&histogram->buckets[ZFSCRYPT_STATS_BUCKETS - 1]);
+    printf("%s_bucket{%s=\"%s\",le=\"+Inf\"} %lu\n", metric, label, name, (unsigned long) cumulative);
+    printf("%s_sum{%s=\"%s\"} %g\n", metric, label, name, atomic_load(&histogram->sum_us) / 1e6);
+    printf("%s_count{%s=\"%s\"} %lu\n", metric, label, name, (unsigned long) cumulative);
+}
+
+// text exposition format, e.g. for the textfile collector of node_exporter
+static void zfscrypt_stats_print_prometheus(zfscrypt_stats_file_t* file) {
+    printf("# HELP zfscrypt_call_duration_seconds Time spent in a pam call of pam_zfscrypt.\n");
+    printf("# TYPE zfscrypt_call_duration_seconds histogram\n");
+    for (size_t i = 0; i < ZFSCRYPT_STATS_CALLS; ++i)
+        zfscrypt_stats_print_histogram(&file->histograms[i], "zfscrypt_call_duration_seconds", "call", ZFSCRYPT_STATS_NAMES[i]);
+    printf("# HELP zfscrypt_call_errors_total Pam calls of pam_zfscrypt that failed.\n");
+    printf("# TYPE zfscrypt_call_errors_total counter\n");
+    for (size_t i = 0; i < ZFSCRYPT_STATS_CALLS; ++i)
+        printf("zfscrypt_call_errors_total{call=\"%s\"} %lu\n", ZFSCRYPT_STATS_NAMES[i], (unsigned long) atomic_load(&file->histograms[i].errors));
+    printf("# HELP zfscrypt_phase_duration_seconds Time spent in a phase, summed up per pam call.\n");
+    printf("# TYPE zfscrypt_phase_duration_seconds histogram\n");
+    for (size_t i = ZFSCRYPT_STATS_CALLS; i < ZFSCRYPT_STATS_METRICS; ++i)
+        zfscrypt_stats_print_histogram(&file->histograms[i], "zfscrypt_phase_duration_seconds", "phase", ZFSCRYPT_STATS_NAMES[i]);
+}
+
+/*
+ * Prints the latency histograms of the pam calls and their phases since boot
+ */
+static int zfscrypt_stats_command(int argc, const char** argv) {
+    const bool prometheus = argc > 0 && streq(argv[0], "prometheus");
+    zfscrypt_context_t context;
+    zfscrypt_err_t err = zfscrypt_context_begin_tool(&context, NULL, argc - prometheus, &argv[prometheus]);
+    zfscrypt_stats_file_t* file = NULL;
+    if (!err.value)
+        err = zfscrypt_stats_file_open(&file, context.runtime_dir, false);
+    if (err.value == ENOENT)
+        err = zfscrypt_err_os(0, "No stats recorded, the module needs stats=file or stats=syslog");
+    else if (err.value)
+        err = zfscrypt_context_log_err(&context, err);
+    if (file != NULL && prometheus)
+        zfscrypt_stats_print_prometheus(file);
+    else if (file != NULL)
+        zfscrypt_stats_print_table(file);
+    if (file != NULL)
+        zfscrypt_stats_file_close(file);
+    return zfscrypt_context_end(&context, err) ? 1 : 0;
+}
+
+/*
+ * Creates the home datasets of existing users read as user:password lines from stdin, prints the outcome per user
+ */
+static int zfscrypt_provision_command(int argc, const char** argv) {
+    if (argc < 2)
+        return zfscrypt_usage(stderr);
+    zfscrypt_context_t context;
+    zfscrypt_err_t err = zfscrypt_context_begin_tool(&context, NULL, argc - 2, &argv[2]);
+    zfscrypt_provision_t provision;
+    zfscrypt_provision_init(&provision, &context, argv[0], argv[1]);
+    if (!err.value)
+        err = zfscrypt_context_log_err(&context, zfscrypt_provision_read(&provision, stdin));
+    const bool read = !err.value;
+    if (read)
+        err = zfscrypt_context_log_err(&context, zfscrypt_provision_run(&provision));
+    for (size_t i = 0; read && i < provision.len; ++i)
+        printf("%s\t%s\t%s\n", provision.users[i].user, provision.users[i].dataset, provision.users[i].result ? "failed" : "created");
+    if (read && provision.failed > 0)
+        fprintf(stderr, "%zu of %zu users failed\n", provision.failed, provision.len);
+    zfscrypt_provision_free(&provision);
+    return zfscrypt_context_end(&context, err) ? 1 : 0;
+}
+
+/*
+ * Turns a passphrase encryption root into one with a raw key sealed by the password read from stdin
+ */
+static int zfscrypt_seal_key_command(int argc, const char** argv) {
+    if (argc < 1)
+        return zfscrypt_usage(stderr);
+    zfscrypt_context_t context;
+    zfscrypt_err_t err = zfscrypt_context_begin_tool(&context, NULL, argc - 1, &argv[1]);
+    zfscrypt_dataset_t dataset = {.context = &context, .handle = NULL, .key = NULL, .new_key = NULL};
+    if (!err.value) {
+        dataset.handle = zfs_open(context.libzfs, argv[0], ZFS_TYPE_FILESYSTEM);
+        if (dataset.handle == NULL)
+            err = zfscrypt_context_log_err(&context, zfscrypt_err_zfs(libzfs_errno(context.libzfs), "Could not open dataset"));
+    }
+    char* password = NULL;
+    size_t size = 0;
+    if (!err.value && getline(&password, &size, stdin) < 0)
+        err = zfscrypt_context_log_err(&context, zfscrypt_err_os(ENOKEY, "Expected the password of the user on stdin"));
+    if (password != NULL)
+        password[strcspn(password, "\n")] = '\0';
+    dataset.key = password;
+    if (!err.value)
+        err = zfscrypt_context_log_err(&context, zfscrypt_err_zfs(zfscrypt_dataset_seal(&dataset), "Sealed raw key with password"));
+    if (password != NULL) {
+        explicit_bzero(password, size);
+        free(password);
+    }
+    if (dataset.handle != NULL)
+        zfs_close(dataset.handle);
+    return zfscrypt_context_end(&context, err) ? 1 : 0;
+}
+
+static void zfscrypt_migrate_progress(zfscrypt_copy_t const* copy, const double seconds) {
+    const double mib = atomic_load(&copy->bytes) / (1024.0 * 1024.0);
+    fprintf(stderr, "%6.0fs  %lu copied  %lu unchanged  %lu removed  %lu failed  %.1f MiB  %.1f MiB/s\n", seconds,
+            (unsigned long) atomic_load(&copy->files), (unsigned long) atomic_load(&copy->skipped), (unsigned long) atomic_load(&copy->removed),
+            (unsigned long) atomic_load(&copy->failed), mib, seconds > 0 ? mib / seconds : 0);
+}
+
+/*
+ * Copies the home of a user into an encrypted dataset, again and again while the user works, then
+ * swaps them once the user has logged out
+ */
+static int zfscrypt_migrate_command(int argc, const char** argv) {
+    if (argc < 3 || (strnq(argv[2], "copy") && strnq(argv[2], "cutover")))
+        return zfscrypt_usage(stderr);
+    const bool cutover = streq(argv[2], "cutover");
+    zfscrypt_context_t context;
+    zfscrypt_err_t err = zfscrypt_context_begin_tool(&context, argv[0], argc - 3, &argv[3]);
+    zfscrypt_migrate_t migrate = {.home = NULL, .staging = NULL, .backup = NULL, .dataset = {.handle = NULL}};
+    if (!err.value)
+        err = zfscrypt_context_log_err(&context, zfscrypt_migrate_init(&migrate, &context, argv[1]));
+    char* password = NULL;
+    size_t size = 0;
+    // the login password becomes the passphrase, it is only needed while the dataset is locked
+    if (!err.value && zfscrypt_migrate_locked(&migrate) && getline(&password, &size, stdin) < 0)
+        err = zfscrypt_context_log_err(&context, zfscrypt_err_os(ENOKEY, "Expected the password of the user on stdin"));
+    if (password != NULL)
+        password[strcspn(password, "\n")] = '\0';
+    if (!err.value)
+        err = zfscrypt_context_log_err(&context, zfscrypt_migrate_unlock(&migrate, password));
+    if (password != NULL) {
+        explicit_bzero(password, size);
+        free(password);
+    }
+    if (!err.value)
+        err = zfscrypt_context_log_err(&context, cutover ? zfscrypt_migrate_cutover(&migrate, zfscrypt_migrate_progress) : zfscrypt_migrate_copy(&migrate, zfscrypt_migrate_progress));
+    if (!err.value && cutover)
+        printf("%s is now on %s, the old home was moved to %s\n", migrate.home, argv[1], migrate.backup);
+    zfscrypt_migrate_free(&migrate);
+    return zfscrypt_context_end(&context, err) ? 1 : 0;
+}
+
+static const zfscrypt_command_t zfscrypt_commands[] = {
+    {"discover", "<user> [discovery=walk|program]", "print the datasets of a user with their encryption root and the time it took to find them", zfscrypt_discover_command},
+    {"index-rebuild", "", "walk all pools and rewrite the user to dataset index", zfscrypt_index_rebuild_command},
+    {"index-update", "<dataset>...", "update the index entries of datasets and the datasets below them", zfscrypt_index_update_command},
+    {"index-show", "", "print the user to dataset index", zfscrypt_index_show_command},
+    {"status", "", "print the number of open sessions and their processes per user, the time left to linger or the state of a queued lock", zfscrypt_status_command},
+    {"linger-expire", "<user> <deadline>", "lock the datasets of a user after the linger window, unless a session was opened meanwhile", zfscrypt_linger_expire_command},
+    {"lock-queue", "", "lock the datasets of all users whose last logout queued the lock, until the queue is empty", zfscrypt_lock_queue_command},
+    {"policy-compile", "[source]", "compile /etc/zfscrypt.conf or source into the policy file in the state dir", zfscrypt_policy_compile_command},
+    {"policy-show", "<user> [policy=<path>]", "print the settings of a user after applying the policy to the module arguments", zfscrypt_policy_show_command},
+    {"stats", "[prometheus]", "print latency histograms of the pam calls and their phases, optionally for node_exporter", zfscrypt_stats_command},
+    {"provision", "<parent> <skeleton> [workers=<n>]", "create encrypted homes below parent for user:password lines from stdin, from a skeleton directory or by cloning a skeleton snapshot", zfscrypt_provision_command},
+    {"migrate", "<user> <dataset> copy|cutover [workers=<n>]", "copy a home into a new encrypted dataset while the user works, repeatable, then swap them after logout", zfscrypt_migrate_command},
+    {"seal-key", "<dataset> [kdf=scrypt|pbkdf2] [kdf_cost=<n>]", "switch an encryption root to a random raw key sealed with the password from stdin", zfscrypt_seal_key_command},
+    {"load-key", "<dataset>", "load the key of a lazily mounted dataset from the keyring of its user", zfscrypt_load_key_command},
+};
+
+static int zfscrypt_usage(FILE* file) {
+    fprintf(file, "usage: zfscrypt <command> [argument...] [debug] [runtime_dir=<path>] [state_dir=<path>]\n\ncommands:\n");
+    for (size_t i = 0; i < sizeof(zfscrypt_commands) / sizeof(zfscrypt_commands[0]); ++i)
+        fprintf(file, "  %s %s\n      %s\n", zfscrypt_commands[i].name, zfscrypt_commands[i].args, zfscrypt_commands[i].help);
+    return 2;
+}
+
+int main(int argc, const char** argv) {
+    if (argc < 2)
+        return zfscrypt_usage(stderr);
+    if (streq(argv[1], "help") || streq(argv[1], "--help")) {
+        (void) zfscrypt_usage(stdout);
+        return 0;
+    }
+    for (size_t i = 0; i < sizeof(zfscrypt_commands) / sizeof(zfscrypt_commands[0]); ++i)
+        if (streq(argv[1], zfscrypt_commands[i].name))
+            return zfscrypt_commands[i].run(argc - 2, &argv[2]);
+    fprintf(stderr, "zfscrypt: unknown command %s\n\n", argv[1]);
+    return zfscrypt_usage(stderr);
+}
@@ -0,0 +1,335 @@
+// struct ucred
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "zfscrypt_client.h"
+#include "zfscrypt_context.h"
+#include "zfscrypt_dataset.h"
+#include "zfscrypt_err.h"
+#include "zfscrypt_policy.h"
+#include "zfscrypt_utils.h"
+
+/*
+ * Serves lock, unlock and rewrap requests of the PAM module on a pool of workers, each with a libzfs
+ * handle that lives as long as the daemon, because libzfs handles must not be shared between threads.
+ * The main thread only multiplexes connections: a connection with a request is handed to a worker and
+ * not polled until the worker hands it back. Accepts the same options as the PAM module, the pool has
+ * as many workers as the workers option, ZFSCRYPTD_WORKERS without it.
+ */
+
+#define ZFSCRYPTD_MAX_CLIENTS 256
+#define ZFSCRYPTD_WORKERS 4
+
+typedef struct zfscryptd_pool {
+    zfscrypt_context_t* context;
+    pthread_mutex_t mutex;
+    pthread_cond_t ready;
+    // connections with a pending request, in the order they became readable
+    int queue[ZFSCRYPTD_MAX_CLIENTS];
+    size_t head;
+    size_t len;
+    size_t workers;
+    bool stopped;
+    // workers write back every connection they served, complemented if it has to be closed
+    int served[2];
+} zfscryptd_pool_t;
+
+static volatile sig_atomic_t zfscryptd_stopped = 0;
+
+static void zfscryptd_stop(unused int signal) {
+    zfscryptd_stopped = 1;
+}
+
+static int zfscryptd_listen(const char* runtime_dir) {
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    const int len = snprintf(address.sun_path, sizeof(address.sun_path), "%s/%s", runtime_dir, ZFSCRYPT_CLIENT_SOCKET);
+    if (len < 0 || (size_t) len >= sizeof(address.sun_path))
+        return -ENAMETOOLONG;
+    // the private runtime dir already keeps everyone but root out, the mode is a second line of defence
+    int err = make_private_dir(runtime_dir);
+    if (err)
+        return err;
+    if (unlink(address.sun_path) < 0 && errno != ENOENT)
+        return -errno;
+    const int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (fd < 0)
+        return -errno;
+    const mode_t mask = umask(0177);
+    err = bind(fd, (struct sockaddr*) &address, sizeof(address)) < 0 ? -errno : 0;
+    umask(mask);
+    if (!err && listen(fd, SOMAXCONN) < 0)
+        err = -errno;
+    if (err) {
+        close(fd);
+        return err;
+    }
+    return fd;
+}
+
+static bool zfscryptd_peer_is_root(const int fd) {
+    struct ucred peer;
+    socklen_t size = sizeof(peer);
+    return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &peer, &size) == 0 && peer.uid == 0;
+}
+
+// splits a request into its fields, tokens are NULL if absent
+static bool zfscryptd_parse(char* message, const size_t size, zfscrypt_client_request_t* request, const char* fields[3]) {
+    if (size < sizeof(*request))
+        return false;
+    memcpy(request, message, sizeof(*request));
+    if (request->version != ZFSCRYPT_CLIENT_VERSION)
+        return false;
+    size_t offset = sizeof(*request);
+    for (size_t i = 0; i < 3; ++i) {
+        const size_t len = request->lengths[i];
+        if (len > size - offset || (len > 0 && message[offset + len - 1] != '\0'))
+            return false;
+        fields[i] = len > 0 ? &message[offset] : NULL;
+        offset += len;
+    }
+    return offset == size && fields[0] != NULL;
+}
+
+static zfscrypt_err_t zfscryptd_serve(zfscrypt_context_t* context, const zfscrypt_client_request_t* request, const char* fields[3]) {
+    const zfscrypt_context_t defaults = *context;
+    context->user = fields[0];
+    struct passwd entry;
+    struct passwd* pwd = NULL;
+    char buffer[4096];
+    const bool found = getpwnam_r(context->user, &entry, buffer, sizeof(buffer), &pwd) == 0 && pwd != NULL;
+    context->uid = found ? pwd->pw_uid : (uid_t) -1;
+    context->gid = found ? pwd->pw_gid : (gid_t) -1;
+    zfscrypt_policy_apply(context);
+    // same restrictions as the in process path, zfs delegations of the user apply
+    zfscrypt_err_t err = zfscrypt_context_drop_privs(context);
+    if (!err.value) {
+        switch (request->op) {
+        case ZFSCRYPT_CLIENT_LOCK:
+            err = zfscrypt_dataset_lock_all(context);
+            break;
+        case ZFSCRYPT_CLIENT_UNLOCK:
+            err = zfscrypt_dataset_unlock_all(context, fields[1]);
+            break;
+        case ZFSCRYPT_CLIENT_VERIFY:
+            err = fields[1] != NULL
+                ? zfscrypt_dataset_verify_all(context, fields[1])
+                : zfscrypt_err_os(EINVAL, "Key check request without token");
+            break;
+        case ZFSCRYPT_CLIENT_UPDATE:
+            err = fields[1] != NULL && fields[2] != NULL
+                ? zfscrypt_dataset_update_all(context, fields[1], fields[2])
+                : zfscrypt_err_os(EINVAL, "Rewrap request without tokens");
+            break;
+        default:
+            err = zfscrypt_err_os(EOPNOTSUPP, "Unknown request");
+        }
+    }
+    if (context->privs.is_dropped)
+        (void) zfscrypt_context_regain_privs(context);
+    zfscrypt_policy_reset(context, &defaults);
+    context->user = NULL;
+    context->uid = (uid_t) -1;
+    context->gid = (gid_t) -1;
+    return zfscrypt_context_log_err(context, err);
+}
+
+// returns false if the connection has to be closed
+static bool zfscryptd_receive(zfscrypt_context_t* context, const int fd, char* message) {
+    const ssize_t size = recv(fd, message, ZFSCRYPT_CLIENT_MAX_MESSAGE, MSG_DONTWAIT | MSG_TRUNC);
+    if (size < 0)
+        return errno == EAGAIN || errno == EINTR;
+    if (size == 0)
+        return false;
+    zfscrypt_client_request_t request;
+    const char* fields[3] = {NULL, NULL, NULL};
+    const zfscrypt_err_t err = (size_t) size <= ZFSCRYPT_CLIENT_MAX_MESSAGE && zfscryptd_parse(message, size, &request, fields)
+        ? zfscryptd_serve(context, &request, fields)
+        : zfscrypt_context_log_err(context, zfscrypt_err_os(EBADMSG, "Malformed request"));
+    memset(message, 0, ZFSCRYPT_CLIENT_MAX_MESSAGE);
+    const zfscrypt_client_response_t response = {.type = err.type, .value = err.value};
+    return send(fd, &response, sizeof(response), MSG_NOSIGNAL) == sizeof(response);
+}
+
+static void* zfscryptd_worker(void* data) {
+    zfscryptd_pool_t* pool = data;
+    zfscrypt_context_t context = *pool->context;
+    context.libzfs = libzfs_init();
+    // holds tokens, so it is locked into memory once per worker
+    char* message = secure_malloc(ZFSCRYPT_CLIENT_MAX_MESSAGE);
+    if (context.libzfs == NULL || message == NULL)
+        zfscrypt_context_log(&context, LOG_ERR, "%s", "Worker could not initialize, closing the connections it is handed");
+    for (;;) {
+        pthread_mutex_lock(&pool->mutex);
+        while (!pool->stopped && pool->len == 0)
+            pthread_cond_wait(&pool->ready, &pool->mutex);
+        if (pool->stopped) {
+            pthread_mutex_unlock(&pool->mutex);
+            break;
+        }
+        const int fd = pool->queue[pool->head];
+        pool->head = (pool->head + 1) % ZFSCRYPTD_MAX_CLIENTS;
+        --pool->len;
+        pthread_mutex_unlock(&pool->mutex);
+        const bool keep = context.libzfs != NULL && message != NULL && zfscryptd_receive(&context, fd, message);
+        const int served = keep ? fd : ~fd;
+        // the pipe holds far more than ZFSCRYPTD_MAX_CLIENTS entries, so this never blocks
+        (void) write(pool->served[1], &served, sizeof(served));
+    }
+    if (message != NULL)
+        secure_free(message, ZFSCRYPT_CLIENT_MAX_MESSAGE);
+    if (context.libzfs != NULL)
+        libzfs_fini(context.libzfs);
+    return NULL;
+}
+
+// false if there is no worker, the caller serves the connection itself then
+static bool zfscryptd_push(zfscryptd_pool_t* pool, const int fd) {
+    if (pool->workers == 0)
+        return false;
+    pthread_mutex_lock(&pool->mutex);
+    pool->queue[(pool->head + pool->len++) % ZFSCRYPTD_MAX_CLIENTS] = fd;
+    pthread_cond_signal(&pool->ready);
+    pthread_mutex_unlock(&pool->mutex);
+    return true;
+}
+
+// polls the connections handed back by workers again, or closes them
+static void zfscryptd_collect(zfscryptd_pool_t* pool, struct pollfd* fds, size_t* len) {
+    int served = 0;
+    while (read(pool->served[0], &served, sizeof(served)) == sizeof(served)) {
+        const int fd = served < 0 ? ~served : served;
+        for (size_t i = 2; i < *len; ++i) {
+            if (fds[i].fd != ~fd)
+                continue;
+            if (served < 0) {
+                close(fd);
+                fds[i] = fds[--*len];
+            } else {
+                fds[i].fd = fd;
+            }
+            break;
+        }
+    }
+}
+
+static void zfscryptd_accept(zfscrypt_context_t* context, struct pollfd* fds, size_t* len) {
+    const int fd = accept(fds[0].fd, NULL, NULL);
+    if (fd < 0)
+        return;
+    if (*len >= ZFSCRYPTD_MAX_CLIENTS + 2 || !zfscryptd_peer_is_root(fd) || fcntl(fd, F_SETFD, FD_CLOEXEC) < 0) {
+        zfscrypt_context_log(context, LOG_WARNING, "%s", "Rejected connection");
+        close(fd);
+        return;
+    }
+    fds[(*len)++] = (struct pollfd) {.fd = fd, .events = POLLIN, .revents = 0};
+}
+
+// connections handed to a worker are complemented, so poll skips them
+static zfscrypt_err_t zfscryptd_loop(zfscryptd_pool_t* pool, struct pollfd* fds, size_t* len, char* message) {
+    zfscrypt_context_t* context = pool->context;
+    while (!zfscryptd_stopped) {
+        if (poll(fds, *len, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            return zfscrypt_err_os(errno, "Could not poll connections");
+        }
+        for (size_t i = *len; i > 2; --i) {
+            struct pollfd* client = &fds[i - 1];
+            if (client->fd < 0 || client->revents == 0)
+                continue;
+            if (client->revents & POLLIN && zfscryptd_push(pool, client->fd)) {
+                client->fd = ~client->fd;
+                continue;
+            }
+            // without workers the request is served right here
+            if (!(client->revents & POLLIN) || !zfscryptd_receive(context, client->fd, message)) {
+                close(client->fd);
+                *client = fds[--*len];
+            }
+        }
+        if (fds[1].revents & POLLIN)
+            zfscryptd_collect(pool, fds, len);
+        if (fds[0].revents & POLLIN)
+            zfscryptd_accept(context, fds, len);
+    }
+    return zfscrypt_err_os(0, "Stopped");
+}
+
+static zfscrypt_err_t zfscryptd_run(zfscrypt_context_t* context, const int listen_fd) {
+    zfscryptd_pool_t pool = {.context = context, .mutex = PTHREAD_MUTEX_INITIALIZER, .ready = PTHREAD_COND_INITIALIZER, .head = 0, .len = 0, .workers = 0, .stopped = false};
+    if (pipe2(pool.served, O_CLOEXEC | O_NONBLOCK) < 0)
+        return zfscrypt_err_os(errno, "Could not create pipe");
+    // holds tokens, so it is locked into memory once
+    char* message = secure_malloc(ZFSCRYPT_CLIENT_MAX_MESSAGE);
+    if (message == NULL) {
+        close(pool.served[0]);
+        close(pool.served[1]);
+        return zfscrypt_err_os(ENOMEM, "Memory allocation failed");
+    }
+    // signals stop the poll of the main thread, not a request of a worker
+    sigset_t signals;
+    sigset_t mask;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &signals, &mask);
+    const size_t wanted = context->workers > 0 ? context->workers : ZFSCRYPTD_WORKERS;
+    pthread_t threads[wanted];
+    while (pool.workers < wanted && pthread_create(&threads[pool.workers], NULL, zfscryptd_worker, &pool) == 0)
+        ++pool.workers;
+    pthread_sigmask(SIG_SETMASK, &mask, NULL);
+    if (pool.workers < wanted)
+        zfscrypt_context_log(context, LOG_WARNING, "Started %zu of %zu workers", pool.workers, wanted);
+    struct pollfd fds[ZFSCRYPTD_MAX_CLIENTS + 2] = {{.fd = listen_fd, .events = POLLIN, .revents = 0}, {.fd = pool.served[0], .events = POLLIN, .revents = 0}};
+    size_t len = 2;
+    const zfscrypt_err_t err = zfscryptd_loop(&pool, fds, &len, message);
+    // requests in progress are finished, queued ones are dropped with their connections
+    pthread_mutex_lock(&pool.mutex);
+    pool.stopped = true;
+    pthread_cond_broadcast(&pool.ready);
+    pthread_mutex_unlock(&pool.mutex);
+    for (size_t i = 0; i < pool.workers; ++i)
+        pthread_join(threads[i], NULL);
+    zfscryptd_collect(&pool, fds, &len);
+    for (size_t i = 2; i < len; ++i)
+        close(fds[i].fd < 0 ? ~fds[i].fd : fds[i].fd);
+    close(pool.served[0]);
+    close(pool.served[1]);
+    pthread_cond_destroy(&pool.ready);
+    pthread_mutex_destroy(&pool.mutex);
+    secure_free(message, ZFSCRYPT_CLIENT_MAX_MESSAGE);
+    return err;
+}
+
+int main(int argc, const char** argv) {
+    zfscrypt_context_t context;
+    zfscrypt_err_t err = zfscrypt_context_begin_tool(&context, NULL, argc - 1, &argv[1]);
+    const struct sigaction action = {.sa_handler = zfscryptd_stop};
+    sigaction(SIGTERM, &action, NULL);
+    sigaction(SIGINT, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+    const int fd = err.value ? -1 : zfscryptd_listen(context.runtime_dir);
+    if (!err.value && fd < 0)
+        err = zfscrypt_context_log_err(&context, zfscrypt_err_os(fd, "Could not listen on socket"));
+    if (!err.value)
+        err = zfscrypt_context_log_err(&context, zfscryptd_run(&context, fd));
+    if (fd >= 0) {
+        close(fd);
+        defer(free_ptr) char* path = strfmt("%s/%s", context.runtime_dir, ZFSCRYPT_CLIENT_SOCKET);
+        if (path != NULL)
+            unlink(path);
+    }
+    return zfscrypt_context_end(&context, err) ? 1 : 0;
+}
@@ -0,0 +1,33 @@
+#!/bin/sh
+#
+# Keeps the zfscrypt user to dataset index up to date.
+#
+# Datasets are looked up by name at login, so the index has to be updated whenever
+# a dataset gets created, renamed or destroyed or its zfscrypt user property changes.
+# Only the entries of the dataset and those below it are rewritten, a rename updates
+# both the old and the new name. A stale entry is detected at login and falls back to
+# walking all pools.
+
+ZFSCRYPT="${ZFSCRYPT:-/usr/sbin/zfscrypt}"
+
+case "${ZEVENT_HISTORY_INTERNAL_NAME}" in
+create | clone | destroy | receive | "clone swap" | promote)
+    ;;
+rename)
+    # logged as "-> <new name>"
+    NEW_NAME="${ZEVENT_HISTORY_INTERNAL_STR#-> }"
+    ;;
+set | inherit)
+    case "${ZEVENT_HISTORY_INTERNAL_STR}" in
+    *zfscrypt_user*) ;;
+    *) exit 0 ;;
+    esac
+    ;;
+*)
+    exit 0
+    ;;
+esac
+
+[ -n "${ZEVENT_HISTORY_DSNAME}" ] || exec "${ZFSCRYPT}" index-rebuild
+
+exec "${ZFSCRYPT}" index-update "${ZEVENT_HISTORY_DSNAME}" ${NEW_NAME:+"${NEW_NAME}"}